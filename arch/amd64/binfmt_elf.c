@@ -1,8 +1,12 @@
 #include "arch/amd64/mm/map.h"
 #include "sys/binfmt_elf.h"
+#include "sys/mem/pcache.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/vma.h"
 #include "user/fcntl.h"
 #include "user/errno.h"
+#include "fs/ofile.h"
+#include "fs/node.h"
 #include "fs/vfs.h"
 #include "sys/assert.h"
 #include "sys/thread.h"
@@ -21,17 +25,29 @@ static int elf_map_region(mm_space_t space, uintptr_t vma_dst, size_t size) {
     uintptr_t page_aligned = vma_dst & ~0xFFF;
     uintptr_t page_offset = vma_dst & 0xFFF;
     size_t npages = (size + page_offset + 4095) / 4096;
-    uintptr_t page_phys;
+    size_t run;
 
-    for (size_t i = 0; i < npages; ++i) {
-        // TODO: access flags (e.g. is section writable?)
-        if ((page_phys = mm_map_get(space, page_aligned + i * MM_PAGE_SIZE, NULL)) == MM_NADDR) {
-            // Allocation needed
-            assert((page_phys = mm_phys_alloc_page(PU_PRIVATE)) != MM_NADDR,
-                    "Failed to allocate memory\n");
-            assert(mm_map_single(space, page_aligned + i * MM_PAGE_SIZE, page_phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0,
-                    "Failed to map memory\n");
+    for (size_t i = 0; i < npages; i += run) {
+        // Pages shared with a previous segment are left as they are
+        if (mm_map_get(space, page_aligned + i * MM_PAGE_SIZE, NULL) != MM_NADDR) {
+            run = 1;
+            continue;
+        }
+
+        // Allocate the whole run of unmapped pages at once
+        for (run = 1; i + run < npages; ++run) {
+            if (mm_map_get(space, page_aligned + (i + run) * MM_PAGE_SIZE, NULL) != MM_NADDR) {
+                break;
+            }
         }
+
+        // TODO: access flags (e.g. is section writable?)
+        assert(mm_map_range_alloc(space,
+                                  page_aligned + i * MM_PAGE_SIZE,
+                                  run,
+                                  PU_PRIVATE,
+                                  MM_PAGE_USER | MM_PAGE_WRITE) == 0,
+                "Failed to map memory\n");
     }
 
     return 0;
@@ -97,6 +113,132 @@ static int elf_bzero(mm_space_t space, uintptr_t vma_dst, size_t size) {
     return 0;
 }
 
+// Text/data pages come from the binary's page cache, so all instances
+// of a program share them until they're written to, and .bss is
+// zero-filled on first access. Returns -EEXIST if the segment shares
+// pages with one loaded before, then it has to be loaded eagerly. On
+// failure nothing is left mapped
+static int elf_map_lazy(struct process *proc, struct vnode *vn, const Elf64_Phdr *phdr) {
+    uintptr_t start = phdr->p_vaddr & ~0xFFF;
+    uintptr_t mem_end = (phdr->p_vaddr + phdr->p_memsz + 0xFFF) & ~0xFFF;
+    uintptr_t file_end = phdr->p_vaddr + phdr->p_filesz;
+    // End of the pages which only contain the segment's file data
+    uintptr_t file_full = phdr->p_filesz ? (file_end & ~0xFFF) : start;
+    size_t file_off = phdr->p_offset & ~0xFFF;
+    uint64_t page_flags = MM_PAGE_USER;
+    uintptr_t page_phys = MM_NADDR, cached;
+    uintptr_t end = start;
+    int tail_mapped = 0;
+    size_t tail;
+    int res;
+
+    if ((phdr->p_vaddr & 0xFFF) != (phdr->p_offset & 0xFFF)) {
+        return -EINVAL;
+    }
+    if (vma_busy(&proc->vm, start, (mem_end - start) / MM_PAGE_SIZE)) {
+        return -EEXIST;
+    }
+
+    // TODO: PF_X is not enforced, as EFER.NXE is not enabled
+    if (phdr->p_flags & PF_W) {
+        page_flags |= MM_PAGE_WRITE;
+    }
+
+    // The rest of the page where file data ends belongs to the next
+    // part of the file, so the page is a zero-padded copy. It's read
+    // first, as it's what is most likely to fail
+    if (phdr->p_filesz && (tail = file_end & 0xFFF)) {
+        cached = pcache_page_get(vn, (file_off + (file_full - start)) / MM_PAGE_SIZE);
+        if (cached == MM_NADDR) {
+            return -EIO;
+        }
+
+        if ((page_phys = mm_phys_alloc_page(PU_PRIVATE)) == MM_NADDR) {
+            pcache_page_put(cached);
+            return -ENOMEM;
+        }
+        memcpy((void *) MM_VIRTUALIZE(page_phys), (const void *) MM_VIRTUALIZE(cached), tail);
+        memset((void *) MM_VIRTUALIZE(page_phys + tail), 0, MM_PAGE_SIZE - tail);
+        PHYS2PAGE(page_phys)->flags |= PG_MMAPED;
+        pcache_page_put(cached);
+    }
+
+    if (file_full > start) {
+        if ((res = vma_insert(&proc->vm, start, (file_full - start) / MM_PAGE_SIZE, page_flags, 0)) != 0) {
+            goto fail;
+        }
+        vma_set_vnode(&proc->vm, start, vn, file_off);
+        end = file_full;
+    }
+
+    if (page_phys != MM_NADDR) {
+        if ((res = vma_insert(&proc->vm, file_full, 1, page_flags, 0)) != 0) {
+            goto fail;
+        }
+        end = file_full + MM_PAGE_SIZE;
+        if ((res = mm_map_single(proc->space, file_full, page_phys, page_flags)) != 0) {
+            goto fail;
+        }
+        tail_mapped = 1;
+        file_full += MM_PAGE_SIZE;
+    }
+
+    if (mem_end > file_full) {
+        if ((res = vma_insert(&proc->vm, file_full, (mem_end - file_full) / MM_PAGE_SIZE, page_flags, VMA_ANON)) != 0) {
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    // Only whole areas were inserted, so removing them can't fail. The
+    // file-backed pages aren't faulted in yet, only the tail is mapped
+    if (tail_mapped) {
+        mm_umap_single(proc->space, file_full - MM_PAGE_SIZE, 1);
+    }
+    if (end > start) {
+        vma_remove(&proc->vm, start, (end - start) / MM_PAGE_SIZE);
+    }
+    if (page_phys != MM_NADDR) {
+        mm_phys_free_page(page_phys);
+    }
+    return res;
+}
+
+static int elf_load_eager(struct process *proc, struct vfs_ioctx *ctx, struct ofile *fd, const Elf64_Phdr *phdr) {
+    uintptr_t start_aligned = phdr->p_vaddr & ~0xFFF;
+    size_t size_aligned = ((phdr->p_vaddr + phdr->p_memsz + 0xFFF) & ~0xFFF) - start_aligned;
+    int res;
+
+    if ((res = elf_map_region(proc->space, start_aligned, size_aligned)) != 0) {
+        return res;
+    }
+    if ((res = elf_load_bytes(proc->space, ctx, fd, phdr->p_vaddr, phdr->p_offset, phdr->p_filesz)) != 0) {
+        return res;
+    }
+    if (phdr->p_memsz > phdr->p_filesz) {
+        if ((res = elf_bzero(proc->space, phdr->p_vaddr + phdr->p_filesz, phdr->p_memsz - phdr->p_filesz)) != 0) {
+            return res;
+        }
+    }
+
+    // Reserve the pages not yet covered by other segments' areas
+    for (size_t i = 0; i < size_aligned / MM_PAGE_SIZE; ++i) {
+        if (!vma_busy(&proc->vm, start_aligned + i * MM_PAGE_SIZE, 1)) {
+            if ((res = vma_insert(&proc->vm,
+                                  start_aligned + i * MM_PAGE_SIZE,
+                                  1,
+                                  MM_PAGE_USER | MM_PAGE_WRITE,
+                                  0)) != 0) {
+                return res;
+            }
+        }
+    }
+
+    return 0;
+}
+
 int binfmt_is_elf(const char *ident, size_t len) {
     if (len < 4) {
         return 0;
@@ -142,6 +284,7 @@ int elf_load(struct process *proc, struct vfs_ioctx *ctx, struct ofile *fd, uint
     ssize_t bread;
     Elf64_Ehdr ehdr;
     Elf64_Phdr phdr;
+    struct vnode *vn = fd->file.vnode;
 
     if ((res = elf_read(ctx, fd, 0, &ehdr, sizeof(Elf64_Ehdr))) != 0) {
         kerror("elf: failed to read file header\n");
@@ -173,20 +316,18 @@ int elf_load(struct process *proc, struct vfs_ioctx *ctx, struct ofile *fd, uint
         }
 
         if (phdr.p_type == PT_LOAD) {
-            uintptr_t start_aligned = phdr.p_vaddr & ~0xFFF;
-            size_t size_aligned = ((phdr.p_vaddr + phdr.p_memsz + 0xFFF) & ~0xFFF) - start_aligned;
-
             //kdebug("[%2d] vaddr=%p\n", i, phdr.p_vaddr);
 
-            if (elf_map_region(proc->space, start_aligned, size_aligned) != 0) {
-                panic("Failed to map segment\n");
+            if (!phdr.p_memsz) {
+                continue;
             }
 
-            if (elf_load_bytes(proc->space, ctx, fd, phdr.p_vaddr, phdr.p_offset, phdr.p_filesz) != 0) {
-                panic("Failed to load filesz data\n");
+            if (vn && vn->type == VN_REG && elf_map_lazy(proc, vn, &phdr) == 0) {
+                continue;
             }
-            if (phdr.p_memsz > phdr.p_filesz) {
-                _assert(elf_bzero(proc->space, phdr.p_vaddr + phdr.p_filesz, phdr.p_memsz - phdr.p_filesz) == 0);
+
+            if (elf_load_eager(proc, ctx, fd, &phdr) != 0) {
+                panic("Failed to load segment\n");
             }
         }
     }
@@ -4,6 +4,7 @@
 #endif
 #include "arch/amd64/cpu.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/vma.h"
 #include "sys/thread.h"
 #include "sys/string.h"
 #include "sys/types.h"
@@ -11,6 +12,7 @@
 #include "sys/debug.h"
 #include "sys/panic.h"
 #include "sys/syms.h"
+#include "user/errno.h"
 #include "sys/mm.h"
 
 #define X86_EXCEPTION_DE        0
@@ -49,6 +51,20 @@ struct amd64_exception_frame {
     uint64_t rip, cs, rflags, rsp, ss;
 };
 
+static int do_pfault_vma(struct amd64_exception_frame *frame, struct process *proc, uintptr_t cr2) {
+    int res;
+
+    // File pages may have to be read from disk, so let interrupts in
+    // if the faulting code had them enabled
+    if (frame->rflags & X86_FLAGS_IF) {
+        asm volatile ("sti");
+    }
+    res = vma_fault(proc, cr2, !!(frame->exc_code & X86_PF_WRITE));
+    asm volatile ("cli");
+
+    return res;
+}
+
 int do_pfault(struct amd64_exception_frame *frame, uintptr_t cr2, uintptr_t cr3) {
     mm_space_t space = (mm_space_t) MM_VIRTUALIZE(cr3);
 
@@ -69,17 +85,53 @@ int do_pfault(struct amd64_exception_frame *frame, uintptr_t cr2, uintptr_t cr3)
         _assert(proc);
 
         if (phys != MM_NADDR) {
+            // Page table still shared with the parent or a child, the
+            // access is retried with a private copy of it
+            if (frame->exc_code & X86_PF_WRITE) {
+                switch (mm_pt_unshare(space, cr2)) {
+                case 0:
+                    return 0;
+                case -ENOMEM:
+                    return -1;
+                }
+            }
+            // Stale read-only translation, the page has been made writable
+            // by another CPU. The fault itself has dropped it
+            if ((frame->exc_code & X86_PF_WRITE) &&
+                (flags & (MM_PAGE_USER | MM_PAGE_WRITE)) == (MM_PAGE_USER | MM_PAGE_WRITE)) {
+                return 0;
+            }
+
             // If the exception was caused by write operation
-            if ((frame->exc_no & X86_PF_WRITE) &&               // Error was caused by write
+            if ((frame->exc_code & X86_PF_WRITE) &&               // Error was caused by write
                 (flags & MM_PAGE_USER) &&                       // Page is user-accessible
                 (!(flags & MM_PAGE_WRITE))) {                   // Page is not writable
                 struct page *page = PHYS2PAGE(phys);
                 _assert(page);
                 _assert(page->refcount);
 
+                if (page->usage == PU_CACHE) {
+                    // File page in a private mapping
+                    return do_pfault_vma(frame, proc, cr2);
+                }
+                if (!(vma_page_flags(&proc->vm, cr2) & MM_PAGE_WRITE)) {
+                    // Area is read-only, e.g. program text
+                    return -1;
+                }
+                if (page->usage == PU_SHARED) {
+                    // Write access given back by mprotect()
+                    _assert(mm_umap_single(space, cr2 & MM_PAGE_MASK, 1) == phys);
+                    _assert(mm_map_single(space, cr2 & MM_PAGE_MASK, phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0);
+                    return 0;
+                }
                 if (page->usage != PU_PRIVATE) {
                     panic("Write to non-CoW page triggered a page fault\n");
                 }
+                if ((flags & MM_PAGE_HUGE) && mm_huge_cow(space, cr2) == 0) {
+                    return 0;
+                }
+                // Otherwise the huge page was split and only this 4KiB
+                // page is copied
 
                 if (page->refcount >= 2) {
                     //kdebug("[%d] Cloning page @ %p\n", proc->pid, cr2 & MM_PAGE_MASK);
@@ -99,6 +151,9 @@ int do_pfault(struct amd64_exception_frame *frame, uintptr_t cr2, uintptr_t cr3)
 
                 return 0;
             }
+        } else {
+            // Not yet touched page of an anonymous or file mapping
+            return do_pfault_vma(frame, proc, cr2);
         }
 
         return -1;
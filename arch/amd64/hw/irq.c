@@ -217,6 +217,7 @@ void irq_init(int cpu) {
 #if defined(AMD64_SMP)
     // Common for all CPUs
     amd64_idt_set(cpu, IPI_VECTOR_GENERIC, (uintptr_t) amd64_irq_ipi, 0x08, IDT_FLG_P | IDT_FLG_R0 | IDT_FLG_INT32);
+    amd64_idt_set(cpu, IPI_VECTOR_RESCHED, (uintptr_t) amd64_irq_ipi_resched, 0x08, IDT_FLG_P | IDT_FLG_R0 | IDT_FLG_INT32);
     amd64_idt_set(cpu, IPI_VECTOR_PANIC, (uintptr_t) amd64_irq_ipi_panic, 0x08, IDT_FLG_P | IDT_FLG_R0 | IDT_FLG_INT32);
 #endif
 }
@@ -86,14 +86,10 @@ static uint32_t timer_tick(void *arg) {
     spin_lock_irqsave(&g_sleep_lock, &irq);
     list_for_each_safe(iter, b_iter, &g_sleep_head) {
         struct io_notify *n = list_entry(iter, struct io_notify, link);
-        struct thread *t = n->owner;
-
-        if (!t) {
-            kdebug("Cleaning up ownerless sleep\n");
-            list_del_init(iter);
-            continue;
-        }
+        struct thread *t = list_entry(n, struct thread, sleep_notify);
 
+        // If the thread isn't waiting yet, the notification is kept
+        // in the value and its wait returns right away
         if (t->sleep_deadline <= system_time) {
             list_del_init(iter);
             thread_notify_io(n);
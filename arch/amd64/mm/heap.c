@@ -4,9 +4,17 @@
 #include "sys/panic.h"
 #include "sys/debug.h"
 #include "sys/spin.h"
+#include "sys/config.h"
+#include "sys/mem/phys.h"
 #include "sys/mm.h"
 
-#define HEAP_MAGIC 0x1BAD83A0
+#define HEAP_MAGIC          0x1BAD83A0
+// Lazy poisoning fills every returned block with this byte
+#define HEAP_POISON_BYTE    0xA5
+// Minimum size of a chunk the heap grows by
+#define HEAP_GROW_PAGES     16
+// mm_phys_alloc_contiguous() limit
+#define HEAP_CHUNK_PAGES    1024
 
 typedef struct heap_block {
     uint32_t magic;
@@ -14,9 +22,18 @@ typedef struct heap_block {
     struct heap_block *prev, *next;
 } heap_block_t;
 
+// Physically contiguous piece of the heap, which is followed by its
+// block list. Blocks are never merged across chunks
+struct heap_chunk {
+    struct heap_chunk *next;
+    size_t size;
+};
+
 static struct kernel_heap {
-    uintptr_t phys_base;
+    struct heap_chunk *chunks;
     size_t limit;
+    int poison;
+    int grow;
 } amd64_global_heap;
 heap_t *heap_global = &amd64_global_heap;
 
@@ -38,96 +55,200 @@ void heap_trace(int type, const char *file, const char *func, int line, void *pt
 }
 #endif
 
+static inline heap_block_t *chunk_blocks(const struct heap_chunk *chunk) {
+    return (heap_block_t *) ((uintptr_t) chunk + sizeof(struct heap_chunk));
+}
+
+static inline int chunk_contains(const struct heap_chunk *chunk, uintptr_t addr) {
+    return addr >= (uintptr_t) chunk && addr < (uintptr_t) chunk + chunk->size;
+}
+
 void heap_stat(heap_t *heap, struct heap_stat *st) {
     uintptr_t irq;
     spin_lock_irqsave(&heap_lock, &irq);
-    heap_block_t *begin = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
 
     st->alloc_count = 0;
     st->alloc_size = 0;
     st->free_size = 0;
     st->total_size = heap->limit;
 
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
-            panic("Broken heap");
-        }
-        if (block->magic & 1) {
-            ++st->alloc_count;
-            st->alloc_size += block->size;
-        } else {
-            st->free_size += block->size;
+    for (struct heap_chunk *chunk = heap->chunks; chunk; chunk = chunk->next) {
+        for (heap_block_t *block = chunk_blocks(chunk); block; block = block->next) {
+            if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
+                panic("Broken heap");
+            }
+            if (block->magic & 1) {
+                ++st->alloc_count;
+                st->alloc_size += block->size;
+            } else {
+                st->free_size += block->size;
+            }
         }
     }
     spin_release_irqrestore(&heap_lock, &irq);
 }
 
-void amd64_heap_init(heap_t *heap, uintptr_t phys_base, size_t sz) {
-    heap->phys_base = phys_base;
-    heap->limit = sz;
+static struct heap_chunk *heap_chunk_init(heap_t *heap, uintptr_t phys_base, size_t sz) {
+    struct heap_chunk *chunk = (struct heap_chunk *) MM_VIRTUALIZE(phys_base);
 
-    // Create a single whole-heap block
-    heap_block_t *block = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
-
-    uint32_t s = 13;
-    for (size_t i = 0; i < sz; ++i) {
-        s ^= s << 13;
-        s ^= s >> 17;
-        s ^= s << 5;
-        ((uint8_t *) block)[i] = s;
+    if (heap->poison == HEAP_POISON_FULL) {
+        uint32_t s = 13;
+        for (size_t i = 0; i < sz; ++i) {
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            ((uint8_t *) chunk)[i] = s;
+        }
     }
 
+    chunk->next = NULL;
+    chunk->size = sz;
+
+    // Create a single whole-chunk block
+    heap_block_t *block = chunk_blocks(chunk);
     block->magic = HEAP_MAGIC;
     block->next = NULL;
     block->prev = NULL;
-    block->size = sz - sizeof(heap_block_t);
+    block->size = sz - sizeof(struct heap_chunk) - sizeof(heap_block_t);
+
+    return chunk;
+}
+
+void amd64_heap_init(heap_t *heap, uintptr_t phys_base, size_t sz) {
+    const char *poison = (const char *) kernel_config[CFG_HEAP_POISON];
+
+    if (!strcmp(poison, "none")) {
+        heap->poison = HEAP_POISON_NONE;
+    } else if (!strcmp(poison, "full")) {
+        heap->poison = HEAP_POISON_FULL;
+    } else {
+        if (strcmp(poison, "lazy")) {
+            kwarn("Unknown heap_poison mode: \"%s\", using \"lazy\"\n", poison);
+        }
+        heap->poison = HEAP_POISON_LAZY;
+    }
+    heap->grow = !!kernel_config[CFG_HEAP_GROW];
+
+    heap->chunks = heap_chunk_init(heap, phys_base, sz);
+    heap->limit = sz;
 }
 
+// Adds a chunk large enough for a `count'-byte block to the heap's tail
+static struct heap_chunk *heap_grow(heap_t *heap, size_t count) {
+    size_t need = sizeof(struct heap_chunk) + sizeof(heap_block_t) + count;
+    size_t pages = (need + MM_PAGE_SIZE - 1) / MM_PAGE_SIZE;
+    struct heap_chunk *chunk, *last;
+    uintptr_t phys;
+
+    if (pages < HEAP_GROW_PAGES) {
+        pages = HEAP_GROW_PAGES;
+    }
+    if (pages > HEAP_CHUNK_PAGES) {
+        return NULL;
+    }
+
+    if ((phys = mm_phys_alloc_contiguous(pages, PU_KERNEL)) == MM_NADDR) {
+        return NULL;
+    }
+
+    chunk = heap_chunk_init(heap, phys, pages * MM_PAGE_SIZE);
+    for (last = heap->chunks; last->next; last = last->next);
+    last->next = chunk;
+    heap->limit += chunk->size;
+
+    return chunk;
+}
+
+// Gives the unused chunk's pages back to the physical allocator.
+// The initial chunk is always kept
+static void heap_shrink(heap_t *heap, struct heap_chunk *chunk) {
+    struct heap_chunk *prev;
+    uintptr_t phys = MM_PHYS(chunk);
+
+    _assert(chunk != heap->chunks);
+    for (prev = heap->chunks; prev->next != chunk; prev = prev->next);
+    prev->next = chunk->next;
+    heap->limit -= chunk->size;
+
+    for (size_t i = 0; i < chunk->size / MM_PAGE_SIZE; ++i) {
+        mm_phys_free_page(phys + i * MM_PAGE_SIZE);
+    }
+}
+
+static void *heap_block_take(heap_block_t *block, size_t count) {
+    if (block->magic & 1) {
+        return NULL;
+    }
+
+    if (count == block->size) {
+        block->magic |= 1;
+        return (void *) ((uintptr_t) block + sizeof(heap_block_t));
+    } else if (block->size >= count + sizeof(heap_block_t)) {
+        // Insert new block after this one
+        heap_block_t *cur_next = block->next;
+        heap_block_t *new_block = (heap_block_t *) (((uintptr_t) block) + sizeof(heap_block_t) + count);
+        if (cur_next) {
+            cur_next->prev = new_block;
+        }
+        new_block->next = cur_next;
+        new_block->prev = block;
+        new_block->size = block->size - sizeof(heap_block_t) - count;
+        new_block->magic = HEAP_MAGIC;
+        block->next = new_block;
+        block->size = count;
+        block->magic |= 1;
+        return (void *) ((uintptr_t) block + sizeof(heap_block_t));
+    }
+
+    return NULL;
+}
+
+#if defined(HEAP_DEBUG)
+static void heap_check(heap_t *heap) {
+    for (struct heap_chunk *chunk = heap->chunks; chunk; chunk = chunk->next) {
+        heap_block_t *begin = chunk_blocks(chunk);
+
+        for (heap_block_t *block = begin; block; block = block->next) {
+            if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
+                panic("Heap is broken: magic %08x, %p (%lu), size could be %S\n", block->magic, block, (uintptr_t) block - (uintptr_t) begin, block->size);
+            }
+        }
+    }
+}
+#endif
+
 // Heap interface implementation
 void *heap_alloc(heap_t *heap, size_t count) {
     uintptr_t irq;
+    struct heap_chunk *chunk;
+    void *ptr = NULL;
     spin_lock_irqsave(&heap_lock, &irq);
-    heap_block_t *begin = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
 
     // Some alignment fuck ups led me to this
     count = (count + 15) & ~15;
 
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
-            panic("Heap is broken: magic %08x, %p (%lu), size could be %S\n", block->magic, block, (uintptr_t) block - (uintptr_t) begin, block->size);
-        }
-    }
+#if defined(HEAP_DEBUG)
+    heap_check(heap);
+#endif
 
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if (block->magic & 1) {
-            continue;
+    for (chunk = heap->chunks; chunk && !ptr; chunk = chunk->next) {
+        for (heap_block_t *block = chunk_blocks(chunk); block && !ptr; block = block->next) {
+            ptr = heap_block_take(block, count);
         }
+    }
 
-        if (count == block->size) {
-            block->magic |= 1;
-            spin_release_irqrestore(&heap_lock, &irq);
-            return (void *) ((uintptr_t) block + sizeof(heap_block_t));
-        } else if (block->size >= count + sizeof(heap_block_t)) {
-            // Insert new block after this one
-            heap_block_t *cur_next = block->next;
-            heap_block_t *new_block = (heap_block_t *) (((uintptr_t) block) + sizeof(heap_block_t) + count);
-            if (cur_next) {
-                cur_next->prev = new_block;
-            }
-            new_block->next = cur_next;
-            new_block->prev = block;
-            new_block->size = block->size - sizeof(heap_block_t) - count;
-            new_block->magic = HEAP_MAGIC;
-            block->next = new_block;
-            block->size = count;
-            block->magic |= 1;
-            spin_release_irqrestore(&heap_lock, &irq);
-            return (void *) ((uintptr_t) block + sizeof(heap_block_t));
-        }
+    if (!ptr && heap->grow && (chunk = heap_grow(heap, count))) {
+        ptr = heap_block_take(chunk_blocks(chunk), count);
+        _assert(ptr);
     }
 
     spin_release_irqrestore(&heap_lock, &irq);
-    return NULL;
+
+    if (ptr && heap->poison == HEAP_POISON_LAZY) {
+        memset(ptr, HEAP_POISON_BYTE, count);
+    }
+
+    return ptr;
 }
 
 void heap_free(heap_t *heap, void *ptr) {
@@ -135,14 +256,16 @@ void heap_free(heap_t *heap, void *ptr) {
         return;
     }
     uintptr_t irq;
+    struct heap_chunk *chunk;
     spin_lock_irqsave(&heap_lock, &irq);
 
-    if (ptr == (void *) 0xffffff00042ddd70) {
-    }
-
     // Check if the pointer belongs to the heap
-    if (((uintptr_t) ptr) < MM_VIRTUALIZE(heap->phys_base) ||
-        ((uintptr_t) ptr) > (MM_VIRTUALIZE(heap->phys_base) + heap->limit)) {
+    for (chunk = heap->chunks; chunk; chunk = chunk->next) {
+        if (chunk_contains(chunk, (uintptr_t) ptr)) {
+            break;
+        }
+    }
+    if (!chunk) {
         panic("Tried to free a pointer from outside a heap: %p\n", ptr);
     }
 
@@ -154,13 +277,9 @@ void heap_free(heap_t *heap, void *ptr) {
 
     block->magic = HEAP_MAGIC;
     //kdebug("%p is free\n", block);
-    heap_block_t *begin = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
-
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
-            panic("Heap is broken: magic %08x, %p (%lu), size could be %S\n", block->magic, block, (uintptr_t) block - (uintptr_t) begin, block->size);
-        }
-    }
+#if defined(HEAP_DEBUG)
+    heap_check(heap);
+#endif
 
     heap_block_t *prev = block->prev;
     heap_block_t *next = block->next;
@@ -185,25 +304,33 @@ void heap_free(heap_t *heap, void *ptr) {
         block->size += sizeof(heap_block_t) + next->size;
     }
 
+    if (!block->prev && !block->next && chunk != heap->chunks) {
+        heap_shrink(heap, chunk);
+    }
+
     spin_release_irqrestore(&heap_lock, &irq);
 }
 
 // amd64-specific
 size_t amd64_heap_blocks(const heap_t *heap) {
     size_t c = 0;
-    for (const heap_block_t *block = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
-         block; block = block->next) {
-        assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
-        ++c;
+    for (const struct heap_chunk *chunk = heap->chunks; chunk; chunk = chunk->next) {
+        for (const heap_block_t *block = chunk_blocks(chunk); block; block = block->next) {
+            assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
+            ++c;
+        }
     }
     return c;
 }
 
 void amd64_heap_dump(const heap_t *heap) {
-    for (const heap_block_t *block = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
-         block; block = block->next) {
-        assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
+    for (const struct heap_chunk *chunk = heap->chunks; chunk; chunk = chunk->next) {
+        kdebug("Chunk %p: %S\n", chunk, chunk->size);
 
-        kdebug("%p: %S %s%s\n", block, block->size, (block->magic & 1 ? "USED" : "FREE"), (block->next ? " -> " : ""));
+        for (const heap_block_t *block = chunk_blocks(chunk); block; block = block->next) {
+            assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
+
+            kdebug("%p: %S %s%s\n", block, block->size, (block->magic & 1 ? "USED" : "FREE"), (block->next ? " -> " : ""));
+        }
     }
 }
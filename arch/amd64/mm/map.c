@@ -1,14 +1,34 @@
 #include "arch/amd64/mm/pool.h"
 #include "arch/amd64/mm/map.h"
+#include "arch/amd64/mm/tlb.h"
 #include "sys/mem/shmem.h"
+#include "sys/mem/vma.h"
 #include "sys/mem/phys.h"
 #include "sys/assert.h"
 #include "sys/string.h"
 #include "sys/thread.h"
 #include "sys/debug.h"
 #include "sys/panic.h"
+#include "user/errno.h"
 #include "sys/mm.h"
 
+// Drop the translation of a page on all the CPUs which may have it
+static void mm_tlb_single(mm_space_t pml4, uintptr_t vaddr) {
+    vaddr = AMD64_MM_ADDRSX(vaddr);
+    asm volatile("invlpg (%0)"::"r"(vaddr):"memory");
+    amd64_tlb_shootdown(vaddr >= KERNEL_VIRT_BASE ? NULL : pml4, &vaddr, 1);
+}
+
+// Drop all the translations of a user space
+static void mm_tlb_space(mm_space_t pml4) {
+    uintptr_t cr3;
+    asm volatile ("movq %%cr3, %0":"=r"(cr3));
+    if (cr3 == MM_PHYS(pml4)) {
+        asm volatile ("movq %0, %%cr3"::"r"(cr3):"memory");
+    }
+    amd64_tlb_shootdown(pml4, NULL, MM_TLB_FLUSH_MAX + 1);
+}
+
 uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
     vaddr = AMD64_MM_STRIPSX(vaddr);
     size_t pml4i = (vaddr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
@@ -37,7 +57,10 @@ uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
     }
 
     if (pdpt[pdpti] & MM_PAGE_HUGE) {
-        return (pdpt[pdpti] & MM_PTE_MASK) | (vaddr & MM_PAGE_L3_OFFSET_MASK);
+        if (flags) {
+            *flags = pdpt[pdpti] & MM_PTE_FLAGS_MASK;
+        }
+        return (pdpt[pdpti] & MM_PTE_MASK & ~MM_PAGE_L3_OFFSET_MASK) | (vaddr & MM_PAGE_L3_OFFSET_MASK);
     }
 
     // L2:
@@ -48,8 +71,11 @@ uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
     }
 
     if (pd[pdi] & MM_PAGE_HUGE) {
-        // Page size is 2MiB (1 << 21)
-        return (pd[pti] & MM_PTE_MASK) | (vaddr & MM_PAGE_L2_OFFSET_MASK);
+        // Page size is 2MiB (1 << 21), MM_PAGE_HUGE is reported in flags
+        if (flags) {
+            *flags = pd[pdi] & MM_PTE_FLAGS_MASK;
+        }
+        return (pd[pdi] & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK) | (vaddr & MM_PAGE_L2_OFFSET_MASK);
     }
 
     // L1:
@@ -66,6 +92,199 @@ uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
     return (pt[pti] & MM_PTE_MASK) | (vaddr & MM_PAGE_OFFSET_MASK);
 }
 
+// Replace a huge page directory entry with a page table mapping the same
+// 4KiB pages. Each of them already holds a reference for the mapping
+static mm_pagetab_t mm_huge_split(mm_space_t pml4, uint64_t *pde, uintptr_t vaddr) {
+    uintptr_t phys = *pde & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK;
+    // Bit 7 is PAT in a page table entry
+    uint64_t flags = *pde & MM_PTE_FLAGS_MASK & ~MM_PAGE_HUGE;
+    mm_pagetab_t pt;
+
+    if (!(*pde & MM_PAGE_USER)) {
+        panic("Tried to split a kernel huge page: %p\n", vaddr);
+    }
+
+    pt = (mm_pagetab_t) amd64_mm_pool_alloc();
+    assert(pt, "PT alloc failed\n");
+
+    for (size_t i = 0; i < MM_PTE_COUNT; ++i) {
+        pt[i] = (phys + i * MM_PAGE_SIZE) | flags;
+    }
+
+    *pde = MM_PHYS(pt) |
+           MM_PAGE_PRESENT |
+           MM_PAGE_USER |
+           MM_PAGE_WRITE;
+    // Same translations, but they shouldn't stay cached as a huge page
+    mm_tlb_single(pml4, vaddr & ~MM_PAGE_L2_OFFSET_MASK);
+
+    return pt;
+}
+
+// Drop a reference from each page of a huge mapping, freeing the ones
+// nobody else maps
+static void mm_huge_unref(uintptr_t phys) {
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i, phys += MM_PAGE_SIZE) {
+        struct page *page = PHYS2PAGE(phys);
+        _assert(page->refcount);
+        if (!__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST)) {
+            mm_phys_free_page(phys);
+        }
+    }
+}
+
+//// Page tables shared by fork()
+// Instead of copying the page tables of the parent, fork() points the
+// page directory entries of both processes to the same tables and clears
+// the write bit in them, so every user write under such an entry faults.
+// The page table's own struct page counts the directories referring to
+// it (0 if it was never shared), while the pages it maps keep a single
+// reference for the table. Whoever modifies the table first gets a copy
+
+static void mm_pt_share(mm_pagetab_t pt) {
+    struct page *pg = PHYS2PAGE(MM_PHYS(pt));
+    size_t old, new;
+
+    old = __atomic_load_n(&pg->refcount, __ATOMIC_SEQ_CST);
+    do {
+        new = old <= 1 ? 2 : old + 1;
+    } while (!__atomic_compare_exchange_n(&pg->refcount, &old, new, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+// Returns 1 if the caller was the only one referring to the table
+static int mm_pt_unref(mm_pagetab_t pt) {
+    struct page *pg = PHYS2PAGE(MM_PHYS(pt));
+    size_t old, new;
+
+    old = __atomic_load_n(&pg->refcount, __ATOMIC_SEQ_CST);
+    do {
+        new = old <= 1 ? 0 : old - 1;
+    } while (!__atomic_compare_exchange_n(&pg->refcount, &old, new, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+    return old <= 1;
+}
+
+// Drop the references of a page table nobody else uses and free it
+static void mm_pt_release(mm_pagetab_t pt) {
+    for (size_t pti = 0; pti < MM_PTE_COUNT; ++pti) {
+        if (!(pt[pti] & MM_PAGE_PRESENT)) {
+            continue;
+        }
+
+        uintptr_t page_phys = pt[pti] & MM_PTE_MASK;
+        struct page *page = PHYS2PAGE(page_phys);
+        _assert(page->refcount);
+
+        // Any page with zero refcount can be released
+        if (!__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST)) {
+            mm_phys_free_page(page_phys);
+        }
+    }
+
+    amd64_mm_pool_free(pt);
+}
+
+// Make the page table under `pde' private to the space, copying it if
+// it's still shared. Private pages mapped writable are turned into CoW
+// ones the same way eager fork() did it. Threads of the space may race
+// here from different CPUs without any lock held, so the new directory
+// entry is installed with a cmpxchg and only the winner lets go of the
+// shared table. Returns NULL if the copy can't be allocated
+static mm_pagetab_t mm_pt_own(mm_space_t pml4, uint64_t *pde) {
+    uint64_t old = __atomic_load_n(pde, __ATOMIC_ACQUIRE);
+    mm_pagetab_t pt = (mm_pagetab_t) MM_VIRTUALIZE(old & MM_PTE_MASK);
+    mm_pagetab_t copy = NULL;
+    uint64_t new;
+
+    if ((old & (MM_PAGE_WRITE | MM_PAGE_HUGE)) || !(old & MM_PAGE_USER)) {
+        return pt;
+    }
+
+    if (__atomic_load_n(&PHYS2PAGE(MM_PHYS(pt))->refcount, __ATOMIC_SEQ_CST) > 1) {
+        if (!(copy = amd64_mm_pool_alloc())) {
+            return NULL;
+        }
+
+        for (size_t pti = 0; pti < MM_PTE_COUNT; ++pti) {
+            uint64_t entry = pt[pti];
+
+            if (!(entry & MM_PAGE_PRESENT)) {
+                continue;
+            }
+
+            struct page *page = PHYS2PAGE(entry & MM_PTE_MASK);
+            _assert(page->refcount);
+
+            if ((entry & MM_PAGE_WRITE) && page->usage == PU_PRIVATE) {
+                // The other users only see it read-only through their
+                // directory entries anyway
+                entry &= ~MM_PAGE_WRITE;
+                pt[pti] = entry;
+            }
+
+            __atomic_add_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
+            copy[pti] = entry;
+        }
+    }
+
+    new = MM_PHYS(copy ? copy : pt) |
+          MM_PAGE_PRESENT |
+          MM_PAGE_USER |
+          MM_PAGE_WRITE;
+
+    if (!__atomic_compare_exchange_n(pde, &old, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Another thread of the space got here first, its table is used
+        // and the original is still referenced by that one's entry
+        if (copy) {
+            mm_pt_release(copy);
+        }
+        return (mm_pagetab_t) MM_VIRTUALIZE(old & MM_PTE_MASK);
+    }
+
+    if (copy) {
+        if (mm_pt_unref(pt)) {
+            // Everyone else has let go of it meanwhile
+            mm_pt_release(pt);
+        }
+        pt = copy;
+    } else {
+        // The other side is gone already
+        mm_pt_unref(pt);
+    }
+
+    // Entries cached through the old directory entry are stale now
+    mm_tlb_space(pml4);
+
+    return pt;
+}
+
+int mm_pt_unshare(mm_space_t pml4, uintptr_t vaddr) {
+    vaddr = AMD64_MM_STRIPSX(vaddr);
+    size_t pml4i = (vaddr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdpti = (vaddr >> MM_PDPTI_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdi =   (vaddr >> MM_PDI_SHIFT)   & MM_PTE_INDEX_MASK;
+    mm_pdpt_t pdpt;
+    mm_pagedir_t pd;
+
+    if (!(pml4[pml4i] & MM_PAGE_PRESENT) || (pml4[pml4i] & MM_PAGE_HUGE)) {
+        return -1;
+    }
+    pdpt = (mm_pdpt_t) MM_VIRTUALIZE(pml4[pml4i] & MM_PTE_MASK);
+    if (!(pdpt[pdpti] & MM_PAGE_PRESENT) || (pdpt[pdpti] & MM_PAGE_HUGE)) {
+        return -1;
+    }
+    pd = (mm_pagedir_t) MM_VIRTUALIZE(pdpt[pdpti] & MM_PTE_MASK);
+    if ((pd[pdi] & (MM_PAGE_PRESENT | MM_PAGE_USER | MM_PAGE_WRITE | MM_PAGE_HUGE)) !=
+        (MM_PAGE_PRESENT | MM_PAGE_USER)) {
+        return -1;
+    }
+
+    if (!mm_pt_own(pml4, &pd[pdi])) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
 uintptr_t mm_umap_single(mm_space_t pml4, uintptr_t vaddr, uint32_t size) {
     vaddr = AMD64_MM_STRIPSX(vaddr);
     // TODO: support page sizes other than 4KiB
@@ -106,13 +325,15 @@ uintptr_t mm_umap_single(mm_space_t pml4, uintptr_t vaddr, uint32_t size) {
         return MM_NADDR;
     }
 
+    // L1:
     if (pd[pdi] & MM_PAGE_HUGE) {
-        panic("NYI\n");
+        // Only a part of the huge page is unmapped
+        pt = mm_huge_split(pml4, &pd[pdi], vaddr);
+    } else {
+        pt = mm_pt_own(pml4, &pd[pdi]);
+        assert(pt, "PT alloc failed\n");
     }
 
-    // L1:
-    pt = (mm_pagetab_t) MM_VIRTUALIZE(pd[pdi] & MM_PTE_MASK);
-
     if (!(pt[pti] & MM_PAGE_PRESENT)) {
         return MM_NADDR;
     }
@@ -120,11 +341,12 @@ uintptr_t mm_umap_single(mm_space_t pml4, uintptr_t vaddr, uint32_t size) {
     uint64_t old = pt[pti] & MM_PTE_MASK;
     pt[pti] = 0;
 
-    asm volatile("invlpg (%0)"::"r"(vaddr));
+    mm_tlb_single(pml4, vaddr);
     struct page *page = PHYS2PAGE(old);
     _assert(page);
     _assert(page->refcount);
-    --page->refcount;
+    // Page cache pages are mapped by several processes at once
+    __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
 
     return old;
 }
@@ -144,8 +366,9 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
 
     if (!(pml4[pml4i] & MM_PAGE_PRESENT)) {
         // Allocate PDPT
-        pdpt = (mm_pdpt_t) amd64_mm_pool_alloc();
-        assert(pdpt, "PDPT alloc failed\n");
+        if (!(pdpt = (mm_pdpt_t) amd64_mm_pool_alloc())) {
+            return -ENOMEM;
+        }
         //kdebug("Allocated PDPT = %p\n", pdpt);
 
         pml4[pml4i] = MM_PHYS(pdpt) |
@@ -158,8 +381,9 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
 
     if (!(pdpt[pdpti] & MM_PAGE_PRESENT)) {
         // Allocate PD
-        pd = (mm_pagedir_t) amd64_mm_pool_alloc();
-        assert(pd, "PD alloc failed\n");
+        if (!(pd = (mm_pagedir_t) amd64_mm_pool_alloc())) {
+            return -ENOMEM;
+        }
         //kdebug("Allocated PD = %p\n", pd);
 
         pdpt[pdpti] = MM_PHYS(pd) |
@@ -172,8 +396,9 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
 
     if (!(pd[pdi] & MM_PAGE_PRESENT)) {
         // Allocate PT
-        pt = (mm_pagetab_t) amd64_mm_pool_alloc();
-        assert(pt, "PT alloc failed\n");
+        if (!(pt = (mm_pagetab_t) amd64_mm_pool_alloc())) {
+            return -ENOMEM;
+        }
         //kdebug("Allocated PT = %p\n", pt);
 
         pd[pdi] = MM_PHYS(pt) |
@@ -181,7 +406,10 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
                   MM_PAGE_USER |
                   MM_PAGE_WRITE;
     } else {
-        pt = (mm_pagetab_t) MM_VIRTUALIZE(pd[pdi] & MM_PTE_MASK);
+        assert(!(pd[pdi] & MM_PAGE_HUGE), "Huge page already present for %p\n", virt_addr);
+        if (!(pt = mm_pt_own(pml4, &pd[pdi]))) {
+            return -ENOMEM;
+        }
     }
 
     // Disallow overwriting without unmapping entries first
@@ -198,7 +426,7 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
     // Increase refcount on physical page
     struct page *pg = PHYS2PAGE(phys);
     _assert(pg);
-    ++pg->refcount;
+    __atomic_add_fetch(&pg->refcount, 1, __ATOMIC_SEQ_CST);
 
     pt[pti] = (phys & MM_PAGE_MASK) |
               (flags & MM_PTE_FLAGS_MASK) |
@@ -209,6 +437,461 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
     return 0;
 }
 
+// Page directory entry for `vaddr', the missing upper levels are
+// allocated if `alloc' is set, otherwise (or if that fails) NULL is
+// returned
+static uint64_t *mm_walk_pde(mm_space_t pml4, uintptr_t vaddr, int alloc) {
+    size_t pml4i = (vaddr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdpti = (vaddr >> MM_PDPTI_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdi =   (vaddr >> MM_PDI_SHIFT)   & MM_PTE_INDEX_MASK;
+    uint64_t *table = pml4;
+    size_t index[2] = { pml4i, pdpti };
+
+    for (size_t level = 0; level < 2; ++level) {
+        uint64_t *entry = &table[index[level]];
+
+        if (!(*entry & MM_PAGE_PRESENT)) {
+            if (!alloc) {
+                return NULL;
+            }
+
+            uint64_t *next = amd64_mm_pool_alloc();
+            if (!next) {
+                return NULL;
+            }
+            *entry = MM_PHYS(next) |
+                     MM_PAGE_PRESENT |
+                     MM_PAGE_USER |
+                     MM_PAGE_WRITE;
+        } else if (*entry & MM_PAGE_HUGE) {
+            panic("NYI\n");
+        }
+
+        table = (uint64_t *) MM_VIRTUALIZE(*entry & MM_PTE_MASK);
+    }
+
+    return &table[pdi];
+}
+
+// Page table for `vaddr', same as above. A huge page there is split
+static mm_pagetab_t mm_walk(mm_space_t pml4, uintptr_t vaddr, int alloc) {
+    uint64_t *pde = mm_walk_pde(pml4, vaddr, alloc);
+    mm_pagetab_t pt;
+
+    if (!pde) {
+        return NULL;
+    }
+
+    if (!(*pde & MM_PAGE_PRESENT)) {
+        if (!alloc) {
+            return NULL;
+        }
+
+        if (!(pt = amd64_mm_pool_alloc())) {
+            return NULL;
+        }
+        *pde = MM_PHYS(pt) |
+               MM_PAGE_PRESENT |
+               MM_PAGE_USER |
+               MM_PAGE_WRITE;
+        return pt;
+    }
+
+    if (*pde & MM_PAGE_HUGE) {
+        return mm_huge_split(pml4, pde, vaddr);
+    }
+
+    pt = mm_pt_own(pml4, pde);
+    // Unmapping or protecting a range can't fail half way through
+    assert(pt || alloc, "PT alloc failed\n");
+    return pt;
+}
+
+// A huge page can be put at `vaddr' if `count' pages starting from
+// there cover the whole of it
+static inline int mm_huge_fits(uintptr_t vaddr, size_t count) {
+    return !(vaddr & MM_PAGE_L2_OFFSET_MASK) && count >= MM_HUGE_PAGE_COUNT;
+}
+
+// Invalidations of a single range operation
+struct mm_tlb_batch {
+    int active;                     // The space is loaded on this CPU
+    int user;                       // Only non-global pages are affected
+    mm_space_t space;               // NULL for kernel ranges
+    size_t count;
+    uintptr_t addrs[MM_TLB_FLUSH_MAX];
+};
+
+static void mm_tlb_begin(struct mm_tlb_batch *b, mm_space_t space, uintptr_t vaddr) {
+    uintptr_t cr3;
+    asm volatile ("movq %%cr3, %0":"=r"(cr3));
+
+    vaddr = AMD64_MM_ADDRSX(vaddr);
+    b->active = (cr3 == MM_PHYS(space)) || vaddr >= KERNEL_VIRT_BASE;
+    b->user = vaddr < KERNEL_VIRT_BASE;
+    b->space = b->user ? space : NULL;
+    b->count = 0;
+}
+
+static void mm_tlb_flush(struct mm_tlb_batch *b);
+
+static inline void mm_tlb_add(struct mm_tlb_batch *b, uintptr_t vaddr) {
+    if (!b->user && b->count == MM_TLB_FLUSH_MAX) {
+        // Global entries survive a CR3 reload
+        mm_tlb_flush(b);
+    }
+    if (b->count < MM_TLB_FLUSH_MAX) {
+        b->addrs[b->count] = AMD64_MM_ADDRSX(vaddr);
+    }
+    ++b->count;
+}
+
+static void mm_tlb_flush(struct mm_tlb_batch *b) {
+    if (b->active && b->count) {
+        if (b->count > MM_TLB_FLUSH_MAX && b->user) {
+            // Cheaper than invalidating that many pages one by one,
+            // global (kernel) entries are kept
+            uintptr_t cr3;
+            asm volatile ("movq %%cr3, %0; movq %0, %%cr3":"=r"(cr3)::"memory");
+        } else {
+            for (size_t i = 0; i < b->count; ++i) {
+                asm volatile ("invlpg (%0)"::"r"(b->addrs[i]):"memory");
+            }
+        }
+    }
+    // Other threads of the process or lazy users of the space
+    amd64_tlb_shootdown(b->space, b->addrs, b->count);
+    b->count = 0;
+}
+
+int mm_map_huge(mm_space_t pml4, uintptr_t vaddr, uintptr_t phys, uint64_t flags) {
+    uint64_t *pde;
+
+    vaddr = AMD64_MM_STRIPSX(vaddr);
+    _assert(!(vaddr & MM_PAGE_L2_OFFSET_MASK) && !(phys & MM_PAGE_L2_OFFSET_MASK));
+
+    if (!(pde = mm_walk_pde(pml4, vaddr, 1))) {
+        return -ENOMEM;
+    }
+    if (*pde & MM_PAGE_PRESENT) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+        __atomic_add_fetch(&PHYS2PAGE(phys + i * MM_PAGE_SIZE)->refcount, 1, __ATOMIC_SEQ_CST);
+    }
+
+    *pde = phys |
+           (flags & MM_PTE_FLAGS_MASK) |
+           MM_PAGE_HUGE |
+           MM_PAGE_PRESENT;
+
+    return 0;
+}
+
+int mm_huge_free(mm_space_t pml4, uintptr_t vaddr) {
+    uint64_t *pde = mm_walk_pde(pml4, AMD64_MM_STRIPSX(vaddr), 0);
+    return !pde || !(*pde & MM_PAGE_PRESENT);
+}
+
+int mm_huge_cow(mm_space_t pml4, uintptr_t vaddr) {
+    uintptr_t phys, copy;
+    uint64_t *pde;
+    int shared = 0;
+
+    vaddr = AMD64_MM_STRIPSX(vaddr) & ~MM_PAGE_L2_OFFSET_MASK;
+    pde = mm_walk_pde(pml4, vaddr, 0);
+    _assert(pde && (*pde & MM_PAGE_HUGE));
+    phys = *pde & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK;
+
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+        if (__atomic_load_n(&PHYS2PAGE(phys + i * MM_PAGE_SIZE)->refcount, __ATOMIC_SEQ_CST) != 1) {
+            shared = 1;
+            break;
+        }
+    }
+
+    if (!shared) {
+        // The other side of fork() is gone
+        *pde |= MM_PAGE_WRITE;
+        mm_tlb_single(pml4, vaddr);
+        return 0;
+    }
+
+    if ((copy = mm_phys_alloc_contiguous(MM_HUGE_PAGE_COUNT, PU_PRIVATE)) == MM_NADDR) {
+        mm_huge_split(pml4, pde, vaddr);
+        return -1;
+    }
+
+    memcpy((void *) MM_VIRTUALIZE(copy), (const void *) MM_VIRTUALIZE(phys), MM_HUGE_PAGE_SIZE);
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+        struct page *page = PHYS2PAGE(copy + i * MM_PAGE_SIZE);
+        page->flags |= PG_MMAPED;
+        page->refcount = 1;
+    }
+
+    *pde = copy | (*pde & MM_PTE_FLAGS_MASK) | MM_PAGE_WRITE;
+    mm_tlb_single(pml4, vaddr);
+
+    mm_huge_unref(phys);
+
+    return 0;
+}
+
+int mm_map_range(mm_space_t pml4, uintptr_t vaddr, const uintptr_t *phys, size_t count, uint64_t flags) {
+    mm_pagetab_t pt = NULL;
+    size_t pti, run;
+
+    vaddr = AMD64_MM_STRIPSX(vaddr);
+
+    // Entries weren't present, so there's nothing to invalidate
+    for (size_t i = 0; i < count; ++i, vaddr += MM_PAGE_SIZE) {
+        pti = (vaddr >> MM_PTI_SHIFT) & MM_PTE_INDEX_MASK;
+
+        if ((flags & MM_PAGE_USER) &&
+            mm_huge_fits(vaddr, count - i) &&
+            !(phys[i] & MM_PAGE_L2_OFFSET_MASK)) {
+            for (run = 1; run < MM_HUGE_PAGE_COUNT; ++run) {
+                if (phys[i + run] != phys[i] + run * MM_PAGE_SIZE) {
+                    break;
+                }
+            }
+
+            if (run == MM_HUGE_PAGE_COUNT && mm_map_huge(pml4, vaddr, phys[i], flags) == 0) {
+                i += MM_HUGE_PAGE_COUNT - 1;
+                vaddr += (MM_HUGE_PAGE_COUNT - 1) * MM_PAGE_SIZE;
+                pt = NULL;
+                continue;
+            }
+        }
+
+        if (!pt || !pti) {
+            if (!(pt = mm_walk(pml4, vaddr, 1))) {
+                return -ENOMEM;
+            }
+        }
+
+        assert(!(pt[pti] & MM_PAGE_PRESENT), "Entry already present for %p\n", vaddr);
+        __atomic_add_fetch(&PHYS2PAGE(phys[i])->refcount, 1, __ATOMIC_SEQ_CST);
+        pt[pti] = (phys[i] & MM_PAGE_MASK) |
+                  (flags & MM_PTE_FLAGS_MASK) |
+                  MM_PAGE_PRESENT;
+    }
+
+    return 0;
+}
+
+// Try to back an aligned 2MiB part of the range with a huge page
+static int mm_map_huge_alloc(mm_space_t pml4, uintptr_t vaddr, int usage, uint64_t flags) {
+    uintptr_t phys;
+
+    if (!mm_huge_free(pml4, vaddr)) {
+        return -1;
+    }
+    if ((phys = mm_phys_alloc_contiguous(MM_HUGE_PAGE_COUNT, usage)) == MM_NADDR) {
+        return -1;
+    }
+
+    memset((void *) MM_VIRTUALIZE(phys), 0, MM_HUGE_PAGE_SIZE);
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+        PHYS2PAGE(phys + i * MM_PAGE_SIZE)->flags |= PG_MMAPED;
+    }
+
+    if (mm_map_huge(pml4, vaddr, phys, flags) != 0) {
+        for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+            mm_phys_free_page(phys + i * MM_PAGE_SIZE);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int mm_map_range_alloc(mm_space_t pml4, uintptr_t vaddr, size_t count, int usage, uint64_t flags) {
+    uintptr_t phys[MM_TLB_FLUSH_MAX];
+    size_t n;
+
+    while (count) {
+        if ((flags & MM_PAGE_USER) &&
+            mm_huge_fits(vaddr, count) &&
+            mm_map_huge_alloc(pml4, vaddr, usage, flags) == 0) {
+            vaddr += MM_HUGE_PAGE_SIZE;
+            count -= MM_HUGE_PAGE_COUNT;
+            continue;
+        }
+
+        // Stop at the next huge page boundary
+        n = MIN(count, MM_TLB_FLUSH_MAX);
+        if (((vaddr + n * MM_PAGE_SIZE) & ~MM_PAGE_L2_OFFSET_MASK) != (vaddr & ~MM_PAGE_L2_OFFSET_MASK)) {
+            n = (MM_HUGE_PAGE_SIZE - (vaddr & MM_PAGE_L2_OFFSET_MASK)) / MM_PAGE_SIZE;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            if ((phys[i] = mm_phys_alloc_page(usage)) == MM_NADDR) {
+                while (i--) {
+                    mm_phys_free_page(phys[i]);
+                }
+                return -1;
+            }
+            memset((void *) MM_VIRTUALIZE(phys[i]), 0, MM_PAGE_SIZE);
+            if (flags & MM_PAGE_USER) {
+                PHYS2PAGE(phys[i])->flags |= PG_MMAPED;
+            }
+        }
+
+        if (mm_map_range(pml4, vaddr, phys, n, flags) != 0) {
+            // The pages which didn't get mapped aren't referenced
+            for (size_t i = 0; i < n; ++i) {
+                if (!PHYS2PAGE(phys[i])->refcount) {
+                    mm_phys_free_page(phys[i]);
+                }
+            }
+            return -1;
+        }
+
+        vaddr += n * MM_PAGE_SIZE;
+        count -= n;
+    }
+
+    return 0;
+}
+
+void mm_umap_range(mm_space_t pml4, uintptr_t vaddr, size_t count, mm_release_t release, void *arg) {
+    struct mm_tlb_batch tlb;
+    uintptr_t pages[MM_TLB_FLUSH_MAX * 2];
+    size_t npages = 0, pti;
+    mm_pagetab_t pt = NULL;
+    uint64_t *pde;
+    int have_pt = 0;
+
+    vaddr = AMD64_MM_STRIPSX(vaddr);
+    mm_tlb_begin(&tlb, pml4, vaddr);
+
+    for (size_t i = 0; i < count; ++i, vaddr += MM_PAGE_SIZE) {
+        pti = (vaddr >> MM_PTI_SHIFT) & MM_PTE_INDEX_MASK;
+        if (!have_pt || !pti) {
+            pde = mm_walk_pde(pml4, vaddr, 0);
+
+            if (pde && (*pde & MM_PAGE_HUGE) && mm_huge_fits(vaddr, count - i)) {
+                // The whole huge page goes away
+                uintptr_t phys = *pde & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK;
+                *pde = 0;
+                mm_tlb_add(&tlb, vaddr);
+                mm_tlb_flush(&tlb);
+
+                for (size_t j = 0; j < npages; ++j) {
+                    release(pages[j] & MM_PAGE_MASK, pages[j] & 1, arg);
+                }
+                npages = 0;
+
+                for (size_t j = 0; j < MM_HUGE_PAGE_COUNT; ++j, phys += MM_PAGE_SIZE) {
+                    struct page *page = PHYS2PAGE(phys);
+                    _assert(page->refcount);
+                    release(phys, !__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST), arg);
+                }
+
+                i += MM_HUGE_PAGE_COUNT - 1;
+                vaddr += (MM_HUGE_PAGE_COUNT - 1) * MM_PAGE_SIZE;
+                have_pt = 0;
+                continue;
+            }
+
+            pt = mm_walk(pml4, vaddr, 0);
+            have_pt = 1;
+        }
+        if (!pt) {
+            // Skip to the next page table
+            size_t skip = MM_PTE_COUNT - pti - 1;
+            if (skip >= count - i) {
+                break;
+            }
+            i += skip;
+            vaddr += skip * MM_PAGE_SIZE;
+            have_pt = 0;
+            continue;
+        }
+        if (!(pt[pti] & MM_PAGE_PRESENT)) {
+            continue;
+        }
+
+        uintptr_t phys = pt[pti] & MM_PTE_MASK;
+        struct page *page = PHYS2PAGE(phys);
+        pt[pti] = 0;
+        mm_tlb_add(&tlb, vaddr);
+
+        _assert(page->refcount);
+        // Last reference is flagged in the low bits, pages may only be
+        // released once no CPU can still reach them through the TLB
+        pages[npages++] = phys | !__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
+
+        if (npages == sizeof(pages) / sizeof(pages[0])) {
+            mm_tlb_flush(&tlb);
+            for (size_t j = 0; j < npages; ++j) {
+                release(pages[j] & MM_PAGE_MASK, pages[j] & 1, arg);
+            }
+            npages = 0;
+        }
+    }
+
+    mm_tlb_flush(&tlb);
+    for (size_t j = 0; j < npages; ++j) {
+        release(pages[j] & MM_PAGE_MASK, pages[j] & 1, arg);
+    }
+}
+
+// Apply mm_protect_range() `flags' to a page table entry
+static inline uint64_t mm_protect_entry(uint64_t entry, uint64_t flags) {
+    // Write access is never granted here: pages which may be written
+    // get it from the fault handler, which also takes care of CoW
+    if (!(flags & MM_PAGE_WRITE)) {
+        entry &= ~MM_PAGE_WRITE;
+    }
+    return (entry & ~(MM_PAGE_USER | MM_PAGE_NOEXEC)) | (flags & (MM_PAGE_USER | MM_PAGE_NOEXEC));
+}
+
+void mm_protect_range(mm_space_t pml4, uintptr_t vaddr, size_t count, uint64_t flags) {
+    struct mm_tlb_batch tlb;
+    mm_pagetab_t pt = NULL;
+    uint64_t entry, *pde;
+    size_t pti;
+    int have_pt = 0;
+
+    vaddr = AMD64_MM_STRIPSX(vaddr);
+    mm_tlb_begin(&tlb, pml4, vaddr);
+
+    for (size_t i = 0; i < count; ++i, vaddr += MM_PAGE_SIZE) {
+        pti = (vaddr >> MM_PTI_SHIFT) & MM_PTE_INDEX_MASK;
+        if (!have_pt || !pti) {
+            pde = mm_walk_pde(pml4, vaddr, 0);
+
+            if (pde && (*pde & MM_PAGE_HUGE) && mm_huge_fits(vaddr, count - i)) {
+                if ((entry = mm_protect_entry(*pde, flags)) != *pde) {
+                    *pde = entry;
+                    mm_tlb_add(&tlb, vaddr);
+                }
+
+                i += MM_HUGE_PAGE_COUNT - 1;
+                vaddr += (MM_HUGE_PAGE_COUNT - 1) * MM_PAGE_SIZE;
+                have_pt = 0;
+                continue;
+            }
+
+            pt = mm_walk(pml4, vaddr, 0);
+            have_pt = 1;
+        }
+        if (!pt || !(pt[pti] & MM_PAGE_PRESENT)) {
+            continue;
+        }
+
+        if ((entry = mm_protect_entry(pt[pti], flags)) != pt[pti]) {
+            pt[pti] = entry;
+            mm_tlb_add(&tlb, vaddr);
+        }
+    }
+
+    mm_tlb_flush(&tlb);
+}
+
 int mm_space_clone(mm_space_t dst_pml4, const mm_space_t src_pml4, uint32_t flags) {
     if ((flags & MM_CLONE_FLG_USER)) {
         panic("NYI\n");
@@ -268,56 +951,32 @@ int mm_space_fork(struct process *dst, const struct process *src, uint32_t flags
                     }
 
                     if (src_pd[pdi] & MM_PAGE_HUGE) {
-                        panic("2MiB pages not supported in userspace\n");
-                    }
-
-                    mm_pagetab_t src_pt = (mm_pagetab_t) MM_VIRTUALIZE(src_pd[pdi] & MM_PTE_MASK);
-                    mm_pagetab_t dst_pt = (mm_pagetab_t) amd64_mm_pool_alloc();
-                    _assert(dst_pt);
-                    dst_pd[pdi] = MM_PHYS(dst_pt) | (src_pd[pdi] & MM_PTE_FLAGS_MASK);
+                        uintptr_t src_huge_phys = src_pd[pdi] & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK;
 
-                    for (size_t pti = 0; pti < MM_PTE_COUNT; ++pti) {
-                        if (!(src_pt[pti] & MM_PAGE_PRESENT)) {
-                            continue;
+                        // Private huge pages become CoW, see mm_huge_cow()
+                        if ((src_pd[pdi] & MM_PAGE_WRITE) && PHYS2PAGE(src_huge_phys)->usage == PU_PRIVATE) {
+                            src_pd[pdi] &= ~MM_PAGE_WRITE;
                         }
+                        dst_pd[pdi] = src_pd[pdi];
 
-                        uintptr_t src_page_virt = (pml4i << MM_PML4I_SHIFT) |
-                                                  (pdpti << MM_PDPTI_SHIFT) |
-                                                  (pdi << MM_PDI_SHIFT) |
-                                                  (pti << MM_PTI_SHIFT);
-                        uintptr_t src_page_phys = src_pt[pti] & MM_PTE_MASK;
-                        struct page *src_page = PHYS2PAGE(src_page_phys);
-
-                        _assert(src_page->refcount);
-
-#define MM_USE_COW
-                        if ((src_pt[pti] & MM_PAGE_WRITE) && src_page->usage == PU_PRIVATE) {
-                            // Clone the mapping, use CoW
-#if defined(MM_USE_COW)
-                            uint64_t access = src_pt[pti] & (MM_PTE_FLAGS_MASK & ~MM_PAGE_WRITE);
-                            dst_pt[pti] = src_page_phys | access;
-                            src_pt[pti] &= ~MM_PAGE_WRITE;
-                            asm volatile("invlpg (%0)"::"r"(src_page_virt));
-                            ++src_page->refcount;
-#else
-                            uint64_t access = src_pt[pti] & MM_PTE_FLAGS_MASK;
-                            uintptr_t new_page = mm_phys_alloc_page(PU_PRIVATE);
-                            _assert(new_page != MM_NADDR);
-                            memcpy((void *) MM_VIRTUALIZE(new_page),
-                                   (const void *) MM_VIRTUALIZE(src_page_phys),
-                                   0x1000);
-                            dst_pt[pti] = new_page | access;
-                            ++PHYS2PAGE(new_page)->refcount;
-#endif
-                        } else {
-                            // Just clone the mapping - it's readonly
-                            dst_pt[pti] = src_page_phys | (src_pt[pti] & MM_PTE_FLAGS_MASK);
-                            ++src_page->refcount;
+                        for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+                            struct page *src_page = PHYS2PAGE(src_huge_phys + i * MM_PAGE_SIZE);
+                            _assert(src_page->refcount);
+                            __atomic_add_fetch(&src_page->refcount, 1, __ATOMIC_SEQ_CST);
                         }
+                        continue;
                     }
+
+                    // Share the page table, see mm_pt_own()
+                    mm_pt_share((mm_pagetab_t) MM_VIRTUALIZE(src_pd[pdi] & MM_PTE_MASK));
+                    src_pd[pdi] &= ~MM_PAGE_WRITE;
+                    dst_pd[pdi] = src_pd[pdi];
                 }
             }
         }
+
+        // Writable translations of the parent may still be cached
+        mm_tlb_space(src_pml4);
     }
 
     // Kernel pages don't need to be copied - just use mm_space_clone(, , MM_CLONE_FLG_KERNEL)
@@ -331,6 +990,8 @@ void mm_space_release(struct process *proc) {
         panic("???\n");
     }
 
+    vma_release(&proc->vm);
+
     for (size_t pml4i = 0; pml4i < AMD64_PML4I_USER_END; ++pml4i) {
         if (!(pml4[pml4i] & MM_PAGE_PRESENT)) {
             continue;
@@ -350,25 +1011,18 @@ void mm_space_release(struct process *proc) {
                     continue;
                 }
 
-                mm_space_t pt = (mm_space_t) MM_VIRTUALIZE(pd[pdi] & MM_PTE_MASK);
-
-                for (size_t pti = 0; pti < MM_PTE_COUNT; ++pti) {
-                    if (!(pt[pti] & MM_PAGE_PRESENT)) {
-                        continue;
-                    }
+                if (pd[pdi] & MM_PAGE_HUGE) {
+                    mm_huge_unref(pd[pdi] & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK);
+                    continue;
+                }
 
-                    uintptr_t page_phys = pt[pti] & MM_PTE_MASK;
-                    struct page *page = PHYS2PAGE(page_phys);
-                    _assert(page->refcount);
-                    --page->refcount;
+                mm_pagetab_t pt = (mm_pagetab_t) MM_VIRTUALIZE(pd[pdi] & MM_PTE_MASK);
 
-                    // Any page with zero refcount can be released
-                    if (!page->refcount) {
-                        mm_phys_free_page(page_phys);
-                    }
+                // Last reference to the table, otherwise it's still used
+                // by a forked process and is left to it
+                if (mm_pt_unref(pt)) {
+                    mm_pt_release(pt);
                 }
-
-                amd64_mm_pool_free(pt);
             }
 
             amd64_mm_pool_free(pd);
@@ -378,10 +1032,14 @@ void mm_space_release(struct process *proc) {
 
         pml4[pml4i] = 0;
     }
+
+    // execve() keeps running in the space
+    mm_tlb_space(pml4);
 }
 
 void mm_space_free(struct process *proc) {
     mm_space_release(proc);
+    amd64_tlb_drop(proc->space);
     amd64_mm_pool_free(proc->space);
 }
 
@@ -8,6 +8,9 @@
 #include "sys/heap.h"
 #include "arch/amd64/mm/phys.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/vma.h"
+#include "sys/thread.h"
+#include "sys/config.h"
 #include "sys/mm.h"
 
 mm_space_t mm_kernel;
@@ -26,18 +29,36 @@ void userptr_check(const void *ptr) {
 
     assert(ptr, "invalid userptr: NULL\n");
     assert((uintptr_t) ptr < KERNEL_VIRT_BASE, "invalid userptr: in kernel space (%p)\n", ptr);
-    assert(mm_map_get(space, (uintptr_t) ptr, NULL) != MM_NADDR, "invalid userptr: not mapped (%p)\n", ptr);
+    if (mm_map_get(space, (uintptr_t) ptr, NULL) == MM_NADDR) {
+        // May be a lazily allocated page
+        _assert(thread_self && thread_self->proc);
+        assert(vma_fault(thread_self->proc, (uintptr_t) ptr, 0) == 0, "invalid userptr: not mapped (%p)\n", ptr);
+    }
+}
+
+void amd64_mm_cpu_init(void) {
+    uintptr_t cr0;
+
+    // CR0.WP: make the kernel's own writes to userspace fault on read-only
+    // pages as well, so that they go through copy-on-write
+    asm volatile ("movq %%cr0, %0":"=r"(cr0));
+    cr0 |= 1 << 16;
+    asm volatile ("movq %0, %%cr0"::"r"(cr0):"memory");
 }
 
 void amd64_mm_init(void) {
     kdebug("Memory manager init\n");
 
+    amd64_mm_cpu_init();
+
     mm_kernel = &kernel_pd_res[5 * 512];
 
-    uintptr_t heap_base_phys = mm_phys_alloc_contiguous(KERNEL_HEAP >> 12, PU_KERNEL);
-    assert(heap_base_phys != MM_NADDR, "Could not allocate %S of memory for kernel heap\n", KERNEL_HEAP);
-    kdebug("Setting up kernel heap of %S @ %p\n", KERNEL_HEAP, heap_base_phys);
-    amd64_heap_init(heap_global, heap_base_phys, KERNEL_HEAP);
+    // A growable heap only needs to be large enough for early boot
+    size_t heap_size = kernel_config[CFG_HEAP_GROW] ? KERNEL_HEAP_GROW : KERNEL_HEAP;
+    uintptr_t heap_base_phys = mm_phys_alloc_contiguous(heap_size >> 12, PU_KERNEL);
+    assert(heap_base_phys != MM_NADDR, "Could not allocate %S of memory for kernel heap\n", heap_size);
+    kdebug("Setting up kernel heap of %S @ %p\n", heap_size, heap_base_phys);
+    amd64_heap_init(heap_global, heap_base_phys, heap_size);
 
     amd64_heap_dump(heap_global);
 }
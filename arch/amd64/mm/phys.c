@@ -1,5 +1,6 @@
 #include "arch/amd64/mm/phys.h"
 #include "arch/amd64/mm/pool.h"
+#include "arch/amd64/cpu.h"
 #include "sys/assert.h"
 #include "sys/panic.h"
 #include "sys/debug.h"
@@ -8,11 +9,28 @@
 #include "sys/mem/phys.h"
 #include "sys/mm.h"
 
-#define PHYS_MAX_PAGES              ((1U << 30) / 0x1000)
+// Boot code maps this much into kernel space
+#define PHYS_BOOT_MAPPED            (4ULL << 30)
+#define PHYS_MAX_ADDR               ((uintptr_t) MM_MAX_SECTIONS << MM_SECTION_SHIFT)
 
 // Reserve 1MiB at bottom
 #define LOW_BOUND                   0x100000
 
+// Largest buddy block is 4MiB
+#define PHYS_MAX_ORDER              10
+#define PHYS_NPFN                   ((size_t) -1)
+// Per-CPU hot page cache limits: when a cache is empty or full, this
+// many pages are moved from/to the buddy allocator at once
+#define PHYS_PCP_HIGH               64
+#define PHYS_PCP_BATCH              16
+// Reclaim starts when less than 1/32 of memory is free and stops at 1/16
+#define PHYS_WMARK_LOW(total)       ((total) / 32)
+#define PHYS_WMARK_HIGH(total)      ((total) / 16)
+#define PHYS_RECLAIM_BATCH          64
+// Most objects don't give their page back when freed, so a single call
+// doesn't go on for more than a few batches
+#define PHYS_RECLAIM_PASSES         4
+
 #define MMAP_KIND_RESERVED          0
 #define MMAP_KIND_USABLE            1
 #define MMAP_KIND_UNKNOWN           2
@@ -21,13 +39,24 @@ struct mmap_iter {
     size_t position, limit;
 };
 
-struct page *mm_pages = NULL;
+struct phys_pcp {
+    size_t count;
+    size_t pfns[PHYS_PCP_HIGH];
+};
+
+struct page *mm_sections[MM_MAX_SECTIONS] = {0};
 static size_t _total_pages, _pages_free;
 static size_t _alloc_pages[_PU_COUNT];
+// Protects the buddy free lists, counters are updated atomically
 static spin_t phys_spin = 0;
+static struct list_head free_areas[PHYS_MAX_ORDER + 1];
+static struct phys_pcp phys_pcps[AMD64_MAX_SMP];
 static struct mm_phys_reserved phys_reserve_mm_pages,
+                               phys_reserve_direct_map,
                                phys_reserve_mmap;
 static LIST_HEAD(reserved_regions);
+static LIST_HEAD(phys_shrinkers);
+static int phys_reclaiming = 0;
 
 static int is_reserved(uintptr_t addr) {
     struct mm_phys_reserved *res;
@@ -165,8 +194,9 @@ uint64_t *amd64_mm_pool_alloc(void) {
     uint64_t *table;
     uintptr_t ptr;
 
-    ptr = mm_phys_alloc_page(PU_PAGING);
-    _assert(ptr != MM_NADDR);
+    if ((ptr = mm_phys_alloc_page(PU_PAGING)) == MM_NADDR) {
+        return NULL;
+    }
 
     table = (uint64_t *) MM_VIRTUALIZE(ptr);
     memset(table, 0, MM_PAGE_SIZE);
@@ -178,84 +208,270 @@ void amd64_mm_pool_free(uint64_t *p) {
     mm_phys_free_page(MM_PHYS(p));
 }
 
+//// Buddy allocator
+
+static void buddy_add(size_t pfn, size_t order) {
+    struct page *pg = PFN2PAGE(pfn);
+
+    pg->flags |= PG_BUDDY;
+    pg->order = order;
+    // Keep lower addresses first: some devices can only do 32-bit DMA
+    list_add_tail(&pg->link, &free_areas[order]);
+}
+
+static void buddy_del(struct page *pg) {
+    list_del_init(&pg->link);
+    pg->flags &= ~PG_BUDDY;
+}
+
+// Add a free range as naturally aligned blocks. Nothing is merged, so
+// the range must not have free neighbours
+static void buddy_add_range(size_t pfn, size_t end) {
+    while (pfn < end) {
+        size_t order = 0;
+        while (order < PHYS_MAX_ORDER &&
+               !(pfn & (1UL << order)) &&
+               pfn + (2UL << order) <= end) {
+            ++order;
+        }
+        buddy_add(pfn, order);
+        pfn += 1UL << order;
+    }
+}
+
+// Return a free block to the free lists, merging it with its buddies.
+// Blocks never span sections, so the buddy's section is always present
+static void buddy_free(size_t pfn, size_t order) {
+    while (order < PHYS_MAX_ORDER) {
+        size_t buddy_pfn = pfn ^ (1UL << order);
+        struct page *buddy = PFN2PAGE(buddy_pfn);
+
+        if (!(buddy->flags & PG_BUDDY) || buddy->order != order) {
+            break;
+        }
+
+        buddy_del(buddy);
+        pfn &= ~(1UL << order);
+        ++order;
+    }
+
+    buddy_add(pfn, order);
+}
+
+// Returns the first PFN of a free block of 2^order pages or PHYS_NPFN
+static size_t buddy_alloc(size_t order) {
+    for (size_t o = order; o <= PHYS_MAX_ORDER; ++o) {
+        struct page *pg;
+        size_t pfn;
+
+        if (list_empty(&free_areas[o])) {
+            continue;
+        }
+
+        pg = list_first_entry(&free_areas[o], struct page, link);
+        pfn = PAGE2PFN(pg);
+        buddy_del(pg);
+
+        // Split the block, returning upper halves to the free lists
+        while (o > order) {
+            --o;
+            buddy_add(pfn + (1UL << o), o);
+        }
+
+        return pfn;
+    }
+
+    return PHYS_NPFN;
+}
+
+static void page_claim(size_t pfn, enum page_usage pu) {
+    struct page *pg = PFN2PAGE(pfn);
+
+    _assert(!(pg->flags & (PG_ALLOC | PG_BUDDY)));
+    _assert(pg->usage == PU_UNKNOWN);
+    _assert(pg->refcount == 0);
+    pg->usage = pu;
+    pg->flags |= PG_ALLOC;
+
+    __atomic_add_fetch(&_alloc_pages[pu], 1, __ATOMIC_RELAXED);
+    _assert(_pages_free);
+    __atomic_sub_fetch(&_pages_free, 1, __ATOMIC_RELAXED);
+}
+
+//// Per-CPU hot page caches
+// Single pages are allocated and freed here with interrupts disabled,
+// phys_spin is only taken to move a batch from/to the buddy allocator
+
+static void phys_pcp_refill(struct phys_pcp *pcp) {
+    size_t pfn;
+
+    spin_lock(&phys_spin);
+    while (pcp->count < PHYS_PCP_BATCH) {
+        if ((pfn = buddy_alloc(0)) == PHYS_NPFN) {
+            break;
+        }
+        pcp->pfns[pcp->count++] = pfn;
+    }
+    spin_release(&phys_spin);
+}
+
+// Give the coldest pages (at the bottom) back to the buddy allocator
+static void phys_pcp_drain(struct phys_pcp *pcp) {
+    spin_lock(&phys_spin);
+    for (size_t i = 0; i < PHYS_PCP_BATCH; ++i) {
+        buddy_free(pcp->pfns[i], 0);
+    }
+    spin_release(&phys_spin);
+
+    pcp->count -= PHYS_PCP_BATCH;
+    memmove(pcp->pfns, &pcp->pfns[PHYS_PCP_BATCH], pcp->count * sizeof(size_t));
+}
+
+////
+
 uintptr_t mm_phys_alloc_page(enum page_usage pu) {
     _assert(pu < _PU_COUNT && pu != PU_UNKNOWN);
-
+    struct phys_pcp *pcp;
+    size_t pfn = PHYS_NPFN;
     uintptr_t irq;
-    spin_lock_irqsave(&phys_spin, &irq);
 
-    for (size_t i = LOW_BOUND >> 12; i < PHYS_MAX_PAGES; ++i) {
-        struct page *pg = &mm_pages[i];
+    asm volatile ("pushfq; cli; popq %0":"=r"(irq)::"memory");
 
-        if (!(pg->flags & PG_ALLOC)) {
-            _assert(pg->usage == PU_UNKNOWN);
-            _assert(pg->refcount == 0);
-            pg->usage = pu;
-            pg->flags |= PG_ALLOC;
-            ++_alloc_pages[pu];
-            _assert(_pages_free);
-            --_pages_free;
-
-            spin_release_irqrestore(&phys_spin, &irq);
-            return i * MM_PAGE_SIZE;
+    if (percpu_ready) {
+        pcp = &phys_pcps[get_cpu()->processor_id];
+        if (!pcp->count) {
+            phys_pcp_refill(pcp);
+        }
+        if (pcp->count) {
+            pfn = pcp->pfns[--pcp->count];
         }
+    } else {
+        spin_lock(&phys_spin);
+        pfn = buddy_alloc(0);
+        spin_release(&phys_spin);
     }
 
-    spin_release_irqrestore(&phys_spin, &irq);
-    return MM_NADDR;
+    if (pfn != PHYS_NPFN) {
+        page_claim(pfn, pu);
+    }
+
+    if (irq & (1 << 9)) {
+        asm volatile ("sti");
+    }
+
+    return pfn == PHYS_NPFN ? MM_NADDR : pfn * MM_PAGE_SIZE;
 }
 
 void mm_phys_free_page(uintptr_t addr) {
+    struct page *pg = PHYS2PAGE(addr);
+    size_t pfn = addr / MM_PAGE_SIZE;
+    struct phys_pcp *pcp;
     uintptr_t irq;
-    spin_lock_irqsave(&phys_spin, &irq);
 
-    struct page *pg = PHYS2PAGE(addr);
     _assert(pg->refcount == 0);
     _assert(pg->flags & PG_ALLOC);
 
     _assert(_alloc_pages[pg->usage]);
-    --_alloc_pages[pg->usage];
-    ++_pages_free;
+    __atomic_sub_fetch(&_alloc_pages[pg->usage], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_pages_free, 1, __ATOMIC_RELAXED);
 
     pg->flags &= ~PG_ALLOC;
     pg->usage = PU_UNKNOWN;
 
-    spin_release_irqrestore(&phys_spin, &irq);
+    asm volatile ("pushfq; cli; popq %0":"=r"(irq)::"memory");
+
+    if (percpu_ready) {
+        pcp = &phys_pcps[get_cpu()->processor_id];
+        if (pcp->count == PHYS_PCP_HIGH) {
+            phys_pcp_drain(pcp);
+        }
+        pcp->pfns[pcp->count++] = pfn;
+    } else {
+        spin_lock(&phys_spin);
+        buddy_free(pfn, 0);
+        spin_release(&phys_spin);
+    }
+
+    if (irq & (1 << 9)) {
+        asm volatile ("sti");
+    }
 }
 
 uintptr_t mm_phys_alloc_contiguous(size_t count, enum page_usage pu) {
+    size_t order = 0, pfn;
     uintptr_t irq;
+
+    _assert(count);
+    while ((1UL << order) < count) {
+        ++order;
+    }
+    if (order > PHYS_MAX_ORDER) {
+        return MM_NADDR;
+    }
+
     spin_lock_irqsave(&phys_spin, &irq);
 
-    for (size_t i = LOW_BOUND >> 12; i < PHYS_MAX_PAGES - count; ++i) {
-        for (size_t j = 0; j < count; ++j) {
-            if (mm_pages[i + j].flags & PG_ALLOC) {
-                goto fail;
-            }
-        }
+    if ((pfn = buddy_alloc(order)) == PHYS_NPFN) {
+        spin_release_irqrestore(&phys_spin, &irq);
+        return MM_NADDR;
+    }
 
-        for (size_t j = 0; j < count; ++j) {
-            _assert(!mm_pages[i + j].refcount);
-            mm_pages[i + j].flags |= PG_ALLOC;
-            mm_pages[i + j].usage = pu;
+    // Give back the unused tail of the block, its buddies are all
+    // within the allocated part
+    buddy_add_range(pfn + count, pfn + (1UL << order));
 
-            ++_alloc_pages[pu];
-            _assert(_pages_free);
-            --_pages_free;
+    for (size_t i = 0; i < count; ++i) {
+        page_claim(pfn + i, pu);
+    }
+
+    spin_release_irqrestore(&phys_spin, &irq);
+    return pfn * MM_PAGE_SIZE;
+}
+
+void mm_phys_shrinker_add(struct mm_shrinker *s) {
+    uintptr_t irq;
+
+    spin_lock_irqsave(&phys_spin, &irq);
+    list_add_tail(&s->link, &phys_shrinkers);
+    spin_release_irqrestore(&phys_spin, &irq);
+}
+
+void mm_phys_reclaim(void) {
+    struct mm_shrinker *s;
+    size_t freed, before;
+
+    if (__atomic_load_n(&_pages_free, __ATOMIC_RELAXED) >= PHYS_WMARK_LOW(_total_pages)) {
+        return;
+    }
+    // Someone else is already at it
+    if (__atomic_exchange_n(&phys_reclaiming, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // Shrinkers are only ever added, so the list can be walked without
+    // the lock
+    for (size_t pass = 0; pass < PHYS_RECLAIM_PASSES; ++pass) {
+        before = __atomic_load_n(&_pages_free, __ATOMIC_RELAXED);
+        freed = 0;
+        list_for_each_entry(s, &phys_shrinkers, link) {
+            freed += s->shrink(PHYS_RECLAIM_BATCH);
         }
 
-        spin_release_irqrestore(&phys_spin, &irq);
-        return i * MM_PAGE_SIZE;
-fail:
-        continue;
+        // Stop once nothing, or at least no pages, came back
+        if (!freed || __atomic_load_n(&_pages_free, __ATOMIC_RELAXED) <= before) {
+            break;
+        }
+        if (__atomic_load_n(&_pages_free, __ATOMIC_RELAXED) >= PHYS_WMARK_HIGH(_total_pages)) {
+            break;
+        }
     }
-    spin_release_irqrestore(&phys_spin, &irq);
-    return MM_NADDR;
+
+    __atomic_store_n(&phys_reclaiming, 0, __ATOMIC_RELEASE);
 }
 
-static uintptr_t place_mm_pages(const struct mm_phys_memory_map *mmap, size_t req_count) {
+// Find `req_count' contiguous usable pages below `limit'
+static uintptr_t place_early(const struct mm_phys_memory_map *mmap, size_t req_count, uintptr_t limit) {
     struct mmap_iter iter;
-    size_t item_offset;
     uintptr_t base;
     size_t size;
     int kind;
@@ -264,7 +480,7 @@ static uintptr_t place_mm_pages(const struct mm_phys_memory_map *mmap, size_t re
     // TODO: merge two consecutive entries into a single address block
     while (mmap_iter_next(&iter, &kind, &base, &size)) {
         uintptr_t page_aligned_begin = (base + 0xFFF) & ~0xFFF;
-        uintptr_t page_aligned_end = (base + size) & ~0xFFF;
+        uintptr_t page_aligned_end = MIN((base + size) & ~0xFFF, limit);
 
         if (kind == MMAP_KIND_USABLE && page_aligned_end > page_aligned_begin) {
             // Something like mm_phys_alloc_contiguous does, but
@@ -293,20 +509,80 @@ static uintptr_t place_mm_pages(const struct mm_phys_memory_map *mmap, size_t re
     return MM_NADDR;
 }
 
+// Boot code only maps the lower 4GiB of physical memory, map the rest
+// using 2MiB pages
+// TODO: use 1GiB pages if PDPE1GB is supported
+static void phys_map_high(const struct mm_phys_memory_map *mmap, uintptr_t end) {
+    extern uint64_t kernel_pd_res[];
+    uint64_t *pdpt = &kernel_pd_res[4 * 512];
+    size_t first = PHYS_BOOT_MAPPED >> MM_PDPTI_SHIFT;
+    size_t last = (end + (1ULL << MM_PDPTI_SHIFT) - 1) >> MM_PDPTI_SHIFT;
+    uintptr_t pds;
+
+    if (last <= first) {
+        return;
+    }
+
+    pds = place_early(mmap, last - first, PHYS_BOOT_MAPPED);
+    assert(pds != MM_NADDR, "Failed to allocate kernel page directories\n");
+    phys_reserve_direct_map.begin = pds;
+    phys_reserve_direct_map.end = pds + (last - first) * MM_PAGE_SIZE;
+    mm_phys_reserve("Direct map", &phys_reserve_direct_map);
+
+    for (size_t i = first; i < last; ++i) {
+        uintptr_t pd_phys = pds + (i - first) * MM_PAGE_SIZE;
+        uint64_t *pd = (uint64_t *) MM_VIRTUALIZE(pd_phys);
+
+        for (size_t j = 0; j < MM_PTE_COUNT; ++j) {
+            pd[j] = ((i << MM_PDPTI_SHIFT) + (j << MM_PDI_SHIFT)) |
+                    MM_PAGE_HUGE | MM_PAGE_WRITE | MM_PAGE_PRESENT;
+        }
+
+        pdpt[i] = pd_phys | MM_PAGE_WRITE | MM_PAGE_PRESENT;
+    }
+}
+
 void amd64_phys_memory_map(const struct mm_phys_memory_map *mmap) {
     struct mmap_iter iter;
-    uintptr_t base;
-    size_t size;
+    uintptr_t base, phys_end = 0;
+    size_t size, nsections = 0;
+    uintptr_t mm_pages_addr;
+    size_t mm_pages_req_count;
+    struct page *pages;
     int kind;
 
     phys_reserve_mmap.begin = (uintptr_t) MM_PHYS(mmap->address);
     phys_reserve_mmap.end = phys_reserve_mmap.begin + mmap->entry_count * mmap->entry_size;
     mm_phys_reserve("Memory map", &phys_reserve_mmap);
 
-    // Allocate space for mm_pages array
-    size_t mm_pages_req_count = (PHYS_MAX_PAGES * sizeof(struct page) + 0xFFF) >> 12;
-    uintptr_t mm_pages_addr = place_mm_pages(mmap, mm_pages_req_count);
-    _assert(mm_pages_addr != MM_NADDR);
+    // Find out which sections contain usable memory. Section pointers
+    // are only used as flags until struct pages are placed
+    mmap_iter_init(mmap, &iter);
+    while (mmap_iter_next(&iter, &kind, &base, &size)) {
+        uintptr_t end = MIN(base + size, PHYS_MAX_ADDR);
+
+        if (kind != MMAP_KIND_USABLE || end <= base) {
+            continue;
+        }
+        if (base + size > PHYS_MAX_ADDR) {
+            kwarn("Ignoring memory above %p\n", PHYS_MAX_ADDR);
+        }
+
+        for (size_t i = base >> MM_SECTION_SHIFT; i <= (end - 1) >> MM_SECTION_SHIFT; ++i) {
+            if (!mm_sections[i]) {
+                mm_sections[i] = (struct page *) -1;
+                ++nsections;
+            }
+        }
+        phys_end = MAX(phys_end, end);
+    }
+
+    phys_map_high(mmap, phys_end);
+
+    // Allocate space for struct pages of present sections
+    mm_pages_req_count = (nsections * MM_SECTION_PAGES * sizeof(struct page) + 0xFFF) >> 12;
+    mm_pages_addr = place_early(mmap, mm_pages_req_count, PHYS_MAX_ADDR);
+    assert(mm_pages_addr != MM_NADDR, "Failed to allocate %u pages for mm_pages\n", mm_pages_req_count);
 
     kdebug("Placing mm_pages (%u) at %p\n", mm_pages_req_count, mm_pages_addr);
     phys_reserve_mm_pages.begin = mm_pages_addr;
@@ -314,10 +590,18 @@ void amd64_phys_memory_map(const struct mm_phys_memory_map *mmap) {
     // TODO: also reserve memory map itself before screwing with it?
     mm_phys_reserve("mm_pages", &phys_reserve_mm_pages);
 
-    mm_pages = (struct page *) MM_VIRTUALIZE(mm_pages_addr);
-    for (size_t i = 0; i < PHYS_MAX_PAGES; ++i) {
-        mm_pages[i].flags = PG_ALLOC;
-        mm_pages[i].refcount = (size_t) -1L;
+    pages = (struct page *) MM_VIRTUALIZE(mm_pages_addr);
+    for (size_t i = 0; i < MM_MAX_SECTIONS; ++i) {
+        if (!mm_sections[i]) {
+            continue;
+        }
+
+        mm_sections[i] = pages;
+        for (size_t j = 0; j < MM_SECTION_PAGES; ++j) {
+            pages[j].flags = PG_ALLOC | ((uint64_t) i << PG_SECTION_SHIFT);
+            pages[j].refcount = (size_t) -1L;
+        }
+        pages += MM_SECTION_PAGES;
     }
 
     _total_pages = 0;
@@ -326,7 +610,7 @@ void amd64_phys_memory_map(const struct mm_phys_memory_map *mmap) {
     // Collect usable physical memory information
     while (mmap_iter_next(&iter, &kind, &base, &size)) {
         uintptr_t page_aligned_begin = (base + 0xFFF) & ~0xFFF;
-        uintptr_t page_aligned_end = (base + size) & ~0xFFF;
+        uintptr_t page_aligned_end = MIN((base + size) & ~0xFFF, PHYS_MAX_ADDR);
 
         if (kind == MMAP_KIND_USABLE && page_aligned_end > page_aligned_begin + 0x1000) {
             //kdebug("+++ %S @ %p\n", page_aligned_end - page_aligned_begin, page_aligned_begin);
@@ -334,7 +618,9 @@ void amd64_phys_memory_map(const struct mm_phys_memory_map *mmap) {
             for (uintptr_t addr = page_aligned_begin; addr < page_aligned_end; addr += 0x1000) {
                 extern char _kernel_end;
 
-                if (!is_reserved(addr) && addr >= (MM_PHYS(&_kernel_end) + 0x1000)) {
+                if (!is_reserved(addr) &&
+                    addr >= LOW_BOUND &&
+                    addr >= (MM_PHYS(&_kernel_end) + 0x1000)) {
                     struct page *pg = PHYS2PAGE(addr);
                     pg->flags &= ~PG_ALLOC;
                     pg->usage = PU_UNKNOWN;
@@ -347,5 +633,33 @@ void amd64_phys_memory_map(const struct mm_phys_memory_map *mmap) {
 
     _pages_free = _total_pages;
 
+    // Hand free runs to the buddy allocator
+    for (size_t i = 0; i <= PHYS_MAX_ORDER; ++i) {
+        list_head_init(&free_areas[i]);
+    }
+    for (size_t i = 0; i < MM_MAX_SECTIONS; ++i) {
+        size_t pfn, end, run = PHYS_NPFN;
+
+        if (!mm_sections[i]) {
+            continue;
+        }
+
+        pfn = i * MM_SECTION_PAGES;
+        end = pfn + MM_SECTION_PAGES;
+        for (; pfn < end; ++pfn) {
+            if (!(PFN2PAGE(pfn)->flags & PG_ALLOC)) {
+                if (run == PHYS_NPFN) {
+                    run = pfn;
+                }
+            } else if (run != PHYS_NPFN) {
+                buddy_add_range(run, pfn);
+                run = PHYS_NPFN;
+            }
+        }
+        if (run != PHYS_NPFN) {
+            buddy_add_range(run, end);
+        }
+    }
+
     kdebug("%S available\n", _total_pages << 12);
 }
@@ -0,0 +1,153 @@
+// TLB shootdown. Every CPU records the address space it has loaded, so
+// changes to a space only interrupt the CPUs which may have translations
+// of it cached. A CPU running a kernel thread keeps the previous user
+// space loaded to avoid a flush when switching back to it, and leaves
+// it for the kernel space on the first shootdown it receives
+#include "arch/amd64/smp/smp.h"
+#include "arch/amd64/smp/ipi.h"
+#include "arch/amd64/mm/map.h"
+#include "arch/amd64/mm/tlb.h"
+#include "arch/amd64/cpu.h"
+#include "sys/assert.h"
+
+struct tlb_request {
+    uintptr_t cr3;                  // 0 for kernel entries
+    const uintptr_t *addrs;
+    size_t count;
+    size_t pending;                 // CPUs which haven't handled it yet
+};
+
+// A CPU waits for its request to complete before making another one,
+// so a slot per (target, initiator) pair is enough
+static struct tlb_request *tlb_inbox[AMD64_MAX_SMP][AMD64_MAX_SMP];
+
+static inline void tlb_load_cr3(struct cpu *cpu, uintptr_t cr3) {
+    // Published before the load: a shootdown either sees the CPU in
+    // the space or its changes are already visible to the page walk
+    __atomic_store_n(&cpu->mm_cr3, cr3, __ATOMIC_SEQ_CST);
+    asm volatile ("movq %0, %%cr3"::"r"(cr3):"memory");
+}
+
+static void tlb_apply(struct cpu *cpu, const struct tlb_request *req) {
+    if (req->cr3) {
+        if (cpu->mm_cr3 != req->cr3) {
+            // Switched away meanwhile, which has flushed the TLB
+            return;
+        }
+        if (cpu->mm_lazy) {
+            // Nothing running here needs the space
+            cpu->mm_lazy = 0;
+            tlb_load_cr3(cpu, MM_PHYS(mm_kernel));
+            return;
+        }
+        if (req->count > MM_TLB_FLUSH_MAX) {
+            asm volatile ("movq %0, %%cr3"::"r"(req->cr3):"memory");
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < req->count; ++i) {
+        asm volatile ("invlpg (%0)"::"r"(req->addrs[i]):"memory");
+    }
+}
+
+// Called with interrupts disabled
+static void tlb_handle(struct cpu *cpu) {
+    struct tlb_request *req;
+
+    for (size_t i = 0; i < smp_ncpus; ++i) {
+        if ((req = __atomic_exchange_n(&tlb_inbox[cpu->processor_id][i], NULL, __ATOMIC_ACQUIRE))) {
+            tlb_apply(cpu, req);
+            __atomic_sub_fetch(&req->pending, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static int tlb_ipi(void *arg, uintptr_t value) {
+    tlb_handle(get_cpu());
+    return 0;
+}
+
+void amd64_tlb_switch(uintptr_t cr3) {
+    struct cpu *cpu = get_cpu();
+
+    if (cr3 == MM_PHYS(mm_kernel) && cpu->mm_cr3) {
+        cpu->mm_lazy = 1;
+        return;
+    }
+
+    cpu->mm_lazy = 0;
+    if (cpu->mm_cr3 != cr3) {
+        tlb_load_cr3(cpu, cr3);
+    }
+}
+
+void amd64_tlb_shootdown(mm_space_t space, const uintptr_t *addrs, size_t count) {
+    uintptr_t cr3 = space ? MM_PHYS(space) : 0;
+    struct tlb_request req;
+    uintptr_t irq, target;
+    struct cpu *self;
+
+    if (smp_ncpus == 1 || !percpu_ready || !count) {
+        return;
+    }
+    // Global entries survive a CR3 reload, kernel ranges are flushed
+    // in smaller batches
+    _assert(space || count <= MM_TLB_FLUSH_MAX);
+
+    req.cr3 = cr3;
+    req.addrs = addrs;
+    req.count = count;
+    req.pending = 0;
+
+    asm volatile ("pushfq; cli; popq %0":"=r"(irq)::"memory");
+    self = get_cpu();
+
+    // Page table changes must be visible before the other CPUs' spaces
+    // are looked at
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < smp_ncpus; ++i) {
+        target = __atomic_load_n(&cpus[i].mm_cr3, __ATOMIC_SEQ_CST);
+
+        // CPUs which haven't entered the scheduler yet are skipped as well
+        if (i == self->processor_id || !target || (cr3 && target != cr3)) {
+            continue;
+        }
+
+        __atomic_add_fetch(&req.pending, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&tlb_inbox[i][self->processor_id], &req, __ATOMIC_RELEASE);
+        amd64_ipi_call(i, tlb_ipi, NULL, 0);
+    }
+
+    while (__atomic_load_n(&req.pending, __ATOMIC_ACQUIRE)) {
+        // The targets may be waiting for this CPU in the same way
+        tlb_handle(self);
+        asm volatile ("pause");
+    }
+
+    if (irq & (1 << 9)) {
+        asm volatile ("sti");
+    }
+}
+
+void amd64_tlb_drop(mm_space_t space) {
+    struct cpu *cpu;
+    uintptr_t irq;
+
+    if (percpu_ready) {
+        asm volatile ("pushfq; cli; popq %0":"=r"(irq)::"memory");
+        cpu = get_cpu();
+        if (cpu->mm_cr3 == MM_PHYS(space)) {
+            _assert(cpu->mm_lazy);
+            cpu->mm_lazy = 0;
+            tlb_load_cr3(cpu, MM_PHYS(mm_kernel));
+        }
+        if (irq & (1 << 9)) {
+            asm volatile ("sti");
+        }
+    }
+
+    // Only lazy users can be left by now, they switch to the kernel space
+    amd64_tlb_shootdown(space, NULL, MM_TLB_FLUSH_MAX + 1);
+}
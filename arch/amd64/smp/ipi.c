@@ -2,22 +2,99 @@
 #include "arch/amd64/smp/smp.h"
 #include "arch/amd64/smp/ipi.h"
 #include "arch/amd64/cpu.h"
+#include "sys/assert.h"
+#include "sys/sched.h"
 #include "sys/debug.h"
+#include "sys/spin.h"
+
+#define IPI_MAILBOX_SIZE        32
+
+// Per-CPU queue of requests for cross-CPU operations
+struct ipi_mailbox {
+    spin_t lock;
+    size_t head, tail;
+    struct ipi_msg {
+        ipi_func_t func;
+        void *arg;
+        uintptr_t value;
+    } msgs[IPI_MAILBOX_SIZE];
+};
+
+static struct ipi_mailbox mailboxes[AMD64_MAX_SMP];
 
 void amd64_ipi_send(int cpu, uint8_t vector) {
+    uintptr_t irq;
+
     if (cpu < 0 || cpu >= (int) smp_ncpus) {
         kerror("Invalid cpu number: %d\n", cpu);
     }
 
+    // CMD1/CMD0 writes must not be interleaved with another IPI
+    // sent from an interrupt handler on this CPU
+    asm volatile ("pushfq; cli; popq %0":"=r"(irq)::"memory");
+
     LAPIC(LAPIC_REG_CMD1) = ((uint32_t) (cpus[cpu].apic_id & 0xFF)) << 24;
     // Wait for delivery status bit to clear
     while (LAPIC(LAPIC_REG_CMD0) & (1 << 12));
     // Command: vector 0xF0,
     LAPIC(LAPIC_REG_CMD0) = vector | (1 << 14);
+
+    if (irq & (1 << 9)) {
+        asm volatile ("sti");
+    }
+}
+
+void amd64_ipi_call(int cpu, ipi_func_t func, void *arg, uintptr_t value) {
+    struct ipi_mailbox *mbox = &mailboxes[cpu];
+    uintptr_t irq;
+    _assert(cpu >= 0 && cpu < (int) smp_ncpus);
+    _assert(cpu != (int) get_cpu()->processor_id);
+
+    while (1) {
+        spin_lock_irqsave(&mbox->lock, &irq);
+        if (mbox->tail - mbox->head < IPI_MAILBOX_SIZE) {
+            break;
+        }
+        // Mailbox is full, let the target CPU drain it
+        spin_release_irqrestore(&mbox->lock, &irq);
+        asm volatile ("pause");
+    }
+
+    struct ipi_msg *msg = &mbox->msgs[mbox->tail++ % IPI_MAILBOX_SIZE];
+    msg->func = func;
+    msg->arg = arg;
+    msg->value = value;
+
+    spin_release_irqrestore(&mbox->lock, &irq);
+
+    amd64_ipi_send(cpu, IPI_VECTOR_GENERIC);
 }
 
 void amd64_ipi_handle(void) {
-    kdebug("IPI received by cpu%u\n", get_cpu()->processor_id);
+    struct ipi_mailbox *mbox = &mailboxes[get_cpu()->processor_id];
+    struct ipi_msg msg;
+    int resched = 0;
+
+    // Handlers never switch context by themselves: the whole mailbox
+    // is drained first, and only then a reschedule happens if any of
+    // the requests needs it
+    while (1) {
+        spin_lock(&mbox->lock);
+        if (mbox->head == mbox->tail) {
+            spin_release(&mbox->lock);
+            break;
+        }
+        msg = mbox->msgs[mbox->head++ % IPI_MAILBOX_SIZE];
+        spin_release(&mbox->lock);
+
+        if (msg.func(msg.arg, msg.value)) {
+            resched = 1;
+        }
+    }
+
+    if (resched) {
+        yield();
+    }
 }
 
 void amd64_ipi_panic(void) {
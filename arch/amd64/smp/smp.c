@@ -29,6 +29,7 @@ struct ap_param_block {
 extern char kernel_stacks_top[];
 // TODO: use mutual exclusion for this
 size_t smp_ncpus = 1;
+int percpu_ready = 0;
 static inline void set_cpu(uintptr_t base) {
     // Write kernelGSbase again
     wrmsr(MSR_IA32_KERNEL_GS_BASE, base);
@@ -64,6 +65,8 @@ static void amd64_ap_code_entry(void) {
     // Enable FPU
     amd64_fpu_init();
 
+    amd64_mm_cpu_init();
+
     // Enable LAPIC timer
     amd64_timer_init();
 
@@ -166,6 +169,7 @@ void amd64_smp_bsp_configure(void) {
     cpus[0].tss = amd64_tss_get(0);
     cpus[0].thread = NULL;
     set_cpu((uintptr_t) &cpus[0]);
+    percpu_ready = 1;
 }
 
 void amd64_smp_init(void) {
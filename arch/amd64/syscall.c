@@ -68,6 +68,7 @@ void *syscall_table[256] = {
     [SYSCALL_NR_FSTATAT] =          sys_fstatat,
     [SYSCALL_NR_LSEEK] =            sys_lseek,
     [SYSCALL_NR_MMAP] =             sys_mmap,
+    [SYSCALL_NR_MPROTECT] =         sys_mprotect,
     [SYSCALL_NR_MUNMAP] =           sys_munmap,
     [SYSCALL_NR_IOCTL] =            sys_ioctl,
     [SYSCALL_NR_FACCESSAT] =        sys_faccessat,
@@ -75,6 +76,13 @@ void *syscall_table[256] = {
     [SYSCALL_NR_SELECT] =           sys_select,
     [SYSCALL_NR_DUP] =              sys_dup,
     [SYSCALL_NR_DUP2] =             sys_dup2,
+    [SYSCALL_NR_FCNTL] =            sys_fcntl,
+    [SYSCALL_NR_SENDFILE] =         sys_sendfile,
+    [SYSCALL_NRX_SPLICE] =          sys_splice,
+    [SYSCALL_NRX_TEE] =             sys_tee,
+    [SYSCALL_NR_EPOLL_CREATE] =     sys_epoll_create,
+    [SYSCALL_NR_EPOLL_WAIT] =       sys_epoll_wait,
+    [SYSCALL_NR_EPOLL_CTL] =        sys_epoll_ctl,
     [SYSCALL_NR_TRUNCATE] =         sys_truncate,
     [SYSCALL_NR_FTRUNCATE] =        sys_ftruncate,
     [SYSCALL_NR_GETCWD] =           sys_getcwd,
@@ -0,0 +1,314 @@
+// Name lookup cache. Every vnode attached to the tree has a positive
+// entry (unless there was no memory for it, see VN_DCACHE_PARTIAL), so
+// finding a child doesn't depend on how many siblings it has.
+// Names the filesystem has reported missing get a negative entry, so that
+// probing the same nonexistent paths (PATH search, library lookup) doesn't
+// rescan the directory on disk every time
+#include "user/errno.h"
+#include "fs/dcache.h"
+#include "sys/mem/slab.h"
+#include "sys/string.h"
+#include "sys/assert.h"
+#include "sys/debug.h"
+#include "sys/heap.h"
+#include "sys/spin.h"
+
+#define DCACHE_BUCKETS_INIT     64
+#define DCACHE_LOAD             2
+
+static struct slab_cache *dentry_cache = NULL;
+static spin_t dcache_lock = 0;
+// Power of two
+static size_t dcache_bucket_count = 0;
+static struct dentry **dcache_buckets = NULL;
+static size_t dcache_count = 0;
+static size_t dcache_neg_count = 0;
+static LIST_HEAD(dcache_neg_lru);
+// Bumped every time a name appears
+static uint64_t dcache_generation = 0;
+
+////
+
+static inline size_t dcache_hash(struct vnode *parent, const char *name) {
+    size_t hash = (uintptr_t) parent;
+    int c;
+
+    while ((c = *name++)) {
+        hash = (hash ^ c) * 0x100000001B3ULL;
+    }
+
+    return (size_t) ((hash * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static struct dentry *dcache_find(struct vnode *parent, const char *name, size_t hash) {
+    struct dentry *d;
+
+    if (!dcache_buckets) {
+        return NULL;
+    }
+
+    for (d = dcache_buckets[hash & (dcache_bucket_count - 1)]; d; d = d->next) {
+        if (d->hash == hash && d->parent == parent && !strcmp(d->name, name)) {
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+static void dcache_hash_insert(struct dentry **buckets, size_t bucket_count, struct dentry *d) {
+    struct dentry **it = &buckets[d->hash & (bucket_count - 1)];
+    d->next = *it;
+    *it = d;
+}
+
+// Entries and tables are allocated without the lock held, as it keeps
+// interrupts off. The dcache only speeds lookups up, so running out of
+// memory is never an error here
+
+// Makes sure the table exists
+static int dcache_prepare(void) {
+    struct dentry **buckets;
+    uintptr_t irq;
+
+    if (!dentry_cache) {
+        dentry_cache = slab_cache_get(sizeof(struct dentry));
+        _assert(dentry_cache);
+    }
+    if (__atomic_load_n(&dcache_buckets, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    if (!(buckets = kmalloc(sizeof(struct dentry *) * DCACHE_BUCKETS_INIT))) {
+        return -ENOMEM;
+    }
+    memset(buckets, 0, sizeof(struct dentry *) * DCACHE_BUCKETS_INIT);
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    if (!dcache_buckets) {
+        dcache_bucket_count = DCACHE_BUCKETS_INIT;
+        __atomic_store_n(&dcache_buckets, buckets, __ATOMIC_RELEASE);
+        buckets = NULL;
+    }
+    spin_release_irqrestore(&dcache_lock, &irq);
+
+    if (buckets) {
+        kfree(buckets);
+    }
+    return 0;
+}
+
+static struct dentry *dcache_alloc(void) {
+    if (dcache_prepare() != 0) {
+        return NULL;
+    }
+    return slab_calloc(dentry_cache);
+}
+
+// Doubles the table once it's loaded past DCACHE_LOAD. Gives up silently
+// if there's no memory, the chains just get longer then
+static void dcache_grow(void) {
+    struct dentry **new_buckets, **old_buckets, *d, *next;
+    size_t count, new_count;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    count = dcache_bucket_count;
+    if (dcache_count <= count * DCACHE_LOAD) {
+        spin_release_irqrestore(&dcache_lock, &irq);
+        return;
+    }
+    spin_release_irqrestore(&dcache_lock, &irq);
+
+    new_count = count * 2;
+    if (!(new_buckets = kmalloc(sizeof(struct dentry *) * new_count))) {
+        return;
+    }
+    memset(new_buckets, 0, sizeof(struct dentry *) * new_count);
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    if (dcache_bucket_count != count) {
+        // Somebody else has grown it meanwhile
+        spin_release_irqrestore(&dcache_lock, &irq);
+        kfree(new_buckets);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        for (d = dcache_buckets[i]; d; d = next) {
+            next = d->next;
+            dcache_hash_insert(new_buckets, new_count, d);
+        }
+    }
+
+    old_buckets = dcache_buckets;
+    dcache_buckets = new_buckets;
+    dcache_bucket_count = new_count;
+    spin_release_irqrestore(&dcache_lock, &irq);
+
+    kfree(old_buckets);
+}
+
+// `d' comes from dcache_alloc()
+static void dcache_insert(struct dentry *d, struct vnode *parent, const char *name, size_t hash, struct vnode *vn) {
+    d->parent = parent;
+    d->vnode = vn;
+    d->hash = hash;
+    strcpy(d->name, name);
+    list_head_init(&d->link);
+
+    dcache_hash_insert(dcache_buckets, dcache_bucket_count, d);
+    ++dcache_count;
+}
+
+static void dcache_remove(struct dentry *d) {
+    struct dentry **it = &dcache_buckets[d->hash & (dcache_bucket_count - 1)];
+
+    while (*it != d) {
+        _assert(*it);
+        it = &(*it)->next;
+    }
+    *it = d->next;
+
+    if (!d->vnode) {
+        list_del(&d->link);
+        --dcache_neg_count;
+    }
+    --dcache_count;
+
+    slab_free(dentry_cache, d);
+}
+
+////
+
+int dcache_lookup(struct vnode *parent, const char *name, struct vnode **child) {
+    size_t hash = dcache_hash(parent, name);
+    struct dentry *d;
+    uintptr_t irq;
+    int res;
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    if (!(d = dcache_find(parent, name, hash))) {
+        res = 1;
+        if (__atomic_load_n(&parent->flags, __ATOMIC_ACQUIRE) & VN_DCACHE_PARTIAL) {
+            for (struct vnode *ch = parent->first_child; ch; ch = ch->next_child) {
+                if (!ch->dentry && !strcmp(ch->name, name)) {
+                    *child = ch;
+                    res = 0;
+                    break;
+                }
+            }
+        }
+    } else if (d->vnode) {
+        *child = d->vnode;
+        res = 0;
+    } else {
+        list_del(&d->link);
+        list_add(&d->link, &dcache_neg_lru);
+        res = -ENOENT;
+    }
+    spin_release_irqrestore(&dcache_lock, &irq);
+
+    return res;
+}
+
+uint64_t dcache_gen(void) {
+    return __atomic_load_n(&dcache_generation, __ATOMIC_ACQUIRE);
+}
+
+void dcache_add_negative(struct vnode *parent, const char *name, uint64_t gen) {
+    size_t hash = dcache_hash(parent, name);
+    struct dentry *d;
+    uintptr_t irq;
+
+    if (!(d = dcache_alloc())) {
+        return;
+    }
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    if (dcache_generation != gen || dcache_find(parent, name, hash)) {
+        spin_release_irqrestore(&dcache_lock, &irq);
+        slab_free(dentry_cache, d);
+        return;
+    }
+
+    dcache_insert(d, parent, name, hash, NULL);
+    list_add(&d->link, &dcache_neg_lru);
+    if (++dcache_neg_count > DCACHE_NEG_MAX) {
+        dcache_remove(list_entry(dcache_neg_lru.prev, struct dentry, link));
+    }
+    spin_release_irqrestore(&dcache_lock, &irq);
+
+    dcache_grow();
+}
+
+void dcache_forget(struct vnode *parent, const char *name) {
+    size_t hash = dcache_hash(parent, name);
+    struct dentry *d;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    __atomic_add_fetch(&dcache_generation, 1, __ATOMIC_RELEASE);
+    if ((d = dcache_find(parent, name, hash)) && !d->vnode) {
+        dcache_remove(d);
+    }
+    spin_release_irqrestore(&dcache_lock, &irq);
+}
+
+void dcache_attach(struct vnode *vn) {
+    size_t hash = dcache_hash(vn->parent, vn->name);
+    struct dentry *d, *old;
+    uintptr_t irq;
+
+    _assert(!vn->dentry);
+
+    d = dcache_alloc();
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    __atomic_add_fetch(&dcache_generation, 1, __ATOMIC_RELEASE);
+    if ((old = dcache_find(vn->parent, vn->name, hash))) {
+        // Two in-memory nodes with the same name in one directory
+        _assert(!old->vnode);
+        dcache_remove(old);
+    }
+    if (d) {
+        dcache_insert(d, vn->parent, vn->name, hash, vn);
+        vn->dentry = d;
+    } else {
+        // Left without an entry, found through the child list instead
+        __atomic_or_fetch(&vn->parent->flags, VN_DCACHE_PARTIAL, __ATOMIC_RELEASE);
+    }
+    spin_release_irqrestore(&dcache_lock, &irq);
+
+    if (d) {
+        dcache_grow();
+    }
+}
+
+void dcache_detach(struct vnode *vn) {
+    uintptr_t irq;
+
+    if (!vn->dentry) {
+        return;
+    }
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    dcache_remove(vn->dentry);
+    vn->dentry = NULL;
+    spin_release_irqrestore(&dcache_lock, &irq);
+}
+
+void dcache_purge(struct vnode *parent) {
+    struct list_head *it, *next;
+    struct dentry *d;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&dcache_lock, &irq);
+    list_for_each_safe(it, next, &dcache_neg_lru) {
+        d = list_entry(it, struct dentry, link);
+        if (d->parent == parent) {
+            dcache_remove(d);
+        }
+    }
+    spin_release_irqrestore(&dcache_lock, &irq);
+}
@@ -212,10 +212,7 @@ int ext2_file_resize(struct fs *ext2, uint32_t ino, struct ext2_inode *inode, si
     size_t block_count = (new_size + data->block_size - 1) / data->block_size;
     size_t old_block_count = (inode->size_lower + data->block_size - 1) / data->block_size;
 
-    uint32_t p = data->block_size / sizeof(uint32_t);
-
-    // TODO: handle L2/L3
-    _assert(block_count <= EXT2_DIRECT_BLOCKS + p && old_block_count <= EXT2_DIRECT_BLOCKS + p);
+    int res;
 
     if (block_count >= old_block_count) {
         for (size_t index = old_block_count; index < block_count; ++index) {
@@ -224,7 +221,10 @@ int ext2_file_resize(struct fs *ext2, uint32_t ino, struct ext2_inode *inode, si
                 panic("Failed to allocate a new block\n");
             }
 
-            _assert(ext2_inode_set_index(ext2, inode, ino, index, block) == 0);
+            if ((res = ext2_inode_set_index(ext2, inode, ino, index, block)) != 0) {
+                ext2_free_block(ext2, data, block);
+                return res;
+            }
         }
     } else {
         // (Depth-first) free data blocks
@@ -235,24 +235,14 @@ int ext2_file_resize(struct fs *ext2, uint32_t ino, struct ext2_inode *inode, si
             ext2_free_block(ext2, data, block);
         }
 
-        if (old_block_count > EXT2_DIRECT_BLOCKS && block_count <= EXT2_DIRECT_BLOCKS + p) {
-            // Free L1 pointer block
-            _assert(inode->indirect_block_l1);
-            ext2_free_block(ext2, data, inode->indirect_block_l1);
-            inode->indirect_block_l1 = 0;
-        }
-
-        if (old_block_count > EXT2_DIRECT_BLOCKS + p && block_count <= EXT2_DIRECT_BLOCKS + p + p * p) {
-            // Free L2 pointer block
-            panic("TODO: L2 support\n");
+        // Then the pointer blocks
+        if ((res = ext2_inode_trim(ext2, inode, block_count)) != 0) {
+            return res;
         }
     }
 
     inode->size_lower = new_size;
-    size_t real_block_count = block_count;
-    if (block_count > EXT2_DIRECT_BLOCKS) {
-        ++real_block_count;
-    }
+    size_t real_block_count = block_count + ext2_inode_ptr_blocks(data, block_count);
     inode->sector_count = (real_block_count * data->block_size + 511) / 512;
 
     return 0;
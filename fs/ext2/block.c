@@ -7,6 +7,12 @@
 #include "fs/ext2/alloc.h"
 #include "fs/fs.h"
 #include "sys/debug.h"
+#include "sys/heap.h"
+
+// Pointers looked at when a block missing from the block map is resolved,
+// and how many runs of them are cached at once
+#define EXT2_BMAP_SCAN          64
+#define EXT2_BMAP_FILL_RUNS     4
 
 int ext2_read_superblock(struct fs *fs) {
     struct ext2_data *data = fs->fs_private;
@@ -33,8 +39,8 @@ int ext2_write_superblock(struct fs *fs) {
 int ext2_read_block(struct fs *fs, void *block, uint32_t no) {
     struct ext2_data *data = fs->fs_private;
     _assert(data);
-    int res = blk_read(fs->blk, block, no * data->block_size, data->block_size);
-    if (res == 1024) {
+    int res = blk_read(fs->blk, block, (uint64_t) no * data->block_size, data->block_size);
+    if (res == (int) data->block_size) {
         return 0;
     }
     kerror("Failed to read block %u: %s\n", no, kstrerror(res));
@@ -44,22 +50,18 @@ int ext2_read_block(struct fs *fs, void *block, uint32_t no) {
 int ext2_write_block(struct fs *fs, const void *block, uint32_t no) {
     struct ext2_data *data = fs->fs_private;
     _assert(data);
-    int res = blk_write(fs->blk, block, no * data->block_size, data->block_size);
-    if (res == 1024) {
+    int res = blk_write(fs->blk, block, (uint64_t) no * data->block_size, data->block_size);
+    if (res == (int) data->block_size) {
         return 0;
     }
     kerror("Failed to write block %u: %s\n", no, kstrerror(res));
     return res;
 }
 
-int ext2_read_inode(struct fs *fs, struct ext2_inode *inode, uint32_t ino) {
-    struct ext2_data *data = fs->fs_private;
-    _assert(data);
-    char block[data->block_size];
+static uint64_t ext2_inode_offset(struct ext2_data *data, uint32_t ino) {
     if (ino < 1 || ino >= data->sb.inode_count) {
         panic("Invalid inode number: %u\n", ino);
     }
-    int res;
 
     --ino;
     uint32_t ino_group = ino / data->sb.block_group_inodes;
@@ -68,11 +70,20 @@ int ext2_read_inode(struct fs *fs, struct ext2_inode *inode, uint32_t ino) {
     uint32_t offset_in_block = (ino_in_group % data->inodes_per_block) * data->inode_size;
     _assert(offset_in_block < data->block_size);
 
-    if ((res = ext2_read_block(fs, block, ino_block)) != 0) {
-        return res;
-    }
+    return (uint64_t) ino_block * data->block_size + offset_in_block;
+}
+
+int ext2_read_inode(struct fs *fs, struct ext2_inode *inode, uint32_t ino) {
+    struct ext2_data *data = fs->fs_private;
+    _assert(data);
+    int res;
 
-    memcpy(inode, offset_in_block + block, data->inode_size);
+    if ((res = blk_read(fs->blk, inode, ext2_inode_offset(data, ino), data->inode_size)) != (int) data->inode_size) {
+        kerror("Failed to read inode %u: %s\n", ino, kstrerror(res));
+        return res < 0 ? res : -EIO;
+    }
+    // Block map of whatever was there before
+    EXT2_BMAP(data, inode)->count = 0;
 
     return 0;
 }
@@ -83,111 +94,470 @@ int ext2_write_inode(struct fs *fs, struct ext2_inode *inode, uint32_t ino) {
 
     struct ext2_data *data = fs->fs_private;
     _assert(data);
-    char block[data->block_size];
-    if (ino < 1 || ino >= data->sb.inode_count) {
-        panic("Invalid inode number: %u\n", ino);
+    int res;
+
+    if ((res = blk_write(fs->blk, inode, ext2_inode_offset(data, ino), data->inode_size)) != (int) data->inode_size) {
+        kerror("Failed to write inode %u: %s\n", ino, kstrerror(res));
+        return res < 0 ? res : -EIO;
     }
+
+    return 0;
+}
+
+//// Block map
+
+// Entries of a pointer block are accessed through the block cache directly,
+// without reading the whole block into a buffer
+static int ext2_ptrs_read(struct fs *ext2, uint32_t block, uint32_t slot, uint32_t *ptrs, uint32_t count) {
+    struct ext2_data *data = ext2->fs_private;
+    size_t size = count * sizeof(uint32_t);
     int res;
 
-    --ino;
-    uint32_t ino_group = ino / data->sb.block_group_inodes;
-    uint32_t ino_in_group = ino % data->sb.block_group_inodes;
-    uint32_t ino_block = data->bgdt[ino_group].inode_table_no + ino_in_group / data->inodes_per_block;
-    uint32_t offset_in_block = (ino_in_group % data->inodes_per_block) * data->inode_size;
-    _assert(offset_in_block < data->block_size);
+    if ((res = blk_read(ext2->blk, ptrs, (uint64_t) block * data->block_size + slot * sizeof(uint32_t), size)) != (int) size) {
+        kerror("Failed to read pointer block %u: %s\n", block, kstrerror(res));
+        return res < 0 ? res : -EIO;
+    }
+    return 0;
+}
 
-    if ((res = ext2_read_block(fs, block, ino_block)) != 0) {
-        return res;
+static int ext2_ptr_write(struct fs *ext2, uint32_t block, uint32_t slot, uint32_t value) {
+    struct ext2_data *data = ext2->fs_private;
+    int res;
+
+    if ((res = blk_write(ext2->blk, &value, (uint64_t) block * data->block_size + slot * sizeof(uint32_t), sizeof(uint32_t))) != sizeof(uint32_t)) {
+        kerror("Failed to write pointer block %u: %s\n", block, kstrerror(res));
+        return res < 0 ? res : -EIO;
     }
+    return 0;
+}
 
-    memcpy(offset_in_block + block, inode, data->inode_size);
+// The inode is packed, so its block pointers are accessed by number:
+// direct blocks first, then the roots of L1, L2 and L3 trees
+#define EXT2_ROOT_L1            (EXT2_DIRECT_BLOCKS)
+#define EXT2_ROOT_L2            (EXT2_DIRECT_BLOCKS + 1)
+#define EXT2_ROOT_L3            (EXT2_DIRECT_BLOCKS + 2)
 
-    return ext2_write_block(fs, block, ino_block);
+static uint32_t ext2_root_get(const struct ext2_inode *inode, uint32_t root) {
+    switch (root) {
+    case EXT2_ROOT_L1:
+        return inode->indirect_block_l1;
+    case EXT2_ROOT_L2:
+        return inode->indirect_block_l2;
+    case EXT2_ROOT_L3:
+        return inode->indirect_block_l3;
+    default:
+        return inode->direct_blocks[root];
+    }
 }
 
-int ext2_read_inode_block(struct fs *fs, struct ext2_inode *inode, void *buf, uint32_t index) {
-    uint32_t block = ext2_inode_get_index(fs, inode, index);
-    if (!block) {
-        panic("Read outside of block count range\n");
+static void ext2_root_set(struct ext2_inode *inode, uint32_t root, uint32_t value) {
+    switch (root) {
+    case EXT2_ROOT_L1:
+        inode->indirect_block_l1 = value;
+        break;
+    case EXT2_ROOT_L2:
+        inode->indirect_block_l2 = value;
+        break;
+    case EXT2_ROOT_L3:
+        inode->indirect_block_l3 = value;
+        break;
+    default:
+        inode->direct_blocks[root] = value;
+        break;
     }
-    return ext2_read_block(fs, buf, block);
 }
 
-int ext2_write_inode_block(struct fs *fs, struct ext2_inode *inode, const void *buf, uint32_t index) {
-    uint32_t block = ext2_inode_get_index(fs, inode, index);
-    if (!block) {
-        panic("Write outside of block count range\n");
+// Splits a logical block index into the indirection tree it belongs to:
+// returns the tree's root pointer number and its depth, leaving the index
+// relative to the tree's first block. Depth 0 means a direct block
+static int ext2_bmap_tree(struct ext2_data *data, uint64_t *index, uint32_t *root) {
+    uint64_t p = data->block_size / sizeof(uint32_t);
+
+    if (*index < EXT2_DIRECT_BLOCKS) {
+        *root = *index;
+        return 0;
+    }
+    *index -= EXT2_DIRECT_BLOCKS;
+    if (*index < p) {
+        *root = EXT2_ROOT_L1;
+        return 1;
     }
-    return ext2_write_block(fs, buf, block);
+    *index -= p;
+    if (*index < p * p) {
+        *root = EXT2_ROOT_L2;
+        return 2;
+    }
+    *index -= p * p;
+    if (*index < p * p * p) {
+        *root = EXT2_ROOT_L3;
+        return 3;
+    }
+
+    return -EFBIG;
 }
 
-uint32_t ext2_inode_get_index(struct fs *ext2, struct ext2_inode *inode, uint32_t index) {
+// Walks the indirect blocks down to the one holding the pointer to the
+// data block `index'. Returns 0 and sets *leaf to 0 if a part of the path
+// isn't allocated
+static int ext2_bmap_leaf(struct fs *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *leaf, uint32_t *slot) {
     struct ext2_data *data = ext2->fs_private;
-    _assert(data);
+    uint64_t p = data->block_size / sizeof(uint32_t);
+    uint64_t rel = index, span;
+    uint32_t root, block;
+    int depth, res;
+
+    if ((depth = ext2_bmap_tree(data, &rel, &root)) <= 0) {
+        return depth;
+    }
+
+    span = 1;
+    for (int i = 1; i < depth; ++i) {
+        span *= p;
+    }
+
+    block = ext2_root_get(inode, root);
+    for (; depth > 1 && block; --depth) {
+        if ((res = ext2_ptrs_read(ext2, block, rel / span, &block, 1)) != 0) {
+            return res;
+        }
+        rel %= span;
+        span /= p;
+    }
+
+    *leaf = block;
+    *slot = rel;
+    return 1;
+}
+
+static struct ext2_extent *ext2_bmap_find(struct ext2_bmap *bmap, uint32_t index) {
+    for (uint32_t i = 0; i < bmap->count; ++i) {
+        struct ext2_extent *e = &bmap->extents[i];
+        if (index >= e->index && index - e->index < e->length) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void ext2_bmap_add(struct ext2_bmap *bmap, uint32_t index, uint32_t block, uint32_t length) {
+    struct ext2_extent *e;
+
+    // Continues a run which is already cached
+    for (uint32_t i = 0; i < bmap->count; ++i) {
+        e = &bmap->extents[i];
+        if (e->index + e->length == index && e->block + e->length == block) {
+            e->length += length;
+            return;
+        }
+    }
+
+    if (bmap->count < EXT2_BMAP_EXTENTS) {
+        e = &bmap->extents[bmap->count++];
+    } else {
+        e = &bmap->extents[bmap->next_victim++ % EXT2_BMAP_EXTENTS];
+    }
+    e->index = index;
+    e->block = block;
+    e->length = length;
+}
+
+// Drops the cached mapping of `index' and of anything following it in
+// the same run
+static void ext2_bmap_forget(struct ext2_bmap *bmap, uint32_t index) {
+    struct ext2_extent *e;
+
+    for (uint32_t i = 0; i < bmap->count;) {
+        e = &bmap->extents[i];
+        if (index >= e->index && index - e->index < e->length && !(e->length = index - e->index)) {
+            *e = bmap->extents[--bmap->count];
+            continue;
+        }
+        ++i;
+    }
+}
 
+// Reads the pointers starting at `index' (up to the end of their pointer
+// block, EXT2_BMAP_SCAN at most) and caches the first few runs of them
+static int ext2_bmap_fill(struct fs *ext2, struct ext2_inode *inode, uint32_t index) {
+    struct ext2_data *data = ext2->fs_private;
+    struct ext2_bmap *bmap = EXT2_BMAP(data, inode);
     uint32_t p = data->block_size / sizeof(uint32_t);
-    uint32_t ptrs[p];
+    uint32_t ptrs[EXT2_BMAP_SCAN];
+    uint32_t leaf, slot, count, len;
+    int res;
+
+    if ((res = ext2_bmap_leaf(ext2, inode, index, &leaf, &slot)) < 0) {
+        return res;
+    }
+
+    if (res == 0) {
+        count = MIN(EXT2_DIRECT_BLOCKS - index, EXT2_BMAP_SCAN);
+        memcpy(ptrs, &inode->direct_blocks[index], count * sizeof(uint32_t));
+    } else if (!leaf) {
+        // Hole
+        return 0;
+    } else {
+        count = MIN(p - slot, EXT2_BMAP_SCAN);
+        if ((res = ext2_ptrs_read(ext2, leaf, slot, ptrs, count)) != 0) {
+            return res;
+        }
+    }
+
+    for (uint32_t i = 0, runs = 0; i < count && ptrs[i] && runs < EXT2_BMAP_FILL_RUNS; i += len, ++runs) {
+        len = 1;
+        while (i + len < count && ptrs[i + len] == ptrs[i] + len) {
+            ++len;
+        }
+        ext2_bmap_add(bmap, index + i, ptrs[i], len);
+    }
+
+    return 0;
+}
+
+uint32_t ext2_inode_map(struct fs *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *run) {
+    struct ext2_data *data = ext2->fs_private;
+    _assert(data);
+    struct ext2_bmap *bmap = EXT2_BMAP(data, inode);
+    struct ext2_extent *e;
+
+    if (!(e = ext2_bmap_find(bmap, index))) {
+        if (ext2_bmap_fill(ext2, inode, index) != 0 || !(e = ext2_bmap_find(bmap, index))) {
+            // Not allocated
+            if (run) {
+                *run = 1;
+            }
+            return 0;
+        }
+    }
 
-    if (index < EXT2_DIRECT_BLOCKS) {
-        return inode->direct_blocks[index];
+    if (run) {
+        *run = e->length - (index - e->index);
     }
+    return e->block + (index - e->index);
+}
+
+uint32_t ext2_inode_get_index(struct fs *ext2, struct ext2_inode *inode, uint32_t index) {
+    return ext2_inode_map(ext2, inode, index, NULL);
+}
 
-    // Fits in L1?
-    index -= EXT2_DIRECT_BLOCKS;
-    if (index < p) {
-        if (!inode->indirect_block_l1) {
-            panic("Read beyond end of file (L1.1)\n");
+int ext2_read_inode_blocks(struct fs *ext2, struct ext2_inode *inode, void *buf, uint32_t index, uint32_t count) {
+    struct ext2_data *data = ext2->fs_private;
+    _assert(data);
+    uint32_t block, run;
+    size_t size;
+    int res;
+
+    // One device request per contiguous run
+    while (count) {
+        if (!(block = ext2_inode_map(ext2, inode, index, &run))) {
+            panic("Read outside of block count range\n");
+        }
+        run = MIN(run, count);
+        size = (size_t) run * data->block_size;
+
+        if ((res = blk_read(ext2->blk, buf, (uint64_t) block * data->block_size, size)) != (int) size) {
+            kerror("Failed to read blocks %u-%u: %s\n", block, block + run - 1, kstrerror(res));
+            return res < 0 ? res : -EIO;
         }
 
-        _assert(ext2_read_block(ext2, ptrs, inode->indirect_block_l1) == 0);
-        return ptrs[index];
+        buf += size;
+        index += run;
+        count -= run;
     }
 
-    // Fits in L2?
-    index -= p;
-    if (index < p * p) {
-        uint32_t index_l1 = index / p;
-        uint32_t index_l0 = index % p;
-        if (!inode->indirect_block_l2) {
-            panic("Read beyond end of the file (L2.2)\n");
+    return 0;
+}
+
+int ext2_write_inode_blocks(struct fs *ext2, struct ext2_inode *inode, const void *buf, uint32_t index, uint32_t count) {
+    struct ext2_data *data = ext2->fs_private;
+    _assert(data);
+    uint32_t block, run;
+    size_t size;
+    int res;
+
+    while (count) {
+        if (!(block = ext2_inode_map(ext2, inode, index, &run))) {
+            panic("Write outside of block count range\n");
         }
-        _assert(ext2_read_block(ext2, ptrs, inode->indirect_block_l2) == 0);
-        if (!ptrs[index_l1]) {
-            panic("Read beyond end of the file (L2.1)\n");
+        run = MIN(run, count);
+        size = (size_t) run * data->block_size;
+
+        if ((res = blk_write(ext2->blk, buf, (uint64_t) block * data->block_size, size)) != (int) size) {
+            kerror("Failed to write blocks %u-%u: %s\n", block, block + run - 1, kstrerror(res));
+            return res < 0 ? res : -EIO;
         }
-        _assert(ext2_read_block(ext2, ptrs, ptrs[index_l1]) == 0);
-        return ptrs[index_l0];
+
+        buf += size;
+        index += run;
+        count -= run;
     }
 
-    panic("TODO: L3 support\n");
+    return 0;
+}
+
+int ext2_read_inode_block(struct fs *fs, struct ext2_inode *inode, void *buf, uint32_t index) {
+    return ext2_read_inode_blocks(fs, inode, buf, index, 1);
+}
+
+int ext2_write_inode_block(struct fs *fs, struct ext2_inode *inode, const void *buf, uint32_t index) {
+    return ext2_write_inode_blocks(fs, inode, buf, index, 1);
+}
+
+static uint32_t ext2_alloc_ptr_block(struct fs *ext2, struct ext2_data *data) {
+    uint32_t block;
+    void *zero;
+
+    if (!(zero = kmalloc(data->block_size))) {
+        return 0;
+    }
+    memset(zero, 0, data->block_size);
+
+    if ((block = ext2_alloc_block(ext2, data)) && ext2_write_block(ext2, zero, block) != 0) {
+        ext2_free_block(ext2, data, block);
+        block = 0;
+    }
+
+    kfree(zero);
+    return block;
 }
 
 int ext2_inode_set_index(struct fs *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index, uint32_t value) {
     struct ext2_data *data = ext2->fs_private;
     _assert(data);
+    uint64_t p = data->block_size / sizeof(uint32_t);
+    uint64_t rel = index, span;
+    uint32_t root, block, next;
+    int depth, res;
 
-    uint32_t p = data->block_size / sizeof(uint32_t);
-    uint32_t a, b, c, d, e, f, g;
-    uint32_t ptrs[p];
+    ext2_bmap_forget(EXT2_BMAP(data, inode), index);
 
-    if (index < EXT2_DIRECT_BLOCKS) {
-        inode->direct_blocks[index] = value;
+    if ((depth = ext2_bmap_tree(data, &rel, &root)) < 0) {
+        return depth;
+    }
+    if (depth == 0) {
+        ext2_root_set(inode, root, value);
         return 0;
-    } else if (index < EXT2_DIRECT_BLOCKS + p) {
-        if (!inode->indirect_block_l1) {
-            uint32_t block = ext2_alloc_block(ext2, data);
-            if (!block) {
-                panic("Failed to allocate a block\n");
+    }
+
+    // Clearing a pointer never allocates the path to it
+    if (!(block = ext2_root_get(inode, root))) {
+        if (!value) {
+            return 0;
+        }
+        if (!(block = ext2_alloc_ptr_block(ext2, data))) {
+            return -ENOSPC;
+        }
+        ext2_root_set(inode, root, block);
+    }
+
+    span = 1;
+    for (int i = 1; i < depth; ++i) {
+        span *= p;
+    }
+
+    for (; depth > 1; --depth) {
+        if ((res = ext2_ptrs_read(ext2, block, rel / span, &next, 1)) != 0) {
+            return res;
+        }
+        if (!next) {
+            if (!value) {
+                return 0;
+            }
+            if (!(next = ext2_alloc_ptr_block(ext2, data))) {
+                return -ENOSPC;
+            }
+            if ((res = ext2_ptr_write(ext2, block, rel / span, next)) != 0) {
+                return res;
             }
-            inode->indirect_block_l1 = block;
         }
+        block = next;
+        rel %= span;
+        span /= p;
+    }
 
-        _assert(ext2_read_block(ext2, ptrs, inode->indirect_block_l1) == 0);
-        ptrs[index - EXT2_DIRECT_BLOCKS] = value;
-        _assert(ext2_write_block(ext2, ptrs, inode->indirect_block_l1) == 0);
+    return ext2_ptr_write(ext2, block, rel, value);
+}
+
+// Frees the pointer blocks under *slot which only point to data blocks at
+// or past `keep'. *slot covers the blocks from `base', each of its entries
+// `span' of them
+static int ext2_trim_ptrs(struct fs *ext2, uint32_t *slot, uint64_t span, uint64_t base, uint64_t keep) {
+    struct ext2_data *data = ext2->fs_private;
+    uint32_t p = data->block_size / sizeof(uint32_t);
+    uint32_t entry, old;
+    int res;
+
+    if (!*slot) {
         return 0;
-    } else {
-        panic("TODO L2+\n");
     }
+
+    if (span > 1) {
+        for (uint32_t i = keep > base ? (keep - base) / span : 0; i < p; ++i) {
+            if ((res = ext2_ptrs_read(ext2, *slot, i, &entry, 1)) != 0) {
+                return res;
+            }
+            old = entry;
+            if ((res = ext2_trim_ptrs(ext2, &entry, span / p, base + i * span, keep)) != 0) {
+                return res;
+            }
+            if (entry != old && keep > base && (res = ext2_ptr_write(ext2, *slot, i, entry)) != 0) {
+                return res;
+            }
+        }
+    }
+
+    if (keep <= base) {
+        ext2_free_block(ext2, data, *slot);
+        *slot = 0;
+    }
+
+    return 0;
 }
 
+int ext2_inode_trim(struct fs *ext2, struct ext2_inode *inode, uint32_t block_count) {
+    struct ext2_data *data = ext2->fs_private;
+    _assert(data);
+    uint64_t p = data->block_size / sizeof(uint32_t);
+    uint64_t base = EXT2_DIRECT_BLOCKS, span = 1;
+    uint32_t block;
+    int res;
+
+    for (uint32_t root = EXT2_ROOT_L1; root <= EXT2_ROOT_L3; ++root) {
+        block = ext2_root_get(inode, root);
+        res = ext2_trim_ptrs(ext2, &block, span, base, block_count);
+        ext2_root_set(inode, root, block);
+        if (res != 0) {
+            return res;
+        }
+
+        base += span * p;
+        span *= p;
+    }
+
+    return 0;
+}
+
+uint32_t ext2_inode_ptr_blocks(struct ext2_data *data, uint32_t block_count) {
+    uint64_t p = data->block_size / sizeof(uint32_t);
+    uint64_t n = block_count, res = 0;
+
+    if (n <= EXT2_DIRECT_BLOCKS) {
+        return 0;
+    }
+    n -= EXT2_DIRECT_BLOCKS;
+    // L1
+    res += 1;
+    if (n <= p) {
+        return res;
+    }
+    n -= p;
+    // L2 and its L1 blocks
+    res += 1 + (MIN(n, p * p) + p - 1) / p;
+    if (n <= p * p) {
+        return res;
+    }
+    n -= p * p;
+    // L3, its L2 and L1 blocks
+    res += 1 + (n + p * p - 1) / (p * p) + (n + p - 1) / p;
+    return res;
+}
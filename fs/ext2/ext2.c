@@ -73,8 +73,8 @@ static int ext2_init(struct fs *ext2, const char *opt) {
         data->inode_size = 128;
     }
 
-    // Create a slab cache for inode objects
-    data->inode_cache = slab_cache_get(data->inode_size);
+    // Create a slab cache for inode objects, with their block maps
+    data->inode_cache = slab_cache_get(data->inode_size + sizeof(struct ext2_bmap));
     if (!data->inode_cache) {
         // TODO: error handling
         panic("Failed to allocate a slab cache of size %d for inodes\n", data->inode_size);
@@ -29,6 +29,7 @@ static int ext2_vnode_truncate(struct vnode *at, size_t new_size);
 static int ext2_vnode_creat(struct vnode *at, const char *name, uid_t uid, gid_t gid, mode_t mode);
 static int ext2_vnode_mkdir(struct vnode *at, const char *name, uid_t uid, gid_t gid, mode_t mode);
 static int ext2_vnode_unlink(struct vnode *node);
+static void ext2_vnode_destroy(struct vnode *node);
 
 ////
 
@@ -45,6 +46,7 @@ struct vnode_operations g_ext2_vnode_ops = {
     .creat = ext2_vnode_creat,
     .mkdir = ext2_vnode_mkdir,
     .unlink = ext2_vnode_unlink,
+    .destroy = ext2_vnode_destroy,
 
     .open = ext2_vnode_open,
     .read = ext2_vnode_read,
@@ -95,7 +97,8 @@ static int ext2_vnode_find(struct vnode *at, const char *name, struct vnode **re
                     struct vnode *node = vnode_create(VN_DIR, name);
 
                     if ((res = ext2_read_inode(ext2, res_inode, dirent->ino)) != 0) {
-                        kfree(res_inode);
+                        slab_free(data->inode_cache, res_inode);
+                        vnode_destroy(node);
                         return res;
                     }
 
@@ -155,11 +158,20 @@ static ssize_t ext2_vnode_read(struct ofile *fd, void *buf, size_t count) {
         size_t can_read = MIN(rem, data->block_size - block_offset);
         uint32_t block_index = fd->file.pos / data->block_size;
 
-        if ((res = ext2_read_inode_block(ext2, inode, block_buffer, block_index)) != 0) {
-            return res;
-        }
+        if (can_read == data->block_size) {
+            // Whole blocks go straight to the caller
+            can_read = rem - rem % data->block_size;
+
+            if ((res = ext2_read_inode_blocks(ext2, inode, buf, block_index, can_read / data->block_size)) != 0) {
+                return res;
+            }
+        } else {
+            if ((res = ext2_read_inode_block(ext2, inode, block_buffer, block_index)) != 0) {
+                return res;
+            }
 
-        memcpy(buf, block_buffer + block_offset, can_read);
+            memcpy(buf, block_buffer + block_offset, can_read);
+        }
 
         buf += can_read;
         fd->file.pos += can_read;
@@ -339,7 +351,7 @@ static ssize_t ext2_vnode_write(struct ofile *fd, const void *buf, size_t count)
         return 0;
     }
 
-    char block_buf[1024];
+    char block_buf[data->block_size];
     size_t req_size = MAX(fd->file.pos + count, inode->size_lower);
     uint32_t block_index;
     uint32_t block_offset;
@@ -368,7 +380,10 @@ static ssize_t ext2_vnode_write(struct ofile *fd, const void *buf, size_t count)
                 panic("PANIC\n");
             }
         } else {
-            if (ext2_write_inode_block(ext2, inode, buf + off, block_index) != 0) {
+            // Whole blocks are written directly from the caller's buffer
+            can_write = rem - rem % data->block_size;
+
+            if (ext2_write_inode_blocks(ext2, inode, buf + off, block_index, can_write / data->block_size) != 0) {
                 panic("PANIC\n");
             }
         }
@@ -582,3 +597,16 @@ static int ext2_vnode_unlink(struct vnode *vn) {
 
     return 0;
 }
+
+// The inode copy is read in again when the node is looked up next time
+static void ext2_vnode_destroy(struct vnode *vn) {
+    struct fs *ext2 = vn->fs;
+    _assert(ext2);
+    struct ext2_data *data = ext2->fs_private;
+    _assert(data);
+
+    if (vn->fs_data) {
+        slab_free(data->inode_cache, vn->fs_data);
+        vn->fs_data = NULL;
+    }
+}
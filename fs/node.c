@@ -1,4 +1,6 @@
 #include "user/errno.h"
+#include "user/time.h"
+#include "fs/dcache.h"
 #include "fs/node.h"
 #include "fs/vfs.h"
 #include "sys/assert.h"
@@ -7,13 +9,40 @@
 #include "sys/debug.h"
 #include "sys/panic.h"
 #include "sys/heap.h"
+#include "sys/mem/pcache.h"
 #include "sys/mem/slab.h"
+#include "sys/mem/phys.h"
+#include "sys/thread.h"
+#include "sys/sched.h"
+#include "sys/spin.h"
+
+// How long the shrinker waits for a moment without path lookups, in yields
+#define VNODE_SHRINK_WAIT       64
+// Path lookups try to reclaim memory at most this often, in ns
+#define VNODE_RECLAIM_INTERVAL  10000000ULL
+// Set in vnode_lookups while the shrinker is freeing nodes
+#define VNODE_LOOKUPS_SHRINKING (1UL << 63)
+
+static size_t vnode_shrink(size_t count);
+static void vnode_lru_del(struct vnode *vn);
 
 static struct slab_cache *vnode_cache = NULL;
+static struct mm_shrinker vnode_shrinker = {
+    .shrink = vnode_shrink
+};
+static LIST_HEAD(vnode_lru);
+static spin_t vnode_lru_lock = 0;
+static size_t vnode_lru_count = 0;
+// Threads between vnode_lookup_enter() and _leave(), plus
+// VNODE_LOOKUPS_SHRINKING
+static size_t vnode_lookups = 0;
+// system_time of the last reclaim attempt from a lookup
+static uint64_t vnode_reclaim_time = 0;
 
 struct vnode *vnode_create(enum vnode_type t, const char *name) {
     if (!vnode_cache) {
         vnode_cache = slab_cache_get(sizeof(struct vnode));
+        mm_phys_shrinker_add(&vnode_shrinker);
         kdebug("Initialized vnode cache\n");
     }
     struct vnode *node = slab_calloc(vnode_cache);
@@ -31,9 +60,199 @@ struct vnode *vnode_create(enum vnode_type t, const char *name) {
 void vnode_destroy(struct vnode *vn) {
     _assert(vnode_cache);
     _assert(!vn->open_count);
+    // Link targets read from storage are referenced by vfs_link_resolve()
+    if (vn->type == VN_LNK && !(vn->flags & (VN_MEMORY | VN_PER_PROCESS))) {
+        vnode_unref(vn->target);
+    }
+    vnode_lru_del(vn);
+    dcache_detach(vn);
+    dcache_purge(vn);
+    pcache_release(vn);
+    if (vn->op && vn->op->destroy) {
+        vn->op->destroy(vn);
+    }
     slab_free(vnode_cache, vn);
 }
 
+void vnode_ref(struct vnode *vn) {
+    if (vn) {
+        __atomic_add_fetch(&vn->refcount, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void vnode_unref(struct vnode *vn) {
+    uint32_t old;
+
+    if (vn) {
+        old = __atomic_fetch_sub(&vn->refcount, 1, __ATOMIC_SEQ_CST);
+        _assert(old != 0);
+        if (old == 1 && (__atomic_load_n(&vn->flags, __ATOMIC_SEQ_CST) & VN_UNLINKED)) {
+            vnode_destroy(vn);
+        }
+    }
+}
+
+//// LRU of nodes loaded from storage
+// Such nodes can be read in again, so the ones nobody uses are dropped
+// when the physical allocator asks for memory back
+
+void vnode_lru_add(struct vnode *vn) {
+    uintptr_t irq;
+
+    spin_lock_irqsave(&vnode_lru_lock, &irq);
+    if (!vn->lru.next) {
+        list_add_tail(&vn->lru, &vnode_lru);
+        ++vnode_lru_count;
+    }
+    spin_release_irqrestore(&vnode_lru_lock, &irq);
+}
+
+void vnode_touch(struct vnode *vn) {
+    uintptr_t irq;
+
+    if (!vn->lru.next) {
+        return;
+    }
+
+    spin_lock_irqsave(&vnode_lru_lock, &irq);
+    if (vn->lru.next) {
+        list_del(&vn->lru);
+        list_add_tail(&vn->lru, &vnode_lru);
+    }
+    spin_release_irqrestore(&vnode_lru_lock, &irq);
+}
+
+static void vnode_lru_del(struct vnode *vn) {
+    uintptr_t irq;
+
+    if (!vn->lru.next) {
+        return;
+    }
+
+    spin_lock_irqsave(&vnode_lru_lock, &irq);
+    if (vn->lru.next) {
+        list_del(&vn->lru);
+        vn->lru.next = NULL;
+        --vnode_lru_count;
+    }
+    spin_release_irqrestore(&vnode_lru_lock, &irq);
+}
+
+static int vnode_reclaimable(struct vnode *vn) {
+    if (vn->open_count || __atomic_load_n(&vn->refcount, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+    // Directories go only after all their children did
+    if (vn->first_child || vn->type == VN_MNT) {
+        return 0;
+    }
+    // Don't lose pages written through a mapping
+    if (vn->pcache && __atomic_load_n(&vn->pcache->dirty, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Takes the least recently used node which can be dropped off the list,
+// looking at no more than *budget of them
+static struct vnode *vnode_lru_victim(size_t *budget) {
+    struct vnode *vn;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&vnode_lru_lock, &irq);
+    while (*budget && !list_empty(&vnode_lru)) {
+        --*budget;
+        vn = list_first_entry(&vnode_lru, struct vnode, lru);
+        list_del(&vn->lru);
+
+        if (vnode_reclaimable(vn)) {
+            vn->lru.next = NULL;
+            --vnode_lru_count;
+            spin_release_irqrestore(&vnode_lru_lock, &irq);
+            return vn;
+        }
+
+        // Busy, give it another round
+        list_add_tail(&vn->lru, &vnode_lru);
+    }
+    spin_release_irqrestore(&vnode_lru_lock, &irq);
+
+    return NULL;
+}
+
+void vnode_lookup_enter(void) {
+    struct thread *thr = thread_self;
+    uint64_t last;
+
+    if (thr && thr->vnode_lookups++) {
+        return;
+    }
+
+    // Nothing is looked up by this thread yet, so it's a good time
+    // to make room for the nodes it's going to load. One lookup per
+    // interval gets to try, so the others don't all line up for it
+    if (thr) {
+        last = __atomic_load_n(&vnode_reclaim_time, __ATOMIC_RELAXED);
+        if (system_time - last >= VNODE_RECLAIM_INTERVAL &&
+            __atomic_compare_exchange_n(&vnode_reclaim_time, &last, system_time,
+                                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            mm_phys_reclaim();
+        }
+    }
+
+    // Only held off while the shrinker is actually freeing nodes
+    while (__atomic_fetch_add(&vnode_lookups, 1, __ATOMIC_SEQ_CST) & VNODE_LOOKUPS_SHRINKING) {
+        __atomic_sub_fetch(&vnode_lookups, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&vnode_lookups, __ATOMIC_ACQUIRE) & VNODE_LOOKUPS_SHRINKING) {
+            sched_yield();
+        }
+    }
+}
+
+void vnode_lookup_leave(void) {
+    struct thread *thr = thread_self;
+
+    if (thr) {
+        _assert(thr->vnode_lookups > 0);
+        if (--thr->vnode_lookups) {
+            return;
+        }
+    }
+
+    _assert(__atomic_fetch_sub(&vnode_lookups, 1, __ATOMIC_SEQ_CST) & ~VNODE_LOOKUPS_SHRINKING);
+}
+
+static size_t vnode_shrink(size_t count) {
+    size_t budget = __atomic_load_n(&vnode_lru_count, __ATOMIC_RELAXED);
+    size_t freed = 0, idle;
+    struct vnode *vn;
+
+    // Nodes can only be freed while nobody's looking anything up. New
+    // lookups aren't held off until such a moment comes, if it doesn't
+    // come soon enough nothing is freed this time
+    for (size_t i = 0;; ++i) {
+        idle = 0;
+        if (__atomic_compare_exchange_n(&vnode_lookups, &idle, VNODE_LOOKUPS_SHRINKING,
+                                        0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (i == VNODE_SHRINK_WAIT) {
+            return 0;
+        }
+        sched_yield();
+    }
+
+    while (freed < count && (vn = vnode_lru_victim(&budget))) {
+        vnode_detach(vn);
+        vnode_destroy(vn);
+        ++freed;
+    }
+
+    __atomic_and_fetch(&vnode_lookups, ~VNODE_LOOKUPS_SHRINKING, __ATOMIC_RELEASE);
+
+    return freed;
+}
+
 void vnode_attach(struct vnode *parent, struct vnode *child) {
     _assert(parent);
     _assert(child);
@@ -42,18 +261,22 @@ void vnode_attach(struct vnode *parent, struct vnode *child) {
     child->parent = parent;
     child->next_child = parent->first_child;
     parent->first_child = child;
+
+    dcache_attach(child);
 }
 
 void vnode_detach(struct vnode *node) {
     _assert(node);
 
     struct vnode *parent = node->parent;
-    node->parent = NULL;
 
     if (!parent) {
         return;
     }
 
+    dcache_detach(node);
+    node->parent = NULL;
+
     if (node == parent->first_child) {
         parent->first_child = node->next_child;
         node->next_child = NULL;
@@ -86,12 +309,5 @@ int vnode_lookup_child(struct vnode *of, const char *name, struct vnode **child)
     _assert(name);
     _assert(strlen(name) < NODE_MAXLEN);
 
-    for (struct vnode *ch = of->first_child; ch; ch = ch->next_child) {
-        if (!strcmp(ch->name, name)) {
-            *child = ch;
-            return 0;
-        }
-    }
-
-    return -ENOENT;
+    return dcache_lookup(of, name, child) == 0 ? 0 : -ENOENT;
 }
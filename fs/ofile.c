@@ -1,6 +1,7 @@
 #include <config.h>
 #include "sys/mem/slab.h"
 #include "sys/assert.h"
+#include "sys/epoll.h"
 #include "fs/ofile.h"
 #include "fs/vfs.h"
 
@@ -29,6 +30,7 @@ void ofile_close(struct vfs_ioctx *ioctx, struct ofile *of) {
     _assert(of->refcount > 0);
     --of->refcount;
     if (of->refcount == 0) {
+        epoll_release_file(of);
 #if defined(ENABLE_NET)
         if (of->flags & OF_SOCKET) {
             net_close(ioctx, of);
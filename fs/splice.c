@@ -0,0 +1,328 @@
+// Moving data between descriptors without copying it through userspace.
+// One side of splice()/tee() is always a pipe, whose ring is filled or
+// drained in place. File data is taken from the page cache, so both
+// splice() from a file and sendfile() copy it once, straight from the
+// cached page to where it goes
+#include "sys/mem/pcache.h"
+#include "sys/char/pipe.h"
+#include "sys/char/ring.h"
+#include "user/errno.h"
+#include "net/socket.h"
+#include "sys/thread.h"
+#include "sys/string.h"
+#include "sys/assert.h"
+#include "sys/debug.h"
+#include "fs/splice.h"
+#include "fs/ofile.h"
+#include "sys/heap.h"
+#include "fs/vfs.h"
+#include "sys/mm.h"
+
+// Source or destination of a transfer
+struct splice_end {
+    struct vfs_ioctx *ctx;
+    struct ofile *of;
+    // Explicit file position (pread()/pwrite() style), NULL to use and
+    // advance the descriptor's one
+    off_t *pos;
+    // File data is read from the page cache
+    int cached;
+    size_t size;
+};
+
+static int splice_end_init(struct splice_end *e, struct vfs_ioctx *ctx, struct ofile *of, off_t *pos) {
+    struct vnode *vn;
+    struct stat st;
+
+    e->ctx = ctx;
+    e->of = of;
+    e->pos = pos;
+    e->cached = 0;
+
+    if (ofile_is_socket(of)) {
+        return pos ? -ESPIPE : 0;
+    }
+
+    vn = of->file.vnode;
+    _assert(vn);
+    if (pos && (vn->type != VN_REG || pipe_get_ring(of))) {
+        return -ESPIPE;
+    }
+    if (pos && *pos < 0) {
+        return -EINVAL;
+    }
+
+    // Only files on storage: in-memory ones (pipes, sysfs) generate their
+    // contents on read
+    if (vn->type == VN_REG && !(vn->flags & VN_MEMORY) && vn->op && vn->op->stat) {
+        if (vn->op->stat(vn, &st) != 0) {
+            return -EIO;
+        }
+        e->cached = 1;
+        e->size = st.st_size;
+    }
+
+    return 0;
+}
+
+static inline size_t splice_pos(struct splice_end *e) {
+    return e->pos ? (size_t) *e->pos : e->of->file.pos;
+}
+
+static inline void splice_advance(struct splice_end *e, size_t count) {
+    if (e->pos) {
+        *e->pos += count;
+    } else {
+        e->of->file.pos += count;
+    }
+}
+
+static inline void splice_rewind(struct splice_end *e, size_t count) {
+    if (e->pos) {
+        *e->pos -= count;
+    } else {
+        e->of->file.pos -= count;
+    }
+}
+
+// Calls `drain' on the cached pages of the file, the page is held for the
+// duration of the call
+static ssize_t splice_file_pages(struct splice_end *e, size_t count, ring_drain_t drain, void *arg) {
+    struct vnode *vn = e->of->file.vnode;
+    size_t done = 0, pos, off, can;
+    uintptr_t phys;
+    ssize_t res;
+
+    while (done < count) {
+        pos = splice_pos(e);
+        if (pos >= e->size) {
+            break;
+        }
+        off = pos % MM_PAGE_SIZE;
+        can = MIN(MIN(count - done, MM_PAGE_SIZE - off), e->size - pos);
+
+        if ((phys = pcache_page_get(vn, pos / MM_PAGE_SIZE)) == MM_NADDR) {
+            return done ? (ssize_t) done : -EIO;
+        }
+        res = drain(arg, (const void *) MM_VIRTUALIZE(phys) + off, can, 1);
+        pcache_page_put(phys);
+
+        if (res <= 0) {
+            return done ? (ssize_t) done : res;
+        }
+        splice_advance(e, res);
+        done += res;
+        if ((size_t) res < can) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+// `arg' is a cursor in the destination buffer
+static ssize_t splice_copy(void *arg, const void *buf, size_t count, int wait) {
+    char **dst = arg;
+    memcpy(*dst, buf, count);
+    *dst += count;
+    return count;
+}
+
+// ring_fill_t
+static ssize_t splice_read(void *arg, void *buf, size_t count, int wait) {
+    struct splice_end *e = arg;
+    size_t saved;
+    ssize_t res;
+
+#if defined(ENABLE_NET)
+    if (ofile_is_socket(e->of)) {
+        if (!wait && !socket_has_data(&e->of->socket)) {
+            return 0;
+        }
+        return net_recvfrom(e->ctx, e->of, buf, count, NULL, NULL);
+    }
+#endif
+    // Reading anything but a file (a tty, for example) may block
+    if (!wait && e->of->file.vnode->type != VN_REG) {
+        return 0;
+    }
+    if (e->cached) {
+        char *dst = buf;
+        return splice_file_pages(e, count, splice_copy, &dst);
+    }
+
+    if (!e->pos) {
+        return vfs_read(e->ctx, e->of, buf, count);
+    }
+    saved = e->of->file.pos;
+    e->of->file.pos = *e->pos;
+    if ((res = vfs_read(e->ctx, e->of, buf, count)) > 0) {
+        *e->pos += res;
+    }
+    e->of->file.pos = saved;
+    return res;
+}
+
+// ring_drain_t
+static ssize_t splice_write(void *arg, const void *buf, size_t count, int wait) {
+    struct splice_end *e = arg;
+    size_t saved;
+    ssize_t res;
+
+#if defined(ENABLE_NET)
+    if (ofile_is_socket(e->of)) {
+        // May block until the peer reads
+        if (!wait) {
+            return 0;
+        }
+        return net_sendto(e->ctx, e->of, buf, count, NULL, 0);
+    }
+#endif
+
+    if (!e->pos) {
+        return vfs_write(e->ctx, e->of, buf, count);
+    }
+    saved = e->of->file.pos;
+    e->of->file.pos = *e->pos;
+    if ((res = vfs_write(e->ctx, e->of, buf, count)) > 0) {
+        *e->pos += res;
+    }
+    e->of->file.pos = saved;
+    return res;
+}
+
+// Destination is another pipe, only waits for the first batch to fit
+static ssize_t splice_ring_write(void *arg, const void *buf, size_t count, int wait) {
+    int res;
+
+    if (wait && (res = ring_wait_writable(thread_self, arg)) != 0) {
+        return res;
+    }
+    return ring_write(thread_self, arg, buf, count, 0);
+}
+
+static int splice_check_access(struct ofile *in, struct ofile *out) {
+    if (!ofile_is_socket(in) && !(in->flags & OF_READABLE)) {
+        return -EBADF;
+    }
+    if (!ofile_is_socket(out) && !(out->flags & OF_WRITABLE)) {
+        return -EBADF;
+    }
+    return 0;
+}
+
+////
+
+ssize_t vfs_splice(struct vfs_ioctx *ctx,
+                   struct ofile *in, off_t *off_in,
+                   struct ofile *out, off_t *off_out,
+                   size_t count) {
+    struct ring *rin = pipe_get_ring(in);
+    struct ring *rout = pipe_get_ring(out);
+    struct splice_end src, dst;
+    int res;
+
+    if ((res = splice_check_access(in, out)) != 0) {
+        return res;
+    }
+    if (!rin && !rout) {
+        return -EINVAL;
+    }
+    if (rin == rout) {
+        return -EINVAL;
+    }
+
+    if (rin && rout) {
+        if (off_in || off_out) {
+            return -ESPIPE;
+        }
+        return ring_splice_out(thread_self, rin, count, splice_ring_write, rout);
+    }
+
+    if (rin) {
+        if (off_in) {
+            return -ESPIPE;
+        }
+        if ((res = splice_end_init(&dst, ctx, out, off_out)) != 0) {
+            return res;
+        }
+        return ring_splice_out(thread_self, rin, count, splice_write, &dst);
+    }
+
+    if (off_out) {
+        return -ESPIPE;
+    }
+    if ((res = splice_end_init(&src, ctx, in, off_in)) != 0) {
+        return res;
+    }
+    return ring_splice_in(thread_self, rout, count, splice_read, &src);
+}
+
+ssize_t vfs_tee(struct vfs_ioctx *ctx, struct ofile *in, struct ofile *out, size_t count) {
+    struct ring *rin = pipe_get_ring(in);
+    struct ring *rout = pipe_get_ring(out);
+    int res;
+
+    if ((res = splice_check_access(in, out)) != 0) {
+        return res;
+    }
+    if (!rin || !rout || rin == rout) {
+        return -EINVAL;
+    }
+
+    return ring_tee(thread_self, rin, rout, count);
+}
+
+ssize_t vfs_sendfile(struct vfs_ioctx *ctx, struct ofile *out, struct ofile *in, off_t *offset, size_t count) {
+    struct ring *rout = pipe_get_ring(out);
+    struct splice_end src, dst;
+    size_t done = 0;
+    ssize_t res, wr;
+    void *buf;
+
+    if ((res = splice_check_access(in, out)) != 0) {
+        return res;
+    }
+    // Input has to be a file
+    if (ofile_is_socket(in) || pipe_get_ring(in) || in->file.vnode->type != VN_REG) {
+        return -EINVAL;
+    }
+    if ((res = splice_end_init(&src, ctx, in, offset)) != 0) {
+        return res;
+    }
+
+    if (rout) {
+        return ring_splice_in(thread_self, rout, count, splice_read, &src);
+    }
+
+    if ((res = splice_end_init(&dst, ctx, out, NULL)) != 0) {
+        return res;
+    }
+    if (src.cached) {
+        return splice_file_pages(&src, count, splice_write, &dst);
+    }
+
+    // Files without a page cache go through a kernel buffer
+    if (!(buf = kmalloc(MM_PAGE_SIZE))) {
+        return -ENOMEM;
+    }
+    while (done < count) {
+        if ((res = splice_read(&src, buf, MIN(count - done, MM_PAGE_SIZE), 1)) <= 0) {
+            break;
+        }
+        wr = splice_write(&dst, buf, res, 1);
+        if (wr < res) {
+            // Whatever wasn't written is left to be read again
+            splice_rewind(&src, res - MAX(wr, 0));
+            res = wr;
+            if (wr > 0) {
+                done += wr;
+            }
+            break;
+        }
+        done += wr;
+    }
+    kfree(buf);
+
+    return done ? (ssize_t) done : res;
+}
@@ -2,8 +2,10 @@
 #include "user/errno.h"
 #include "sys/thread.h"
 #include "sys/block/blk.h"
+#include "fs/dcache.h"
 #include "fs/node.h"
 #include "sys/heap.h"
+#include "sys/mem/phys.h"
 #include "sys/string.h"
 #include "sys/assert.h"
 #include "fs/vfs.h"
@@ -39,19 +41,26 @@ mode_t vfs_vnode_to_mode(enum vnode_type type) {
     }
 }
 
-int vfs_setcwd(struct vfs_ioctx *ctx, const char *path) {
+void vfs_set_cwd_vnode(struct vfs_ioctx *ctx, struct vnode *vn) {
+    // The cwd is pinned, so it's never reclaimed from under the process
+    vnode_ref(vn);
+    vnode_unref(ctx->cwd_vnode);
+    ctx->cwd_vnode = vn;
+}
+
+static int vfs_setcwd_internal(struct vfs_ioctx *ctx, const char *path) {
     struct vnode *node;
     struct vnode *dst;
     int res;
 
     if (path[0] == '/') {
         if (path[1] == 0) {
-            ctx->cwd_vnode = NULL;
+            vfs_set_cwd_vnode(ctx, NULL);
             return 0;
         }
 
         if (!vfs_root) {
-            ctx->cwd_vnode = NULL;
+            vfs_set_cwd_vnode(ctx, NULL);
         } else {
             if ((res = vfs_find_internal(ctx, vfs_root, path, 0, &node)) != 0) {
                 return res;
@@ -74,7 +83,7 @@ int vfs_setcwd(struct vfs_ioctx *ctx, const char *path) {
                 return res;
             }
 
-            ctx->cwd_vnode = dst;
+            vfs_set_cwd_vnode(ctx, dst);
         }
         return 0;
     } else {
@@ -98,12 +107,22 @@ int vfs_setcwd(struct vfs_ioctx *ctx, const char *path) {
             return res;
         }
 
-        ctx->cwd_vnode = dst;
+        vfs_set_cwd_vnode(ctx, dst);
 
         return 0;
     }
 }
 
+int vfs_setcwd(struct vfs_ioctx *ctx, const char *path) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_setcwd_internal(ctx, path);
+    vnode_lookup_leave();
+
+    return res;
+}
+
 void vfs_vnode_path(char *path, struct vnode *node) {
     size_t c = 0;
     size_t off = 0;
@@ -168,6 +187,12 @@ static int vfs_link_resolve_internal(struct vfs_ioctx *ctx,
         return 0;
     }
 
+    if (!(lnk->flags & (VN_MEMORY | VN_PER_PROCESS)) && lnk->target && (lnk->target->flags & VN_UNLINKED)) {
+        // Cached target is gone, look it up again
+        vnode_unref(lnk->target);
+        lnk->target = NULL;
+    }
+
     if (!lnk->target && !(lnk->flags & VN_MEMORY)) {
         // Try to load link contents from storage
         _assert(lnk->op);
@@ -186,6 +211,8 @@ static int vfs_link_resolve_internal(struct vfs_ioctx *ctx,
             lnk->target = NULL;
             return res;
         }
+        // Keep the target in memory while the link caches it
+        vnode_ref(lnk->target);
     }
 
     struct vnode *target;
@@ -217,13 +244,15 @@ int vfs_link_resolve(struct vfs_ioctx *ctx, struct vnode *lnk, struct vnode **to
 }
 
 static int vfs_lookup_or_load(struct vnode *at, const char *name, struct vnode **child) {
+    uint64_t gen;
     int res;
 
-    if ((res = vnode_lookup_child(at, name, child)) == 0) {
+    // Either in memory or known not to exist
+    if ((res = dcache_lookup(at, name, child)) == 0) {
+        vnode_touch(*child);
         return 0;
     }
-
-    if (res != -ENOENT) {
+    if (res < 0) {
         return res;
     }
 
@@ -233,12 +262,17 @@ static int vfs_lookup_or_load(struct vnode *at, const char *name, struct vnode *
         _assert(at->op->find);
         struct vnode *node;
 
+        gen = dcache_gen();
         if ((res = at->op->find(at, name, &node)) != 0) {
+            if (res == -ENOENT) {
+                dcache_add_negative(at, name, gen);
+            }
             return res;
         }
 
         // Attach found node to its parent
         vnode_attach(at, node);
+        vnode_lru_add(node);
         *child = node;
 
         return 0;
@@ -373,7 +407,7 @@ void vfs_init(void) {
     }
 }
 
-int vfs_umount(struct vfs_ioctx *ctx, const char *dir_name) {
+static int vfs_umount_internal(struct vfs_ioctx *ctx, const char *dir_name) {
     struct vnode *node;
     int res;
 
@@ -418,6 +452,16 @@ int vfs_umount(struct vfs_ioctx *ctx, const char *dir_name) {
     return 0;
 }
 
+int vfs_umount(struct vfs_ioctx *ctx, const char *dir_name) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_umount_internal(ctx, dir_name);
+    vnode_lookup_leave();
+
+    return res;
+}
+
 int vfs_mount_internal(struct vnode *at, void *blk, struct fs_class *cls, uint32_t flags, const char *opt) {
     int res;
     struct fs *fs;
@@ -479,7 +523,7 @@ int vfs_mount_internal(struct vnode *at, void *blk, struct fs_class *cls, uint32
     return 0;
 }
 
-int vfs_mount(struct vfs_ioctx *ctx, const char *at, void *blk, const char *fs, uint32_t flags, const char *opt) {
+static int vfs_mount_path(struct vfs_ioctx *ctx, const char *at, void *blk, const char *fs, uint32_t flags, const char *opt) {
     int res;
     struct fs_class *fs_class;
     struct vnode *mountpoint;
@@ -521,6 +565,16 @@ int vfs_mount(struct vfs_ioctx *ctx, const char *at, void *blk, const char *fs,
     }
 }
 
+int vfs_mount(struct vfs_ioctx *ctx, const char *at, void *blk, const char *fs, uint32_t flags, const char *opt) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_mount_path(ctx, at, blk, fs, flags, opt);
+    vnode_lookup_leave();
+
+    return res;
+}
+
 int vfs_find(struct vfs_ioctx *ctx,
              struct vnode *rel,
              const char *path,
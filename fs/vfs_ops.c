@@ -1,8 +1,10 @@
 #include "user/errno.h"
 #include "user/fcntl.h"
 #include "sys/block/blk.h"
+#include "sys/mem/pcache.h"
 #include "sys/char/chr.h"
 #include "fs/ofile.h"
+#include "fs/dcache.h"
 #include "fs/node.h"
 #include "sys/thread.h"
 #include "fs/vfs.h"
@@ -76,7 +78,7 @@ static int vfs_opendir(struct vfs_ioctx *ctx, struct ofile *fd) {
         fd->flags |= OF_MEMDIR | OF_MEMDIR_DOT;
         fd->file.pos = (size_t) node->first_child;
 
-        ++node->open_count;
+        __atomic_add_fetch(&node->open_count, 1, __ATOMIC_ACQ_REL);
 
         return 0;
     } else {
@@ -89,7 +91,7 @@ static int vfs_opendir(struct vfs_ioctx *ctx, struct ofile *fd) {
             return res;
         }
 
-        ++node->open_count;
+        __atomic_add_fetch(&node->open_count, 1, __ATOMIC_ACQ_REL);
 
         return 0;
     }
@@ -264,12 +266,12 @@ int vfs_open_vnode(struct vfs_ioctx *ctx, struct ofile *fd, struct vnode *node,
         }
     }
 
-    ++fd->file.vnode->open_count;
+    __atomic_add_fetch(&fd->file.vnode->open_count, 1, __ATOMIC_ACQ_REL);
 
     return 0;
 }
 
-int vfs_mkdirat(struct vfs_ioctx *ctx, struct vnode *rel, const char *path, mode_t mode) {
+static int vfs_mkdirat_internal(struct vfs_ioctx *ctx, struct vnode *rel, const char *path, mode_t mode) {
     char parent_path[PATH_MAX];
     const char *filename;
     int res;
@@ -303,10 +305,25 @@ int vfs_mkdirat(struct vfs_ioctx *ctx, struct vnode *rel, const char *path, mode
         return -EROFS;
     }
 
-    return at->op->mkdir(at, filename, ctx->uid, ctx->gid, mode & ~ctx->umask);
+    if ((res = at->op->mkdir(at, filename, ctx->uid, ctx->gid, mode & ~ctx->umask)) != 0) {
+        return res;
+    }
+    dcache_forget(at, filename);
+
+    return 0;
 }
 
-int vfs_unlinkat(struct vfs_ioctx *ctx, struct vnode *at, const char *pathname, int flags) {
+int vfs_mkdirat(struct vfs_ioctx *ctx, struct vnode *rel, const char *path, mode_t mode) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_mkdirat_internal(ctx, rel, path, mode);
+    vnode_lookup_leave();
+
+    return res;
+}
+
+static int vfs_unlinkat_internal(struct vfs_ioctx *ctx, struct vnode *at, const char *pathname, int flags) {
     struct vnode *node;
     int res;
 
@@ -346,12 +363,26 @@ int vfs_unlinkat(struct vfs_ioctx *ctx, struct vnode *at, const char *pathname,
     }
 
     vnode_detach(node);
-    vnode_destroy(node);
+    // Someone's cwd or a cached link target may still refer to the node,
+    // the last of them frees it then
+    vnode_ref(node);
+    __atomic_or_fetch(&node->flags, VN_UNLINKED, __ATOMIC_SEQ_CST);
+    vnode_unref(node);
 
     return 0;
 }
 
-int vfs_mknod(struct vfs_ioctx *ctx, const char *path, mode_t mode, struct vnode **_nod) {
+int vfs_unlinkat(struct vfs_ioctx *ctx, struct vnode *at, const char *pathname, int flags) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_unlinkat_internal(ctx, at, pathname, flags);
+    vnode_lookup_leave();
+
+    return res;
+}
+
+static int vfs_mknod_internal(struct vfs_ioctx *ctx, const char *path, mode_t mode, struct vnode **_nod) {
     char parent_path[PATH_MAX];
     const char *filename;
     int res;
@@ -401,16 +432,27 @@ int vfs_mknod(struct vfs_ioctx *ctx, const char *path, mode_t mode, struct vnode
         vnode_destroy(nod);
         return res;
     }
+    dcache_forget(at, filename);
 
     *_nod = nod;
 
     return 0;
 }
 
-int vfs_creatat(struct vfs_ioctx *ctx,
-                struct vnode *vn_at,
-                const char *path,
-                mode_t mode) {
+int vfs_mknod(struct vfs_ioctx *ctx, const char *path, mode_t mode, struct vnode **_nod) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_mknod_internal(ctx, path, mode, _nod);
+    vnode_lookup_leave();
+
+    return res;
+}
+
+static int vfs_creatat_internal(struct vfs_ioctx *ctx,
+                                struct vnode *vn_at,
+                                const char *path,
+                                mode_t mode) {
     char parent_path[PATH_MAX];
     const char *filename;
     int res;
@@ -440,14 +482,32 @@ int vfs_creatat(struct vfs_ioctx *ctx,
         return -EROFS;
     }
 
-    return at->op->creat(at, filename, ctx->uid, ctx->gid, mode & ~ctx->umask);
+    if ((res = at->op->creat(at, filename, ctx->uid, ctx->gid, mode & ~ctx->umask)) != 0) {
+        return res;
+    }
+    dcache_forget(at, filename);
+
+    return 0;
 }
 
-int vfs_openat(struct vfs_ioctx *ctx,
-               struct ofile *fd,
-               struct vnode *at,
-               const char *path,
-               int opt, int mode) {
+int vfs_creatat(struct vfs_ioctx *ctx,
+                struct vnode *vn_at,
+                const char *path,
+                mode_t mode) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_creatat_internal(ctx, vn_at, path, mode);
+    vnode_lookup_leave();
+
+    return res;
+}
+
+static int vfs_openat_internal(struct vfs_ioctx *ctx,
+                               struct ofile *fd,
+                               struct vnode *at,
+                               const char *path,
+                               int opt, int mode) {
     if (!at) {
         at = ctx->cwd_vnode;
     }
@@ -481,6 +541,20 @@ int vfs_openat(struct vfs_ioctx *ctx,
     return vfs_open_vnode(ctx, fd, node, opt);
 }
 
+int vfs_openat(struct vfs_ioctx *ctx,
+               struct ofile *fd,
+               struct vnode *at,
+               const char *path,
+               int opt, int mode) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_openat_internal(ctx, fd, at, path, opt, mode);
+    vnode_lookup_leave();
+
+    return res;
+}
+
 void vfs_close(struct vfs_ioctx *ctx, struct ofile *fd) {
     _assert(ctx);
     _assert(fd);
@@ -488,14 +562,17 @@ void vfs_close(struct vfs_ioctx *ctx, struct ofile *fd) {
     _assert(!(fd->refcount));
     _assert(fd->file.vnode);
 
-    --fd->file.vnode->open_count;
+    if (!__atomic_sub_fetch(&fd->file.vnode->open_count, 1, __ATOMIC_ACQ_REL) && fd->file.vnode->pcache) {
+        // Neither open nor mapped anymore
+        pcache_shrink(fd->file.vnode);
+    }
 
     if (fd->file.vnode->op && fd->file.vnode->op->close) {
         fd->file.vnode->op->close(fd);
     }
 }
 
-int vfs_faccessat(struct vfs_ioctx *ctx, struct vnode *at, const char *path, int mode, int flags) {
+static int vfs_faccessat_internal(struct vfs_ioctx *ctx, struct vnode *at, const char *path, int mode, int flags) {
     _assert(ctx);
     _assert(path);
 
@@ -513,7 +590,17 @@ int vfs_faccessat(struct vfs_ioctx *ctx, struct vnode *at, const char *path, int
     return vfs_access_node(ctx, node, mode);
 }
 
-int vfs_fstatat(struct vfs_ioctx *ctx, struct vnode *at, const char *path, struct stat *st, int flags) {
+int vfs_faccessat(struct vfs_ioctx *ctx, struct vnode *at, const char *path, int mode, int flags) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_faccessat_internal(ctx, at, path, mode, flags);
+    vnode_lookup_leave();
+
+    return res;
+}
+
+static int vfs_fstatat_internal(struct vfs_ioctx *ctx, struct vnode *at, const char *path, struct stat *st, int flags) {
     struct vnode *node;
     int res;
 
@@ -546,11 +633,21 @@ int vfs_fstatat(struct vfs_ioctx *ctx, struct vnode *at, const char *path, struc
     return node->op->stat(node, st);
 }
 
-ssize_t vfs_readlinkat(struct vfs_ioctx *ctx,
-                       struct vnode *at,
-                       const char *restrict pathname,
-                       char *restrict buf,
-                       size_t lim) {
+int vfs_fstatat(struct vfs_ioctx *ctx, struct vnode *at, const char *path, struct stat *st, int flags) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_fstatat_internal(ctx, at, path, st, flags);
+    vnode_lookup_leave();
+
+    return res;
+}
+
+static ssize_t vfs_readlinkat_internal(struct vfs_ioctx *ctx,
+                                       struct vnode *at,
+                                       const char *restrict pathname,
+                                       char *restrict buf,
+                                       size_t lim) {
     struct vnode *node;
     int res;
 
@@ -586,6 +683,20 @@ ssize_t vfs_readlinkat(struct vfs_ioctx *ctx,
     return node->op->readlink(node, buf, lim);
 }
 
+ssize_t vfs_readlinkat(struct vfs_ioctx *ctx,
+                       struct vnode *at,
+                       const char *restrict pathname,
+                       char *restrict buf,
+                       size_t lim) {
+    ssize_t res;
+
+    vnode_lookup_enter();
+    res = vfs_readlinkat_internal(ctx, at, pathname, buf, lim);
+    vnode_lookup_leave();
+
+    return res;
+}
+
 int vfs_ftruncate(struct vfs_ioctx *ctx, struct vnode *node, off_t length) {
     _assert(ctx);
     _assert(node);
@@ -604,6 +715,7 @@ int vfs_ftruncate(struct vfs_ioctx *ctx, struct vnode *node, off_t length) {
 
 ssize_t vfs_write(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size_t count) {
     struct vnode *node;
+    size_t pos;
     ssize_t b;
 
     _assert(fd);
@@ -623,7 +735,12 @@ ssize_t vfs_write(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size
     case VN_REG:
     case VN_FIFO:
         _assert(node->op && node->op->write);
+        pos = fd->file.pos;
         b = node->op->write(fd, buf, count);
+        // Keep mmap()ed pages of the file coherent
+        if (b > 0 && node->pcache) {
+            pcache_update(node, pos, buf, b);
+        }
         return b;
     case VN_CHR:
         _assert(node->dev && ((struct chrdev *) node->dev)->write);
@@ -657,6 +774,10 @@ ssize_t vfs_read(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t coun
     case VN_REG:
     case VN_FIFO:
         _assert(node->op && node->op->read);
+        // Data written through shared mappings has to reach the file first
+        if (node->pcache) {
+            pcache_sync(node);
+        }
         b = node->op->read(fd, buf, count);
         return b;
     case VN_CHR:
@@ -694,7 +815,7 @@ off_t vfs_lseek(struct vfs_ioctx *ctx, struct ofile *fd, off_t offset, int whenc
     return node->op->lseek(fd, offset, whence);
 }
 
-int vfs_chmod(struct vfs_ioctx *ctx, const char *path, mode_t mode) {
+static int vfs_chmod_internal(struct vfs_ioctx *ctx, const char *path, mode_t mode) {
     _assert(ctx);
     _assert(path);
     struct vnode *node;
@@ -735,7 +856,17 @@ int vfs_chmod(struct vfs_ioctx *ctx, const char *path, mode_t mode) {
     return 0;
 }
 
-int vfs_chown(struct vfs_ioctx *ctx, const char *path, uid_t uid, gid_t gid) {
+int vfs_chmod(struct vfs_ioctx *ctx, const char *path, mode_t mode) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_chmod_internal(ctx, path, mode);
+    vnode_lookup_leave();
+
+    return res;
+}
+
+static int vfs_chown_internal(struct vfs_ioctx *ctx, const char *path, uid_t uid, gid_t gid) {
     struct vnode *node;
     int res;
 
@@ -764,6 +895,16 @@ int vfs_chown(struct vfs_ioctx *ctx, const char *path, uid_t uid, gid_t gid) {
     return 0;
 }
 
+int vfs_chown(struct vfs_ioctx *ctx, const char *path, uid_t uid, gid_t gid) {
+    int res;
+
+    vnode_lookup_enter();
+    res = vfs_chown_internal(ctx, path, uid, gid);
+    vnode_lookup_leave();
+
+    return res;
+}
+
 int vfs_ioctl(struct vfs_ioctx *ctx, struct ofile *fd, unsigned int cmd, void *arg) {
     _assert(ctx);
     _assert(fd);
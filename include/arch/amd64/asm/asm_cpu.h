@@ -46,5 +46,11 @@ struct cpu {
     // from assembly
     uint64_t flags;
     uint64_t apic_id;
+
+    // Physical address of the PML4 whose translations may be cached,
+    // see arch/amd64/mm/tlb.c
+    uint64_t mm_cr3;
+    // Running a kernel thread on top of it
+    int mm_lazy;
 };
 #endif
@@ -31,6 +31,8 @@ static inline void wrmsr(uint32_t addr, uint64_t v) {
 
 #if defined(AMD64_SMP)
 extern struct cpu cpus[AMD64_MAX_SMP];
+// Set once %gs is set up for BSP, get_cpu() cannot be used before that
+extern int percpu_ready;
 
 static inline struct cpu *get_cpu(void) {
     struct cpu *cpu;
@@ -41,4 +43,5 @@ static inline struct cpu *get_cpu(void) {
 extern struct cpu __amd64_cpu;
 
 #define get_cpu()   ((struct cpu *) &__amd64_cpu)
+#define percpu_ready    1
 #endif
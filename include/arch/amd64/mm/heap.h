@@ -3,7 +3,16 @@
 #include "sys/heap.h"
 #include <stdint.h>
 
-#define KERNEL_HEAP     (4 * 512 * 1024)
+#define KERNEL_HEAP         (4 * 512 * 1024)
+// Initial heap size when it's allowed to grow ("heap_grow" cmdline option)
+#define KERNEL_HEAP_GROW    (64 * 1024)
+
+// "heap_poison" cmdline option values
+#define HEAP_POISON_NONE    0
+// Only the blocks returned by heap_alloc() are filled
+#define HEAP_POISON_LAZY    1
+// The whole heap is filled with noise when it's set up
+#define HEAP_POISON_FULL    2
 
 /**
  * @brief Initialize heap instance of size `sz' at `phys_base'
@@ -14,7 +23,9 @@
  *       allows heap to just MM_VIRTUALIZE allocated pointers no matter
  *       where the kernel heap actually resides, which could be the
  *       problem if we created a separate mapping for kernel heap
- *       memory.
+ *       memory. For the same reason, when the heap is allowed to grow,
+ *       it does so by adding physically contiguous chunks, so MM_PHYS()
+ *       stays valid for any heap pointer.
  */
 void amd64_heap_init(heap_t *heap, uintptr_t phys_base, size_t sz);
 
@@ -9,6 +9,10 @@
 /// Splits userspace mappings and kernelspace ones
 #define AMD64_PML4I_USER_END    255
 
+/// Range operations touching more pages than this reload CR3 instead of
+/// invalidating the pages one by one
+#define MM_TLB_FLUSH_MAX        32
+
 /**
  * @brief Translate a virtual address in `space' to its physical mapping (if one exists).
  *        May optionally return access flags in `flags' if non-NULL
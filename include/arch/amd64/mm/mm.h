@@ -16,6 +16,10 @@
 #define MM_PHYS(a)                          ((uintptr_t) (a) - 0xFFFFFF0000000000)
 
 #define MM_PAGE_SIZE                        0x1000
+/// Size of a page mapped by a page directory entry
+#define MM_HUGE_PAGE_SIZE                   (1ULL << MM_PDI_SHIFT)
+/// Number of 4KiB pages in a huge one
+#define MM_HUGE_PAGE_COUNT                  512
 
 #define MM_PTE_INDEX_MASK                   0x1FF
 #define MM_PTE_COUNT                        512
@@ -62,3 +66,5 @@ typedef mm_pml4_t mm_space_t;
 extern mm_space_t mm_kernel;
 
 void amd64_mm_init(void);
+/// Per-CPU paging setup, done by every AP during its startup
+void amd64_mm_cpu_init(void);
@@ -13,7 +13,7 @@ struct amd64_pool_stat {
 /// Initialize the paging structure allocation pool
 void amd64_mm_pool_init(uintptr_t base, size_t size);
 
-/// Allocate a paging structure (returns virtual addresses)
+/// Allocate a paging structure (returns virtual addresses), NULL if out of memory
 uint64_t *amd64_mm_pool_alloc(void);
 
 /// Free a paging structure (obj is a virtual pointer)
@@ -0,0 +1,32 @@
+/** vim: set ft=cpp.doxygen :
+ * @file arch/amd64/mm/tlb.h
+ * @brief Cross-CPU TLB invalidation
+ */
+#pragma once
+#include "sys/types.h"
+#include "sys/mm.h"
+
+/**
+ * @brief Switch the CPU to the space of a thread which is about to run.
+ *        Kernel threads keep the previous space loaded ("lazy TLB"), as
+ *        the kernel part is the same in all of them
+ * @param cr3 Physical address of the thread's PML4
+ */
+void amd64_tlb_switch(uintptr_t cr3);
+
+/**
+ * @brief Invalidate `addrs' on the other CPUs which may have translations
+ *        of `space' cached and wait for them to finish. The local TLB is
+ *        left to the caller
+ * @param space Address space, NULL for kernel (global) entries, which are
+ *              invalidated on all the CPUs
+ * @param count Number of addresses, anything above MM_TLB_FLUSH_MAX
+ *              flushes all the translations of the space
+ */
+void amd64_tlb_shootdown(mm_space_t space, const uintptr_t *addrs, size_t count);
+
+/**
+ * @brief Make all the CPUs, this one included, leave `space' before it's
+ *        freed
+ */
+void amd64_tlb_drop(mm_space_t space);
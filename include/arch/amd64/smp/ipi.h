@@ -2,6 +2,20 @@
 #include "sys/types.h"
 
 #define IPI_VECTOR_GENERIC      0xF0
+#define IPI_VECTOR_RESCHED      0xF1
 #define IPI_VECTOR_PANIC        0xF3
 
+/**
+ * Cross-CPU request handler. Runs on the target CPU in interrupt context,
+ * must not switch context by itself.
+ * @return Non-zero if the target CPU has to reschedule
+ */
+typedef int (*ipi_func_t) (void *arg, uintptr_t value);
+
 void amd64_ipi_send(int cpu, uint8_t vector);
+
+/**
+ * @brief Post a request to `cpu's mailbox and interrupt it to handle it.
+ *        Does not wait for the request to complete.
+ */
+void amd64_ipi_call(int cpu, ipi_func_t func, void *arg, uintptr_t value);
@@ -0,0 +1,51 @@
+/** vim: ft=c.doxygen
+ * @file dcache.h
+ * @brief Name lookup cache: (parent, name) -> vnode
+ */
+#pragma once
+#include "sys/types.h"
+#include "sys/list.h"
+#include "fs/node.h"
+
+// Upper bound on the number of negative entries kept, the least
+// recently used ones are dropped first
+#define DCACHE_NEG_MAX          512
+
+struct dentry {
+    struct vnode *parent;
+    // NULL for negative entries: the name is known not to exist
+    struct vnode *vnode;
+    size_t hash;
+    char name[NODE_MAXLEN];
+
+    struct dentry *next;
+    // Negative entries only, LRU order
+    struct list_head link;
+};
+
+/**
+ * @brief Find a cached name
+ * @return 0 if the child is in memory (stored in `child'),
+ *         -ENOENT if the name is known not to exist,
+ *         1 if nothing is known about it
+ */
+int dcache_lookup(struct vnode *parent, const char *name, struct vnode **child);
+/**
+ * @return Value to pass to dcache_add_negative() once the lookup in the
+ *         filesystem has failed
+ */
+uint64_t dcache_gen(void);
+/**
+ * @brief Remember that `name' doesn't exist in `parent'. Ignored if any
+ *        name was created since `gen' was obtained
+ */
+void dcache_add_negative(struct vnode *parent, const char *name, uint64_t gen);
+/**
+ * @brief Drop the negative entry for a name which has just been created
+ */
+void dcache_forget(struct vnode *parent, const char *name);
+
+// Called by vnode_attach/vnode_detach/vnode_destroy
+void dcache_attach(struct vnode *vn);
+void dcache_detach(struct vnode *vn);
+void dcache_purge(struct vnode *parent);
@@ -2,6 +2,7 @@
 #include "sys/types.h"
 
 struct ext2_inode;
+struct ext2_data;
 struct fs;
 
 int ext2_read_superblock(struct fs *ext2);
@@ -12,9 +13,20 @@ int ext2_write_block(struct fs *ext2, const void *blk, uint32_t no);
 
 int ext2_read_inode_block(struct fs *ext2, struct ext2_inode *inode, void *block, uint32_t index);
 int ext2_write_inode_block(struct fs *ext2, struct ext2_inode *inode, const void *block, uint32_t index);
+// Transfer `count' whole blocks of a file, one device request per run of
+// blocks which are contiguous on disk
+int ext2_read_inode_blocks(struct fs *ext2, struct ext2_inode *inode, void *buf, uint32_t index, uint32_t count);
+int ext2_write_inode_blocks(struct fs *ext2, struct ext2_inode *inode, const void *buf, uint32_t index, uint32_t count);
 
+// Returns the disk block of file block `index' (0 if it's not allocated),
+// setting *run to the number of blocks which follow it contiguously
+uint32_t ext2_inode_map(struct fs *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *run);
 uint32_t ext2_inode_get_index(struct fs *ext2, struct ext2_inode *inode, uint32_t index);
 int ext2_inode_set_index(struct fs *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index, uint32_t value);
+// Free the indirect blocks no longer needed by a file of `block_count' blocks
+int ext2_inode_trim(struct fs *ext2, struct ext2_inode *inode, uint32_t block_count);
+// Number of indirect blocks a file of `block_count' blocks needs
+uint32_t ext2_inode_ptr_blocks(struct ext2_data *data, uint32_t block_count);
 
 int ext2_read_inode(struct fs *ext2, struct ext2_inode *dst, uint32_t ino);
 // NOTE: this function automatically updates access and modification time
@@ -30,6 +30,8 @@
 #define EXT2_IFSOCK             0xC000
 
 #define EXT2_DIRECT_BLOCKS      12
+// Size of the block map cache of an inode
+#define EXT2_BMAP_EXTENTS       16
 
 struct slab_cache;
 struct vnode;
@@ -118,6 +120,25 @@ struct ext2_inode {
     uint32_t os_val2;
 } __attribute__((packed));
 
+// Run of logical blocks of a file which are contiguous on disk
+struct ext2_extent {
+    uint32_t index;
+    uint32_t block;
+    uint32_t length;
+};
+
+// Cache of the block map of an in-memory inode, so that the indirect
+// blocks aren't walked again for every block of a file. Stored right after
+// the on-disk inode in the objects of inode_cache (see EXT2_BMAP())
+struct ext2_bmap {
+    uint32_t count;
+    uint32_t next_victim;
+    struct ext2_extent extents[EXT2_BMAP_EXTENTS];
+};
+
+#define EXT2_BMAP(data, inode) \
+    ((struct ext2_bmap *) ((char *) (inode) + (data)->inode_size))
+
 struct ext2_data {
     union {
         struct ext2_superblock sb;
@@ -7,6 +7,7 @@
 #include "user/dirent.h"
 #include "user/stat.h"
 #include "sys/types.h"
+#include "sys/list.h"
 
 #define NODE_MAXLEN 64
 
@@ -16,11 +17,19 @@
 // Means the link has different meanings depending on
 // resolving process ID - use target_func instead
 #define VN_PER_PROCESS  (1 << 1)
+// Removed from its directory while still referenced, freed
+// by the last vnode_unref()
+#define VN_UNLINKED     (1 << 2)
+// Some of the directory's children couldn't be entered into the
+// dcache, so a miss there has to check the child list as well
+#define VN_DCACHE_PARTIAL (1 << 3)
 
 struct ofile;
 struct vfs_ioctx;
 struct thread;
 struct vnode;
+struct pcache;
+struct dentry;
 struct fs;
 
 typedef struct vnode *(*vnode_link_getter_t) (struct thread *, struct vnode *, char *, size_t);
@@ -50,6 +59,8 @@ struct vnode_operations {
     int (*mkdir) (struct vnode *at, const char *filename, uid_t uid, gid_t gid, mode_t mode);
     int (*truncate) (struct vnode *at, size_t size);
     int (*unlink) (struct vnode *vn);
+    // Release fs_data of a node dropped from memory
+    void (*destroy) (struct vnode *vn);
 
     off_t (*lseek) (struct ofile *fd, off_t offset, int whence);
 
@@ -72,6 +83,8 @@ struct vnode {
     struct vnode *first_child;
     struct vnode *next_child;
     struct vnode *parent;
+    // Name cache entry, present while the node is attached
+    struct dentry *dentry;
 
     // For filesystem roots, mountpoint directory vnode
     // For symlinks, this is target vnode
@@ -81,7 +94,15 @@ struct vnode {
         vnode_link_getter_t target_func;
     };
 
+    // Open files and mappings of the node. Also taken by page faults,
+    // so it's only changed atomically
     uint32_t open_count;
+    // Other long-lived users of the node (cwd, cached link targets),
+    // reclaim only drops nodes which have neither of the counts. Unlike
+    // open files, these don't prevent the node from being unlinked
+    uint32_t refcount;
+    // Nodes loaded from storage, least recently used first
+    struct list_head lru;
     uint64_t ino;
 
     gid_t gid;
@@ -96,6 +117,9 @@ struct vnode {
      */
     void *dev;
 
+    // Pages of the file which are or were mmap()ed
+    struct pcache *pcache;
+
     struct vnode_operations *op;
 };
 
@@ -103,6 +127,19 @@ struct vnode {
 struct vnode *vnode_create(enum vnode_type t, const char *name);
 void vnode_destroy(struct vnode *vn);
 
+// Reference counting
+void vnode_ref(struct vnode *vn);
+void vnode_unref(struct vnode *vn);
+
+// Reclaim of nodes loaded from storage
+void vnode_lru_add(struct vnode *vn);
+void vnode_touch(struct vnode *vn);
+// Nodes returned by path lookups aren't referenced, so anything which
+// looks up a path and uses the result is done between these two. The
+// shrinker only runs when no thread is in there
+void vnode_lookup_enter(void);
+void vnode_lookup_leave(void);
+
 // Tree manipulation
 void vnode_attach(struct vnode *parent, struct vnode *child);
 void vnode_detach(struct vnode *node);
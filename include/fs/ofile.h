@@ -16,6 +16,8 @@ struct vfs_ioctx;
 struct ofile {
     int flags;
     int refcount;
+    // Event queues the file is in
+    struct list_head epoll_items;
     union {
         struct {
             struct vnode *vnode;
@@ -0,0 +1,29 @@
+/** vim: ft=c.doxygen
+ * @file splice.h
+ * @brief Data transfers between descriptors inside the kernel
+ */
+#pragma once
+#include "sys/types.h"
+
+struct vfs_ioctx;
+struct ofile;
+
+/**
+ * @brief Move up to `count' bytes from `in' to `out', one of which has to
+ *        be a pipe. The offsets are only allowed for regular files: they
+ *        are used and updated instead of the descriptor's position
+ * @return Number of bytes moved, 0 on EOF, or an error
+ */
+ssize_t vfs_splice(struct vfs_ioctx *ctx,
+                   struct ofile *in, off_t *off_in,
+                   struct ofile *out, off_t *off_out,
+                   size_t count);
+/**
+ * @brief Duplicate up to `count' bytes buffered in pipe `in' to pipe `out',
+ *        leaving them in `in'
+ */
+ssize_t vfs_tee(struct vfs_ioctx *ctx, struct ofile *in, struct ofile *out, size_t count);
+/**
+ * @brief Write up to `count' bytes of regular file `in' to `out'
+ */
+ssize_t vfs_sendfile(struct vfs_ioctx *ctx, struct ofile *out, struct ofile *in, off_t *offset, size_t count);
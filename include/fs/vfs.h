@@ -32,6 +32,8 @@ mode_t vfs_vnode_to_mode(enum vnode_type type);
 void vfs_init(void);
 
 int vfs_setcwd(struct vfs_ioctx *ctx, const char *rel_path);
+// Moves the cwd reference from the old node to the new one
+void vfs_set_cwd_vnode(struct vfs_ioctx *ctx, struct vnode *vn);
 void vfs_vnode_path(char *path, struct vnode *node);
 
 int vfs_mount_internal(struct vnode *at, void *blk, struct fs_class *cls, uint32_t flags, const char *opt);
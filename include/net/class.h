@@ -20,6 +20,9 @@ struct sockops {
 
     int (*count_pending) (struct socket *);
     struct io_notify *(*get_rx_notify) (struct socket *);
+    // Optional, sockets without these are always writable
+    int (*can_send) (struct socket *);
+    struct io_notify *(*get_tx_notify) (struct socket *);
 };
 
 struct socket_class {
@@ -39,3 +39,5 @@ void net_close(struct vfs_ioctx *ioctx, struct ofile *fd);
 
 int socket_has_data(struct socket *sock);
 struct io_notify *socket_get_rx_notify(struct socket *sock);
+int socket_can_send(struct socket *sock);
+struct io_notify *socket_get_tx_notify(struct socket *sock);
@@ -5,6 +5,17 @@
 #define BLK_CACHE       (1 << 1)
 #define BLK_BUSY        (1 << 0)
 
+// Period of background writeback passes
+#define BLK_WRITEBACK_INTERVAL      1000000000ULL   // 1s
+// Pages which have been dirty for longer are written by the next pass
+#define BLK_DIRTY_EXPIRE            5000000000ULL   // 5s
+
+// Read-ahead window limits, in cache pages. The window starts at the
+// minimum once sequential access is detected and doubles with each
+// following sequential read
+#define BLK_RA_MIN                  4
+#define BLK_RA_MAX                  32
+
 struct vnode;
 struct ofile;
 
@@ -12,6 +23,9 @@ struct blkdev {
     uint32_t flags;
     size_t block_size;
     struct block_cache cache;
+    // Read-ahead state: last page of the previous read, current window
+    // and the end of the already read-ahead range
+    size_t ra_last, ra_window, ra_end;
 
     void *dev_data;
 
@@ -29,6 +43,10 @@ void blk_cache_release(struct blkdev *blk);
 void blk_sync(struct blkdev *blk);
 int blk_page_sync(struct blkdev *blk, uintptr_t address, uintptr_t page);
 void blk_sync_all(void);
+// Start the background writeback thread
+void blk_writeback_start(void);
+// Make the writeback thread run a pass right away
+void blk_writeback_kick(void);
 
 int blk_mmap(struct blkdev *blk, uintptr_t base, size_t page_count, int prot, int flags);
 ssize_t blk_read(struct blkdev *blk, void *buf, size_t off, size_t count);
@@ -1,26 +1,90 @@
 #pragma once
 #include "sys/types.h"
+#include "sys/list.h"
+#include "sys/spin.h"
 
-struct lru_node;
+// Count of locks protecting the index hash buckets, bucket i is
+// guarded by lock (i % BLOCK_CACHE_STRIPES)
+#define BLOCK_CACHE_STRIPES     16
 
-struct lru_hash {
-    size_t bucket_count;
-    struct lru_node **bucket_heads;
-    struct lru_node **bucket_tails;
+// block_cache_page::flags
+#define BLOCK_PAGE_UPTODATE     (1 << 0)
+#define BLOCK_PAGE_DIRTY        (1 << 1)
+// Used since it was last seen by the eviction scan
+#define BLOCK_PAGE_REFERENCED   (1 << 2)
+// Couldn't be read, the page is no longer in the cache
+#define BLOCK_PAGE_ERROR        (1 << 3)
+
+// Percentage of the cache which may be dirty before background
+// writeback is started
+#define BLOCK_CACHE_DIRTY_RATIO     10
+#define BLOCK_CACHE_DIRTY_LIMIT(cache) \
+    ((cache)->capacity * BLOCK_CACHE_DIRTY_RATIO / 100)
+
+struct block_cache_page {
+    uintptr_t address;              // Block index
+    uintptr_t page;                 // Physical page with the data
+    uint32_t flags;
+    uint32_t refcount;
+    struct block_cache_page *hash_next;
+    struct list_head lru;
+    // Dirty pages are kept in the order they were first written to
+    struct list_head dirty_link;
+    uint64_t dirtied_at;
 };
 
 struct block_cache {
     size_t page_size;
     size_t capacity, size;
     struct blkdev *blk;
-    struct lru_node *queue_head, *queue_tail;
-    struct lru_hash index_hash;
+
+    // Index hash, bucket_count is a power of two
+    spin_t hash_locks[BLOCK_CACHE_STRIPES];
+    size_t bucket_count;
+    struct block_cache_page **buckets;
+
+    // Eviction order, entries are only added at the head and looked up
+    // pages are just marked as referenced instead of being moved
+    spin_t lru_lock;
+    struct list_head lru;
+
+    spin_t dirty_lock;
+    struct list_head dirty;
+    size_t dirty_count;
+
     // For global cache tracking
     struct block_cache *g_prev, *g_next;
+    size_t g_users;
 };
 
 void block_cache_init(struct block_cache *cache, struct blkdev *blk, size_t page_size, size_t page_capacity);
 void block_cache_release(struct block_cache *cache);
+/**
+ * @brief Write back all the dirty pages and drop the unused ones from
+ *        the cache
+ */
 void block_cache_flush(struct block_cache *cache);
-int block_cache_get(struct block_cache *cache, uintptr_t address, uintptr_t *page);
-void block_cache_mark_dirty(struct block_cache *cache, uintptr_t address);
+/**
+ * @brief Write back dirty pages, oldest first, until the remaining ones
+ *        were all dirtied at or after `dirtied_before' and there're
+ *        at most `keep' of them
+ * @return Number of pages written
+ */
+size_t block_cache_writeback(struct block_cache *cache, uint64_t dirtied_before, size_t keep);
+/**
+ * @brief Find or create a cache page for block at byte `address',
+ *        referencing it
+ * @param ref Receives the page, which must be released with
+ *            block_cache_put()
+ * @return 0 if the page contains the block's data,
+ *         -1 if it's a new one which the caller has to read from the
+ *         device and then call block_cache_page_ready()
+ */
+int block_cache_get(struct block_cache *cache, uintptr_t address, struct block_cache_page **ref);
+void block_cache_page_ready(struct block_cache *cache, struct block_cache_page *ref);
+/**
+ * @brief Drop a new page which couldn't be read, releasing the reference
+ */
+void block_cache_page_abort(struct block_cache *cache, struct block_cache_page *ref);
+void block_cache_put(struct block_cache *cache, struct block_cache_page *ref);
+void block_cache_mark_dirty(struct block_cache *cache, struct block_cache_page *ref);
@@ -1,7 +1,22 @@
 #pragma once
+#include "sys/types.h"
+
+// Buffer size of a new pipe or FIFO
+#define PIPE_DEFAULT_SIZE   (64 * 1024)
+// Limit for F_SETPIPE_SZ
+#define PIPE_MAX_SIZE       (1024 * 1024)
 
 struct ofile;
 struct vnode;
+struct ring;
 
 int pipe_create(struct ofile **read, struct ofile **write);
 int pipe_fifo_create(struct vnode *res);
+
+// Buffer of a pipe or FIFO, NULL if `of' is something else
+struct ring *pipe_get_ring(struct ofile *of);
+
+// F_GETPIPE_SZ/F_SETPIPE_SZ: the size is rounded up to whole pages,
+// the new one is returned. -EBADF if `of' is not a pipe
+int pipe_get_size(struct ofile *of);
+int pipe_set_size(struct ofile *of, size_t size);
@@ -10,13 +10,29 @@ struct thread;
 #define RING_SIGNAL_RET     (1 << 2)
 #define RING_RAW            (1 << 3)
 
-// Ring buffer
+// Byte ring buffer, possibly with several readers and writers. Data is
+// copied in and out in bulk, waking the other side once per batch
 struct ring {
+    // Only ever incremented, wr - rd bytes are buffered
     size_t rd, wr;
+    // Capacities of a page or more are rounded up to whole pages, which
+    // are taken from the physical allocator one by one and kept in
+    // `pages'. Smaller buffers are a single heap block at `base'
     size_t cap;
     char *base;
+    char **pages;
     int flags;
 
+    // Guards against resizing while the data is being copied
+    spin_t lock;
+    uint32_t users;
+    int resizing;
+
+    // One reader and one writer copy at a time, the others wait for
+    // their turn
+    int reading, writing;
+    struct io_notify reader_turn, writer_turn;
+
     // Reader notification
     struct io_notify wait;
     // Writer notification
@@ -24,10 +40,38 @@ struct ring {
 };
 
 int ring_readable(struct ring *b);
+size_t ring_writable(struct ring *b);
 int ring_getc(struct thread *ctx, struct ring *b, char *c, int err);
+// Blocks until there's data, then reads until `count' bytes are read, the
+// ring is drained after RING_SIGNAL_RET or EOF is reached
+ssize_t ring_read(struct thread *ctx, struct ring *b, void *data, size_t count);
+
+// Produce/consume data in place: `fill' gets free space of the ring to read
+// into, `drain' gets buffered data to write out. Both return the number of
+// bytes moved (stopping at the first short one), 0 or an error. `wait' is
+// cleared once something has been moved: the callback must not block then,
+// and returns 0 if it would
+typedef ssize_t (*ring_fill_t) (void *arg, void *buf, size_t count, int wait);
+typedef ssize_t (*ring_drain_t) (void *arg, const void *buf, size_t count, int wait);
+
+// Returns 0 once there's room to write, -EPIPE on EOF or -EINTR
+int ring_wait_writable(struct thread *ctx, struct ring *b);
+// Wait until there's room, then fill up to `count' bytes of it
+ssize_t ring_splice_in(struct thread *ctx, struct ring *b, size_t count, ring_fill_t fill, void *arg);
+// Wait until there's data, then drain up to `count' bytes of it
+ssize_t ring_splice_out(struct thread *ctx, struct ring *b, size_t count, ring_drain_t drain, void *arg);
+// Copy up to `count' buffered bytes of `src' to `dst' without consuming them
+ssize_t ring_tee(struct thread *ctx, struct ring *src, struct ring *dst, size_t count);
 
 void ring_signal(struct ring *b, int type);
 int ring_putc(struct thread *ctx, struct ring *b, char c, int wait);
-int ring_write(struct thread *ctx, struct ring *b, const void *data, size_t count, int wait);
+// Without `wait', the data which doesn't fit is dropped. Returns the
+// number of bytes written, or an error if nothing was
+ssize_t ring_write(struct thread *ctx, struct ring *b, const void *data, size_t count, int wait);
 
 int ring_init(struct ring *b, size_t cap);
+// Releases the buffer, the ring must not be used anymore
+void ring_fini(struct ring *b);
+// Reallocates the buffer, keeping the data. Fails with -EBUSY if it's
+// more than what fits into the new capacity, or if the ring stays in use
+int ring_resize(struct ring *b, size_t cap);
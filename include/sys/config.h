@@ -9,6 +9,8 @@ enum {
     CFG_RDINIT,
     CFG_CONSOLE,
     CFG_DEBUG,
+    CFG_HEAP_POISON,
+    CFG_HEAP_GROW,
 
     __CFG_SIZE
 };
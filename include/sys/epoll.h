@@ -0,0 +1,37 @@
+/** vim: ft=c.doxygen
+ * @file sys/epoll.h
+ * @brief Event queues: epoll_create()/epoll_ctl()/epoll_wait()
+ */
+#pragma once
+#include "sys/types.h"
+
+// Upper bound on events returned by a single epoll_wait()
+#define EPOLL_WAIT_MAX          256
+
+struct epoll_event;
+struct thread;
+struct ofile;
+
+/**
+ * @brief Create a new queue, returned as an open file
+ */
+int epoll_create(struct ofile **of);
+/**
+ * @brief Add, modify or remove the interest in `of' (open as `fd')
+ * @return 0 on success,
+ *         -EEXIST/-ENOENT if `of' is already/not in the queue,
+ *         -EPERM if `of' can't be waited on
+ */
+int epoll_ctl(struct ofile *ep, int op, int fd, struct ofile *of, const struct epoll_event *ev);
+/**
+ * @brief Wait for at least one of the descriptors to become ready. Edge-
+ *        triggered (EPOLLET) ones are only reported once per change,
+ *        level-triggered ones as long as they're ready
+ * @param timeout Milliseconds, -1 to wait indefinitely, 0 to only check
+ * @return Number of events stored, 0 on timeout or an error
+ */
+int epoll_wait(struct thread *thr, struct ofile *ep, struct epoll_event *events, int max, int timeout);
+/**
+ * @brief Remove a file which is being closed from all the queues
+ */
+void epoll_release_file(struct ofile *of);
@@ -18,18 +18,18 @@ struct heap_stat {
 
 #if defined(HEAP_TRACE)
 #define kmalloc(sz)     ({ \
-        void *p = heap_alloc(heap_global, sz); \
+        void *p = kmem_alloc(sz); \
         heap_trace(HEAP_TRACE_ALLOC, __FILE__, __func__, __LINE__, p, sz); \
         p; \
     })
 
 #define kfree(p)        heap_trace(HEAP_TRACE_FREE, __FILE__, __func__, __LINE__, p, 0); \
-                        heap_free(heap_global, p)
+                        kmem_free(p)
 
 void heap_trace(int type, const char *file, const char *func, int line, void *ptr, size_t count);
 #else
-#define kmalloc(sz)     heap_alloc(heap_global, sz)
-#define kfree(p)        heap_free(heap_global, p)
+#define kmalloc(sz)     kmem_alloc(sz)
+#define kfree(p)        kmem_free(p)
 #endif
 
 /// Opaque type for kernel heap usage
@@ -58,6 +58,19 @@ void heap_free(heap_t *heap, void *ptr);
 
 void heap_stat(heap_t *heap, struct heap_stat *st);
 
+/**
+ * @brief Allocate `count' bytes of kernel memory. Small requests are
+ *        served by size-class slab caches, larger ones by the global heap
+ * @return Virtual address of the block on success,
+ *         NULL otherwise
+ */
+void *kmem_alloc(size_t count);
+
+/**
+ * @brief Free a block returned by kmem_alloc() if `ptr' is non-NULL
+ */
+void kmem_free(void *ptr);
+
 #if defined(ARCH_AMD64)
 #include "arch/amd64/mm/heap.h"
 #endif
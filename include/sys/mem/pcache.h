@@ -0,0 +1,57 @@
+/** vim: set ft=cpp.doxygen :
+ * @file sys/mem/pcache.h
+ * @brief Per-vnode cache of file pages, used for mmap()
+ */
+#pragma once
+#include "sys/types.h"
+#include "sys/spin.h"
+
+struct vnode;
+
+// pcache_page::flags
+// Written through a shared mapping, not yet stored to the file
+#define PCACHE_PAGE_DIRTY       (1 << 0)
+
+struct pcache_page {
+    size_t index;                   // File offset / MM_PAGE_SIZE
+    uintptr_t phys;
+    uint32_t flags;
+    struct pcache_page *next;
+};
+
+struct pcache {
+    spin_t lock;
+    size_t count, dirty;
+    // Index hash, bucket_count is a power of two
+    size_t bucket_count;
+    struct pcache_page **buckets;
+};
+
+/**
+ * @brief Find or read page `index' of the file. The cache holds its own
+ *        reference to the physical page, so it's never freed while
+ *        cached
+ * @return Physical address of the page, referenced for the caller,
+ *         or MM_NADDR on failure
+ */
+uintptr_t pcache_page_get(struct vnode *vn, size_t index);
+void pcache_page_put(uintptr_t phys);
+void pcache_mark_dirty(struct vnode *vn, size_t index);
+
+/**
+ * @brief Store the dirty pages to the file
+ */
+int pcache_sync(struct vnode *vn);
+/**
+ * @brief Copy data written to the file by other means into the cached
+ *        pages
+ */
+void pcache_update(struct vnode *vn, size_t pos, const void *buf, size_t count);
+/**
+ * @brief Drop the clean pages nobody has mapped
+ */
+void pcache_shrink(struct vnode *vn);
+/**
+ * @brief Free the whole cache of a vnode which is being destroyed
+ */
+void pcache_release(struct vnode *vn);
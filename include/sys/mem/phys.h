@@ -6,15 +6,31 @@
 #include "sys/types.h"
 #include "sys/list.h"
 
-extern struct page *mm_pages;
+// Physical memory is described in 128MiB sections, struct page arrays
+// are only allocated for the sections which contain usable memory
+#define MM_SECTION_SHIFT        27
+#define MM_SECTION_PAGES        (1UL << (MM_SECTION_SHIFT - 12))
+#define MM_MAX_SECTIONS         4096        // 512GiB
 
+extern struct page *mm_sections[MM_MAX_SECTIONS];
+
+// Section number is kept in top bits of page flags
+#define PG_SECTION_SHIFT        48
+#define PG_SECTION(page)        ((page)->flags >> PG_SECTION_SHIFT)
+
+#define PFN2PAGE(pfn) \
+    (&mm_sections[(pfn) / MM_SECTION_PAGES][(pfn) % MM_SECTION_PAGES])
+#define PAGE2PFN(page) \
+    (PG_SECTION(page) * MM_SECTION_PAGES + (size_t) ((page) - mm_sections[PG_SECTION(page)]))
 #define PHYS2PAGE(phys) \
-    (&mm_pages[((uintptr_t) (phys)) / MM_PAGE_SIZE])
+    PFN2PAGE(((uintptr_t) (phys)) / MM_PAGE_SIZE)
 #define PAGE2PHYS(page) \
-    (MM_PAGE_SIZE * ((uintptr_t) (phys) - (uintptr_t) pages) / sizeof(struct page))
+    (PAGE2PFN(page) * MM_PAGE_SIZE)
 
 #define PG_ALLOC                (1 << 0)
 #define PG_MMAPED               (1 << 1)
+#define PG_BUDDY                (1 << 2)    // First page of a free buddy block
+#define PG_SLAB                 (1 << 3)    // Slab page, see kmem_free()
 
 struct page {
     uint64_t flags;
@@ -28,7 +44,9 @@ struct page {
         PU_CACHE,
         _PU_COUNT
     } usage;
+    uint32_t order;             // Buddy block order, valid with PG_BUDDY
     size_t refcount;
+    struct list_head link;      // Buddy free list
 };
 
 struct mm_phys_reserved {
@@ -46,6 +64,13 @@ struct mm_phys_stat {
     size_t pages_used_cache;
 };
 
+// Caches which can give memory back when the system runs low on it
+struct mm_shrinker {
+    // Try to release up to `count' objects, returns the number released
+    size_t (*shrink) (size_t count);
+    struct list_head link;
+};
+
 void mm_phys_reserve(const char *use, struct mm_phys_reserved *res);
 void mm_phys_stat(struct mm_phys_stat *st);
 
@@ -68,3 +93,14 @@ uintptr_t mm_phys_alloc_contiguous(size_t count, enum page_usage pu);
  */
 void mm_phys_free_page(uintptr_t addr);
 
+/**
+ * @brief Register a cache to be shrunk by mm_phys_reclaim()
+ */
+void mm_phys_shrinker_add(struct mm_shrinker *s);
+/**
+ * @brief If free memory is below the low watermark, shrink the registered
+ *        caches until it's above the high one or nothing more can be
+ *        released. Must not be called with interrupts disabled or with
+ *        any of the caches' locks held
+ */
+void mm_phys_reclaim(void);
@@ -10,3 +10,4 @@ void *sys_shmat(int id, const void *hint, int flags);
 
 void *sys_mmap(void *hint, size_t length, int prot, int flags, int fd, off_t offset);
 int sys_munmap(void *addr, size_t length);
+int sys_mprotect(void *addr, size_t length, int prot);
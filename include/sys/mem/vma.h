@@ -0,0 +1,105 @@
+/** vim: set ft=cpp.doxygen :
+ * @file sys/mem/vma.h
+ * @brief Per-process virtual memory areas
+ */
+#pragma once
+#include "sys/types.h"
+#include "sys/list.h"
+#include "sys/spin.h"
+
+struct process;
+struct vnode;
+
+// vm_area::flags
+// Pages are allocated and zero-filled on first access
+#define VMA_ANON            (1 << 0)
+// Pages are shared with the forked children instead of being copied
+#define VMA_SHARED          (1 << 1)
+
+struct vm_area {
+    // Page-aligned, [start, end)
+    uintptr_t start, end;
+    // MM_PAGE_* bits the pages are mapped with
+    uint64_t page_flags;
+    uint32_t flags;
+
+    // File-backed areas: pages come from the vnode's page cache, private
+    // ones are copied on write
+    struct vnode *vnode;
+    size_t offset;                  // File offset of `start'
+
+    // AVL tree node, keyed by start
+    struct vm_area *left, *right;
+    int height;
+
+    struct list_head link;
+};
+
+struct vm_map {
+    spin_t lock;
+    struct vm_area *root;
+    // All the areas, sorted by address
+    struct list_head areas;
+    size_t count;
+};
+
+void vma_init(struct vm_map *map);
+/**
+ * @brief Drop all the areas of the map. Doesn't touch the page tables
+ */
+void vma_release(struct vm_map *map);
+/**
+ * @brief Copy the area list of `src' to an empty map `dst'
+ */
+int vma_fork(struct vm_map *dst, struct vm_map *src);
+
+/**
+ * @brief Add an area at a fixed address
+ * @return 0 on success,
+ *         -EEXIST if the range overlaps an existing area
+ */
+int vma_insert(struct vm_map *map, uintptr_t start, size_t page_count, uint64_t page_flags, uint32_t flags);
+/**
+ * @brief Find a free range of `page_count' pages in [from, to) and add
+ *        an area there. Areas of MM_HUGE_PAGE_SIZE or more are aligned to
+ *        it when possible
+ * @return Start of the area or MM_NADDR if there's no hole large enough
+ */
+uintptr_t vma_alloc(struct vm_map *map, uintptr_t from, uintptr_t to, size_t page_count, uint64_t page_flags, uint32_t flags);
+/**
+ * @brief Back the area starting at `start' by a file, referencing the
+ *        vnode
+ */
+void vma_set_vnode(struct vm_map *map, uintptr_t start, struct vnode *vn, size_t offset);
+/**
+ * @brief Remove [start, start + page_count pages) from the map, splitting
+ *        areas which are only partially covered
+ * @return 0 on success,
+ *         -ENOMEM if an area has to be split and there's no memory for
+ *         that, the map is left unchanged then
+ */
+int vma_remove(struct vm_map *map, uintptr_t start, size_t page_count);
+/**
+ * @brief Change the page permissions of [start, start + page_count pages),
+ *        splitting areas which are only partially covered
+ * @return 0 on success,
+ *         -ENOMEM if a part of the range is not mapped or there's no
+ *         memory to split the areas
+ */
+int vma_protect(struct vm_map *map, uintptr_t start, size_t page_count, uint64_t page_flags);
+/**
+ * @brief Check if any area overlaps [start, start + page_count pages)
+ */
+int vma_busy(struct vm_map *map, uintptr_t start, size_t page_count);
+/**
+ * @return MM_PAGE_* bits of the area containing `addr', 0 if there's none
+ */
+uint64_t vma_page_flags(struct vm_map *map, uintptr_t addr);
+
+/**
+ * @brief Resolve a fault at a not-present user address or a write to
+ *        a read-only page of a private file mapping
+ * @return 0 if the page was mapped, -1 if the access is invalid or
+ *         there's no memory for the page
+ */
+int vma_fault(struct process *proc, uintptr_t addr, int write);
@@ -28,8 +28,69 @@ void mm_space_free(struct process *proc);
 
 void mm_describe(const mm_space_t pd);
 
+// Returns -ENOMEM if a paging structure couldn't be allocated
 int mm_map_single(mm_space_t pd, uintptr_t virt_page, uintptr_t phys_page, uint64_t flags);
 uintptr_t mm_umap_single(mm_space_t pd, uintptr_t virt_page, uint32_t size);
 uintptr_t mm_map_get(mm_space_t pd, uintptr_t virt, uint64_t *rflags);
 
+/**
+ * @brief Called for every page removed by mm_umap_range(), once it's no
+ *        longer reachable through the TLB
+ * @param last Set if the page table entry was the last reference
+ */
+typedef void (*mm_release_t) (uintptr_t phys, int last, void *arg);
+
+/**
+ * @brief Map a huge page at `virt'. Both addresses must be aligned to
+ *        MM_HUGE_PAGE_SIZE. Each of the 4KiB pages gets a reference
+ * @return 0 on success, -1 if the page table for the range already exists
+ */
+int mm_map_huge(mm_space_t pd, uintptr_t virt, uintptr_t phys, uint64_t flags);
+/**
+ * @brief Check if mm_map_huge() can be used at `virt': neither a page
+ *        table nor a huge page is there yet
+ */
+int mm_huge_free(mm_space_t pd, uintptr_t virt);
+/**
+ * @brief Handle a write to a read-only private huge page: claim it if
+ *        nobody else maps it or copy it. If there's no contiguous memory
+ *        for the copy, the mapping is split into 4KiB pages instead
+ * @return 0 if the page is writable now, -1 if it was split
+ */
+int mm_huge_cow(mm_space_t pd, uintptr_t virt);
+/**
+ * @brief Give the space its own copy of the page table for `virt' if
+ *        it's still shared with a fork()ed process
+ * @return 0 if the table was shared, -ENOMEM if it couldn't be copied,
+ *         -1 otherwise
+ */
+int mm_pt_unshare(mm_space_t pd, uintptr_t virt);
+
+/**
+ * @brief Map `count' pages at `virt' to `phys[0 .. count - 1]', walking
+ *        the paging structures once per page table. Aligned runs of
+ *        contiguous user pages are mapped as huge pages
+ * @return 0 on success, -ENOMEM if a paging structure couldn't be
+ *         allocated (the pages before that one are left mapped)
+ */
+int mm_map_range(mm_space_t pd, uintptr_t virt, const uintptr_t *phys, size_t count, uint64_t flags);
+/**
+ * @brief Allocate `count' zeroed pages of `usage' and map them at `virt',
+ *        using huge pages for the aligned parts of user ranges when
+ *        there's enough contiguous memory
+ */
+int mm_map_range_alloc(mm_space_t pd, uintptr_t virt, size_t count, int usage, uint64_t flags);
+/**
+ * @brief Unmap whatever is mapped in [virt, virt + count pages),
+ *        invalidating the TLB in batches. Huge pages which are only
+ *        partially covered are split first
+ */
+void mm_umap_range(mm_space_t pd, uintptr_t virt, size_t count, mm_release_t release, void *arg);
+/**
+ * @brief Change permissions of the present pages in a range. Write access
+ *        can only be removed this way. Huge pages which are only
+ *        partially covered are split first
+ */
+void mm_protect_range(mm_space_t pd, uintptr_t virt, size_t count, uint64_t flags);
+
 void userptr_check(const void *ptr);
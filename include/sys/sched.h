@@ -1,5 +1,6 @@
 #pragma once
 enum thread_state;
+struct sched_class;
 struct thread;
 
 extern int sched_ncpus;
@@ -7,13 +8,22 @@ extern int sched_ready;
 
 void sched_queue(struct thread *thr);
 void sched_unqueue(struct thread *thr, enum thread_state new_state);
+void sched_queue_to(struct thread *thr, int cpu_no);
+#if defined(AMD64_SMP)
+int sched_migrate(struct thread *thr, int cpu_no);
+#endif
 
 void sched_set_ncpus(int ncpus);
 
+const struct sched_class *sched_class_find(const char *name);
+// `param' is the priority for realtime class and nice value for fair one
+int sched_set_policy(struct thread *thr, const struct sched_class *cls, int param);
+
 void sched_debug_cycle(uint64_t delta_ms);
 void sched_reboot(unsigned int cmd);
 
 void yield(void);
+void sched_yield(void);
 
 void sched_init(void);
 void sched_enter(void);
@@ -0,0 +1,58 @@
+#pragma once
+#include "sys/types.h"
+#include "sys/list.h"
+#include "sys/spin.h"
+
+#define SCHED_RT_PRIO_COUNT     32
+#define SCHED_RT_SLICE          10000000ULL     // 10ms
+
+#define SCHED_FAIR_NICE_MIN     -20
+#define SCHED_FAIR_NICE_MAX     19
+#define SCHED_FAIR_SLICE        4000000ULL      // 4ms
+// How far behind the queue's minimum a waking thread may be placed, so
+// that sleepers don't get to monopolize the CPU once they're woken up
+#define SCHED_FAIR_WAKEUP_BONUS 2000000LL       // 2ms
+// Minimum virtual runtime lead for a thread to preempt a running one
+#define SCHED_FAIR_WAKEUP_GRAN  1000000LL       // 1ms
+
+// sched_class::enqueue() flags
+#define SCHED_ENQ_WAKEUP        (1 << 0)
+
+struct thread;
+
+struct sched_queue {
+    spin_t lock;
+    size_t size;                // All the queued threads, including the running one
+
+    // Realtime class: a FIFO per priority level, bits are set for
+    // non-empty levels
+    uint32_t rt_bitmap;
+    struct list_head rt_queues[SCHED_RT_PRIO_COUNT];
+
+    // Fair class: ordered by virtual runtime
+    struct list_head fair_queue;
+    int64_t fair_min_vruntime;
+};
+
+// All the operations are called with the queue locked
+struct sched_class {
+    const char *name;
+
+    void (*enqueue)(struct sched_queue *q, struct thread *thr, int flags);
+    void (*dequeue)(struct sched_queue *q, struct thread *thr);
+    // Returns the best runnable thread of the class (or NULL). Threads
+    // which are live on some CPU are skipped, except for `from'
+    struct thread *(*pick)(struct sched_queue *q, struct thread *from);
+    // Charges `delta' nanoseconds of CPU time to a thread running from
+    // the queue. Returns nonzero when its time slice is used up
+    int (*charge)(struct sched_queue *q, struct thread *thr, uint64_t delta);
+    // Whether a thread should preempt a running one of the same class
+    int (*preempt)(const struct thread *thr, const struct thread *cur);
+};
+
+// In order of precedence
+extern const struct sched_class sched_class_rt;
+extern const struct sched_class sched_class_fair;
+
+void sched_rt_queue_init(struct sched_queue *q);
+void sched_fair_queue_init(struct sched_queue *q);
@@ -21,6 +21,15 @@ int sys_pipe(int *filedes);
 int sys_select(int n, fd_set *inp, fd_set *outp, fd_set *excp, struct timeval *tv);
 int sys_dup(int from);
 int sys_dup2(int from, int to);
+int sys_fcntl(int fd, int cmd, uintptr_t arg);
+ssize_t sys_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+ssize_t sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+struct epoll_event;
+int sys_epoll_create(int size);
+int sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int sys_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
 int sys_chmod(const char *path, mode_t mode);
 int sys_chown(const char *path, uid_t uid, gid_t gid);
 off_t sys_lseek(int fd, off_t offset, int whence);
@@ -4,6 +4,7 @@
 #include "arch/amd64/cpu.h"
 #endif
 #include "user/signum.h"
+#include "sys/mem/vma.h"
 #include "sys/wait.h"
 #include "sys/list.h"
 #include "fs/vfs.h"
@@ -49,6 +50,19 @@ static inline int signal_is_exception(int signum) {
 }
 
 struct process;
+struct sched_class;
+
+struct sched_stat {
+    uint64_t runtime;           // Total CPU time, ns
+    uint64_t nvcsw;             // Switched away by blocking or yielding
+    uint64_t nivcsw;            // Preempted
+    uint64_t nwakeups;
+    uint64_t wait_total;        // Wakeup-to-run latency, ns
+    uint64_t wait_max;
+
+    uint64_t run_start;         // When the thread got the CPU
+    uint64_t wakeup_time;       // When the thread got queued, 0 if already ran
+};
 
 struct thread {
     // Platform data and context
@@ -70,14 +84,26 @@ struct thread {
     uint64_t sigq;
 
     uint32_t flags;
+    // Nesting of vnode_lookup_enter()
+    int vnode_lookups;
 
     // Scheduler
-    int cpu;
-    struct thread *sched_prev, *sched_next;
+    int cpu;                    // Run queue the thread is in, -1 if none
+    int on_cpu;                 // Set while the thread's context is live on a CPU
+    int wakeup_pending;         // Woken up before it got to sleep, see sched_unqueue()
+    const struct sched_class *sched_class;
+    int sched_prio;             // Realtime class priority, higher runs first
+    int sched_nice;             // Fair class weight
+    int64_t sched_vruntime;
+    uint64_t sched_slice;       // Time left of the current slice, ns
+    struct list_head sched_link;
+    struct sched_stat sched_stat;
 };
 
 struct process {
     mm_space_t space;
+    // Areas of the user address space which are in use
+    struct vm_map vm;
     size_t image_end;
     size_t brk;
 
@@ -86,6 +112,8 @@ struct process {
     // Threads
     struct list_head thread_list;
     size_t thread_count;
+    // Guards thread_list against threads being added while it's walked
+    spin_t thread_lock;
 
     // Shared memory
     struct list_head shm_list;
@@ -3,20 +3,63 @@
 #include "sys/spin.h"
 #include "sys/list.h"
 
+#define IO_WAIT_EXCLUSIVE       (1 << 0)
+#define IO_WAIT_WOKEN           (1 << 1)
+
 struct io_notify {
     spin_t lock;
-    struct thread *owner;
+    // Notifications nobody was waiting for
     size_t value;
+    // Timer sleep list
+    struct list_head link;
+    // io_waiter list: non-exclusive waiters first, then the exclusive
+    // ones in the order they came
+    struct list_head waiters;
+    // io_watch list
+    struct list_head watchers;
+};
+
+// A thread blocked on a notification. thread_wait_io() keeps it on the
+// stack, thread_wait_io_add() allocates one per notification and links
+// it to the thread's wait_head
+struct io_waiter {
+    struct thread *thread;
+    struct io_notify *notify;
+    uint32_t flags;
     struct list_head link, own_link;
 };
 
+// Callback run by every thread_notify_io() of a notification, lets any
+// number of event queues follow it without waiting on it. Called with
+// the notification's lock held and possibly from an interrupt, so it
+// must not block
+struct io_watch {
+    void (*func) (struct io_watch *w);
+    struct io_notify *notify;
+    struct list_head link;
+};
+
 // Multiple-notifier wait
-void thread_wait_io_add(struct thread *t, struct io_notify *n);
+int thread_wait_io_add(struct thread *t, struct io_notify *n);
 int thread_wait_io_any(struct thread *t, struct io_notify **r_n);
 void thread_wait_io_clear(struct thread *t);
 
-// Wait for single specific I/O notification
+// Wait for single specific I/O notification. Any number of threads may
+// wait on the same one: a notification wakes all of the non-exclusive
+// waiters and the first exclusive one, so that e.g. only one of the
+// threads blocked in accept() or read() gets to run for a single event
 int thread_wait_io(struct thread *t, struct io_notify *n);
+int thread_wait_io_exclusive(struct thread *t, struct io_notify *n);
 void thread_notify_io(struct io_notify *n);
+// Wakes every waiter, exclusive or not (EOF, hangup)
+void thread_notify_io_all(struct io_notify *n);
+// Unlocked check, only a hint
+static inline int thread_io_has_waiters(struct io_notify *n) {
+    return !list_empty(&n->waiters);
+}
 
 void thread_wait_io_init(struct io_notify *n);
+
+void thread_io_watch_add(struct io_notify *n, struct io_watch *w, void (*func) (struct io_watch *));
+// Once this returns, the callback is not running and won't be called again
+void thread_io_watch_del(struct io_watch *w);
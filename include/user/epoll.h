@@ -0,0 +1,28 @@
+#pragma once
+#include "sys/types.h"
+
+// epoll_ctl() operations
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+// Events
+#define EPOLLIN         (1 << 0)
+#define EPOLLOUT        (1 << 2)
+#define EPOLLERR        (1 << 3)
+#define EPOLLHUP        (1 << 4)
+// Flags
+#define EPOLLONESHOT    (1 << 30)
+#define EPOLLET         (1U << 31)
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+} __attribute__((packed));
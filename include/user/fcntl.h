@@ -42,3 +42,5 @@
 // fcntl() commands
 #define F_GETFD         1
 #define F_SETFD         2
+#define F_SETPIPE_SZ    1031
+#define F_GETPIPE_SZ    1032
@@ -18,6 +18,8 @@
 #define SOCK_RAW        3
 
 /* sockopts */
+#define SO_SNDBUF       7
+#define SO_RCVBUF       8
 #define SO_BINDTODEVICE 25
 
 #define SA_MAX_SIZE     64
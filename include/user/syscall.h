@@ -7,6 +7,7 @@
 #define SYSCALL_NR_FSTATAT          4
 #define SYSCALL_NR_LSEEK            8
 #define SYSCALL_NR_MMAP             9
+#define SYSCALL_NR_MPROTECT         10
 #define SYSCALL_NR_MUNMAP           11
 #define SYSCALL_NRX_SBRK            12
 #define SYSCALL_NR_IOCTL            16
@@ -15,6 +16,8 @@
 #define SYSCALL_NR_SELECT           23
 #define SYSCALL_NR_DUP              32
 #define SYSCALL_NR_DUP2             33
+#define SYSCALL_NR_SENDFILE         40
+#define SYSCALL_NR_FCNTL            72
 #define SYSCALL_NR_TRUNCATE         76
 #define SYSCALL_NR_FTRUNCATE        77
 #define SYSCALL_NR_GETCWD           79
@@ -27,6 +30,12 @@
 #define SYSCALL_NR_READLINKAT       91
 #define SYSCALL_NR_CHOWN            92
 #define SYSCALL_NR_MKNOD            133
+// Linux numbers are beyond the table
+#define SYSCALL_NRX_SPLICE          251
+#define SYSCALL_NRX_TEE             252
+#define SYSCALL_NR_EPOLL_CREATE     213
+#define SYSCALL_NR_EPOLL_WAIT       232
+#define SYSCALL_NR_EPOLL_CTL        233
 
 #define SYSCALL_NR_SHMGET           113
 #define SYSCALL_NR_SHMAT            114
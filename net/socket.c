@@ -23,6 +23,22 @@ struct io_notify *socket_get_rx_notify(struct socket *sock) {
     return sock->op->get_rx_notify(sock);
 }
 
+int socket_can_send(struct socket *sock) {
+    _assert(sock->op);
+    if (!sock->op->can_send) {
+        return 1;
+    }
+    return !!sock->op->can_send(sock);
+}
+
+struct io_notify *socket_get_tx_notify(struct socket *sock) {
+    _assert(sock->op);
+    if (!sock->op->get_tx_notify) {
+        return NULL;
+    }
+    return sock->op->get_tx_notify(sock);
+}
+
 int net_open(struct vfs_ioctx *ioctx, struct ofile *fd, int dom, int type, int proto) {
     struct socket_class *cls, *iter;
 
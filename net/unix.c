@@ -14,6 +14,10 @@
 #include "fs/node.h"
 #include "fs/vfs.h"
 
+// Per direction of a connection, can be changed with SO_SNDBUF/SO_RCVBUF
+#define UNIX_BUFFER_SIZE        (32 * 1024)
+#define UNIX_BUFFER_MAX         (1024 * 1024)
+
 // TODO: check for possible races
 // TODO: SOCK_DGRAM
 static int unix_class_supports(int proto) {
@@ -31,8 +35,11 @@ static ssize_t unix_socket_sendto(struct socket *s,
 static ssize_t unix_socket_recvfrom(struct socket *s,
                                     void *buf, size_t lim,
                                     struct sockaddr *dst, size_t *salen);
+static int unix_socket_setsockopt(struct socket *s, int optname, void *optval, size_t optlen);
 static int unix_socket_count_pending(struct socket *s);
 static struct io_notify *unix_socket_get_rx_notify(struct socket *s);
+static int unix_socket_can_send(struct socket *s);
+static struct io_notify *unix_socket_get_tx_notify(struct socket *s);
 
 static struct sockops unix_socket_ops = {
     .open =     unix_socket_open,
@@ -43,11 +50,14 @@ static struct sockops unix_socket_ops = {
 
     .bind =     unix_socket_bind,
     .connect =  unix_socket_connect,
+    .setsockopt = unix_socket_setsockopt,
 
     .accept =   unix_socket_accept,
 
     .count_pending = unix_socket_count_pending,
     .get_rx_notify = unix_socket_get_rx_notify,
+    .can_send = unix_socket_can_send,
+    .get_tx_notify = unix_socket_get_tx_notify,
 };
 static struct socket_class unix_socket_class = {
     .name =     "unix",
@@ -64,16 +74,22 @@ static ssize_t unix_conn_recvfrom(struct socket *s,
                                   void *buf, size_t lim,
                                   struct sockaddr *dst, size_t *salen);
 static void unix_conn_close(struct socket *s);
+static int unix_conn_setsockopt(struct socket *s, int optname, void *optval, size_t optlen);
 static int unix_conn_count_pending(struct socket *sock);
 static struct io_notify *unix_conn_get_rx_notify(struct socket *sock);
+static int unix_conn_can_send(struct socket *sock);
+static struct io_notify *unix_conn_get_tx_notify(struct socket *sock);
 
 static struct sockops unix_conn_ops = {
     .sendto =   unix_conn_sendto,
     .recvfrom = unix_conn_recvfrom,
     .close =    unix_conn_close,
+    .setsockopt = unix_conn_setsockopt,
 
     .count_pending = unix_conn_count_pending,
     .get_rx_notify = unix_conn_get_rx_notify,
+    .can_send = unix_conn_can_send,
+    .get_tx_notify = unix_conn_get_tx_notify,
 };
 
 ////
@@ -138,6 +154,7 @@ static void unix_socket_close(struct socket *sock) {
         struct vnode *vn = data->vnode;
         _assert(vn);
         vn->fs_data = NULL;
+        vnode_unref(vn);
     } else {
         kdebug("Closing non-server socket\n");
         // Hangup connection
@@ -156,6 +173,8 @@ static void unix_socket_close(struct socket *sock) {
 
             if (!conn->server) {
                 kinfo("Client side removes the connection\n");
+                ring_fini(&conn->client_tx);
+                ring_fini(&conn->server_tx);
                 memset(conn, 0, sizeof(struct unix_conn));
                 kfree(conn);
             }
@@ -171,8 +190,10 @@ static int unix_socket_count_pending(struct socket *sock) {
 
     if (data->type == 1) {
         return !!data->remote;
+    } else if (data->remote) {
+        return ring_readable(&data->remote->server_tx);
     } else {
-        panic("TODO\n");
+        return 0;
     }
 }
 
@@ -182,8 +203,36 @@ static struct io_notify *unix_socket_get_rx_notify(struct socket *sock) {
 
     if (data->type == 1) {
         return &data->client_notify;
+    } else if (data->remote) {
+        return &data->remote->server_tx.wait;
+    } else {
+        return NULL;
+    }
+}
+
+// Servers can't be written to. A terminated connection is reported as
+// writable, so the writer gets ECONNRESET instead of waiting forever
+static int unix_socket_can_send(struct socket *sock) {
+    struct unix_socket *data = sock->data;
+    _assert(data);
+
+    if (data->type == 1 || !data->remote) {
+        return 0;
+    } else if (data->remote->state != STATE_ESTABLISHED) {
+        return 1;
     } else {
-        panic("TODO\n");
+        return !!ring_writable(&data->remote->client_tx);
+    }
+}
+
+static struct io_notify *unix_socket_get_tx_notify(struct socket *sock) {
+    struct unix_socket *data = sock->data;
+    _assert(data);
+
+    if (data->type == 1 || !data->remote) {
+        return NULL;
+    } else {
+        return &data->remote->client_tx.writer_wait;
     }
 }
 
@@ -204,14 +253,59 @@ static void unix_conn_close(struct socket *s) {
 
     if (!conn->client) {
         _assert(conn->server->remote_count > 0);
-        --conn->server->remote_count;
+        __atomic_sub_fetch(&conn->server->remote_count, 1, __ATOMIC_RELAXED);
 
         kinfo("Server side removes the connection\n");
+        ring_fini(&conn->client_tx);
+        ring_fini(&conn->server_tx);
         memset(conn, 0, sizeof(struct unix_conn));
         kfree(conn);
     }
 }
 
+// SO_SNDBUF/SO_RCVBUF resize the ring of the corresponding direction
+static int unix_ring_setsockopt(struct ring *tx, struct ring *rx, int optname, void *optval, size_t optlen) {
+    struct ring *r;
+    int size;
+
+    switch (optname) {
+    case SO_SNDBUF:
+        r = tx;
+        break;
+    case SO_RCVBUF:
+        r = rx;
+        break;
+    default:
+        return -ENOPROTOOPT;
+    }
+
+    if (optlen < sizeof(int)) {
+        return -EINVAL;
+    }
+    size = *(int *) optval;
+    if (size <= 0 || size > UNIX_BUFFER_MAX) {
+        return -EINVAL;
+    }
+
+    return ring_resize(r, size);
+}
+
+static int unix_conn_setsockopt(struct socket *s, int optname, void *optval, size_t optlen) {
+    struct unix_conn *conn = s->data;
+    _assert(conn);
+    return unix_ring_setsockopt(&conn->server_tx, &conn->client_tx, optname, optval, optlen);
+}
+
+static int unix_socket_setsockopt(struct socket *s, int optname, void *optval, size_t optlen) {
+    struct unix_socket *data = s->data;
+    _assert(data);
+
+    if (data->type != 0 || !data->remote) {
+        return -ENOTCONN;
+    }
+    return unix_ring_setsockopt(&data->remote->client_tx, &data->remote->server_tx, optname, optval, optlen);
+}
+
 static int unix_conn_count_pending(struct socket *sock) {
     struct unix_conn *conn = sock->data;
     _assert(conn);
@@ -229,6 +323,23 @@ static struct io_notify *unix_conn_get_rx_notify(struct socket *sock) {
     return &conn->client_tx.wait;
 }
 
+static int unix_conn_can_send(struct socket *sock) {
+    struct unix_conn *conn = sock->data;
+    _assert(conn);
+
+    if (conn->state != STATE_ESTABLISHED) {
+        return 1;
+    }
+
+    return !!ring_writable(&conn->server_tx);
+}
+
+static struct io_notify *unix_conn_get_tx_notify(struct socket *sock) {
+    struct unix_conn *conn = sock->data;
+    _assert(conn);
+    return &conn->server_tx.writer_wait;
+}
+
 
 static int unix_socket_bind(struct socket *sock, struct sockaddr *sa, size_t len) {
     if (sa->sa_family != AF_UNIX) {
@@ -240,20 +351,26 @@ static int unix_socket_bind(struct socket *sock, struct sockaddr *sa, size_t len
     struct unix_socket *data = sock->data;
     _assert(data);
 
+    vnode_lookup_enter();
     // If socket already exists
     if ((res = vfs_find(&thread_self->proc->ioctx, NULL, sun->sun_path, 0, &data->vnode)) == 0) {
         data->vnode = NULL;
+        vnode_lookup_leave();
         return -EADDRINUSE;
     }
 
     // Create socket vnode
     if ((res = vfs_mknod(&thread_self->proc->ioctx, sun->sun_path, 0777 | S_IFSOCK, &data->vnode)) != 0) {
+        vnode_lookup_leave();
         return res;
     }
 
     // Setup server socket params
     data->type = 1;
     data->vnode->fs_data = data;
+    // Held until the socket is closed
+    vnode_ref(data->vnode);
+    vnode_lookup_leave();
 
     return 0;
 }
@@ -264,23 +381,40 @@ static int unix_socket_connect(struct socket *sock, struct sockaddr *sa, size_t
     }
     struct sockaddr_un *sun = (struct sockaddr_un *) sa;
     struct unix_socket *data = sock->data;
+    struct unix_socket *server = NULL;
     int res;
     _assert(data);
 
-    if ((res = vfs_find(&thread_self->proc->ioctx, NULL, sun->sun_path, 0, &data->vnode)) != 0) {
-        return -ENOENT;
+    vnode_lookup_enter();
+    if ((res = vfs_find(&thread_self->proc->ioctx, NULL, sun->sun_path, 0, &data->vnode)) == 0) {
+        server = data->vnode->fs_data;
     }
+    data->vnode = NULL;
+    vnode_lookup_leave();
 
-    if (!data->vnode->fs_data) {
+    if (res != 0) {
+        return -ENOENT;
+    }
+    if (!server) {
         return -ECONNREFUSED;
     }
 
     struct unix_conn *conn = kmalloc(sizeof(struct unix_conn));
+    if (!conn) {
+        return -ENOMEM;
+    }
     conn->client = data;
-    conn->server = data->vnode->fs_data;
+    conn->server = server;
     conn->state = STATE_NEW;
-    ring_init(&conn->client_tx, 1024);
-    ring_init(&conn->server_tx, 1024);
+    if (ring_init(&conn->client_tx, UNIX_BUFFER_SIZE) != 0) {
+        kfree(conn);
+        return -ENOMEM;
+    }
+    if (ring_init(&conn->server_tx, UNIX_BUFFER_SIZE) != 0) {
+        ring_fini(&conn->client_tx);
+        kfree(conn);
+        return -ENOMEM;
+    }
 
     // Notify server of connection
     _assert(!conn->server->remote);
@@ -307,18 +441,18 @@ static int unix_socket_accept(struct socket *serv, struct socket *client) {
     data_serv = serv->data;
     _assert(data_serv);
 
-    // Wait for incoming connection attempts
-    //_assert(!(data_serv->remote));
-    while (!(conn = data_serv->remote)) {
-        thread_wait_io(thread_self, &data_serv->client_notify);
+    // Wait for incoming connection attempts. Any number of threads may
+    // accept() on the same socket: each attempt wakes one of them, and
+    // whoever takes it first gets it
+    while (!(conn = __atomic_exchange_n(&data_serv->remote, NULL, __ATOMIC_ACQ_REL))) {
+        thread_wait_io_exclusive(thread_self, &data_serv->client_notify);
     }
-    data_serv->remote = NULL;
 
     // Setup client socket
     client->data = conn;
     client->op = &unix_conn_ops;
     client->ioctx = serv->ioctx;
-    ++data_serv->remote_count;
+    __atomic_add_fetch(&data_serv->remote_count, 1, __ATOMIC_RELAXED);
 
     // Acknowledge connection attempt
     conn->state = STATE_PRE_ESTABLISHED;
@@ -333,30 +467,6 @@ static int unix_socket_accept(struct socket *serv, struct socket *client) {
     return 0;
 }
 
-static ssize_t unix_ring_recv(struct ring *r, void *buf, size_t lim) {
-    size_t rd = 0;
-    char c;
-    size_t rem = lim;
-    char *wr = buf;
-
-    while (rem) {
-        if (ring_getc(thread_self, r, &c, 0) < 0) {
-            break;
-        }
-
-        *wr++ = c;
-        ++rd;
-        --rem;
-
-        if (!ring_readable(r) && (r->flags & RING_SIGNAL_RET)) {
-            r->flags &= ~RING_SIGNAL_RET;
-            return rd;
-        }
-    }
-
-    return rd;
-}
-
 static ssize_t unix_socket_sendto(struct socket *s,
                                   const void *buf, size_t lim,
                                   struct sockaddr *dst, size_t salen) {
@@ -386,7 +496,7 @@ static ssize_t unix_socket_recvfrom(struct socket *s,
     if (conn->state != STATE_ESTABLISHED && !ring_readable(&conn->server_tx)) {
         return -ECONNRESET;
     }
-    return unix_ring_recv(&conn->server_tx, buf, lim);
+    return ring_read(thread_self, &conn->server_tx, buf, lim);
 }
 
 static ssize_t unix_conn_sendto(struct socket *s,
@@ -412,7 +522,7 @@ static ssize_t unix_conn_recvfrom(struct socket *s,
     if (conn->state != STATE_ESTABLISHED && !ring_readable(&conn->client_tx)) {
         return -ECONNRESET;
     }
-    return unix_ring_recv(&conn->client_tx, buf, lim);
+    return ring_read(thread_self, &conn->client_tx, buf, lim);
 }
 
 ////
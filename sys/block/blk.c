@@ -1,4 +1,6 @@
+#include "arch/amd64/hw/timer.h"
 #include "sys/block/part_gpt.h"
+#include "sys/mem/phys.h"
 #include "user/errno.h"
 #include "sys/block/blk.h"
 #include "fs/node.h"
@@ -7,11 +9,21 @@
 #include "sys/string.h"
 #include "fs/fs.h"
 #include "sys/debug.h"
+#include "sys/thread.h"
+#include "sys/sched.h"
+#include "sys/wait.h"
+#include "user/time.h"
 #include "sys/heap.h"
 #include "sys/dev.h"
 #include "sys/mm.h"
 
 static struct block_cache *g_cache_head = NULL, *g_cache_tail = NULL;
+static spin_t g_cache_lock = 0;
+
+static struct process blk_writeback_proc = {0};
+static struct io_notify blk_writeback_notify;
+static int blk_writeback_running = 0;
+static int blk_writeback_kicked = 0;
 
 struct blk_part {
     struct blkdev *device;
@@ -20,11 +32,16 @@ struct blk_part {
 };
 
 void blk_set_cache(struct blkdev *blk, size_t page_capacity) {
+    uintptr_t irq;
     _assert(blk);
     _assert(!(blk->flags & BLK_CACHE));
 
     block_cache_init(&blk->cache, blk, MM_PAGE_SIZE, page_capacity);
+    blk->ra_last = (size_t) -1;
+    blk->ra_window = 0;
+    blk->ra_end = 0;
 
+    spin_lock_irqsave(&g_cache_lock, &irq);
     if (g_cache_tail) {
         g_cache_tail->g_next = &blk->cache;
     } else {
@@ -33,15 +50,17 @@ void blk_set_cache(struct blkdev *blk, size_t page_capacity) {
     blk->cache.g_prev = g_cache_tail;
     blk->cache.g_next = NULL;
     g_cache_tail = &blk->cache;
+    spin_release_irqrestore(&g_cache_lock, &irq);
 
     blk->flags |= BLK_CACHE;
 }
 
 void blk_cache_release(struct blkdev *blk) {
+    uintptr_t irq;
     _assert(blk->flags & BLK_CACHE);
     struct block_cache *cache = &blk->cache;
-    block_cache_flush(cache);
 
+    spin_lock_irqsave(&g_cache_lock, &irq);
     struct block_cache *prev = cache->g_prev;
     struct block_cache *next = cache->g_next;
 
@@ -56,19 +75,111 @@ void blk_cache_release(struct blkdev *blk) {
     } else {
         g_cache_tail = prev;
     }
+    spin_release_irqrestore(&g_cache_lock, &irq);
+
+    // Wait for writeback/sync to finish with the cache
+    while (__atomic_load_n(&cache->g_users, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
 
+    block_cache_flush(cache);
     block_cache_release(cache);
 
     blk->flags &= ~BLK_CACHE;
 }
 
+// Returns the n-th cache in the global list with a user reference
+// held. The list may change while the cache is written back, so it's
+// not walked by the next pointers
+static struct block_cache *blk_cache_nth(size_t n) {
+    struct block_cache *cache;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&g_cache_lock, &irq);
+    for (cache = g_cache_head; cache && n; cache = cache->g_next, --n);
+    if (cache) {
+        __atomic_add_fetch(&cache->g_users, 1, __ATOMIC_ACQUIRE);
+    }
+    spin_release_irqrestore(&g_cache_lock, &irq);
+
+    return cache;
+}
+
+static inline void blk_cache_unref(struct block_cache *cache) {
+    __atomic_sub_fetch(&cache->g_users, 1, __ATOMIC_RELEASE);
+}
+
+void blk_sync(struct blkdev *blk) {
+    if (blk->flags & BLK_CACHE) {
+        block_cache_writeback(&blk->cache, (uint64_t) -1, 0);
+    }
+}
+
 void blk_sync_all(void) {
+    struct block_cache *cache;
+
     kdebug("Global cache sync\n");
-    for (struct block_cache *cache = g_cache_head; cache; cache = cache->g_next) {
-        block_cache_flush(cache);
+    for (size_t i = 0; (cache = blk_cache_nth(i)); ++i) {
+        block_cache_writeback(cache, (uint64_t) -1, 0);
+        blk_cache_unref(cache);
     }
 }
 
+void blk_writeback_kick(void) {
+    if (!blk_writeback_running) {
+        return;
+    }
+    if (!__atomic_exchange_n(&blk_writeback_kicked, 1, __ATOMIC_ACQ_REL)) {
+        thread_notify_io(&blk_writeback_notify);
+    }
+}
+
+static void *blk_writeback_daemon(void *arg) {
+    struct thread *thr = thread_self;
+    struct block_cache *cache;
+    struct io_notify *result;
+    uint64_t expire;
+
+    kinfo("Block writeback daemon started\n");
+
+    while (1) {
+        // Wait for either a kick or the next periodic pass
+        list_head_init(&thr->wait_head);
+        thr->sleep_notify.value = 0;
+        thr->sleep_deadline = system_time + BLK_WRITEBACK_INTERVAL;
+        if (thread_wait_io_add(thr, &blk_writeback_notify) != 0 ||
+            thread_wait_io_add(thr, &thr->sleep_notify) != 0) {
+            // Out of memory, just do the periodic pass
+            thread_wait_io_clear(thr);
+            thread_sleep(thr, thr->sleep_deadline, NULL);
+        } else {
+            timer_add_sleep(thr);
+            thread_wait_io_any(thr, &result);
+            timer_remove_sleep(thr);
+            thread_wait_io_clear(thr);
+        }
+
+        __atomic_store_n(&blk_writeback_kicked, 0, __ATOMIC_RELEASE);
+
+        // Write the pages which have been dirty for too long, and then
+        // the oldest ones until the cache is below its dirty limit
+        expire = system_time > BLK_DIRTY_EXPIRE ? system_time - BLK_DIRTY_EXPIRE : 0;
+        for (size_t i = 0; (cache = blk_cache_nth(i)); ++i) {
+            block_cache_writeback(cache, expire, BLOCK_CACHE_DIRTY_LIMIT(cache));
+            blk_cache_unref(cache);
+        }
+    }
+
+    panic("This code should not run\n");
+}
+
+void blk_writeback_start(void) {
+    thread_wait_io_init(&blk_writeback_notify);
+    _assert(process_init_thread(&blk_writeback_proc, (uintptr_t) blk_writeback_daemon, NULL, 0) == 0);
+    blk_writeback_running = 1;
+    sched_queue(process_first_thread(&blk_writeback_proc));
+}
+
 int blk_mmap(struct blkdev *blk, uintptr_t base, size_t page_count, int prot, int flags) {
     _assert(blk);
     if (blk->mmap) {
@@ -86,35 +197,179 @@ static inline ssize_t blk_read_really(struct blkdev *blk, void *buf, size_t off,
     }
 }
 
+// Reads a run of new cache pages with a single device request, through
+// a contiguous bounce buffer. Pages the device couldn't return are
+// dropped from the cache
+static void blk_cache_fill_run(struct blkdev *blk, struct block_cache_page **refs, size_t index, size_t count) {
+    size_t page_size = blk->cache.page_size;
+    uintptr_t bounce = MM_NADDR;
+    size_t valid = 0;
+    ssize_t res;
+
+    if (count > 1) {
+        bounce = mm_phys_alloc_contiguous(count, PU_KERNEL);
+    }
+
+    if (bounce != MM_NADDR) {
+        res = blk_read_really(blk, (void *) MM_VIRTUALIZE(bounce), index * page_size, count * page_size);
+        if (res > 0) {
+            valid = ((size_t) res + page_size - 1) / page_size;
+            // Don't pass on what the bounce buffer held before
+            if ((size_t) res % page_size) {
+                memset((void *) MM_VIRTUALIZE(bounce + res), 0, page_size - (size_t) res % page_size);
+            }
+        }
+        for (size_t i = 0; i < valid; ++i) {
+            memcpy((void *) MM_VIRTUALIZE(refs[i]->page), (void *) MM_VIRTUALIZE(bounce + i * page_size), page_size);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            mm_phys_free_page(bounce + i * page_size);
+        }
+    } else {
+        for (; valid < count; ++valid) {
+            res = blk_read_really(blk, (void *) MM_VIRTUALIZE(refs[valid]->page), (index + valid) * page_size, page_size);
+            if (res <= 0) {
+                break;
+            }
+            if ((size_t) res < page_size) {
+                // End of the device, the rest of the page reads as zeroes
+                memset((void *) MM_VIRTUALIZE(refs[valid]->page + res), 0, page_size - (size_t) res);
+                ++valid;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (i < valid) {
+            block_cache_page_ready(&blk->cache, refs[i]);
+            block_cache_put(&blk->cache, refs[i]);
+        } else {
+            block_cache_page_abort(&blk->cache, refs[i]);
+        }
+    }
+}
+
+// Makes sure pages [index, index + count) are in the cache, reading
+// consecutive missing ones together
+static void blk_cache_fill(struct blkdev *blk, size_t index, size_t count) {
+    struct block_cache_page *refs[BLK_RA_MAX];
+    size_t page_size = blk->cache.page_size;
+    size_t run_start = index, run_len = 0;
+    struct block_cache_page *ref;
+
+    for (size_t i = index; i < index + count; ++i) {
+        if (block_cache_get(&blk->cache, i * page_size, &ref) != 0) {
+            if (!run_len) {
+                run_start = i;
+            }
+            refs[run_len++] = ref;
+
+            if (run_len < BLK_RA_MAX) {
+                continue;
+            }
+        } else {
+            block_cache_put(&blk->cache, ref);
+        }
+
+        if (run_len) {
+            blk_cache_fill_run(blk, refs, run_start, run_len);
+            run_len = 0;
+        }
+    }
+
+    if (run_len) {
+        blk_cache_fill_run(blk, refs, run_start, run_len);
+    }
+}
+
+// Reads a new cache page on its own. Returns 0 or an error, in which
+// case the page is dropped from the cache
+static int blk_cache_read_page(struct blkdev *blk, struct block_cache_page *ref, size_t index) {
+    size_t page_size = blk->cache.page_size;
+    ssize_t res;
+
+    res = blk_read_really(blk, (void *) MM_VIRTUALIZE(ref->page), index * page_size, page_size);
+    if (res <= 0) {
+        kerror("Read failed: %s\n", kstrerror(res ? res : -EIO));
+        block_cache_page_abort(&blk->cache, ref);
+        return res ? res : -EIO;
+    }
+    if ((size_t) res < page_size) {
+        // End of the device, the rest of the page reads as zeroes
+        memset((void *) MM_VIRTUALIZE(ref->page + res), 0, page_size - (size_t) res);
+    }
+
+    return 0;
+}
+
+// Sequential access detection: when a read starts where the previous
+// one has ended, the window is grown and the pages following the
+// request are read together with it
+static void blk_readahead(struct blkdev *blk, size_t first, size_t last) {
+    size_t start, end;
+
+    if (first == blk->ra_last || first == blk->ra_last + 1) {
+        blk->ra_window = blk->ra_window ? MIN(blk->ra_window * 2, BLK_RA_MAX) : BLK_RA_MIN;
+    } else {
+        blk->ra_window = 0;
+        blk->ra_end = 0;
+    }
+    blk->ra_last = last;
+
+    start = first;
+    end = last + 1;
+
+    // Only read ahead again once less than half of the window is left
+    if (blk->ra_window && (blk->ra_end < last + 1 || blk->ra_end - (last + 1) < blk->ra_window / 2)) {
+        end = last + 1 + blk->ra_window;
+        blk->ra_end = end;
+    }
+
+    while (start < end) {
+        size_t count = MIN(end - start, BLK_RA_MAX);
+        blk_cache_fill(blk, start, count);
+        start += count;
+    }
+}
+
 ssize_t blk_read(struct blkdev *blk, void *buf, size_t off, size_t lim) {
     _assert(blk);
 
     if (blk->flags & BLK_CACHE) {
         // Use cache to fetch pages
-        uintptr_t page;
+        struct block_cache_page *ref;
         size_t page_size = blk->cache.page_size;
         size_t rem = lim;
         size_t index = off / page_size;
+        size_t blk_off = off % page_size;
         size_t bread = 0;
         int err;
 
+        if (!lim) {
+            return 0;
+        }
+        blk_readahead(blk, index, (off + lim - 1) / page_size);
+
         while (rem) {
-            size_t blk_off = off % page_size;
             size_t can = MIN(page_size - blk_off, rem);
 
-            if (block_cache_get(&blk->cache, index * page_size, &page) != 0) {
-                // Fetch page from device
-                if ((err = blk_read_really(blk, (void *) MM_VIRTUALIZE(page), index * page_size, page_size)) < 0) {
-                    kerror("Read failed: %s\n", kstrerror(err));
-                    panic("TODO: deal with to-cache reads\n");
+            if (block_cache_get(&blk->cache, index * page_size, &ref) != 0) {
+                // Readahead couldn't get it, or it's been evicted since
+                if ((err = blk_cache_read_page(blk, ref, index)) != 0) {
+                    return bread ? (ssize_t) bread : err;
                 }
+                block_cache_page_ready(&blk->cache, ref);
             }
 
-            memcpy(buf, (void *) MM_VIRTUALIZE(page + blk_off), can);
+            memcpy(buf, (void *) MM_VIRTUALIZE(ref->page + blk_off), can);
+            block_cache_put(&blk->cache, ref);
 
             rem -= can;
             buf += can;
             bread += can;
+            blk_off = 0;
             ++index;
         }
 
@@ -145,31 +400,34 @@ int blk_page_sync(struct blkdev *blk, uintptr_t block_address, uintptr_t page) {
 ssize_t blk_write(struct blkdev *blk, const void *buf, size_t off, size_t lim) {
     _assert(blk);
     if (blk->flags & BLK_CACHE) {
-        uintptr_t page;
+        struct block_cache_page *ref;
         size_t page_size = blk->cache.page_size;
         size_t rem = lim;
         size_t index = off / page_size;
+        size_t blk_off = off % page_size;
         size_t bwritten = 0;
         int err;
 
         while (rem) {
-            size_t blk_off = off % page_size;
             size_t can = MIN(page_size - blk_off, rem);
+            int miss = block_cache_get(&blk->cache, index * page_size, &ref) != 0;
 
-            if (block_cache_get(&blk->cache, index * page_size, &page) != 0) {
-                // Fetch page
-                if ((err = blk_read_really(blk, (void *) MM_VIRTUALIZE(page), index * page_size, page_size)) < 0) {
-                    kerror("Read failed: %s\n", kstrerror(err));
-                    panic("TODO: deal with to-cache reads\n");
-                }
+            // Fetch page, unless it's going to be overwritten as a whole
+            if (miss && can != page_size && (err = blk_cache_read_page(blk, ref, index)) != 0) {
+                return bwritten ? (ssize_t) bwritten : err;
             }
 
-            memcpy((void *) MM_VIRTUALIZE(page + blk_off), buf, can);
-            block_cache_mark_dirty(&blk->cache, index * page_size);
+            memcpy((void *) MM_VIRTUALIZE(ref->page + blk_off), buf, can);
+            block_cache_mark_dirty(&blk->cache, ref);
+            if (miss) {
+                block_cache_page_ready(&blk->cache, ref);
+            }
+            block_cache_put(&blk->cache, ref);
 
             rem -= can;
             buf += can;
             bwritten += can;
+            blk_off = 0;
             ++index;
         }
 
@@ -1,248 +1,438 @@
-// TODO: SMP/thread safety
 #include "sys/block/cache.h"
 #include "sys/block/blk.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
 #include "sys/string.h"
 #include "sys/assert.h"
+#include "sys/sched.h"
 #include "sys/debug.h"
 #include "sys/heap.h"
+#include "user/errno.h"
+#include "user/time.h"
 #include "sys/mm.h"
 
-#define LRU_PAGE_DIRTY          1
-#define LRU_PAGE_MASK           (~LRU_PAGE_DIRTY)
+// Initial index size, it's doubled once there're more than
+// BLOCK_CACHE_LOAD pages per bucket on average
+#define BLOCK_CACHE_BUCKETS_INIT    64
+#define BLOCK_CACHE_LOAD            2
 
-struct lru_node {
-    uintptr_t block_address;
-    union {
-        uintptr_t page;             // For LRU
-        struct lru_node *index;     // For index hash
-    };
-    struct lru_node *prev, *next;
-};
+static struct slab_cache *block_page_cache = NULL;
 
 ////
 
-static inline size_t lru_hash_reference(uintptr_t address) {
-    return address;
+static inline size_t block_cache_hash(uintptr_t address) {
+    // Fibonacci hashing, so that runs of consecutive blocks are spread
+    // across all the buckets
+    return (size_t) ((address * 0x9E3779B97F4A7C15ULL) >> 32);
 }
 
-static struct lru_node *lru_hash_lookup(struct lru_hash *hash, uintptr_t address) {
-    size_t bucket_index = lru_hash_reference(address) % hash->bucket_count;
+static inline spin_t *block_cache_stripe(struct block_cache *cache, size_t hash) {
+    // Bucket count is a power of two and a multiple of the stripe count,
+    // so a bucket is always guarded by the same lock
+    return &cache->hash_locks[hash % BLOCK_CACHE_STRIPES];
+}
+
+// Following functions are called with the page's stripe locked
+static struct block_cache_page *block_cache_lookup(struct block_cache *cache, size_t hash, uintptr_t address) {
+    struct block_cache_page *p;
 
-    for (struct lru_node *node = hash->bucket_heads[bucket_index]; node; node = node->next) {
-        if (node->block_address == address) {
-            return node;
+    for (p = cache->buckets[hash & (cache->bucket_count - 1)]; p; p = p->hash_next) {
+        if (p->address == address) {
+            return p;
         }
     }
 
     return NULL;
 }
 
-static int lru_hash_insert(struct lru_hash *hash, uintptr_t address, struct lru_node *index) {
-    size_t bucket_index = lru_hash_reference(address) % hash->bucket_count;
-    struct lru_node *node = kmalloc(sizeof(struct lru_node));
-    _assert(node);
+static void block_cache_hash_insert(struct block_cache *cache, size_t hash, struct block_cache_page *p) {
+    struct block_cache_page **bucket = &cache->buckets[hash & (cache->bucket_count - 1)];
 
-    node->block_address = address;
-    node->index = index;
+    p->hash_next = *bucket;
+    *bucket = p;
+}
 
-    node->prev = hash->bucket_tails[bucket_index];
-    if (node->prev) {
-        hash->bucket_tails[bucket_index]->next = node;
-    } else {
-        hash->bucket_heads[bucket_index] = node;
-    }
-    hash->bucket_tails[bucket_index] = node;
-    node->next = NULL;
+static void block_cache_hash_remove(struct block_cache *cache, struct block_cache_page *p) {
+    size_t hash = block_cache_hash(p->address);
+    struct block_cache_page **it = &cache->buckets[hash & (cache->bucket_count - 1)];
 
-    return 0;
+    while (*it != p) {
+        _assert(*it);
+        it = &(*it)->hash_next;
+    }
+    *it = p->hash_next;
+    p->hash_next = NULL;
 }
 
-static int lru_hash_remove(struct lru_hash *hash, uintptr_t address) {
-    size_t bucket_index = lru_hash_reference(address) % hash->bucket_count;
-    struct lru_node *node = lru_hash_lookup(hash, address);
-    if (!node) {
-        return -1;
+static void block_cache_hash_grow(struct block_cache *cache) {
+    size_t old_count = cache->bucket_count;
+    size_t new_count = old_count * 2;
+    struct block_cache_page **old, **new;
+    struct block_cache_page *p, *next;
+    uintptr_t irq;
+
+    new = kmalloc(sizeof(struct block_cache_page *) * new_count);
+    if (!new) {
+        // Not fatal, lookups just get slower
+        return;
     }
+    memset(new, 0, sizeof(struct block_cache_page *) * new_count);
 
-    struct lru_node *prev = node->prev;
-    struct lru_node *next = node->next;
+    spin_lock_irqsave(&cache->hash_locks[0], &irq);
+    for (size_t i = 1; i < BLOCK_CACHE_STRIPES; ++i) {
+        spin_lock(&cache->hash_locks[i]);
+    }
 
-    if (prev) {
-        prev->next = next;
+    if (cache->bucket_count != old_count) {
+        // Someone else has already done it
+        old = new;
     } else {
-        hash->bucket_heads[bucket_index] = next;
+        old = cache->buckets;
+        for (size_t i = 0; i < old_count; ++i) {
+            for (p = old[i]; p; p = next) {
+                next = p->hash_next;
+                size_t index = block_cache_hash(p->address) & (new_count - 1);
+                p->hash_next = new[index];
+                new[index] = p;
+            }
+        }
+        cache->buckets = new;
+        cache->bucket_count = new_count;
     }
-    if (next) {
-        next->prev = prev;
-    } else {
-        hash->bucket_tails[bucket_index] = prev;
+
+    for (size_t i = BLOCK_CACHE_STRIPES - 1; i > 0; --i) {
+        spin_release(&cache->hash_locks[i]);
     }
+    spin_release_irqrestore(&cache->hash_locks[0], &irq);
 
-    kfree(node);
+    kfree(old);
+}
 
-    return 0;
+////
+
+static uintptr_t block_cache_page_alloc(struct block_cache *cache) {
+    // Other sizes are not supported
+    _assert(cache->page_size == MM_PAGE_SIZE);
+    return mm_phys_alloc_page(PU_CACHE);
 }
 
-static void lru_hash_init(struct lru_hash *hash, size_t capacity) {
-    hash->bucket_count = capacity;
-    hash->bucket_heads = kmalloc(sizeof(struct lru_node *) * capacity);
-    hash->bucket_tails = kmalloc(sizeof(struct lru_node *) * capacity);
-    _assert(hash->bucket_tails && hash->bucket_heads);
-    memset(hash->bucket_heads, 0, sizeof(struct lru_node *) * capacity);
-    memset(hash->bucket_tails, 0, sizeof(struct lru_node *) * capacity);
+static void block_cache_page_destroy(struct block_cache *cache, struct block_cache_page *p) {
+    _assert(!p->refcount);
+    _assert(!(p->flags & BLOCK_PAGE_DIRTY));
+    _assert(list_empty(&p->dirty_link));
+
+    mm_phys_free_page(p->page);
+    slab_free(block_page_cache, p);
+    __atomic_sub_fetch(&cache->size, 1, __ATOMIC_RELAXED);
+}
+
+// Second chance LRU: pages referenced since the last scan are moved
+// back to the head. Dirty pages are skipped, they're left to the
+// writeback thread. Returns 0 if a page was evicted
+static int block_cache_evict(struct block_cache *cache) {
+    struct block_cache_page *p, *victim = NULL;
+    uintptr_t irq, hash_irq;
+    spin_t *lock;
+    size_t scan;
+
+    spin_lock_irqsave(&cache->lru_lock, &irq);
+    // Enough to see every page twice: the first time its "referenced"
+    // bit may just get cleared
+    scan = cache->size * 2;
+
+    while (scan-- && !list_empty(&cache->lru)) {
+        p = list_entry(cache->lru.prev, struct block_cache_page, lru);
+        list_del(&p->lru);
+        list_add(&p->lru, &cache->lru);
+
+        if (__atomic_fetch_and(&p->flags, ~BLOCK_PAGE_REFERENCED, __ATOMIC_SEQ_CST) & BLOCK_PAGE_REFERENCED) {
+            continue;
+        }
+        // Only checked locklessly to avoid taking the stripe lock for
+        // pages which are in use
+        if ((__atomic_load_n(&p->flags, __ATOMIC_ACQUIRE) & BLOCK_PAGE_DIRTY) ||
+            __atomic_load_n(&p->refcount, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        // Lookups only take references under the lock, so the page
+        // cannot be picked up while we're unhashing it. Writeback takes
+        // its reference before clearing the dirty bit, so the bit is
+        // tested first: once it's seen clear, the reference is visible
+        lock = block_cache_stripe(cache, block_cache_hash(p->address));
+        spin_lock_irqsave(lock, &hash_irq);
+        if (!(__atomic_load_n(&p->flags, __ATOMIC_ACQUIRE) & BLOCK_PAGE_DIRTY) &&
+            !__atomic_load_n(&p->refcount, __ATOMIC_ACQUIRE)) {
+            block_cache_hash_remove(cache, p);
+            list_del(&p->lru);
+            victim = p;
+        }
+        spin_release_irqrestore(lock, &hash_irq);
+
+        if (victim) {
+            break;
+        }
+    }
+
+    spin_release_irqrestore(&cache->lru_lock, &irq);
+
+    if (victim) {
+        block_cache_page_destroy(cache, victim);
+        return 0;
+    }
+
+    return -1;
+}
+
+static struct block_cache_page *block_cache_page_create(struct block_cache *cache, uintptr_t address) {
+    struct block_cache_page *p;
+
+    if (__atomic_add_fetch(&cache->size, 1, __ATOMIC_RELAXED) > cache->capacity &&
+        block_cache_evict(cache) != 0) {
+        // Every page is either in use or dirty: the cache is allowed to
+        // go over the capacity until writeback cleans some of them
+        blk_writeback_kick();
+    }
+
+    p = slab_calloc(block_page_cache);
+    _assert(p);
+    p->page = block_cache_page_alloc(cache);
+    _assert(p->page != MM_NADDR);
+    p->address = address;
+    p->flags = 0;
+    p->refcount = 0;
+    p->hash_next = NULL;
+    list_head_init(&p->lru);
+    list_head_init(&p->dirty_link);
+
+    return p;
 }
 
 ////
 
 void block_cache_init(struct block_cache *cache, struct blkdev *blk, size_t page_size, size_t capacity) {
+    if (!block_page_cache) {
+        block_page_cache = slab_cache_get(sizeof(struct block_cache_page));
+        _assert(block_page_cache);
+    }
+
     cache->page_size = page_size;
     cache->capacity = capacity;
-    cache->queue_head = NULL;
-    cache->queue_tail = NULL;
     cache->size = 0;
     cache->blk = blk;
-    lru_hash_init(&cache->index_hash, 32);
+
+    for (size_t i = 0; i < BLOCK_CACHE_STRIPES; ++i) {
+        cache->hash_locks[i] = 0;
+    }
+    cache->bucket_count = BLOCK_CACHE_BUCKETS_INIT;
+    cache->buckets = kmalloc(sizeof(struct block_cache_page *) * cache->bucket_count);
+    _assert(cache->buckets);
+    memset(cache->buckets, 0, sizeof(struct block_cache_page *) * cache->bucket_count);
+
+    cache->lru_lock = 0;
+    list_head_init(&cache->lru);
+
+    cache->dirty_lock = 0;
+    list_head_init(&cache->dirty);
+    cache->dirty_count = 0;
+
+    cache->g_users = 0;
 }
 
 void block_cache_release(struct block_cache *cache) {
-    _assert(!cache->queue_head);
-    _assert(!cache->queue_tail);
-    kfree(cache->index_hash.bucket_heads);
-    kfree(cache->index_hash.bucket_tails);
+    _assert(list_empty(&cache->lru));
+    _assert(list_empty(&cache->dirty));
+    _assert(!cache->size);
+    kfree(cache->buckets);
     memset(cache, 0, sizeof(struct block_cache));
 }
 
-static void block_cache_queue_push_node(struct block_cache *cache, struct lru_node *node) {
-    node->next = cache->queue_head;
-    if (cache->queue_head) {
-        cache->queue_head->prev = node;
-    } else {
-        cache->queue_tail = node;
-    }
-    cache->queue_head = node;
-    node->prev = NULL;
-    ++cache->size;
-}
+int block_cache_get(struct block_cache *cache, uintptr_t address, struct block_cache_page **ref) {
+    struct block_cache_page *p, *new = NULL;
+    uintptr_t irq;
+    size_t hash;
+    spin_t *lock;
+    int created = 0;
 
-static void block_cache_queue_pop_tail(struct block_cache *cache) {
-    struct lru_node *last = cache->queue_tail;
-    _assert(last);
-    _assert(lru_hash_remove(&cache->index_hash, last->block_address) == 0);
-    cache->queue_tail = last->prev;
-    if (cache->queue_tail) {
-        cache->queue_tail->next = NULL;
-    } else {
-        _assert(cache->size == 1);
-        cache->queue_head = NULL;
+    // Convert address to block index
+    _assert((address % cache->page_size) == 0);
+    address /= cache->page_size;
+    hash = block_cache_hash(address);
+    lock = block_cache_stripe(cache, hash);
+
+retry:
+    spin_lock_irqsave(lock, &irq);
+    if (!(p = block_cache_lookup(cache, hash, address))) {
+        // Page allocation and eviction are done without the lock held
+        spin_release_irqrestore(lock, &irq);
+        new = block_cache_page_create(cache, address);
+        spin_lock_irqsave(lock, &irq);
+
+        // Someone else could've added the block meanwhile
+        if (!(p = block_cache_lookup(cache, hash, address))) {
+            block_cache_hash_insert(cache, hash, new);
+            p = new;
+            new = NULL;
+            created = 1;
+        }
     }
-    --cache->size;
-}
+    __atomic_add_fetch(&p->refcount, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&p->flags, BLOCK_PAGE_REFERENCED, __ATOMIC_RELAXED);
+    spin_release_irqrestore(lock, &irq);
 
-static struct lru_node *block_cache_queue_push_head(struct block_cache *cache, uintptr_t address, uintptr_t page) {
-    struct lru_node *node = kmalloc(sizeof(struct lru_node));
-    node->block_address = address;
-    node->page = page;
-    _assert(node);
-    block_cache_queue_push_node(cache, node);
-    return node;
-}
+    *ref = p;
 
-static void block_cache_queue_erase(struct block_cache *cache, struct lru_node *node) {
-    struct lru_node *prev = node->prev;
-    struct lru_node *next = node->next;
+    if (created) {
+        spin_lock_irqsave(&cache->lru_lock, &irq);
+        list_add(&p->lru, &cache->lru);
+        spin_release_irqrestore(&cache->lru_lock, &irq);
 
-    if (prev) {
-        prev->next = next;
-    } else {
-        cache->queue_head = next;
-    }
-    if (next) {
-        next->prev = prev;
-    } else {
-        cache->queue_tail = prev;
+        if (cache->size > cache->bucket_count * BLOCK_CACHE_LOAD) {
+            block_cache_hash_grow(cache);
+        }
+
+        return -1;
     }
 
-    --cache->size;
-}
+    if (new) {
+        block_cache_page_destroy(cache, new);
+    }
 
-static void block_cache_page_release(struct block_cache *cache, uintptr_t address, uintptr_t page) {
-    if (page & LRU_PAGE_DIRTY) {
-        kdebug("Block cache: write page %p\n", page & LRU_PAGE_MASK);
-        _assert(blk_page_sync(cache->blk, address * cache->page_size, page & LRU_PAGE_MASK) == 0);
+    // Wait until the thread which has added the page reads it
+    while (!(__atomic_load_n(&p->flags, __ATOMIC_ACQUIRE) & BLOCK_PAGE_UPTODATE)) {
+        if (__atomic_load_n(&p->flags, __ATOMIC_ACQUIRE) & BLOCK_PAGE_ERROR) {
+            // The read has failed, try it ourselves
+            block_cache_put(cache, p);
+            goto retry;
+        }
+        sched_yield();
     }
-    mm_phys_free_page(page & LRU_PAGE_MASK);
-}
 
-static uintptr_t block_cache_page_alloc(struct block_cache *cache) {
-    // Other sizes are not supported
-    _assert(cache->page_size == MM_PAGE_SIZE);
-    return mm_phys_alloc_page(PU_CACHE);
+    return 0;
 }
 
-void block_cache_mark_dirty(struct block_cache *cache, uintptr_t address) {
-    // Convert address to block index
-    _assert((address % cache->page_size) == 0);
-    address /= cache->page_size;
+void block_cache_page_ready(struct block_cache *cache, struct block_cache_page *ref) {
+    __atomic_fetch_or(&ref->flags, BLOCK_PAGE_UPTODATE, __ATOMIC_RELEASE);
+}
 
-    // Lookup index in cache
-    struct lru_node *index = lru_hash_lookup(&cache->index_hash, address);
-    // Must be present in cache
-    _assert(index);
-    struct lru_node *node = index->index;
-    _assert(node);
+void block_cache_page_abort(struct block_cache *cache, struct block_cache_page *ref) {
+    uintptr_t irq, hash_irq;
+    spin_t *lock = block_cache_stripe(cache, block_cache_hash(ref->address));
 
-    node->page |= LRU_PAGE_DIRTY;
-}
+    _assert(!(ref->flags & (BLOCK_PAGE_UPTODATE | BLOCK_PAGE_DIRTY)));
 
-int block_cache_get(struct block_cache *cache, uintptr_t address, uintptr_t *page) {
-    // Convert address to block index
-    _assert((address % cache->page_size) == 0);
-    address /= cache->page_size;
+    // New lookups won't find the page, the ones waiting for it will
+    // see the error. The last reference frees it
+    spin_lock_irqsave(&cache->lru_lock, &irq);
+    spin_lock_irqsave(lock, &hash_irq);
+    block_cache_hash_remove(cache, ref);
+    list_del_init(&ref->lru);
+    __atomic_fetch_or(&ref->flags, BLOCK_PAGE_ERROR, __ATOMIC_SEQ_CST);
+    spin_release_irqrestore(lock, &hash_irq);
+    spin_release_irqrestore(&cache->lru_lock, &irq);
 
-    // Lookup index in cache
-    struct lru_node *index = lru_hash_lookup(&cache->index_hash, address);
+    block_cache_put(cache, ref);
+}
 
-    if (!index) {
-        // Remove the least recently used element
-        if (cache->capacity == cache->size) {
-            _assert(cache->queue_tail);
-            uintptr_t old_page = cache->queue_tail->page;
-            block_cache_page_release(cache, cache->queue_tail->block_address, cache->queue_tail->page);
-            block_cache_queue_pop_tail(cache);
-        }
+void block_cache_put(struct block_cache *cache, struct block_cache_page *ref) {
+    _assert(ref->refcount);
+    if (!__atomic_sub_fetch(&ref->refcount, 1, __ATOMIC_SEQ_CST) &&
+        (__atomic_load_n(&ref->flags, __ATOMIC_SEQ_CST) & BLOCK_PAGE_ERROR)) {
+        block_cache_page_destroy(cache, ref);
+    }
+}
 
-        uintptr_t result = block_cache_page_alloc(cache);
-        _assert(result != MM_NADDR);
+void block_cache_mark_dirty(struct block_cache *cache, struct block_cache_page *ref) {
+    uintptr_t irq;
+    size_t dirty_count;
 
-        // Insert a new reference
-        struct lru_node *node = block_cache_queue_push_head(cache, address, result);
-        _assert(node);
-        lru_hash_insert(&cache->index_hash, address, node);
+    _assert(ref->refcount);
+    if (__atomic_fetch_or(&ref->flags, BLOCK_PAGE_DIRTY, __ATOMIC_SEQ_CST) & BLOCK_PAGE_DIRTY) {
+        // Already queued for writeback
+        return;
+    }
 
-        *page = result;
-        return -1;
-    } else {
-        // Put reference to the head
-        struct lru_node *node = index->index;
-        _assert(node);
-        _assert(node->block_address == index->block_address);
-        *page = node->page & LRU_PAGE_MASK;
+    spin_lock_irqsave(&cache->dirty_lock, &irq);
+    if (list_empty(&ref->dirty_link)) {
+        ref->dirtied_at = system_time;
+        list_add_tail(&ref->dirty_link, &cache->dirty);
+        ++cache->dirty_count;
+    }
+    dirty_count = cache->dirty_count;
+    spin_release_irqrestore(&cache->dirty_lock, &irq);
 
-        block_cache_queue_erase(cache, node);
-        block_cache_queue_push_node(cache, node);
+    if (dirty_count > BLOCK_CACHE_DIRTY_LIMIT(cache)) {
+        blk_writeback_kick();
+    }
+}
 
-        return 0;
+size_t block_cache_writeback(struct block_cache *cache, uint64_t dirtied_before, size_t keep) {
+    struct block_cache_page *p;
+    size_t written = 0;
+    uintptr_t irq;
+    int res;
+
+    while (1) {
+        // Oldest pages are at the head of the list
+        spin_lock_irqsave(&cache->dirty_lock, &irq);
+        if (list_empty(&cache->dirty)) {
+            spin_release_irqrestore(&cache->dirty_lock, &irq);
+            break;
+        }
+        p = list_first_entry(&cache->dirty, struct block_cache_page, dirty_link);
+        if (p->dirtied_at >= dirtied_before && cache->dirty_count <= keep) {
+            spin_release_irqrestore(&cache->dirty_lock, &irq);
+            break;
+        }
+        list_del_init(&p->dirty_link);
+        --cache->dirty_count;
+
+        // Dirty pages are never evicted, so it's safe to take the
+        // reference here. It keeps the page around once it's clean.
+        // Writes made during writeback will mark the page dirty again
+        __atomic_add_fetch(&p->refcount, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_and(&p->flags, ~BLOCK_PAGE_DIRTY, __ATOMIC_SEQ_CST);
+        spin_release_irqrestore(&cache->dirty_lock, &irq);
+
+        if ((res = blk_page_sync(cache->blk, p->address * cache->page_size, p->page)) != 0) {
+            kerror("Block cache: failed to write back block %p: %s\n", p->address, kstrerror(res));
+            block_cache_mark_dirty(cache, p);
+            block_cache_put(cache, p);
+            break;
+        }
+        block_cache_put(cache, p);
+        ++written;
     }
+
+    return written;
 }
 
 void block_cache_flush(struct block_cache *cache) {
-    // Write all "dirty" pages and release the whole cache to force
-    // reload from disk
-    struct lru_node *node;
+    struct block_cache_page *p;
+    struct list_head dead, *it, *it_next;
+    uintptr_t irq, hash_irq;
+    spin_t *lock;
+
+    // Write all "dirty" pages
+    block_cache_writeback(cache, (uint64_t) -1, 0);
+
+    // Then release the unused ones to force reload from disk
+    list_head_init(&dead);
+    spin_lock_irqsave(&cache->lru_lock, &irq);
+    list_for_each_safe(it, it_next, &cache->lru) {
+        p = list_entry(it, struct block_cache_page, lru);
+        lock = block_cache_stripe(cache, block_cache_hash(p->address));
+        spin_lock_irqsave(lock, &hash_irq);
+        if (!p->refcount && !(p->flags & BLOCK_PAGE_DIRTY)) {
+            block_cache_hash_remove(cache, p);
+            list_del(&p->lru);
+            list_add(&p->lru, &dead);
+        }
+        spin_release_irqrestore(lock, &hash_irq);
+    }
+    spin_release_irqrestore(&cache->lru_lock, &irq);
 
-    while ((node = cache->queue_tail) != NULL) {
-        block_cache_page_release(cache, node->block_address, node->page);
-        block_cache_queue_pop_tail(cache);
+    list_for_each_safe(it, it_next, &dead) {
+        block_cache_page_destroy(cache, list_entry(it, struct block_cache_page, lru));
     }
 }
@@ -6,21 +6,22 @@
 #include "sys/debug.h"
 #include "fs/ofile.h"
 #include "sys/heap.h"
-
-#define PIPE_RING_SIZE      1024
+#include "sys/mm.h"
 
 static int pipe_vnode_open(struct ofile *of, int opt);
 static ssize_t pipe_vnode_write(struct ofile *of, const void *buf, size_t count);
 static ssize_t pipe_vnode_read(struct ofile *of, void *buf, size_t count);
 static int pipe_vnode_stat(struct vnode *vn, struct stat *st);
 static void pipe_vnode_close(struct ofile *of);
+static void pipe_vnode_destroy(struct vnode *vn);
 
 static struct vnode_operations pipe_vnode_ops = {
     .open = pipe_vnode_open,
     .close = pipe_vnode_close,
     .write = pipe_vnode_write,
     .read = pipe_vnode_read,
-    .stat = pipe_vnode_stat
+    .stat = pipe_vnode_stat,
+    .destroy = pipe_vnode_destroy
 };
 
 int pipe_create(struct ofile **_read, struct ofile **_write) {
@@ -29,12 +30,20 @@ int pipe_create(struct ofile **_read, struct ofile **_write) {
 
     struct ring *pipe_ring = kmalloc(sizeof(struct ring));
     _assert(pipe_ring);
-    ring_init(pipe_ring, PIPE_RING_SIZE);
+    if (ring_init(pipe_ring, PIPE_DEFAULT_SIZE) != 0) {
+        kfree(pipe_ring);
+        ofile_destroy(read_end);
+        ofile_destroy(write_end);
+        return -ENOMEM;
+    }
 
     struct vnode *vnode = vnode_create(VN_REG, NULL);
     _assert(vnode);
     vnode->op = &pipe_vnode_ops;
     vnode->flags |= VN_MEMORY;
+    vnode->fs_data = pipe_ring;
+    // Both ends are open, the pipe is gone once they're closed
+    vnode->open_count = 2;
 
     read_end->flags = OF_READABLE;
     read_end->file.vnode = vnode;
@@ -57,7 +66,10 @@ int pipe_fifo_create(struct vnode *nod) {
 
     struct ring *pipe_ring = kmalloc(sizeof(struct ring));
     _assert(pipe_ring);
-    ring_init(pipe_ring, PIPE_RING_SIZE);
+    if (ring_init(pipe_ring, PIPE_DEFAULT_SIZE) != 0) {
+        kfree(pipe_ring);
+        return -ENOMEM;
+    }
 
     nod->fs_data = pipe_ring;
 
@@ -83,35 +95,30 @@ static ssize_t pipe_vnode_read(struct ofile *of, void *buf, size_t count) {
     struct ring *r = of->file.priv_data;
     _assert(r);
 
-    size_t rd = 0;
-    char c;
-    size_t rem = count;
-    char *wr = buf;
+    return ring_read(thr, r, buf, count);
+}
 
-    while (rem) {
-        if (ring_getc(thr, r, &c, 0) < 0) {
-            break;
-        }
+static void pipe_vnode_close(struct ofile *of) {
+    _assert(of && of->file.priv_data);
+    struct vnode *vn = of->file.vnode;
 
-        *wr++ = c;
-        ++rd;
-        --rem;
+    ring_signal(of->file.priv_data, RING_SIGNAL_EOF);
 
-        if (!ring_readable(r) && (r->flags & RING_SIGNAL_RET)) {
-            r->flags &= ~RING_SIGNAL_RET;
-            return rd;
-        }
+    // Anonymous pipes aren't reachable once both ends are closed,
+    // FIFOs keep their buffer until the node is removed
+    if (!vn->parent && !vn->open_count) {
+        vnode_destroy(vn);
     }
-
-    return rd;
 }
 
-static void pipe_vnode_close(struct ofile *of) {
-    _assert(of && of->file.priv_data);
-    ring_signal(of->file.priv_data, RING_SIGNAL_EOF);
-    // TODO: this
-    //kfree(((struct ring *) of->file.priv_data)->base);
-    //kfree(of->file.priv_data);
+static void pipe_vnode_destroy(struct vnode *vn) {
+    struct ring *pipe_ring = vn->fs_data;
+
+    if (pipe_ring) {
+        ring_fini(pipe_ring);
+        kfree(pipe_ring);
+        vn->fs_data = NULL;
+    }
 }
 
 static int pipe_vnode_open(struct ofile *of, int opt) {
@@ -147,3 +154,39 @@ static int pipe_vnode_stat(struct vnode *vn, struct stat *st) {
 
     return 0;
 }
+
+struct ring *pipe_get_ring(struct ofile *of) {
+    if (ofile_is_socket(of) || !of->file.vnode || of->file.vnode->op != &pipe_vnode_ops) {
+        return NULL;
+    }
+    return of->file.priv_data;
+}
+
+int pipe_get_size(struct ofile *of) {
+    struct ring *r;
+
+    if (!(r = pipe_get_ring(of))) {
+        return -EBADF;
+    }
+    return r->cap;
+}
+
+int pipe_set_size(struct ofile *of, size_t size) {
+    struct ring *r;
+    int res;
+
+    if (!(r = pipe_get_ring(of))) {
+        return -EBADF;
+    }
+    if (size > PIPE_MAX_SIZE) {
+        return -EPERM;
+    }
+    if (size < MM_PAGE_SIZE) {
+        size = MM_PAGE_SIZE;
+    }
+
+    if ((res = ring_resize(r, size)) != 0) {
+        return res;
+    }
+    return r->cap;
+}
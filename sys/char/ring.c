@@ -1,147 +1,619 @@
 #include "sys/char/ring.h"
+#include "sys/mem/phys.h"
 #include "sys/thread.h"
 #include "user/errno.h"
 #include "sys/assert.h"
+#include "sys/string.h"
 #include "sys/sched.h"
 #include "sys/debug.h"
 #include "sys/heap.h"
+#include "sys/mm.h"
+
+// rd and wr only ever grow, wr - rd is the amount of data buffered and
+// (index % cap) is its position in the buffer. Readers only move rd and
+// writers only move wr, each after it's done copying, so the data itself
+// is accessed without the spinlock. A pipe or a socket may have several
+// readers and writers though (fork(), threads), so each side takes its
+// turn lock around the copy. ring_resize() waits for the copies in
+// progress to finish and holds off new ones
 
 int ring_readable(struct ring *ring) {
-    // | . . . . R X X X W . . . |
-    if (ring->rd <= ring->wr) {
-        return ring->wr - ring->rd;
-    // | X X W . . . . . . R X X |
-    } else {
-        return ring->wr + (ring->cap - ring->rd);
-    }
+    size_t rd = __atomic_load_n(&ring->rd, __ATOMIC_ACQUIRE);
+    size_t wr = __atomic_load_n(&ring->wr, __ATOMIC_ACQUIRE);
+
+    return wr - rd;
 }
 
-static int ring_writable(struct ring *ring) {
-    if (ring->wr == ring->cap - 1 && ring->rd == 0) {
-        return 0;
+size_t ring_writable(struct ring *ring) {
+    return ring->cap - ring_readable(ring);
+}
+
+// Keeps the buffer and cap from changing until ring_leave()
+static void ring_enter(struct ring *ring) {
+    uintptr_t irq;
+
+    spin_lock_irqsave(&ring->lock, &irq);
+    while (ring->resizing) {
+        spin_release_irqrestore(&ring->lock, &irq);
+        sched_yield();
+        spin_lock_irqsave(&ring->lock, &irq);
     }
+    ++ring->users;
+    spin_release_irqrestore(&ring->lock, &irq);
+}
 
-    // | X X X X R . . . W X X X |
-    if (ring->rd <= ring->wr) {
-        return ring->wr + (ring->cap - ring->rd);
-    // | . . W X X X X R . . . . |
-    } else {
-        if (ring->rd == ring->wr + 1) {
-            return 0;
+static void ring_leave(struct ring *ring) {
+    __atomic_sub_fetch(&ring->users, 1, __ATOMIC_RELEASE);
+}
+
+// Serializes the readers or the writers among themselves. The copy may
+// fault in a user buffer, so this sleeps instead of spinning, except for
+// the interrupt handlers (no `ctx'), which only try
+static int ring_turn_take(struct thread *ctx, int *busy, struct io_notify *turn) {
+    int res;
+
+    while (__atomic_exchange_n(busy, 1, __ATOMIC_ACQUIRE)) {
+        if (!ctx) {
+            return -EAGAIN;
+        }
+        if ((res = thread_wait_io_exclusive(ctx, turn)) != 0) {
+            _assert(res == -EINTR);
+            return res;
         }
-        return ring->rd - ring->wr;
     }
+
+    return 0;
 }
 
-static void ring_advance_read(struct ring *ring) {
-    if (ring->rd == ring->cap - 1) {
-        ring->rd = 0;
-    } else {
-        ++ring->rd;
+static void ring_turn_give(int *busy, struct io_notify *turn) {
+    __atomic_store_n(busy, 0, __ATOMIC_RELEASE);
+    thread_notify_io(turn);
+}
+
+#define ring_reader_take(ctx, r)    ring_turn_take(ctx, &(r)->reading, &(r)->reader_turn)
+#define ring_reader_give(r)         ring_turn_give(&(r)->reading, &(r)->reader_turn)
+#define ring_writer_take(ctx, r)    ring_turn_take(ctx, &(r)->writing, &(r)->writer_turn)
+#define ring_writer_give(r)         ring_turn_give(&(r)->writing, &(r)->writer_turn)
+
+// Address of the byte at index `pos' of a buffer, `span' is set to how
+// many bytes are contiguous from there: up to the end of the buffer or
+// of the page it's in
+static char *ring_buffer_at(char *base, char **pages, size_t cap, size_t pos, size_t *span) {
+    size_t off = pos % cap;
+
+    if (!pages) {
+        *span = cap - off;
+        return base + off;
     }
+    *span = MM_PAGE_SIZE - off % MM_PAGE_SIZE;
+    return pages[off / MM_PAGE_SIZE] + off % MM_PAGE_SIZE;
 }
 
-static void ring_advance_write(struct ring *ring) {
-    if (ring->wr == ring->cap - 1) {
-        ring->wr = 0;
-    } else {
-        ++ring->wr;
+static inline char *ring_at(struct ring *ring, size_t pos, size_t *span) {
+    return ring_buffer_at(ring->base, ring->pages, ring->cap, pos, span);
+}
+
+// Copy out `count' readable bytes, one contiguous span at a time
+static void ring_copy_out(struct ring *ring, void *buf, size_t count) {
+    size_t rd = ring->rd;
+    size_t span;
+    char *src;
+
+    for (size_t done = 0; done < count; done += span) {
+        src = ring_at(ring, rd + done, &span);
+        span = MIN(span, count - done);
+        memcpy(buf + done, src, span);
     }
+
+    __atomic_store_n(&ring->rd, rd + count, __ATOMIC_RELEASE);
 }
 
-//static void ring_notify_reader(struct ring *ring) {
-//    if (ring->reader_head) {
-//        struct thread *thr = ring->reader_head;
-//        ring->reader_head = NULL; //thr->wait_next;
-//
-//        sched_queue(thr);
-//    }
-//}
+static void ring_copy_in(struct ring *ring, const void *buf, size_t count) {
+    size_t wr = ring->wr;
+    size_t span;
+    char *dst;
 
-int ring_getc(struct thread *ctx, struct ring *ring, char *c, int err) {
+    for (size_t done = 0; done < count; done += span) {
+        dst = ring_at(ring, wr + done, &span);
+        span = MIN(span, count - done);
+        memcpy(dst, buf + done, span);
+    }
+
+    __atomic_store_n(&ring->wr, wr + count, __ATOMIC_RELEASE);
+}
+
+// Waiters for data and for space are exclusive, so a notification only
+// wakes the first of them. If it leaves something for the next one, the
+// wakeup is passed on
+static inline void ring_pass_on(struct io_notify *n, int cond) {
+    if (cond && thread_io_has_waiters(n)) {
+        thread_notify_io(n);
+    }
+}
+
+// Returns 0 once there's something to read, -1 on EOF/break, or an error
+// if the wait was interrupted
+static int ring_wait_readable(struct thread *ctx, struct ring *ring) {
     int res;
-    if (err) {
-        if (!ring_readable(ring)) {
-            return -1;
-        }
-    } else {
-        do {
-            // TODO: better handling of EOF condition?
-            if (ring->flags & (RING_SIGNAL_BRK | RING_SIGNAL_EOF)) {
-                if (!ring_readable(ring)) {
-                    ring->flags &= ~RING_SIGNAL_BRK;
-                    return -1;
-                }
+
+    while (1) {
+        // TODO: better handling of EOF condition?
+        if (ring->flags & (RING_SIGNAL_BRK | RING_SIGNAL_EOF)) {
+            if (!ring_readable(ring)) {
+                ring->flags &= ~RING_SIGNAL_BRK;
+                return -1;
             }
+        }
+
+        if (ring_readable(ring)) {
+            return 0;
+        }
+
+        // Readers take turns, see ring_pass_on()
+        if ((res = thread_wait_io_exclusive(ctx, &ring->wait)) != 0) {
+            _assert(res == -EINTR);
+            return res;
+        }
+    }
+}
+
+int ring_getc(struct thread *ctx, struct ring *ring, char *c, int err) {
+    int res;
 
+    while (1) {
+        if (err) {
             if (!ring_readable(ring)) {
-                if ((res = thread_wait_io(ctx, &ring->wait)) != 0) {
-                    _assert(res == -EINTR);
-                    return res;
-                }
-            } else {
-                break;
+                return -1;
             }
-        } while (1);
+        } else if ((res = ring_wait_readable(ctx, ring)) != 0) {
+            return res;
+        }
+
+        if ((res = ring_reader_take(ctx, ring)) != 0) {
+            return err ? -1 : res;
+        }
+        if (ring_readable(ring)) {
+            break;
+        }
+        // Another reader got there first
+        ring_reader_give(ring);
     }
 
-    *c = ring->base[ring->rd];
-    ring_advance_read(ring);
+    ring_enter(ring);
+    ring_copy_out(ring, c, 1);
+    ring_leave(ring);
+    ring_reader_give(ring);
     thread_notify_io(&ring->writer_wait);
+    ring_pass_on(&ring->wait, ring_readable(ring));
 
     return 0;
 }
 
+ssize_t ring_read(struct thread *ctx, struct ring *ring, void *buf, size_t count) {
+    size_t rd = 0, can;
+
+    while (rd < count) {
+        if (ring_wait_readable(ctx, ring) != 0) {
+            break;
+        }
+        if (ring_reader_take(ctx, ring) != 0) {
+            break;
+        }
+
+        // May have been taken by another reader meanwhile
+        ring_enter(ring);
+        can = MIN((size_t) ring_readable(ring), count - rd);
+        ring_copy_out(ring, buf + rd, can);
+        ring_leave(ring);
+        ring_reader_give(ring);
+        rd += can;
+        // One wakeup for the whole batch
+        thread_notify_io(&ring->writer_wait);
+
+        // Stop at the end of what the writer has sent
+        if (!ring_readable(ring) && (ring->flags & RING_SIGNAL_RET)) {
+            ring->flags &= ~RING_SIGNAL_RET;
+            break;
+        }
+    }
+    ring_pass_on(&ring->wait, ring_readable(ring));
+
+    return rd;
+}
+
+int ring_wait_writable(struct thread *ctx, struct ring *ring) {
+    int res;
+
+    while (1) {
+        if (ring->flags & RING_SIGNAL_EOF) {
+            return -EPIPE;
+        }
+        if (ring_writable(ring)) {
+            return 0;
+        }
+        if ((res = thread_wait_io_exclusive(ctx, &ring->writer_wait)) != 0) {
+            _assert(res == -EINTR);
+            return res;
+        }
+    }
+}
+
 int ring_putc(struct thread *ctx, struct ring *ring, char c, int wait) {
-    if (wait) {
-        int res;
-        while (!ring_writable(ring)) {
-            if (ring->flags & RING_SIGNAL_EOF) {
-                return -EPIPE;
+    ssize_t res = ring_write(ctx, ring, &c, 1, wait);
+    return res == 1 ? 0 : (res < 0 ? res : -EAGAIN);
+}
+
+ssize_t ring_write(struct thread *ctx, struct ring *ring, const void *buf, size_t count, int wait) {
+    size_t wr = 0, can;
+    int res;
+
+    while (wr < count) {
+        if (ring->flags & RING_SIGNAL_EOF) {
+            return wr ? (ssize_t) wr : -EPIPE;
+        }
+
+        if ((res = ring_writer_take(ctx, ring)) != 0) {
+            if (res == -EAGAIN) {
+                break;
+            }
+            return wr ? (ssize_t) wr : res;
+        }
+
+        ring_enter(ring);
+        if (!(can = ring_writable(ring))) {
+            ring_leave(ring);
+            ring_writer_give(ring);
+            if (!wait) {
+                // Whatever doesn't fit is dropped
+                break;
+            }
+            if ((res = thread_wait_io_exclusive(ctx, &ring->writer_wait)) != 0) {
+                _assert(res == -EINTR);
+                return wr ? (ssize_t) wr : res;
+            }
+            continue;
+        }
+
+        can = MIN(can, count - wr);
+        ring_copy_in(ring, buf + wr, can);
+        ring_leave(ring);
+        ring_writer_give(ring);
+        wr += can;
+        thread_notify_io(&ring->wait);
+    }
+    ring_pass_on(&ring->writer_wait, ring_writable(ring));
+
+    return wr;
+}
+
+//// Transfers without an intermediate buffer
+// The callbacks get pointers into the ring itself, so the data is copied
+// once, straight from/to where it comes from or goes to. Like splice(2),
+// these only wait until the first batch can be moved
+
+ssize_t ring_splice_in(struct thread *ctx, struct ring *ring, size_t count, ring_fill_t fill, void *arg) {
+    size_t done = 0, can, span;
+    ssize_t res;
+    char *dst;
+
+    while (done < count) {
+        if (ring->flags & RING_SIGNAL_EOF) {
+            return done ? (ssize_t) done : -EPIPE;
+        }
+
+        if ((res = ring_writer_take(ctx, ring)) != 0) {
+            return done ? (ssize_t) done : res;
+        }
+
+        ring_enter(ring);
+        if (!(can = ring_writable(ring))) {
+            ring_leave(ring);
+            ring_writer_give(ring);
+            if (done) {
+                break;
             }
-            if ((res = thread_wait_io(ctx, &ring->writer_wait)) != 0) {
+            if ((res = thread_wait_io_exclusive(ctx, &ring->writer_wait)) != 0) {
                 _assert(res == -EINTR);
                 return res;
             }
+            continue;
+        }
+
+        // One contiguous span of the free space
+        dst = ring_at(ring, ring->wr, &span);
+        can = MIN(MIN(can, count - done), span);
+
+        if ((res = fill(arg, dst, can, !done)) <= 0) {
+            ring_leave(ring);
+            ring_writer_give(ring);
+            return done ? (ssize_t) done : res;
+        }
+        _assert((size_t) res <= can);
+        __atomic_store_n(&ring->wr, ring->wr + res, __ATOMIC_RELEASE);
+        ring_leave(ring);
+        ring_writer_give(ring);
+
+        done += res;
+        thread_notify_io(&ring->wait);
+
+        if ((size_t) res < can) {
+            // Source has nothing more right now
+            break;
         }
     }
-    if (ring->flags & RING_SIGNAL_EOF) {
-        return -EPIPE;
+    ring_pass_on(&ring->writer_wait, ring_writable(ring));
+
+    return done;
+}
+
+ssize_t ring_splice_out(struct thread *ctx, struct ring *ring, size_t count, ring_drain_t drain, void *arg) {
+    size_t done = 0, can, span;
+    ssize_t res;
+    char *src;
+
+    while (done < count) {
+        if (!done) {
+            if ((res = ring_wait_readable(ctx, ring)) != 0) {
+                return res == -1 ? 0 : res;
+            }
+        } else if (!ring_readable(ring)) {
+            break;
+        }
+
+        if ((res = ring_reader_take(ctx, ring)) != 0) {
+            return done ? (ssize_t) done : res;
+        }
+
+        ring_enter(ring);
+        src = ring_at(ring, ring->rd, &span);
+        can = MIN((size_t) ring_readable(ring), count - done);
+        can = MIN(can, span);
+
+        if (!can) {
+            // Another reader got there first
+            ring_leave(ring);
+            ring_reader_give(ring);
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        if ((res = drain(arg, src, can, !done)) <= 0) {
+            ring_leave(ring);
+            ring_reader_give(ring);
+            return done ? (ssize_t) done : res;
+        }
+        _assert((size_t) res <= can);
+        __atomic_store_n(&ring->rd, ring->rd + res, __ATOMIC_RELEASE);
+        ring_leave(ring);
+        ring_reader_give(ring);
+
+        done += res;
+        thread_notify_io(&ring->writer_wait);
+
+        if ((size_t) res < can) {
+            break;
+        }
     }
 
-    ring->base[ring->wr] = c;
-    ring_advance_write(ring);
-    thread_notify_io(&ring->wait);
+    if (!ring_readable(ring) && (ring->flags & RING_SIGNAL_RET)) {
+        ring->flags &= ~RING_SIGNAL_RET;
+    }
+    ring_pass_on(&ring->wait, ring_readable(ring));
 
-    return 0;
+    return done;
 }
 
-int ring_write(struct thread *ctx, struct ring *ring, const void *buf, size_t len, int wait) {
-    for (size_t i = 0; i < len; ++i) {
-        if (ring_putc(ctx, ring, ((const char *) buf)[i], wait) != 0) {
-            return -1;
+ssize_t ring_tee(struct thread *ctx, struct ring *src, struct ring *dst, size_t count) {
+    size_t done = 0, can, avail;
+    ssize_t res;
+    char *data;
+
+    _assert(src != dst);
+
+    if ((res = ring_wait_readable(ctx, src)) != 0) {
+        return res == -1 ? 0 : res;
+    }
+    // Only this wait may block, the copy takes what fits
+    if ((res = ring_wait_writable(ctx, dst)) != 0) {
+        return res;
+    }
+
+    // Keeps the other readers from consuming the data being copied
+    if ((res = ring_reader_take(ctx, src)) != 0) {
+        return res;
+    }
+
+    ring_enter(src);
+    avail = MIN((size_t) ring_readable(src), count);
+    // Source data is left in place, copied one span at a time
+    while (done < avail) {
+        data = ring_at(src, src->rd + done, &can);
+        can = MIN(avail - done, can);
+
+        if ((res = ring_write(ctx, dst, data, can, 0)) <= 0) {
+            ring_leave(src);
+            ring_reader_give(src);
+            return done ? (ssize_t) done : res;
+        }
+        done += res;
+        if ((size_t) res < can) {
+            break;
         }
     }
-    return len;
+    ring_leave(src);
+    ring_reader_give(src);
+    // Nothing was consumed
+    ring_pass_on(&src->wait, 1);
+
+    return done;
 }
 
 void ring_signal(struct ring *r, int s) {
     r->flags |= s;
-    thread_notify_io(&r->wait);
+    if (s & (RING_SIGNAL_EOF | RING_SIGNAL_BRK)) {
+        // Concerns everybody waiting
+        thread_notify_io_all(&r->wait);
+        thread_notify_io_all(&r->writer_wait);
+    } else {
+        thread_notify_io(&r->wait);
+        thread_notify_io(&r->writer_wait);
+    }
+}
+
+//// Buffer memory
+// Buffers of a page or more (pipes, sockets) are made of single PU_KERNEL
+// pages, so even a large one doesn't need physically contiguous memory,
+// small ones (device event queues) come from the heap
+
+// How many times ring_resize() yields waiting for the copies to finish
+#define RING_RESIZE_WAIT        64
+
+static size_t ring_buffer_size(size_t cap) {
+    if (cap >= MM_PAGE_SIZE) {
+        return (cap + MM_PAGE_SIZE - 1) & ~(MM_PAGE_SIZE - 1);
+    }
+    return cap;
+}
+
+static void ring_buffer_free(char *base, char **pages, size_t size) {
+    if (!pages) {
+        kfree(base);
+        return;
+    }
+
+    for (size_t i = 0; i < size / MM_PAGE_SIZE; ++i) {
+        if (pages[i]) {
+            mm_phys_free_page(MM_PHYS(pages[i]));
+        }
+    }
+    kfree(pages);
+}
+
+static int ring_buffer_alloc(size_t size, char **base, char ***pages) {
+    size_t npages = size / MM_PAGE_SIZE;
+    uintptr_t phys;
+
+    *base = NULL;
+    *pages = NULL;
+
+    if (size < MM_PAGE_SIZE) {
+        return (*base = kmalloc(size)) ? 0 : -ENOMEM;
+    }
+
+    if (!(*pages = kmalloc(npages * sizeof(char *)))) {
+        return -ENOMEM;
+    }
+    memset(*pages, 0, npages * sizeof(char *));
+
+    for (size_t i = 0; i < npages; ++i) {
+        if ((phys = mm_phys_alloc_page(PU_KERNEL)) == MM_NADDR) {
+            ring_buffer_free(NULL, *pages, size);
+            *pages = NULL;
+            return -ENOMEM;
+        }
+        (*pages)[i] = (char *) MM_VIRTUALIZE(phys);
+    }
+
+    return 0;
+}
+
+int ring_resize(struct ring *r, size_t cap) {
+    size_t size = ring_buffer_size(cap);
+    size_t count, span, dst_span;
+    uintptr_t irq;
+    char *base, **pages;
+    char *src, *dst;
+
+    if (size == r->cap) {
+        return 0;
+    }
+    // Only the page-backed buffers are resized
+    if (size < MM_PAGE_SIZE || r->cap < MM_PAGE_SIZE) {
+        return -EINVAL;
+    }
+    if (ring_buffer_alloc(size, &base, &pages) != 0) {
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&r->lock, &irq);
+    if (r->resizing) {
+        spin_release_irqrestore(&r->lock, &irq);
+        ring_buffer_free(base, pages, size);
+        return -EBUSY;
+    }
+    r->resizing = 1;
+    spin_release_irqrestore(&r->lock, &irq);
+
+    // A splice callback may hold the ring while it's blocked on the other
+    // descriptor, so don't wait for it indefinitely
+    for (int i = 0; __atomic_load_n(&r->users, __ATOMIC_ACQUIRE); ++i) {
+        if (i == RING_RESIZE_WAIT) {
+            break;
+        }
+        sched_yield();
+    }
+
+    // Nobody's copying now, so neither rd nor wr can move
+    count = r->wr - r->rd;
+    if (__atomic_load_n(&r->users, __ATOMIC_ACQUIRE) || count > size) {
+        spin_lock_irqsave(&r->lock, &irq);
+        r->resizing = 0;
+        spin_release_irqrestore(&r->lock, &irq);
+        ring_buffer_free(base, pages, size);
+        return -EBUSY;
+    }
+
+    // Keep the data at the same indices, now modulo the new size
+    for (size_t done = 0; done < count; done += span) {
+        src = ring_at(r, r->rd + done, &span);
+        dst = ring_buffer_at(base, pages, size, r->rd + done, &dst_span);
+        span = MIN(MIN(span, dst_span), count - done);
+        memcpy(dst, src, span);
+    }
+
+    ring_buffer_free(r->base, r->pages, r->cap);
+    r->base = base;
+    r->pages = pages;
+    r->cap = size;
+
+    spin_lock_irqsave(&r->lock, &irq);
+    r->resizing = 0;
+    spin_release_irqrestore(&r->lock, &irq);
+
+    // There may be room for a blocked writer now
     thread_notify_io(&r->writer_wait);
+
+    return 0;
+}
+
+void ring_fini(struct ring *r) {
+    _assert(!r->users);
+    if (r->base || r->pages) {
+        ring_buffer_free(r->base, r->pages, r->cap);
+        r->base = NULL;
+        r->pages = NULL;
+    }
 }
 
 int ring_init(struct ring *r, size_t cap) {
-    r->cap = cap;
+    r->cap = ring_buffer_size(cap);
     r->rd = 0;
     r->wr = 0;
     r->flags = 0;
+    r->lock = 0;
+    r->users = 0;
+    r->resizing = 0;
+    r->reading = 0;
+    r->writing = 0;
     thread_wait_io_init(&r->wait);
     thread_wait_io_init(&r->writer_wait);
+    thread_wait_io_init(&r->reader_turn);
+    thread_wait_io_init(&r->writer_turn);
 
-    if (!(r->base = kmalloc(cap))) {
+    if (ring_buffer_alloc(r->cap, &r->base, &r->pages) != 0) {
         return -1;
     }
     return 0;
 }
-
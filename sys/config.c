@@ -17,6 +17,8 @@ static const struct __kernel_cmdline_pair {
     { "init",       CFG_INIT,       VALUE_STRING },
     { "console",    CFG_CONSOLE,    VALUE_STRING },
     { "debug",      CFG_DEBUG,      VALUE_NUMBER },
+    { "heap_poison", CFG_HEAP_POISON, VALUE_STRING },
+    { "heap_grow",  CFG_HEAP_GROW,  VALUE_BOOLEAN },
 };
 
 char g_kernel_cmdline[KERNEL_CMDLINE_MAX];
@@ -31,6 +33,8 @@ uintptr_t kernel_config[__CFG_SIZE] = {
                   DEBUG_DISP(DEBUG_WARN) |
                   DEBUG_DISP(DEBUG_ERROR) |
                   DEBUG_DISP(DEBUG_FATAL),
+    [CFG_HEAP_POISON] = (uintptr_t) "lazy",
+    [CFG_HEAP_GROW] = 0,
 };
 
 static int parse_number(const char *s, intptr_t *res) {
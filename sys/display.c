@@ -77,10 +77,15 @@ static int display_blk_mmap(struct blkdev *blk, uintptr_t base, size_t page_coun
 
     phys = MM_PHYS(disp->framebuffer);
     for (size_t i = 0; i < page_count; ++i) {
-        mm_map_single(proc->space,
-                      base + i * MM_PAGE_SIZE,
-                      phys + i * MM_PAGE_SIZE,
-                      pf | MM_PAGE_USER);
+        if (mm_map_single(proc->space,
+                          base + i * MM_PAGE_SIZE,
+                          phys + i * MM_PAGE_SIZE,
+                          pf | MM_PAGE_USER) != 0) {
+            while (i--) {
+                mm_umap_single(proc->space, base + i * MM_PAGE_SIZE, 1);
+            }
+            return -ENOMEM;
+        }
     }
 
     return 0;
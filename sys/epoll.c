@@ -0,0 +1,570 @@
+// Event queues with a persistent interest list. Every registered descriptor
+// keeps watches on the notifications of its buffers, which put it on the
+// queue's ready list when they fire, so epoll_wait() only looks at the
+// descriptors that had something happen instead of all of them
+#include "arch/amd64/hw/timer.h"
+#include "user/time.h"
+#include "sys/char/pipe.h"
+#include "sys/char/ring.h"
+#include "sys/char/chr.h"
+#include "user/errno.h"
+#include "user/epoll.h"
+#include "net/socket.h"
+#include "net/class.h"
+#include "sys/thread.h"
+#include "sys/assert.h"
+#include "sys/string.h"
+#include "sys/debug.h"
+#include "sys/epoll.h"
+#include "fs/ofile.h"
+#include "sys/heap.h"
+#include "sys/spin.h"
+
+// Reported regardless of what's asked for
+#define EPOLL_ALWAYS            (EPOLLERR | EPOLLHUP)
+#define EPOLL_EVENT_MASK        (EPOLLIN | EPOLLOUT | EPOLL_ALWAYS)
+
+struct epoll_item {
+    struct epoll *ep;
+    struct ofile *of;
+    int fd;
+    uint32_t events;
+    uint64_t data;
+    // Set once the item is being removed, watches ignore it then
+    int dead;
+
+    // Readable/writable notifications of the descriptor
+    struct io_watch watch_rx, watch_tx;
+
+    // epoll::items
+    struct list_head link;
+    // epoll::ready, next == NULL if not on the list
+    struct list_head ready_link;
+    // ofile::epoll_items
+    struct list_head file_link;
+};
+
+struct epoll {
+    spin_t lock;
+    struct list_head items;
+    struct list_head ready;
+    // Notified when an item becomes ready
+    struct io_notify wait;
+};
+
+static int epoll_vnode_open(struct ofile *of, int opt);
+static void epoll_vnode_close(struct ofile *of);
+static ssize_t epoll_vnode_read(struct ofile *of, void *buf, size_t count);
+static ssize_t epoll_vnode_write(struct ofile *of, const void *buf, size_t count);
+
+static struct vnode_operations epoll_vnode_ops = {
+    .open = epoll_vnode_open,
+    .close = epoll_vnode_close,
+    .read = epoll_vnode_read,
+    .write = epoll_vnode_write,
+};
+
+// Guards ofile::epoll_items of all the files. Taken before epoll::lock
+static spin_t epoll_files_lock = 0;
+
+//// Descriptor readiness
+
+// Notifications to watch for EPOLLIN/EPOLLOUT, either may be NULL if the
+// descriptor is always ready in that direction
+static int epoll_file_notify(struct ofile *of, struct io_notify **rx, struct io_notify **tx) {
+    struct ring *r;
+
+    *rx = NULL;
+    *tx = NULL;
+
+#if defined(ENABLE_NET)
+    if (ofile_is_socket(of)) {
+        if (!of->socket.op || !of->socket.op->get_rx_notify || !of->socket.op->count_pending) {
+            return -EPERM;
+        }
+        if (!(*rx = socket_get_rx_notify(&of->socket))) {
+            return -EPERM;
+        }
+        *tx = socket_get_tx_notify(&of->socket);
+        return 0;
+    }
+#endif
+
+    if ((r = pipe_get_ring(of))) {
+        if (of->flags & OF_READABLE) {
+            *rx = &r->wait;
+        }
+        if (of->flags & OF_WRITABLE) {
+            *tx = &r->writer_wait;
+        }
+        return 0;
+    }
+
+    _assert(of->file.vnode);
+    if (of->file.vnode->type == VN_CHR) {
+        struct chrdev *chr = of->file.vnode->dev;
+        // Devices without an input buffer aren't pollable
+        if (!chr || !chr->buffer.base) {
+            return -EPERM;
+        }
+        *rx = &chr->buffer.wait;
+        return 0;
+    }
+
+    // Regular files and directories are always ready, same as in Linux
+    // they can't be added
+    return -EPERM;
+}
+
+static uint32_t epoll_file_poll(struct ofile *of) {
+    uint32_t res = 0;
+    struct ring *r;
+
+#if defined(ENABLE_NET)
+    if (ofile_is_socket(of)) {
+        if (socket_has_data(&of->socket)) {
+            res |= EPOLLIN;
+        }
+        if (socket_can_send(&of->socket)) {
+            res |= EPOLLOUT;
+        }
+        return res;
+    }
+#endif
+
+    if ((r = pipe_get_ring(of))) {
+        if (r->flags & RING_SIGNAL_EOF) {
+            res |= EPOLLHUP;
+        }
+        if ((of->flags & OF_READABLE) && ring_readable(r)) {
+            res |= EPOLLIN;
+        }
+        if (of->flags & OF_WRITABLE) {
+            if (r->flags & RING_SIGNAL_EOF) {
+                res |= EPOLLERR;
+            } else if (ring_writable(r)) {
+                res |= EPOLLOUT;
+            }
+        }
+        return res;
+    }
+
+    if (of->file.vnode->type == VN_CHR) {
+        struct chrdev *chr = of->file.vnode->dev;
+        if (chr->type == CHRDEV_TTY && (chr->tc.c_lflag & ICANON)) {
+            if (chr->buffer.flags & (RING_SIGNAL_RET | RING_SIGNAL_EOF | RING_SIGNAL_BRK)) {
+                res |= EPOLLIN;
+            }
+        } else if (ring_readable(&chr->buffer)) {
+            res |= EPOLLIN;
+        }
+        return res | EPOLLOUT;
+    }
+
+    return 0;
+}
+
+//// Items
+
+// Called with ep->lock held
+static void epoll_item_queue(struct epoll_item *item) {
+    if (!item->ready_link.next) {
+        list_add_tail(&item->ready_link, &item->ep->ready);
+    }
+}
+
+static void epoll_item_unqueue(struct epoll_item *item) {
+    if (item->ready_link.next) {
+        list_del(&item->ready_link);
+        item->ready_link.next = NULL;
+    }
+}
+
+// io_watch callbacks, run with the watched notification's lock held
+static void epoll_item_wake(struct epoll_item *item) {
+    struct epoll *ep = item->ep;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&ep->lock, &irq);
+    if (!item->dead && (item->events & EPOLL_EVENT_MASK)) {
+        epoll_item_queue(item);
+    }
+    spin_release_irqrestore(&ep->lock, &irq);
+
+    thread_notify_io(&ep->wait);
+}
+
+static void epoll_item_wake_rx(struct io_watch *w) {
+    epoll_item_wake(list_entry(w, struct epoll_item, watch_rx));
+}
+
+static void epoll_item_wake_tx(struct io_watch *w) {
+    epoll_item_wake(list_entry(w, struct epoll_item, watch_tx));
+}
+
+// (Re)attach the watches for the events the item is interested in
+static void epoll_item_watch(struct epoll_item *item) {
+    struct io_notify *rx, *tx;
+    int res;
+
+    res = epoll_file_notify(item->of, &rx, &tx);
+    _assert(res == 0);
+
+    thread_io_watch_del(&item->watch_rx);
+    thread_io_watch_del(&item->watch_tx);
+
+    if (rx && (item->events & EPOLLIN)) {
+        thread_io_watch_add(rx, &item->watch_rx, epoll_item_wake_rx);
+    }
+    if (tx && (item->events & EPOLLOUT)) {
+        thread_io_watch_add(tx, &item->watch_tx, epoll_item_wake_tx);
+    }
+}
+
+// Called with epoll_files_lock held. Takes the item off all the lists,
+// the caller frees it with epoll_item_free() once the locks are released
+static void epoll_item_unlink(struct epoll_item *item) {
+    struct epoll *ep = item->ep;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&ep->lock, &irq);
+    item->dead = 1;
+    list_del(&item->link);
+    epoll_item_unqueue(item);
+    spin_release_irqrestore(&ep->lock, &irq);
+
+    list_del(&item->file_link);
+}
+
+static void epoll_item_free(struct epoll_item *item) {
+    // Waits for the callbacks which may be running
+    thread_io_watch_del(&item->watch_rx);
+    thread_io_watch_del(&item->watch_tx);
+    kfree(item);
+}
+
+// Called with ep->lock held
+static struct epoll_item *epoll_item_find(struct epoll *ep, struct ofile *of, int fd) {
+    struct epoll_item *item;
+
+    list_for_each_entry(item, &ep->items, link) {
+        if (item->of == of && item->fd == fd) {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+//// The queue itself
+
+static struct epoll *epoll_get(struct ofile *of) {
+    if (ofile_is_socket(of) || !of->file.vnode || of->file.vnode->op != &epoll_vnode_ops) {
+        return NULL;
+    }
+    return of->file.vnode->fs_data;
+}
+
+int epoll_create(struct ofile **res) {
+    struct ofile *of;
+    struct vnode *vn;
+    struct epoll *ep;
+
+    if (!(ep = kmalloc(sizeof(struct epoll)))) {
+        return -ENOMEM;
+    }
+    ep->lock = 0;
+    list_head_init(&ep->items);
+    list_head_init(&ep->ready);
+    thread_wait_io_init(&ep->wait);
+
+    of = ofile_create();
+    _assert(of);
+    vn = vnode_create(VN_REG, NULL);
+    _assert(vn);
+    vn->op = &epoll_vnode_ops;
+    vn->flags |= VN_MEMORY;
+    vn->fs_data = ep;
+    vn->open_count = 1;
+
+    of->flags = OF_READABLE;
+    of->file.vnode = vn;
+
+    *res = of;
+    return 0;
+}
+
+int epoll_ctl(struct ofile *epof, int op, int fd, struct ofile *of, const struct epoll_event *ev) {
+    struct epoll_item *item, *new = NULL;
+    struct io_notify *rx, *tx;
+    struct epoll *ep;
+    uintptr_t irq, irq_files;
+    int res;
+
+    if (!(ep = epoll_get(epof))) {
+        return -EINVAL;
+    }
+    // Queues can't be nested
+    if (of == epof || epoll_get(of)) {
+        return -EINVAL;
+    }
+    if (op != EPOLL_CTL_DEL && (res = epoll_file_notify(of, &rx, &tx)) != 0) {
+        return res;
+    }
+
+    if (op == EPOLL_CTL_ADD) {
+        if (!(new = kmalloc(sizeof(struct epoll_item)))) {
+            return -ENOMEM;
+        }
+        memset(new, 0, sizeof(struct epoll_item));
+        new->ep = ep;
+        new->of = of;
+        new->fd = fd;
+        new->events = ev->events;
+        new->data = ev->data.u64;
+    }
+
+    spin_lock_irqsave(&epoll_files_lock, &irq_files);
+    spin_lock_irqsave(&ep->lock, &irq);
+    item = epoll_item_find(ep, of, fd);
+
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        if (item) {
+            res = -EEXIST;
+            break;
+        }
+        list_add_tail(&new->link, &ep->items);
+        if (!of->epoll_items.next) {
+            list_head_init(&of->epoll_items);
+        }
+        list_add(&new->file_link, &of->epoll_items);
+        // Whatever is ready already is reported by the next wait
+        if (epoll_file_poll(of) & (new->events | EPOLL_ALWAYS)) {
+            epoll_item_queue(new);
+        }
+        item = new;
+        new = NULL;
+        res = 0;
+        break;
+    case EPOLL_CTL_MOD:
+        if (!item) {
+            res = -ENOENT;
+            break;
+        }
+        item->events = ev->events;
+        item->data = ev->data.u64;
+        epoll_item_unqueue(item);
+        if (epoll_file_poll(of) & (item->events | EPOLL_ALWAYS)) {
+            epoll_item_queue(item);
+        }
+        res = 0;
+        break;
+    case EPOLL_CTL_DEL:
+        if (!item) {
+            res = -ENOENT;
+            break;
+        }
+        spin_release_irqrestore(&ep->lock, &irq);
+        epoll_item_unlink(item);
+        spin_release_irqrestore(&epoll_files_lock, &irq_files);
+        epoll_item_free(item);
+        return 0;
+    default:
+        res = -EINVAL;
+        break;
+    }
+    spin_release_irqrestore(&ep->lock, &irq);
+
+    if (res == 0) {
+        // The watches take the notifications' locks, which are taken
+        // before ep->lock by the callbacks
+        epoll_item_watch(item);
+    }
+    spin_release_irqrestore(&epoll_files_lock, &irq_files);
+
+    if (new) {
+        kfree(new);
+    }
+    if (res == 0) {
+        thread_notify_io(&ep->wait);
+    }
+    return res;
+}
+
+// Fill `events' with up to `max' entries of the ready list. Level-triggered
+// items which are still ready go back to its end
+static int epoll_collect(struct epoll *ep, struct epoll_event *events, int max) {
+    struct epoll_item *item;
+    LIST_HEAD(again);
+    uint32_t ready;
+    uintptr_t irq;
+    int count = 0;
+
+    spin_lock_irqsave(&ep->lock, &irq);
+    while (count < max && !list_empty(&ep->ready)) {
+        item = list_entry(ep->ready.next, struct epoll_item, ready_link);
+        epoll_item_unqueue(item);
+
+        ready = epoll_file_poll(item->of) & (item->events | EPOLL_ALWAYS) & EPOLL_EVENT_MASK;
+        if (!ready) {
+            // Was consumed before we got to it
+            continue;
+        }
+
+        events[count].events = ready;
+        events[count].data.u64 = item->data;
+        ++count;
+
+        if (item->events & EPOLLONESHOT) {
+            // Disabled until EPOLL_CTL_MOD
+            item->events &= ~EPOLL_EVENT_MASK;
+        } else if (!(item->events & EPOLLET)) {
+            list_add_tail(&item->ready_link, &again);
+        }
+    }
+    // Splice the level-triggered ones back
+    while (!list_empty(&again)) {
+        item = list_entry(again.next, struct epoll_item, ready_link);
+        list_del(&item->ready_link);
+        list_add_tail(&item->ready_link, &ep->ready);
+    }
+    spin_release_irqrestore(&ep->lock, &irq);
+
+    return count;
+}
+
+int epoll_wait(struct thread *thr, struct ofile *epof, struct epoll_event *events, int max, int timeout) {
+    struct epoll_event *buf;
+    struct io_notify *result;
+    uint64_t deadline = 0;
+    struct epoll *ep;
+    int count, res = 0;
+
+    if (!(ep = epoll_get(epof))) {
+        return -EINVAL;
+    }
+    if (max <= 0) {
+        return -EINVAL;
+    }
+    max = MIN(max, EPOLL_WAIT_MAX);
+    if (timeout > 0) {
+        deadline = system_time + timeout * 1000000ULL;
+    }
+
+    // Events are gathered under the queue's lock, and only then copied
+    // to userspace
+    if (!(buf = kmalloc(sizeof(struct epoll_event) * max))) {
+        return -ENOMEM;
+    }
+
+    while (1) {
+        // Notifications before this point are covered by the check below
+        __atomic_store_n(&ep->wait.value, 0, __ATOMIC_RELEASE);
+        if ((count = epoll_collect(ep, buf, max)) || timeout == 0) {
+            break;
+        }
+        if (timeout > 0 && system_time >= deadline) {
+            break;
+        }
+
+        list_head_init(&thr->wait_head);
+        if ((res = thread_wait_io_add(thr, &ep->wait)) == 0 && timeout > 0) {
+            thr->sleep_notify.value = 0;
+            thr->sleep_deadline = deadline;
+            if ((res = thread_wait_io_add(thr, &thr->sleep_notify)) == 0) {
+                timer_add_sleep(thr);
+            }
+        }
+        if (res != 0) {
+            thread_wait_io_clear(thr);
+            break;
+        }
+
+        res = thread_wait_io_any(thr, &result);
+        if (timeout > 0) {
+            timer_remove_sleep(thr);
+        }
+        thread_wait_io_clear(thr);
+
+        if (res < 0) {
+            // Interrupted
+            break;
+        }
+    }
+
+    if (count) {
+        memcpy(events, buf, sizeof(struct epoll_event) * count);
+    }
+    kfree(buf);
+
+    return res < 0 ? res : count;
+}
+
+void epoll_release_file(struct ofile *of) {
+    struct epoll_item *item;
+    LIST_HEAD(dead);
+    uintptr_t irq;
+
+    if (!of->epoll_items.next) {
+        return;
+    }
+
+    spin_lock_irqsave(&epoll_files_lock, &irq);
+    while (!list_empty(&of->epoll_items)) {
+        item = list_entry(of->epoll_items.next, struct epoll_item, file_link);
+        epoll_item_unlink(item);
+        list_add(&item->file_link, &dead);
+    }
+    spin_release_irqrestore(&epoll_files_lock, &irq);
+
+    while (!list_empty(&dead)) {
+        item = list_entry(dead.next, struct epoll_item, file_link);
+        list_del(&item->file_link);
+        epoll_item_free(item);
+    }
+}
+
+////
+
+static int epoll_vnode_open(struct ofile *of, int opt) {
+    // Only created by epoll_create()
+    return -EINVAL;
+}
+
+static ssize_t epoll_vnode_read(struct ofile *of, void *buf, size_t count) {
+    return -EINVAL;
+}
+
+static ssize_t epoll_vnode_write(struct ofile *of, const void *buf, size_t count) {
+    return -EINVAL;
+}
+
+static void epoll_vnode_close(struct ofile *of) {
+    struct vnode *vn = of->file.vnode;
+    struct epoll *ep = vn->fs_data;
+    struct epoll_item *item;
+    LIST_HEAD(dead);
+    uintptr_t irq;
+
+    _assert(ep);
+    _assert(!vn->open_count);
+
+    spin_lock_irqsave(&epoll_files_lock, &irq);
+    while (!list_empty(&ep->items)) {
+        item = list_entry(ep->items.next, struct epoll_item, link);
+        epoll_item_unlink(item);
+        list_add(&item->file_link, &dead);
+    }
+    spin_release_irqrestore(&epoll_files_lock, &irq);
+
+    while (!list_empty(&dead)) {
+        item = list_entry(dead.next, struct epoll_item, file_link);
+        list_del(&item->file_link);
+        epoll_item_free(item);
+    }
+
+    kfree(ep);
+    vn->fs_data = NULL;
+    vnode_destroy(vn);
+}
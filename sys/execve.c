@@ -1,7 +1,8 @@
 #include "arch/amd64/mm/pool.h"
 #include "arch/amd64/context.h"
 #include "arch/amd64/mm/map.h"
-#include "sys/mem/vmalloc.h"
+#include "arch/amd64/mm/tlb.h"
+#include "sys/mem/vma.h"
 #include "sys/binfmt_elf.h"
 #include "sys/sys_proc.h"
 #include "sys/mem/phys.h"
@@ -257,7 +258,7 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
 
         thr->data.cr3 = MM_PHYS(proc->space);
         // Switch CR3 to the newly allocated space!
-        asm volatile ("movq %0, %%rax; movq %%rax, %%cr3"::"a"(thr->data.cr3));
+        amd64_tlb_switch(thr->data.cr3);
         asm volatile ("sti");
     } else {
         mm_space_release(proc);
@@ -283,14 +284,18 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
     }
 
     // Allocate a virtual address to map argp page
-    uintptr_t procv_virt = vmfind(proc->space, 0x100000, 0xF0000000, procv_page_count);
+    uintptr_t procv_virt = vma_alloc(&proc->vm,
+                                     0x100000,
+                                     0xF0000000,
+                                     procv_page_count,
+                                     MM_PAGE_USER | MM_PAGE_WRITE,
+                                     0);
     _assert(procv_virt != MM_NADDR);
-    for (size_t i = 0; i < procv_page_count; ++i) {
-        _assert(mm_map_single(proc->space,
-                              procv_virt + i * MM_PAGE_SIZE,
-                              procv_phys_pages[i],
-                              MM_PAGE_USER | MM_PAGE_WRITE) == 0);
-    }
+    _assert(mm_map_range(proc->space,
+                         procv_virt,
+                         procv_phys_pages,
+                         procv_page_count,
+                         MM_PAGE_USER | MM_PAGE_WRITE) == 0);
     uintptr_t *argv_fixup = (uintptr_t *) procv_virt;
     uintptr_t *envp_fixup = (uintptr_t *) procv_virt + procv_vecp[0] + 1;
 
@@ -311,13 +316,18 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
     thr->data.rsp0 = thr->data.rsp0_top;
 
     // Allocate a new user stack
-    uintptr_t ustack = vmfind(proc->space, THREAD_USTACK_BEGIN, THREAD_USTACK_END, THREAD_USTACK_PAGES);
+    uintptr_t ustack = vma_alloc(&proc->vm,
+                                 THREAD_USTACK_BEGIN,
+                                 THREAD_USTACK_END,
+                                 THREAD_USTACK_PAGES,
+                                 MM_PAGE_WRITE | MM_PAGE_USER,
+                                 0);
     _assert(ustack != MM_NADDR);
-    for (size_t i = 0; i < THREAD_USTACK_PAGES; ++i) {
-        uintptr_t phys = mm_phys_alloc_page(PU_PRIVATE);
-        _assert(phys != MM_NADDR);
-        mm_map_single(proc->space, ustack + i * MM_PAGE_SIZE, phys, MM_PAGE_WRITE | MM_PAGE_USER);
-    }
+    _assert(mm_map_range_alloc(proc->space,
+                               ustack,
+                               THREAD_USTACK_PAGES,
+                               PU_PRIVATE,
+                               MM_PAGE_WRITE | MM_PAGE_USER) == 0);
 
     thr->data.rsp3_base = ustack;
     thr->data.rsp3_size = MM_PAGE_SIZE * THREAD_USTACK_PAGES;
@@ -0,0 +1,376 @@
+// Page cache for mmap()ed files: pages are read in on first use and are
+// shared by all the mappings of the file. A page is held (refcount) by
+// the cache itself and by every page table entry mapping it
+#include "sys/mem/pcache.h"
+#include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
+#include "sys/string.h"
+#include "sys/assert.h"
+#include "sys/debug.h"
+#include "sys/heap.h"
+#include "user/errno.h"
+#include "fs/ofile.h"
+#include "fs/node.h"
+#include "sys/mm.h"
+
+#define PCACHE_BUCKETS_INIT     16
+#define PCACHE_LOAD             2
+
+static struct slab_cache *pcache_page_cache = NULL;
+static struct slab_cache *pcache_cache = NULL;
+
+////
+
+static inline size_t pcache_hash(size_t index) {
+    return (size_t) ((index * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static struct pcache_page *pcache_lookup(struct pcache *pc, size_t index) {
+    struct pcache_page *p = pc->buckets[pcache_hash(index) & (pc->bucket_count - 1)];
+
+    while (p) {
+        if (p->index == index) {
+            return p;
+        }
+        p = p->next;
+    }
+
+    return NULL;
+}
+
+static void pcache_hash_insert(struct pcache_page **buckets, size_t bucket_count, struct pcache_page *p) {
+    struct pcache_page **it = &buckets[pcache_hash(p->index) & (bucket_count - 1)];
+    p->next = *it;
+    *it = p;
+}
+
+// Called with the lock held, gives up silently if there's no memory,
+// the chains just get longer then
+static void pcache_grow(struct pcache *pc) {
+    size_t new_count = pc->bucket_count * 2;
+    struct pcache_page **new_buckets, *p, *next;
+
+    if (!(new_buckets = kmalloc(sizeof(struct pcache_page *) * new_count))) {
+        return;
+    }
+    memset(new_buckets, 0, sizeof(struct pcache_page *) * new_count);
+
+    for (size_t i = 0; i < pc->bucket_count; ++i) {
+        for (p = pc->buckets[i]; p; p = next) {
+            next = p->next;
+            pcache_hash_insert(new_buckets, new_count, p);
+        }
+    }
+
+    kfree(pc->buckets);
+    pc->buckets = new_buckets;
+    pc->bucket_count = new_count;
+}
+
+static struct pcache *pcache_get(struct vnode *vn) {
+    struct pcache *pc;
+
+    if ((pc = __atomic_load_n(&vn->pcache, __ATOMIC_ACQUIRE))) {
+        return pc;
+    }
+
+    if (!pcache_cache) {
+        pcache_cache = slab_cache_get(sizeof(struct pcache));
+        pcache_page_cache = slab_cache_get(sizeof(struct pcache_page));
+        _assert(pcache_cache && pcache_page_cache);
+    }
+
+    if (!(pc = slab_calloc(pcache_cache))) {
+        return NULL;
+    }
+    pc->bucket_count = PCACHE_BUCKETS_INIT;
+    if (!(pc->buckets = kmalloc(sizeof(struct pcache_page *) * pc->bucket_count))) {
+        slab_free(pcache_cache, pc);
+        return NULL;
+    }
+    memset(pc->buckets, 0, sizeof(struct pcache_page *) * pc->bucket_count);
+
+    // Lost the race to another faulting thread
+    struct pcache *expected = NULL;
+    if (!__atomic_compare_exchange_n(&vn->pcache, &expected, pc, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        kfree(pc->buckets);
+        slab_free(pcache_cache, pc);
+        return expected;
+    }
+
+    return pc;
+}
+
+static ssize_t pcache_file_size(struct vnode *vn) {
+    struct stat st;
+    int res;
+
+    if (!vn->op || !vn->op->stat) {
+        return -EINVAL;
+    }
+    if ((res = vn->op->stat(vn, &st)) != 0) {
+        return res;
+    }
+
+    return st.st_size;
+}
+
+static int pcache_page_read(struct vnode *vn, size_t index, uintptr_t phys) {
+    struct ofile of;
+    ssize_t bread;
+    char *data = (char *) MM_VIRTUALIZE(phys);
+
+    if (!vn->op || !vn->op->read) {
+        return -EINVAL;
+    }
+
+    memset(&of, 0, sizeof(of));
+    of.flags = OF_READABLE;
+    of.file.vnode = vn;
+    of.file.pos = index * MM_PAGE_SIZE;
+
+    if ((bread = vn->op->read(&of, data, MM_PAGE_SIZE)) < 0) {
+        return bread;
+    }
+
+    // Tail of the last page, or past the end of file
+    memset(data + bread, 0, MM_PAGE_SIZE - bread);
+
+    return 0;
+}
+
+////
+
+uintptr_t pcache_page_get(struct vnode *vn, size_t index) {
+    struct pcache_page *p, *new;
+    struct pcache *pc;
+    uintptr_t phys, irq;
+
+    if (!(pc = pcache_get(vn))) {
+        return MM_NADDR;
+    }
+
+    spin_lock_irqsave(&pc->lock, &irq);
+    if ((p = pcache_lookup(pc, index))) {
+        phys = p->phys;
+        __atomic_add_fetch(&PHYS2PAGE(phys)->refcount, 1, __ATOMIC_SEQ_CST);
+        spin_release_irqrestore(&pc->lock, &irq);
+        return phys;
+    }
+    spin_release_irqrestore(&pc->lock, &irq);
+
+    // The page is read without the lock held
+    if ((phys = mm_phys_alloc_page(PU_CACHE)) == MM_NADDR) {
+        return MM_NADDR;
+    }
+    if (pcache_page_read(vn, index, phys) != 0) {
+        mm_phys_free_page(phys);
+        return MM_NADDR;
+    }
+    if (!(new = slab_calloc(pcache_page_cache))) {
+        mm_phys_free_page(phys);
+        return MM_NADDR;
+    }
+    new->index = index;
+    new->phys = phys;
+
+    spin_lock_irqsave(&pc->lock, &irq);
+    if ((p = pcache_lookup(pc, index))) {
+        // Someone else has read it meanwhile
+        phys = p->phys;
+        __atomic_add_fetch(&PHYS2PAGE(phys)->refcount, 1, __ATOMIC_SEQ_CST);
+        spin_release_irqrestore(&pc->lock, &irq);
+
+        mm_phys_free_page(new->phys);
+        slab_free(pcache_page_cache, new);
+        return phys;
+    }
+
+    // One reference for the cache, one for the caller
+    PHYS2PAGE(phys)->refcount = 2;
+    pcache_hash_insert(pc->buckets, pc->bucket_count, new);
+    if (++pc->count > pc->bucket_count * PCACHE_LOAD) {
+        pcache_grow(pc);
+    }
+    spin_release_irqrestore(&pc->lock, &irq);
+
+    return phys;
+}
+
+void pcache_page_put(uintptr_t phys) {
+    // The cache's own reference is still there
+    _assert(__atomic_sub_fetch(&PHYS2PAGE(phys)->refcount, 1, __ATOMIC_SEQ_CST) != 0);
+}
+
+void pcache_mark_dirty(struct vnode *vn, size_t index) {
+    struct pcache *pc = vn->pcache;
+    struct pcache_page *p;
+    uintptr_t irq;
+
+    _assert(pc);
+
+    spin_lock_irqsave(&pc->lock, &irq);
+    p = pcache_lookup(pc, index);
+    _assert(p);
+    if (!(p->flags & PCACHE_PAGE_DIRTY)) {
+        p->flags |= PCACHE_PAGE_DIRTY;
+        ++pc->dirty;
+    }
+    spin_release_irqrestore(&pc->lock, &irq);
+}
+
+int pcache_sync(struct vnode *vn) {
+    struct pcache *pc = vn->pcache;
+    struct pcache_page *p, **pages;
+    size_t count = 0, len;
+    ssize_t size, res = 0;
+    struct ofile of;
+    uintptr_t irq;
+
+    if (!pc || !__atomic_load_n(&pc->dirty, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (!vn->op || !vn->op->write) {
+        return -EROFS;
+    }
+    if ((size = pcache_file_size(vn)) < 0) {
+        return size;
+    }
+
+    // Pages are never removed from the cache while they're dirty, so
+    // the entries can be used after the lock is dropped
+    spin_lock_irqsave(&pc->lock, &irq);
+    if (!(pages = kmalloc(sizeof(struct pcache_page *) * pc->dirty))) {
+        spin_release_irqrestore(&pc->lock, &irq);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < pc->bucket_count; ++i) {
+        for (p = pc->buckets[i]; p; p = p->next) {
+            if (p->flags & PCACHE_PAGE_DIRTY) {
+                pages[count++] = p;
+            }
+        }
+    }
+    spin_release_irqrestore(&pc->lock, &irq);
+
+    memset(&of, 0, sizeof(of));
+    of.flags = OF_WRITABLE;
+    of.file.vnode = vn;
+
+    for (size_t i = 0; i < count; ++i) {
+        p = pages[i];
+
+        if (p->index * MM_PAGE_SIZE < (size_t) size) {
+            len = MIN(MM_PAGE_SIZE, size - p->index * MM_PAGE_SIZE);
+            of.file.pos = p->index * MM_PAGE_SIZE;
+
+            if ((res = vn->op->write(&of, (void *) MM_VIRTUALIZE(p->phys), len)) < 0) {
+                kwarn("pcache: failed to write back page %u\n", (uint32_t) p->index);
+                break;
+            }
+            res = 0;
+        }
+
+        // Pages still mapped writable may be written to again
+        spin_lock_irqsave(&pc->lock, &irq);
+        if ((p->flags & PCACHE_PAGE_DIRTY) &&
+            __atomic_load_n(&PHYS2PAGE(p->phys)->refcount, __ATOMIC_SEQ_CST) == 1) {
+            p->flags &= ~PCACHE_PAGE_DIRTY;
+            --pc->dirty;
+        }
+        spin_release_irqrestore(&pc->lock, &irq);
+    }
+
+    kfree(pages);
+    return res;
+}
+
+void pcache_update(struct vnode *vn, size_t pos, const void *buf, size_t count) {
+    struct pcache *pc = vn->pcache;
+    struct pcache_page *p;
+    uintptr_t irq, phys;
+    size_t off, len;
+
+    if (!pc) {
+        return;
+    }
+
+    while (count) {
+        off = pos & MM_PAGE_OFFSET_MASK;
+        len = MIN(count, MM_PAGE_SIZE - off);
+
+        // buf may be a userspace pointer, so it can't be touched with
+        // the lock held
+        phys = MM_NADDR;
+        spin_lock_irqsave(&pc->lock, &irq);
+        if ((p = pcache_lookup(pc, pos / MM_PAGE_SIZE))) {
+            phys = p->phys;
+            __atomic_add_fetch(&PHYS2PAGE(phys)->refcount, 1, __ATOMIC_SEQ_CST);
+        }
+        spin_release_irqrestore(&pc->lock, &irq);
+
+        if (phys != MM_NADDR) {
+            memcpy((void *) MM_VIRTUALIZE(phys + off), buf, len);
+            pcache_page_put(phys);
+        }
+
+        buf += len;
+        pos += len;
+        count -= len;
+    }
+}
+
+void pcache_shrink(struct vnode *vn) {
+    struct pcache *pc = vn->pcache;
+    struct pcache_page *p, **it;
+    uintptr_t irq;
+
+    if (!pc) {
+        return;
+    }
+
+    spin_lock_irqsave(&pc->lock, &irq);
+    for (size_t i = 0; i < pc->bucket_count; ++i) {
+        it = &pc->buckets[i];
+
+        while ((p = *it)) {
+            if ((p->flags & PCACHE_PAGE_DIRTY) ||
+                __atomic_load_n(&PHYS2PAGE(p->phys)->refcount, __ATOMIC_SEQ_CST) != 1) {
+                it = &p->next;
+                continue;
+            }
+
+            *it = p->next;
+            PHYS2PAGE(p->phys)->refcount = 0;
+            mm_phys_free_page(p->phys);
+            slab_free(pcache_page_cache, p);
+            --pc->count;
+        }
+    }
+    spin_release_irqrestore(&pc->lock, &irq);
+}
+
+void pcache_release(struct vnode *vn) {
+    struct pcache *pc = vn->pcache;
+    struct pcache_page *p, *next;
+
+    if (!pc) {
+        return;
+    }
+
+    for (size_t i = 0; i < pc->bucket_count; ++i) {
+        for (p = pc->buckets[i]; p; p = next) {
+            next = p->next;
+
+            // Nobody may have it mapped by now
+            _assert(PHYS2PAGE(p->phys)->refcount == 1);
+            PHYS2PAGE(p->phys)->refcount = 0;
+            mm_phys_free_page(p->phys);
+            slab_free(pcache_page_cache, p);
+        }
+    }
+
+    kfree(pc->buckets);
+    slab_free(pcache_cache, pc);
+    vn->pcache = NULL;
+}
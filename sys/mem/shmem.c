@@ -1,11 +1,12 @@
-#include "sys/mem/vmalloc.h"
 #include "sys/mem/shmem.h"
 #include "sys/block/blk.h"
 #include "sys/mem/phys.h"
 #include "sys/mem/slab.h"
+#include "sys/mem/vma.h"
 #include "user/errno.h"
 #include "sys/thread.h"
 #include "sys/assert.h"
+#include "sys/string.h"
 #include "user/mman.h"
 #include "sys/debug.h"
 #include "fs/ofile.h"
@@ -24,32 +25,22 @@ struct shm_chunk {
 
 static LIST_HEAD(g_shm_chunks);
 
-static int sys_mmap_anon(mm_space_t space, uintptr_t base, size_t page_count, int prot, int flags) {
-    uint64_t map_flags = MM_PAGE_USER;
-    int map_usage = PU_PRIVATE;
-
-    if (prot & PROT_WRITE) {
-        map_flags |= MM_PAGE_WRITE;
-    }
-    if (flags & MAP_SHARED) {
-        map_usage = PU_SHARED;
+// Private anonymous mappings only reserve the area, pages are allocated
+// on first access by vma_fault(). Shared ones are populated right away,
+// so that fork()ed children refer to the same pages
+static int sys_mmap_anon(mm_space_t space, uintptr_t base, size_t page_count, uint64_t map_flags, int flags) {
+    if (!(flags & MAP_SHARED)) {
+        return 0;
     }
 
-    // Map pages
-    for (size_t i = 0; i < page_count; ++i) {
-        uintptr_t phys = mm_phys_alloc_page(map_usage);
-        _assert(phys != MM_NADDR);
-        struct page *page = PHYS2PAGE(phys);
-        _assert(page);
-
-        page->flags |= PG_MMAPED;
-        _assert(mm_map_single(space, base + i * MM_PAGE_SIZE, phys, map_flags) == 0);
+    if (mm_map_range_alloc(space, base, page_count, PU_SHARED, map_flags) != 0) {
+        return -ENOMEM;
     }
 
     return 0;
 }
 
-static uintptr_t mmap_findmem(mm_space_t space, void *hint, size_t page_count, int flags) {
+static uintptr_t mmap_findmem(struct process *proc, void *hint, size_t page_count, int flags, uint64_t map_flags, uint32_t vma_flags) {
     uintptr_t virt_base;
 
     if (flags & MAP_FIXED) {
@@ -59,40 +50,51 @@ static uintptr_t mmap_findmem(mm_space_t space, void *hint, size_t page_count, i
         if (virt_base == 0 || (virt_base & MM_PAGE_OFFSET_MASK)) {
             return MM_NADDR;
         }
+        if (virt_base >= KERNEL_VIRT_BASE || page_count > (KERNEL_VIRT_BASE - virt_base) / MM_PAGE_SIZE) {
+            return MM_NADDR;
+        }
 
-        // TODO: check for hint + page_count * PAGE_SIZE overflow
-        // Check that any of the pages in that range are already taken
-        for (size_t i = 0; i < page_count; ++i) {
-            if (mm_map_get(space, virt_base + i * MM_PAGE_SIZE, 0) != MM_NADDR) {
-                return MM_NADDR;
-            }
+        // Fails if any of the pages in that range are already taken
+        if (vma_insert(&proc->vm, virt_base, page_count, map_flags, vma_flags) != 0) {
+            return MM_NADDR;
         }
-        // Good to proceed
     } else {
-        virt_base = vmfind(space, 0x100000000, 0x400000000, page_count);
-        _assert(virt_base != MM_NADDR);
+        virt_base = vma_alloc(&proc->vm, 0x100000000, 0x400000000, page_count, map_flags, vma_flags);
     }
 
     return virt_base;
 }
 
 void *sys_mmap(void *hint, size_t length, int prot, int flags, int fd, off_t off) {
+    struct process *proc;
     size_t page_count;
-    mm_space_t space;
+    uint64_t map_flags;
+    uint32_t vma_flags;
     uintptr_t base;
     long res;
 
     _assert(thread_self && thread_self->proc);
-    space = thread_self->proc->space;
-    _assert(space);
+    proc = thread_self->proc;
+    _assert(proc->space);
 
-    if (length & MM_PAGE_OFFSET_MASK) {
+    if (!length || (length & MM_PAGE_OFFSET_MASK)) {
         return (void *) -EINVAL;
     }
     page_count = length / MM_PAGE_SIZE;
 
+    map_flags = MM_PAGE_USER;
+    if (prot & PROT_WRITE) {
+        map_flags |= MM_PAGE_WRITE;
+    }
+    vma_flags = 0;
+    if (flags & MAP_SHARED) {
+        vma_flags |= VMA_SHARED;
+    } else if (flags & MAP_ANONYMOUS) {
+        vma_flags |= VMA_ANON;
+    }
+
     // Allocate the virtual pages first
-    base = mmap_findmem(space, hint, page_count, flags);
+    base = mmap_findmem(proc, hint, page_count, flags, map_flags, vma_flags);
 
     if (base == MM_NADDR) {
         return (void *) -ENOMEM;
@@ -100,46 +102,81 @@ void *sys_mmap(void *hint, size_t length, int prot, int flags, int fd, off_t off
 
     if (flags & MAP_ANONYMOUS) {
         // Anonymous mapping
-        if ((res = sys_mmap_anon(space, base, page_count, prot, flags)) != 0) {
-            return (void *) res;
-        }
-        return (void *) base;
+        res = sys_mmap_anon(proc->space, base, page_count, map_flags, flags);
     } else {
         // File/device-backed mapping
-        if (fd < 0 || fd >= THREAD_MAX_FDS) {
-            return (void *) -EBADF;
+        struct ofile *of = NULL;
+
+        if (fd >= 0 && fd < THREAD_MAX_FDS) {
+            of = proc->fds[fd];
         }
 
-        struct ofile *of = thread_self->proc->fds[fd];
         if (!of) {
-            return (void *) -EBADF;
+            res = -EBADF;
+        } else if (ofile_is_socket(of)) {
+            res = -EINVAL;
+        } else {
+            struct vnode *vn = of->file.vnode;
+            _assert(vn);
+
+            switch (vn->type) {
+            case VN_BLK:
+                res = blk_mmap(vn->dev, base, page_count, prot, flags);
+                break;
+            case VN_REG:
+                // Pages are faulted in from the vnode's page cache
+                if (off < 0 || (off & MM_PAGE_OFFSET_MASK)) {
+                    res = -EINVAL;
+                } else if (!(of->flags & OF_READABLE) ||
+                           ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !(of->flags & OF_WRITABLE))) {
+                    res = -EACCES;
+                } else {
+                    vma_set_vnode(&proc->vm, base, vn, off);
+                    res = 0;
+                }
+                break;
+            default:
+                res = -EINVAL;
+                break;
+            }
         }
+    }
 
-        if (ofile_is_socket(of)) {
-            return (void *) -EINVAL;
-        }
+    if (res != 0) {
+        vma_remove(&proc->vm, base, page_count);
+        return (void *) res;
+    }
 
-        struct vnode *vn = of->file.vnode;
-        _assert(vn);
+    return (void *) base;
+}
 
-        switch (vn->type) {
-        case VN_BLK:
-            {
-                struct blkdev *blk = vn->dev;
-                if ((res = blk_mmap(blk, base, page_count, prot, flags)) != 0) {
-                    return (void *) res;
-                }
-                return (void *) base;
-            }
-        default:
-            return (void *) -EINVAL;
+static void sys_munmap_page(uintptr_t phys, int last, void *arg) {
+    struct page *page = PHYS2PAGE(phys);
+    _assert(page);
+
+    switch (page->usage) {
+    case PU_DEVICE:
+        // TODO: FIX THIS
+        break;
+    case PU_CACHE:
+        // File page, which is still held by the page cache
+        break;
+    case PU_SHARED:
+    case PU_PRIVATE:
+        if (last) {
+            //kdebug("Free page %p\n", phys);
+            mm_phys_free_page(phys);
         }
+        break;
+    default:
+        panic("Unhandled page type: %d (%p)\n", page->usage, phys);
     }
 }
 
 int sys_munmap(void *ptr, size_t len) {
     uintptr_t addr = (uintptr_t) ptr;
     struct thread *thr;
+    int res;
 
     thr = thread_self;
     _assert(thr);
@@ -161,44 +198,47 @@ int sys_munmap(void *ptr, size_t len) {
 
     len /= MM_PAGE_SIZE;
 
-    // TODO: If it's a device mapping, notify device a page was unmapped
-
-    for (size_t i = 0; i < len; ++i) {
-        uint64_t flags;
-        uintptr_t phys = mm_map_get(thr->proc->space, addr + i * MM_PAGE_SIZE, &flags);
+    // The areas go first, as that is the part which may fail
+    if ((res = vma_remove(&thr->proc->vm, addr, len)) != 0) {
+        return res;
+    }
 
-        if (phys == MM_NADDR) {
-            continue;
-        }
+    // TODO: If it's a device mapping, notify device a page was unmapped
+    mm_umap_range(thr->proc->space, addr, len, sys_munmap_page, NULL);
 
-        struct page *page = PHYS2PAGE(phys);
-        _assert(page);
+    return 0;
+}
 
-        // TODO: FIX THIS
-        if (page->usage == PU_DEVICE) {
-            _assert(page->refcount);
-            _assert(mm_umap_single(thr->proc->space, addr + i * MM_PAGE_SIZE, 1) == phys);
+int sys_mprotect(void *ptr, size_t len, int prot) {
+    uintptr_t addr = (uintptr_t) ptr;
+    uint64_t map_flags;
+    struct thread *thr;
+    int res;
 
-            continue;
-        }
+    thr = thread_self;
+    _assert(thr);
 
-        if (!(page->flags & PG_MMAPED)) {
-            panic("Tried to unmap non-mmapped page\n");
-        }
+    if ((addr & MM_PAGE_OFFSET_MASK) || (len & MM_PAGE_OFFSET_MASK)) {
+        return -EINVAL;
+    }
+    if (addr >= KERNEL_VIRT_BASE || KERNEL_VIRT_BASE - addr < len) {
+        return -EACCES;
+    }
 
-        _assert(page->refcount);
-        _assert(mm_umap_single(thr->proc->space, addr + i * MM_PAGE_SIZE, 1) == phys);
+    len /= MM_PAGE_SIZE;
+    map_flags = MM_PAGE_USER;
+    if (prot & PROT_WRITE) {
+        map_flags |= MM_PAGE_WRITE;
+    }
 
-        if (page->usage == PU_SHARED || page->usage == PU_PRIVATE) {
-            if (!page->refcount) {
-                //kdebug("Free page %p\n", phys);
-                mm_phys_free_page(phys);
-            }
-        } else {
-            panic("Unhandled page type: %d (%p -> %p)\n", page->usage, addr + i * MM_PAGE_SIZE, phys);
-        }
+    if ((res = vma_protect(&thr->proc->vm, addr, len, map_flags)) != 0) {
+        return res;
     }
 
+    // Pages gaining write access are upgraded by the fault handler, which
+    // checks the area permissions
+    mm_protect_range(thr->proc->space, addr, len, map_flags);
+
     return 0;
 }
 
@@ -213,9 +253,22 @@ int sys_shmget(size_t size, int flags) {
     chunk->id = ++shmid;
     list_head_init(&chunk->link);
 
-    for (size_t i = 0; i < size; ++i) {
+    for (size_t i = 0; i < size;) {
+        // Contiguous runs can be mapped as huge pages by shmat()
+        if (size - i >= MM_HUGE_PAGE_COUNT) {
+            uintptr_t phys = mm_phys_alloc_contiguous(MM_HUGE_PAGE_COUNT, PU_SHARED);
+
+            if (phys != MM_NADDR) {
+                for (size_t j = 0; j < MM_HUGE_PAGE_COUNT; ++j) {
+                    chunk->pages[i++] = phys + j * MM_PAGE_SIZE;
+                }
+                continue;
+            }
+        }
+
         chunk->pages[i] = mm_phys_alloc_page(PU_SHARED);
         _assert(chunk->pages[i] != MM_NADDR);
+        ++i;
     }
 
     list_add(&chunk->link, &g_shm_chunks);
@@ -242,16 +295,17 @@ void *sys_shmat(int id, const void *hint, int flags) {
     space = thread_self->proc->space;
 
     // TODO: use hint
-    virt_base = vmfind(space, 0x100000000, 0x400000000, chunk->page_count);
-    _assert(virt_base != MM_NADDR);
-
-    for (size_t i = 0; i < chunk->page_count; ++i) {
-        _assert(PHYS2PAGE(chunk->pages[i])->usage == PU_SHARED);
-        mm_map_single(space,
-                      virt_base + i * MM_PAGE_SIZE,
-                      chunk->pages[i],
-                      MM_PAGE_WRITE | MM_PAGE_USER);
+    virt_base = vma_alloc(&thread_self->proc->vm,
+                          0x100000000,
+                          0x400000000,
+                          chunk->page_count,
+                          MM_PAGE_WRITE | MM_PAGE_USER,
+                          VMA_SHARED);
+    if (virt_base == MM_NADDR) {
+        return (void *) -ENOMEM;
     }
 
+    mm_map_range(space, virt_base, chunk->pages, chunk->page_count, MM_PAGE_WRITE | MM_PAGE_USER);
+
     return (void *) virt_base;
 }
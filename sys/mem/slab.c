@@ -1,10 +1,13 @@
+#include "arch/amd64/cpu.h"
 #include "sys/mem/phys.h"
 #include "sys/mem/slab.h"
 #include "sys/assert.h"
 #include "sys/string.h"
 #include "sys/debug.h"
+#include "sys/heap.h"
 #include "sys/list.h"
 #include "sys/attr.h"
+#include "sys/spin.h"
 #include "sys/mm.h"
 
 typedef uint32_t bufctl_t;
@@ -17,14 +20,28 @@ typedef uint32_t bufctl_t;
 #define CACHE_SIZE_END \
     { 0, NULL }
 #define PREALLOC_COUNT  6
+// Largest predefined cache size, kmalloc() goes to heap for anything larger
+#define SLAB_SIZE_MAX   (1UL << (PREALLOC_COUNT + 3))
+
+// Per-CPU object cache size. When a magazine is empty or full, half
+// of it is moved from/to the slabs at once
+#define SLAB_MAG_SIZE   32
+
+struct slab_magazine {
+    size_t count;
+    void *objs[SLAB_MAG_SIZE];
+};
 
 struct slab_cache {
+    spin_t lock;
     struct list_head slabs_empty, slabs_partial, slabs_full;
     size_t object_size, objects_per_slab;
+    struct slab_magazine mags[AMD64_MAX_SMP];
 };
 
 struct slab {
     struct list_head list;
+    struct slab_cache *cache;
     size_t inuse;
     void *base;
     bufctl_t free;
@@ -46,7 +63,10 @@ struct cache_size predefined_cache_sizes[PREALLOC_COUNT + 1] = {
     CACHE_SIZE_END
 };
 
+static int slab_ready = 0;
+
 static void slab_init_cache(struct slab_cache *cp, size_t object_size) {
+    cp->lock = 0;
     cp->object_size = object_size;
     list_head_init(&cp->slabs_empty);
     list_head_init(&cp->slabs_partial);
@@ -54,8 +74,8 @@ static void slab_init_cache(struct slab_cache *cp, size_t object_size) {
 
     // Reserve space for slab descriptor
     cp->objects_per_slab = (MM_PAGE_SIZE - sizeof(struct slab)) / cp->object_size;
-    // Reserve space for bufctl
-    size_t bufctl_array_size = cp->objects_per_slab * sizeof(bufctl_t);
+    // Reserve space for bufctl and 16-byte alignment of objects
+    size_t bufctl_array_size = cp->objects_per_slab * sizeof(bufctl_t) + 0xF;
     cp->objects_per_slab -= (bufctl_array_size + cp->object_size - 1) / cp->object_size;
 }
 
@@ -64,6 +84,8 @@ __init(slab_init_caches) {
         kdebug("Initializing predefined cache: %u\n", 1UL << (i + 4));
         slab_init_cache(&predefined_caches[i], 1UL << (i + 4));
     }
+
+    slab_ready = 1;
 }
 
 struct slab_cache *slab_cache_get(size_t size) {
@@ -88,9 +110,11 @@ static struct slab *slab_create(struct slab_cache *cp) {
     }
 
     struct slab *slab = (struct slab *) MM_VIRTUALIZE(page_phys);
+    PHYS2PAGE(page_phys)->flags |= PG_SLAB;
 
     slab->base = ((void *) &slab[1]) + sizeof(bufctl_t) * cp->objects_per_slab;
-    slab->base = (void *) (((uintptr_t) slab->base + 0x7) & ~0x7);
+    slab->base = (void *) (((uintptr_t) slab->base + 0xF) & ~0xF);
+    slab->cache = cp;
     list_head_init(&slab->list);
     slab->inuse = 0;
     slab->free = 0;
@@ -109,9 +133,12 @@ static struct slab *slab_create(struct slab_cache *cp) {
 static void slab_destroy(struct slab_cache *cp, struct slab *slabp) {
     _assert(!((uintptr_t) slabp & 0xFFF));
     kdebug("Destoyed slab of %u x %u B\n", cp->objects_per_slab, cp->object_size);
+    PHYS2PAGE(MM_PHYS(slabp))->flags &= ~PG_SLAB;
     mm_phys_free_page(MM_PHYS(slabp));
 }
 
+// Slab lists are only touched with the cache locked
+
 static inline void *slab_alloc_from(struct slab_cache *cp, struct slab *slabp) {
     void *objp;
     ++slabp->inuse;
@@ -126,11 +153,10 @@ static inline void *slab_alloc_from(struct slab_cache *cp, struct slab *slabp) {
         list_add(&slabp->list, &cp->slabs_full);
     }
 
-    memset(objp, 0, cp->object_size);
     return objp;
 }
 
-void *slab_calloc_int(struct slab_cache *cp) {
+static void *slab_get(struct slab_cache *cp) {
     struct list_head *slabs_partial, *slabs_empty, *entry;
     struct slab *slabp;
 try_again:
@@ -162,7 +188,7 @@ try_again:
     return slab_alloc_from(cp, slabp);
 }
 
-void slab_free_int(struct slab_cache *cp, void *objp) {
+static void slab_put(struct slab_cache *cp, void *objp) {
     struct slab *slabp;
     // Get page-aligned address
     uintptr_t page = (uintptr_t) objp;
@@ -172,6 +198,7 @@ void slab_free_int(struct slab_cache *cp, void *objp) {
 
     // slab descriptor is on the same page objp points to
     slabp = (struct slab *) page;
+    _assert(slabp->cache == cp);
 
     unsigned int obj_number = (objp - slabp->base) / cp->object_size;
     slab_bufctl(slabp)[obj_number] = slabp->free;
@@ -191,6 +218,83 @@ void slab_free_int(struct slab_cache *cp, void *objp) {
     }
 }
 
+//// Per-CPU magazines
+// Objects are taken from/returned to the current CPU's magazine with
+// interrupts disabled, the cache lock is only needed to move a batch
+
+static inline struct slab_magazine *slab_mag_get(struct slab_cache *cp, uintptr_t *irq) {
+    asm volatile ("pushfq; cli; popq %0":"=r"(*irq)::"memory");
+    if (!percpu_ready) {
+        return NULL;
+    }
+    return &cp->mags[get_cpu()->processor_id];
+}
+
+static inline void slab_mag_release(uintptr_t irq) {
+    if (irq & (1 << 9)) {
+        asm volatile ("sti");
+    }
+}
+
+void *slab_calloc_int(struct slab_cache *cp) {
+    struct slab_magazine *mag;
+    void *objp = NULL;
+    uintptr_t irq;
+
+    if ((mag = slab_mag_get(cp, &irq))) {
+        if (!mag->count) {
+            spin_lock(&cp->lock);
+            while (mag->count < SLAB_MAG_SIZE / 2) {
+                if (!(objp = slab_get(cp))) {
+                    break;
+                }
+                mag->objs[mag->count++] = objp;
+            }
+            spin_release(&cp->lock);
+        }
+
+        objp = mag->count ? mag->objs[--mag->count] : NULL;
+    } else {
+        spin_lock(&cp->lock);
+        objp = slab_get(cp);
+        spin_release(&cp->lock);
+    }
+
+    slab_mag_release(irq);
+
+    if (objp) {
+        memset(objp, 0, cp->object_size);
+    }
+    return objp;
+}
+
+void slab_free_int(struct slab_cache *cp, void *objp) {
+    struct slab_magazine *mag;
+    uintptr_t irq;
+
+    if ((mag = slab_mag_get(cp, &irq))) {
+        if (mag->count == SLAB_MAG_SIZE) {
+            // Return the least recently freed half
+            spin_lock(&cp->lock);
+            for (size_t i = 0; i < SLAB_MAG_SIZE / 2; ++i) {
+                slab_put(cp, mag->objs[i]);
+            }
+            spin_release(&cp->lock);
+
+            mag->count -= SLAB_MAG_SIZE / 2;
+            memmove(mag->objs, &mag->objs[SLAB_MAG_SIZE / 2], mag->count * sizeof(void *));
+        }
+
+        mag->objs[mag->count++] = objp;
+    } else {
+        spin_lock(&cp->lock);
+        slab_put(cp, objp);
+        spin_release(&cp->lock);
+    }
+
+    slab_mag_release(irq);
+}
+
 void slab_stat(struct slab_stat *st) {
     st->alloc_bytes = 0;
     st->alloc_objects = 0;
@@ -199,6 +303,10 @@ void slab_stat(struct slab_stat *st) {
     for (size_t i = 0; i < PREALLOC_COUNT; ++i) {
         struct slab_cache *cp = &predefined_caches[i];
         struct slab *slab;
+        uintptr_t irq;
+
+        // Objects sitting in magazines are accounted as allocated
+        spin_lock_irqsave(&cp->lock, &irq);
 
         list_for_each_entry(slab, &cp->slabs_full, list) {
             _assert(slab->inuse == cp->objects_per_slab);
@@ -217,7 +325,35 @@ void slab_stat(struct slab_stat *st) {
         list_for_each_entry(slab, &cp->slabs_empty, list) {
             panic("This list should be empty, slabs are freed once they're empty\n");
         }
+        spin_release_irqrestore(&cp->lock, &irq);
+    }
+}
+
+//// kmalloc()
+
+void *kmem_alloc(size_t count) {
+    // Allocations made before caches are initialized go to heap
+    if (count <= SLAB_SIZE_MAX && slab_ready) {
+        return slab_calloc(slab_cache_get(count));
+    }
+    return heap_alloc(heap_global, count);
+}
+
+void kmem_free(void *ptr) {
+    struct slab *slabp;
+
+    if (!ptr) {
+        return;
+    }
+    // Both heap chunks and slabs are allocated pages, which tells them
+    // apart without taking the heap lock
+    slabp = (struct slab *) ((uintptr_t) ptr & ~0xFFFULL);
+    if (!(PHYS2PAGE(MM_PHYS(slabp))->flags & PG_SLAB)) {
+        heap_free(heap_global, ptr);
+        return;
     }
+
+    slab_free(slabp->cache, ptr);
 }
 
 // Tracing
@@ -0,0 +1,717 @@
+// Virtual memory areas of a process: an AVL tree keyed by start address
+// for lookups, plus the same areas in a sorted list for walking
+#include "sys/mem/pcache.h"
+#include "sys/mem/vma.h"
+#include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
+#include "sys/string.h"
+#include "sys/assert.h"
+#include "sys/thread.h"
+#include "user/errno.h"
+#include "fs/node.h"
+#include "sys/mm.h"
+
+static struct slab_cache *vm_area_cache = NULL;
+
+////
+
+static inline int vma_height(struct vm_area *a) {
+    return a ? a->height : 0;
+}
+
+static inline void vma_update(struct vm_area *a) {
+    int l = vma_height(a->left), r = vma_height(a->right);
+    a->height = (l > r ? l : r) + 1;
+}
+
+static struct vm_area *vma_rotate_right(struct vm_area *a) {
+    struct vm_area *b = a->left;
+    a->left = b->right;
+    b->right = a;
+    vma_update(a);
+    vma_update(b);
+    return b;
+}
+
+static struct vm_area *vma_rotate_left(struct vm_area *a) {
+    struct vm_area *b = a->right;
+    a->right = b->left;
+    b->left = a;
+    vma_update(a);
+    vma_update(b);
+    return b;
+}
+
+static struct vm_area *vma_balance(struct vm_area *a) {
+    int bf;
+
+    vma_update(a);
+    bf = vma_height(a->left) - vma_height(a->right);
+
+    if (bf > 1) {
+        if (vma_height(a->left->left) < vma_height(a->left->right)) {
+            a->left = vma_rotate_left(a->left);
+        }
+        return vma_rotate_right(a);
+    }
+    if (bf < -1) {
+        if (vma_height(a->right->right) < vma_height(a->right->left)) {
+            a->right = vma_rotate_right(a->right);
+        }
+        return vma_rotate_left(a);
+    }
+
+    return a;
+}
+
+static struct vm_area *vma_tree_insert(struct vm_area *root, struct vm_area *a) {
+    if (!root) {
+        a->left = NULL;
+        a->right = NULL;
+        a->height = 1;
+        return a;
+    }
+
+    if (a->start < root->start) {
+        root->left = vma_tree_insert(root->left, a);
+    } else {
+        root->right = vma_tree_insert(root->right, a);
+    }
+
+    return vma_balance(root);
+}
+
+static struct vm_area *vma_tree_unlink_min(struct vm_area *root, struct vm_area **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = vma_tree_unlink_min(root->left, min);
+    return vma_balance(root);
+}
+
+static struct vm_area *vma_tree_remove(struct vm_area *root, struct vm_area *a) {
+    struct vm_area *min;
+
+    _assert(root);
+
+    if (a->start < root->start) {
+        root->left = vma_tree_remove(root->left, a);
+    } else if (a->start > root->start) {
+        root->right = vma_tree_remove(root->right, a);
+    } else {
+        _assert(root == a);
+
+        if (!a->right) {
+            return a->left;
+        }
+
+        a->right = vma_tree_unlink_min(a->right, &min);
+        min->left = a->left;
+        min->right = a->right;
+        return vma_balance(min);
+    }
+
+    return vma_balance(root);
+}
+
+// Last area starting at or below addr
+static struct vm_area *vma_floor(struct vm_map *map, uintptr_t addr) {
+    struct vm_area *it = map->root, *res = NULL;
+
+    while (it) {
+        if (it->start <= addr) {
+            res = it;
+            it = it->right;
+        } else {
+            it = it->left;
+        }
+    }
+
+    return res;
+}
+
+// First area ending above addr
+static struct vm_area *vma_lower_bound(struct vm_map *map, uintptr_t addr) {
+    struct vm_area *a = vma_floor(map, addr);
+    struct list_head *next;
+
+    if (a && a->end > addr) {
+        return a;
+    }
+
+    next = a ? a->link.next : map->areas.next;
+    if (next == &map->areas) {
+        return NULL;
+    }
+    return list_entry(next, struct vm_area, link);
+}
+
+static struct vm_area *vma_new(uintptr_t start, uintptr_t end, uint64_t page_flags, uint32_t flags) {
+    struct vm_area *a;
+
+    if (!vm_area_cache) {
+        vm_area_cache = slab_cache_get(sizeof(struct vm_area));
+        _assert(vm_area_cache);
+    }
+
+    if (!(a = slab_calloc(vm_area_cache))) {
+        return NULL;
+    }
+
+    a->start = start;
+    a->end = end;
+    a->page_flags = page_flags;
+    a->flags = flags;
+    list_head_init(&a->link);
+
+    return a;
+}
+
+static void vma_link(struct vm_map *map, struct vm_area *a) {
+    struct vm_area *prev = vma_floor(map, a->start);
+
+    if (prev) {
+        _assert(prev->end <= a->start);
+        list_add(&a->link, &prev->link);
+    } else {
+        list_add(&a->link, &map->areas);
+    }
+
+    map->root = vma_tree_insert(map->root, a);
+    ++map->count;
+}
+
+static void vma_unlink(struct vm_map *map, struct vm_area *a) {
+    map->root = vma_tree_remove(map->root, a);
+    list_del(&a->link);
+    --map->count;
+}
+
+static int vma_overlaps(struct vm_map *map, uintptr_t start, uintptr_t end) {
+    struct vm_area *a = vma_lower_bound(map, start);
+    return a && a->start < end;
+}
+
+// Moves [at, a->end) of the area to `tail'
+static void vma_split(struct vm_map *map, struct vm_area *a, uintptr_t at, struct vm_area *tail) {
+    _assert(at > a->start && at < a->end);
+
+    tail->start = at;
+    tail->end = a->end;
+    tail->page_flags = a->page_flags;
+    tail->flags = a->flags;
+    if ((tail->vnode = a->vnode)) {
+        tail->offset = a->offset + (at - a->start);
+        __atomic_add_fetch(&tail->vnode->open_count, 1, __ATOMIC_ACQ_REL);
+    }
+
+    a->end = at;
+    vma_link(map, tail);
+}
+
+// Called without the map lock held, as writing the pages back may block
+static void vma_drop(struct vm_area *a) {
+    struct vnode *vn = a->vnode;
+
+    if (vn) {
+        if (a->flags & VMA_SHARED) {
+            pcache_sync(vn);
+        }
+
+        _assert(__atomic_load_n(&vn->open_count, __ATOMIC_ACQUIRE));
+        if (!__atomic_sub_fetch(&vn->open_count, 1, __ATOMIC_ACQ_REL)) {
+            pcache_shrink(vn);
+        }
+    }
+
+    slab_free(vm_area_cache, a);
+}
+
+// Private copy of a file page, MM_NADDR if out of memory
+static uintptr_t vma_page_copy(uintptr_t src) {
+    uintptr_t phys = mm_phys_alloc_page(PU_PRIVATE);
+    if (phys == MM_NADDR) {
+        return MM_NADDR;
+    }
+    memcpy((void *) MM_VIRTUALIZE(phys), (const void *) MM_VIRTUALIZE(src), MM_PAGE_SIZE);
+    PHYS2PAGE(phys)->flags |= PG_MMAPED;
+    return phys;
+}
+
+////
+
+void vma_init(struct vm_map *map) {
+    map->lock = 0;
+    map->root = NULL;
+    map->count = 0;
+    list_head_init(&map->areas);
+}
+
+void vma_release(struct vm_map *map) {
+    struct list_head *it, *tmp;
+    struct list_head dead;
+    uintptr_t irq;
+
+    list_head_init(&dead);
+
+    spin_lock_irqsave(&map->lock, &irq);
+    list_for_each_safe(it, tmp, &map->areas) {
+        list_del(it);
+        list_add_tail(it, &dead);
+    }
+    map->root = NULL;
+    map->count = 0;
+    spin_release_irqrestore(&map->lock, &irq);
+
+    list_for_each_safe(it, tmp, &dead) {
+        vma_drop(list_entry(it, struct vm_area, link));
+    }
+}
+
+int vma_fork(struct vm_map *dst, struct vm_map *src) {
+    struct vm_area *a, *copy;
+    uintptr_t irq;
+    int res = 0;
+
+    _assert(!dst->count);
+
+    spin_lock_irqsave(&src->lock, &irq);
+    list_for_each_entry(a, &src->areas, link) {
+        if (!(copy = vma_new(a->start, a->end, a->page_flags, a->flags))) {
+            res = -ENOMEM;
+            break;
+        }
+        if ((copy->vnode = a->vnode)) {
+            copy->offset = a->offset;
+            __atomic_add_fetch(&copy->vnode->open_count, 1, __ATOMIC_ACQ_REL);
+        }
+        // Source is sorted already
+        list_add_tail(&copy->link, &dst->areas);
+        dst->root = vma_tree_insert(dst->root, copy);
+        ++dst->count;
+    }
+    spin_release_irqrestore(&src->lock, &irq);
+
+    return res;
+}
+
+int vma_insert(struct vm_map *map, uintptr_t start, size_t page_count, uint64_t page_flags, uint32_t flags) {
+    uintptr_t end = start + page_count * MM_PAGE_SIZE;
+    struct vm_area *a;
+    uintptr_t irq;
+
+    _assert(!(start & MM_PAGE_OFFSET_MASK));
+    if (!page_count || end < start) {
+        return -EINVAL;
+    }
+
+    if (!(a = vma_new(start, end, page_flags, flags))) {
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&map->lock, &irq);
+    if (vma_overlaps(map, start, end)) {
+        spin_release_irqrestore(&map->lock, &irq);
+        slab_free(vm_area_cache, a);
+        return -EEXIST;
+    }
+    vma_link(map, a);
+    spin_release_irqrestore(&map->lock, &irq);
+
+    return 0;
+}
+
+// First fit: only the areas from `from' onwards need to be walked
+static uintptr_t vma_find_hole(struct vm_map *map, uintptr_t from, uintptr_t to, size_t size, size_t align) {
+    uintptr_t base = (from + align - 1) & ~(align - 1);
+    struct vm_area *it;
+
+    it = vma_lower_bound(map, from);
+    while (it && it->start < to) {
+        if (it->start >= base + size) {
+            break;
+        }
+        base = (it->end + align - 1) & ~(align - 1);
+
+        if (it->link.next == &map->areas) {
+            break;
+        }
+        it = list_entry(it->link.next, struct vm_area, link);
+    }
+
+    if (base < from || base + size > to || base + size < base) {
+        return MM_NADDR;
+    }
+
+    return base;
+}
+
+uintptr_t vma_alloc(struct vm_map *map, uintptr_t from, uintptr_t to, size_t page_count, uint64_t page_flags, uint32_t flags) {
+    size_t size = page_count * MM_PAGE_SIZE;
+    uintptr_t base, irq;
+    struct vm_area *a;
+
+    if (!page_count) {
+        return MM_NADDR;
+    }
+    if (!(a = vma_new(0, 0, page_flags, flags))) {
+        return MM_NADDR;
+    }
+
+    spin_lock_irqsave(&map->lock, &irq);
+
+    // Large areas are put at huge page boundaries if there's room,
+    // so that they can be backed by huge pages
+    base = MM_NADDR;
+    if (size >= MM_HUGE_PAGE_SIZE) {
+        base = vma_find_hole(map, from, to, size, MM_HUGE_PAGE_SIZE);
+    }
+    if (base == MM_NADDR) {
+        base = vma_find_hole(map, from, to, size, MM_PAGE_SIZE);
+    }
+
+    if (base == MM_NADDR) {
+        spin_release_irqrestore(&map->lock, &irq);
+        slab_free(vm_area_cache, a);
+        return MM_NADDR;
+    }
+
+    a->start = base;
+    a->end = base + size;
+    vma_link(map, a);
+
+    spin_release_irqrestore(&map->lock, &irq);
+
+    return base;
+}
+
+void vma_set_vnode(struct vm_map *map, uintptr_t start, struct vnode *vn, size_t offset) {
+    struct vm_area *a;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&map->lock, &irq);
+    a = vma_floor(map, start);
+    _assert(a && a->start == start && !a->vnode);
+    a->vnode = vn;
+    a->offset = offset;
+    __atomic_add_fetch(&vn->open_count, 1, __ATOMIC_ACQ_REL);
+    spin_release_irqrestore(&map->lock, &irq);
+}
+
+int vma_remove(struct vm_map *map, uintptr_t start, size_t page_count) {
+    uintptr_t end = start + page_count * MM_PAGE_SIZE;
+    struct vm_area *a, *spare;
+    struct list_head *next, *tmp;
+    struct list_head dead;
+    uintptr_t irq;
+
+    list_head_init(&dead);
+
+    // Only needed when an area has to be split in two, but can't be
+    // allocated with the lock held
+    spare = vma_new(0, 0, 0, 0);
+
+    spin_lock_irqsave(&map->lock, &irq);
+
+    a = vma_lower_bound(map, start);
+    if (!spare && a && a->start < start && a->end > end) {
+        spin_release_irqrestore(&map->lock, &irq);
+        return -ENOMEM;
+    }
+    while (a && a->start < end) {
+        next = a->link.next;
+
+        if (a->start < start && a->end > end) {
+            // Hole in the middle
+            vma_split(map, a, end, spare);
+            spare = NULL;
+            a->end = start;
+            break;
+        } else if (a->start < start) {
+            a->end = start;
+        } else if (a->end > end) {
+            // Still sorts the same relative to its neighbours, so the
+            // key may be changed in place
+            a->offset += end - a->start;
+            a->start = end;
+        } else {
+            vma_unlink(map, a);
+            list_add_tail(&a->link, &dead);
+        }
+
+        if (next == &map->areas) {
+            break;
+        }
+        a = list_entry(next, struct vm_area, link);
+    }
+
+    spin_release_irqrestore(&map->lock, &irq);
+
+    list_for_each_safe(next, tmp, &dead) {
+        vma_drop(list_entry(next, struct vm_area, link));
+    }
+
+    if (spare) {
+        slab_free(vm_area_cache, spare);
+    }
+
+    return 0;
+}
+
+int vma_protect(struct vm_map *map, uintptr_t start, size_t page_count, uint64_t page_flags) {
+    uintptr_t end = start + page_count * MM_PAGE_SIZE;
+    struct vm_area *a, *spare[2];
+    uintptr_t irq, pos;
+    int res = 0;
+
+    spare[0] = vma_new(0, 0, 0, 0);
+    spare[1] = vma_new(0, 0, 0, 0);
+    if (!spare[0] || !spare[1]) {
+        // Nothing has been changed yet
+        for (size_t i = 0; i < 2; ++i) {
+            if (spare[i]) {
+                slab_free(vm_area_cache, spare[i]);
+            }
+        }
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&map->lock, &irq);
+
+    // The whole range has to be mapped
+    pos = start;
+    for (a = vma_lower_bound(map, start); a && a->start < end; ) {
+        if (a->start > pos) {
+            break;
+        }
+        // Opened read-only for all we know
+        if (a->vnode && (a->flags & VMA_SHARED) &&
+            (page_flags & MM_PAGE_WRITE) && !(a->page_flags & MM_PAGE_WRITE)) {
+            res = -EACCES;
+            break;
+        }
+        pos = a->end;
+        if (pos >= end || a->link.next == &map->areas) {
+            break;
+        }
+        a = list_entry(a->link.next, struct vm_area, link);
+    }
+    if (!res && pos < end) {
+        res = -ENOMEM;
+    }
+
+    if (!res) {
+        a = vma_lower_bound(map, start);
+        if (a->start < start) {
+            vma_split(map, a, start, spare[0]);
+            spare[0] = NULL;
+            a = list_entry(a->link.next, struct vm_area, link);
+        }
+
+        while (1) {
+            if (a->end > end) {
+                vma_split(map, a, end, spare[1]);
+                spare[1] = NULL;
+            }
+            a->page_flags = page_flags;
+
+            if (a->end >= end) {
+                break;
+            }
+            a = list_entry(a->link.next, struct vm_area, link);
+        }
+    }
+
+    spin_release_irqrestore(&map->lock, &irq);
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (spare[i]) {
+            slab_free(vm_area_cache, spare[i]);
+        }
+    }
+
+    return res;
+}
+
+int vma_busy(struct vm_map *map, uintptr_t start, size_t page_count) {
+    uintptr_t irq;
+    int res;
+
+    spin_lock_irqsave(&map->lock, &irq);
+    res = vma_overlaps(map, start, start + page_count * MM_PAGE_SIZE);
+    spin_release_irqrestore(&map->lock, &irq);
+
+    return res;
+}
+
+uint64_t vma_page_flags(struct vm_map *map, uintptr_t addr) {
+    struct vm_area *a;
+    uint64_t res = 0;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&map->lock, &irq);
+    if ((a = vma_floor(map, addr)) && a->end > addr) {
+        res = a->page_flags;
+    }
+    spin_release_irqrestore(&map->lock, &irq);
+
+    return res;
+}
+
+// Back the whole aligned 2MiB around `addr' by a huge page if the area
+// covers it and nothing in there has been touched yet
+static int vma_fault_huge(struct process *proc, struct vm_area *a, uintptr_t addr) {
+    uintptr_t base = addr & ~(MM_HUGE_PAGE_SIZE - 1);
+    uintptr_t phys;
+
+    if (base < a->start || a->end - base < MM_HUGE_PAGE_SIZE || !mm_huge_free(proc->space, base)) {
+        return -1;
+    }
+    if ((phys = mm_phys_alloc_contiguous(MM_HUGE_PAGE_COUNT, PU_PRIVATE)) == MM_NADDR) {
+        return -1;
+    }
+
+    memset((void *) MM_VIRTUALIZE(phys), 0, MM_HUGE_PAGE_SIZE);
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+        PHYS2PAGE(phys + i * MM_PAGE_SIZE)->flags |= PG_MMAPED;
+    }
+
+    if (mm_map_huge(proc->space, base, phys, a->page_flags) != 0) {
+        // The caller falls back to a single page
+        for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+            mm_phys_free_page(phys + i * MM_PAGE_SIZE);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int vma_fault(struct process *proc, uintptr_t addr, int write) {
+    struct vm_map *map = &proc->vm;
+    uintptr_t phys, cached, irq;
+    struct vm_area *a;
+    struct vnode *vn;
+    uint64_t flags;
+    size_t index;
+    int res;
+
+    addr &= MM_PAGE_MASK;
+
+    spin_lock_irqsave(&map->lock, &irq);
+
+    a = vma_floor(map, addr);
+    if (!a || a->end <= addr || !((a->flags & VMA_ANON) || a->vnode)) {
+        spin_release_irqrestore(&map->lock, &irq);
+        return -1;
+    }
+    if (write && !(a->page_flags & MM_PAGE_WRITE)) {
+        spin_release_irqrestore(&map->lock, &irq);
+        return -1;
+    }
+
+    if ((phys = mm_map_get(proc->space, addr, &flags)) != MM_NADDR) {
+        // Another thread of the process may have got here first
+        if (!write || (flags & MM_PAGE_WRITE)) {
+            spin_release_irqrestore(&map->lock, &irq);
+            return 0;
+        }
+
+        // Write to a file page in a private mapping
+        if (!a->vnode || (a->flags & VMA_SHARED) || PHYS2PAGE(phys)->usage != PU_CACHE) {
+            spin_release_irqrestore(&map->lock, &irq);
+            return -1;
+        }
+
+        cached = phys;
+        if ((phys = vma_page_copy(cached)) == MM_NADDR) {
+            spin_release_irqrestore(&map->lock, &irq);
+            return -1;
+        }
+        _assert(mm_umap_single(proc->space, addr, 1) == cached);
+        if (mm_map_single(proc->space, addr, phys, a->page_flags) != 0) {
+            // The file page is faulted in again on the next access
+            mm_phys_free_page(phys);
+            spin_release_irqrestore(&map->lock, &irq);
+            return -1;
+        }
+
+        spin_release_irqrestore(&map->lock, &irq);
+        return 0;
+    }
+
+    if (!a->vnode) {
+        if (vma_fault_huge(proc, a, addr) == 0) {
+            spin_release_irqrestore(&map->lock, &irq);
+            return 0;
+        }
+
+        // Out of memory is reported to the process as a bad access
+        if ((phys = mm_phys_alloc_page(PU_PRIVATE)) == MM_NADDR) {
+            spin_release_irqrestore(&map->lock, &irq);
+            return -1;
+        }
+        memset((void *) MM_VIRTUALIZE(phys), 0, MM_PAGE_SIZE);
+        PHYS2PAGE(phys)->flags |= PG_MMAPED;
+
+        if (mm_map_single(proc->space, addr, phys, a->page_flags) != 0) {
+            mm_phys_free_page(phys);
+            spin_release_irqrestore(&map->lock, &irq);
+            return -1;
+        }
+
+        spin_release_irqrestore(&map->lock, &irq);
+        return 0;
+    }
+
+    // The page may have to be read from the file, which can't be done
+    // with the lock held. Keep the vnode referenced meanwhile
+    vn = a->vnode;
+    index = (a->offset + (addr - a->start)) / MM_PAGE_SIZE;
+    __atomic_add_fetch(&vn->open_count, 1, __ATOMIC_ACQ_REL);
+    spin_release_irqrestore(&map->lock, &irq);
+
+    cached = pcache_page_get(vn, index);
+
+    spin_lock_irqsave(&map->lock, &irq);
+    a = vma_floor(map, addr);
+
+    if (cached == MM_NADDR || !a || a->end <= addr || a->vnode != vn ||
+        (a->offset + (addr - a->start)) / MM_PAGE_SIZE != index) {
+        // Couldn't be read or the area has changed meanwhile
+        res = -1;
+    } else if (mm_map_get(proc->space, addr, NULL) != MM_NADDR) {
+        res = 0;
+    } else if (a->flags & VMA_SHARED) {
+        if ((res = mm_map_single(proc->space, addr, cached, a->page_flags)) == 0 &&
+            (a->page_flags & MM_PAGE_WRITE)) {
+            pcache_mark_dirty(vn, index);
+        }
+    } else if (write) {
+        if ((phys = vma_page_copy(cached)) == MM_NADDR) {
+            res = -1;
+        } else if ((res = mm_map_single(proc->space, addr, phys, a->page_flags)) != 0) {
+            mm_phys_free_page(phys);
+        }
+    } else {
+        // Copied once written to
+        res = mm_map_single(proc->space, addr, cached, a->page_flags & ~MM_PAGE_WRITE);
+    }
+    if (res != 0) {
+        // A bad access for the process, whatever the reason
+        res = -1;
+    }
+
+    spin_release_irqrestore(&map->lock, &irq);
+
+    if (cached != MM_NADDR) {
+        pcache_page_put(cached);
+    }
+    if (!__atomic_sub_fetch(&vn->open_count, 1, __ATOMIC_ACQ_REL)) {
+        pcache_shrink(vn);
+    }
+
+    return res;
+}
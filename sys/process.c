@@ -5,6 +5,7 @@
 #include "sys/thread.h"
 #include "sys/string.h"
 #include "user/errno.h"
+#include "sys/sched_class.h"
 #include "sys/sched.h"
 #include "sys/debug.h"
 #include "fs/sysfs.h"
@@ -53,6 +54,101 @@ static int sysfs_proc_ioctx(void *ctx, char *buf, size_t lim) {
     return 0;
 }
 
+static void sysfs_proc_sched_policy(struct thread *thr, char **buf, size_t *lim) {
+    if (thr->sched_class == &sched_class_rt) {
+        sysfs_buf_printf(*buf, *lim, "rt %d\n", thr->sched_prio);
+    } else {
+        sysfs_buf_printf(*buf, *lim, "fair %d\n", thr->sched_nice);
+    }
+}
+
+static void sysfs_proc_sched_stat(const struct sched_stat *st, char **buf, size_t *lim) {
+    uint64_t wait_avg = st->nwakeups ? st->wait_total / st->nwakeups : 0;
+
+    sysfs_buf_printf(*buf, *lim, "runtime:  %lu ms\n", st->runtime / 1000000ULL);
+    sysfs_buf_printf(*buf, *lim, "nvcsw:    %lu\n", st->nvcsw);
+    sysfs_buf_printf(*buf, *lim, "nivcsw:   %lu\n", st->nivcsw);
+    sysfs_buf_printf(*buf, *lim, "wakeups:  %lu\n", st->nwakeups);
+    sysfs_buf_printf(*buf, *lim, "wait_avg: %lu us\n", wait_avg / 1000ULL);
+    sysfs_buf_printf(*buf, *lim, "wait_max: %lu us\n", st->wait_max / 1000ULL);
+}
+
+// Totals of the process, then the policy and counters of each thread
+static int sysfs_proc_sched(void *ctx, char *buf, size_t lim) {
+    struct process *proc = ctx;
+    struct sched_stat st = {0};
+    struct thread *thr;
+    uintptr_t irq;
+    size_t i = 0;
+
+    spin_lock_irqsave(&proc->thread_lock, &irq);
+    list_for_each_entry(thr, &proc->thread_list, thread_link) {
+        st.runtime += thr->sched_stat.runtime;
+        st.nvcsw += thr->sched_stat.nvcsw;
+        st.nivcsw += thr->sched_stat.nivcsw;
+        st.nwakeups += thr->sched_stat.nwakeups;
+        st.wait_total += thr->sched_stat.wait_total;
+        if (thr->sched_stat.wait_max > st.wait_max) {
+            st.wait_max = thr->sched_stat.wait_max;
+        }
+    }
+    sysfs_proc_sched_stat(&st, &buf, &lim);
+
+    list_for_each_entry(thr, &proc->thread_list, thread_link) {
+        sysfs_buf_printf(buf, lim, "\nthread:   %u\n", (uint32_t) i++);
+        sysfs_buf_printf(buf, lim, "policy:   ");
+        sysfs_proc_sched_policy(thr, &buf, &lim);
+        sysfs_proc_sched_stat(&thr->sched_stat, &buf, &lim);
+    }
+    spin_release_irqrestore(&proc->thread_lock, &irq);
+
+    return 0;
+}
+
+// Accepts "<class> [<param>]", e.g. "rt 10" or "fair -5"
+static int sysfs_proc_sched_set(void *ctx, const char *value) {
+    struct process *proc = ctx;
+    const struct sched_class *cls;
+    struct thread *thr;
+    char name[16];
+    size_t len = 0;
+    uintptr_t irq;
+    int param, res;
+
+    while (value[len] && value[len] != ' ' && value[len] != '\n') {
+        if (len == sizeof(name) - 1) {
+            return -EINVAL;
+        }
+        name[len] = value[len];
+        ++len;
+    }
+    name[len] = 0;
+    value += len;
+    while (*value == ' ') {
+        ++value;
+    }
+
+    if (!(cls = sched_class_find(name))) {
+        return -EINVAL;
+    }
+    if (*value == '-') {
+        param = -atoi(value + 1);
+    } else {
+        param = atoi(value);
+    }
+
+    res = 0;
+    spin_lock_irqsave(&proc->thread_lock, &irq);
+    list_for_each_entry(thr, &proc->thread_list, thread_link) {
+        if ((res = sched_set_policy(thr, cls, param)) != 0) {
+            break;
+        }
+    }
+    spin_release_irqrestore(&proc->thread_lock, &irq);
+
+    return res;
+}
+
 static struct vnode *sysfs_proc_self(struct thread *ctx, struct vnode *link, char *buf, size_t lim) {
     _assert(ctx && ctx->proc);
     struct vnode *res = ctx->proc->fs_entry;
@@ -88,6 +184,8 @@ void proc_add_entry(struct process *proc) {
 
     _assert(sysfs_add_config_endpoint(proc->fs_entry, "name", SYSFS_MODE_DEFAULT, 64,
                                       proc, sysfs_proc_name, NULL) == 0);
+    _assert(sysfs_add_config_endpoint(proc->fs_entry, "sched", SYSFS_MODE_DEFAULT, 256,
+                                      proc, sysfs_proc_sched, sysfs_proc_sched_set) == 0);
     if (proc->pid > 0) {
         _assert(sysfs_add_config_endpoint(proc->fs_entry, "parent", SYSFS_MODE_DEFAULT, 64,
                                           proc, sysfs_proc_parent, NULL) == 0);
@@ -119,7 +217,7 @@ static void process_ioctx_empty(struct process *proc) {
 void process_ioctx_fork(struct process *dst, struct process *src) {
     process_ioctx_empty(dst);
 
-    dst->ioctx.cwd_vnode = src->ioctx.cwd_vnode;
+    vfs_set_cwd_vnode(&dst->ioctx, src->ioctx.cwd_vnode);
     dst->ioctx.gid = src->ioctx.gid;
     dst->ioctx.uid = src->ioctx.uid;
     dst->ioctx.umask = src->ioctx.umask;
@@ -249,6 +347,8 @@ void process_free(struct process *proc) {
     struct thread *thr;
     thr = list_first_entry(&proc->thread_list, struct thread, thread_link);
     _assert(thr);
+    // Still on the timer's sleep list otherwise
+    _assert(list_empty(&thr->sleep_notify.link));
 
     // Free kstack
     for (size_t i = 0; i < thr->data.rsp0_size / MM_PAGE_SIZE; ++i) {
@@ -257,10 +357,9 @@ void process_free(struct process *proc) {
 
     // Free page directory (if not mm_kernel)
     if (proc->space != mm_kernel) {
-        // Make sure we don't shoot a leg off
-        uintptr_t cr3;
-        asm volatile ("movq %%cr3, %0":"=a"(cr3));
-        _assert(MM_VIRTUALIZE(cr3) != (uintptr_t) proc->space);
+        // Make sure we don't shoot a leg off. The space may still be
+        // loaded here lazily though, mm_space_free() takes care of that
+        _assert(!thread_self || thread_self->proc != proc);
 
         mm_space_free(proc);
     }
@@ -279,12 +378,14 @@ int process_init_thread(struct process *proc, uintptr_t entry, void *arg, int us
     list_head_init(&proc->g_link);
     list_head_init(&proc->shm_list);
     thread_wait_io_init(&proc->pid_notify);
+    vma_init(&proc->vm);
 
     proc->name[0] = 0;
     proc->flags = user ? 0 : THREAD_KERNEL;
 
     if (user) {
         proc->space = amd64_mm_pool_alloc();
+        _assert(proc->space);
         mm_space_clone(proc->space, mm_kernel, MM_CLONE_FLG_KERNEL);
     } else {
         proc->space = mm_kernel;
@@ -294,6 +395,7 @@ int process_init_thread(struct process *proc, uintptr_t entry, void *arg, int us
     _assert(main_thread);
     main_thread->proc = proc;
     list_head_init(&proc->thread_list);
+    proc->thread_lock = 0;
 
     int res = thread_init(main_thread, entry, arg, user ? THR_INIT_USER : 0);
     _assert(res == 0);
@@ -342,6 +444,7 @@ int sys_fork(struct sys_fork_frame *frame) {
     struct process *dst = kmalloc(sizeof(struct process));
     _assert(dst);
     list_head_init(&dst->thread_list);
+    dst->thread_lock = 0;
     struct thread *dst_thread = kmalloc(sizeof(struct thread));
     _assert(dst_thread);
     list_head_init(&dst_thread->thread_link);
@@ -353,8 +456,12 @@ int sys_fork(struct sys_fork_frame *frame) {
 
     // Initialize dst process: memory space
     mm_space_t space = amd64_mm_pool_alloc();
+    _assert(space);
     dst->space = space;
+    vma_init(&dst->vm);
     mm_space_fork(dst, src, MM_CLONE_FLG_KERNEL | MM_CLONE_FLG_USER);
+    // Areas which haven't been touched yet stay lazy in the child
+    _assert(vma_fork(&dst->vm, &src->vm) == 0);
 
     // Initialize dst process state
     list_head_init(&dst->g_link);
@@ -380,8 +487,19 @@ int sys_fork(struct sys_fork_frame *frame) {
     list_head_init(&dst_thread->wait_head);
     thread_wait_io_init(&dst_thread->sleep_notify);
 
-    dst_thread->sched_prev = NULL;
-    dst_thread->sched_next = NULL;
+    dst_thread->cpu = -1;
+    dst_thread->on_cpu = 0;
+    dst_thread->wakeup_pending = 0;
+    dst_thread->vnode_lookups = 0;
+    // Scheduling policy is inherited, the child starts at the
+    // minimum virtual runtime of the queue it's placed to
+    dst_thread->sched_class = src_thread->sched_class;
+    dst_thread->sched_prio = src_thread->sched_prio;
+    dst_thread->sched_nice = src_thread->sched_nice;
+    dst_thread->sched_vruntime = 0;
+    dst_thread->sched_slice = 0;
+    list_head_init(&dst_thread->sched_link);
+    memset(&dst_thread->sched_stat, 0, sizeof(struct sched_stat));
 
     dst_thread->data.rsp0_base = MM_VIRTUALIZE(stack_pages);
     dst_thread->data.rsp0_size = MM_PAGE_SIZE * THREAD_KSTACK_PAGES;
@@ -1,3 +1,6 @@
+#if defined(AMD64_SMP)
+#include "arch/amd64/smp/ipi.h"
+#endif
 #include "arch/amd64/context.h"
 #include "arch/amd64/mm/pool.h"
 #include "arch/amd64/mm/phys.h"
@@ -5,12 +8,16 @@
 #include "arch/amd64/hw/idt.h"
 #include "arch/amd64/cpu.h"
 #include "sys/block/blk.h"
+#include "sys/sched_class.h"
 #include "user/signum.h"
 #include "user/reboot.h"
+#include "user/errno.h"
+#include "user/time.h"
 #include "sys/reboot.h"
 #include "sys/assert.h"
 #include "sys/thread.h"
 #include "sys/sched.h"
+#include "sys/string.h"
 #include "sys/debug.h"
 #include "sys/heap.h"
 #include "sys/spin.h"
@@ -20,14 +27,20 @@ void yield(void);
 
 //// Thread queueing
 
-static struct thread *queue_heads[AMD64_MAX_SMP] = {NULL};
+static struct sched_queue queues[AMD64_MAX_SMP] = {0};
 static struct thread threads_idle[AMD64_MAX_SMP] = {0};
-static size_t queue_sizes[AMD64_MAX_SMP] = {0};
 int sched_ncpus = 1;
 int sched_ready = 0;
-static int clk = 0;
 
-static spin_t sched_lock = 0;
+// In order of precedence: a runnable thread of some class always
+// goes before any thread of the classes after it
+static const struct sched_class *sched_classes[] = {
+    &sched_class_rt,
+    &sched_class_fair
+};
+#define SCHED_CLASS_COUNT       (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+static int sched_steal(int cpu_no);
 
 void sched_set_ncpus(int ncpus) {
     kinfo("Setting ncpus to %d\n", ncpus);
@@ -35,7 +48,14 @@ void sched_set_ncpus(int ncpus) {
 }
 
 static void *idle(void *arg) {
+    int cpu_no = (int) (uintptr_t) arg;
+
     while (1) {
+        // Rather than sleeping, try to take some work from busier CPUs
+        if (sched_steal(cpu_no)) {
+            sched_yield();
+            continue;
+        }
         asm volatile ("hlt");
     }
     return 0;
@@ -43,35 +63,207 @@ static void *idle(void *arg) {
 
 ////
 
+// Interrupts are disabled before the CPU is looked up, so the caller cannot
+// be preempted (and possibly migrated) in between
+static inline struct sched_queue *sched_lock_local(struct cpu **cpu, uintptr_t *irq) {
+    struct sched_queue *q;
+    asm volatile ("pushfq; cli; popq %0":"=r"(*irq)::"memory");
+    *cpu = get_cpu();
+    q = &queues[(*cpu)->processor_id];
+    spin_lock(&q->lock);
+    return q;
+}
+
+static inline void sched_irq_restore(uintptr_t irq) {
+    if (irq & (1 << 9)) {
+        asm volatile ("sti");
+    }
+}
+
+static void sched_link(struct sched_queue *q, struct thread *thr, int flags) {
+    thr->sched_class->enqueue(q, thr, flags);
+    ++q->size;
+}
+
+static void sched_unlink(struct sched_queue *q, struct thread *thr) {
+    _assert(q->size);
+    thr->sched_class->dequeue(q, thr);
+    --q->size;
+}
+
+static struct thread *sched_pick_class(struct sched_queue *q, struct thread *from) {
+    struct thread *thr;
+
+    for (size_t i = 0; i < SCHED_CLASS_COUNT; ++i) {
+        if ((thr = sched_classes[i]->pick(q, from))) {
+            return thr;
+        }
+    }
+
+    return NULL;
+}
+
+// Select the next thread to run. Threads which are still running on
+// (or switching away from) some other CPU are skipped
+static struct thread *sched_pick(struct sched_queue *q, struct thread *from, int cpu_no) {
+    struct thread *thr = sched_pick_class(q, from);
+    return thr ? thr : &threads_idle[cpu_no];
+}
+
+static size_t sched_class_rank(const struct sched_class *cls) {
+    for (size_t i = 0; i < SCHED_CLASS_COUNT; ++i) {
+        if (sched_classes[i] == cls) {
+            return i;
+        }
+    }
+    // Idle threads
+    return SCHED_CLASS_COUNT;
+}
+
+// Whether `thr' should take the CPU from `cur'
+static int sched_preempts(const struct thread *thr, const struct thread *cur) {
+    size_t thr_rank, cur_rank;
+
+    if (cur->flags & THREAD_IDLE) {
+        return 1;
+    }
+
+    thr_rank = sched_class_rank(thr->sched_class);
+    cur_rank = sched_class_rank(cur->sched_class);
+
+    if (thr_rank != cur_rank) {
+        return thr_rank < cur_rank;
+    }
+    return thr->sched_class->preempt(thr, cur);
+}
+
+//// Accounting
+
+// Called when the thread gets the CPU
+static void sched_stat_run(struct thread *thr, uint64_t now) {
+    struct sched_stat *st = &thr->sched_stat;
+
+    if (st->wakeup_time) {
+        uint64_t wait = now - st->wakeup_time;
+
+        st->wait_total += wait;
+        if (wait > st->wait_max) {
+            st->wait_max = wait;
+        }
+        ++st->nwakeups;
+        st->wakeup_time = 0;
+    }
+
+    st->run_start = now;
+}
+
+// Returns the CPU time used since the thread got the CPU or
+// was last charged
+static uint64_t sched_stat_runtime(struct thread *thr, uint64_t now) {
+    struct sched_stat *st = &thr->sched_stat;
+    uint64_t delta = now - st->run_start;
+
+    st->runtime += delta;
+    st->run_start = now;
+
+    return delta;
+}
+
+////
+
+// Called from context_switch_to() once the old thread's context is saved:
+// only after this point the thread may be picked up by another CPU
+void sched_switch_finish(struct thread *to, struct thread *from) {
+    if (from && from != to) {
+        __atomic_store_n(&from->on_cpu, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Move a single ready thread from the busiest run queue to `cpu_no'
+static int sched_steal(int cpu_no) {
+    struct sched_queue *src, *dst, *first, *second;
+    struct thread *thr;
+    size_t max_size = 1;
+    int src_no = -1;
+    uintptr_t irq;
+
+    // Sizes are just a hint here, the victim is rechecked under the lock
+    for (int i = 0; i < sched_ncpus; ++i) {
+        if (i != cpu_no && queues[i].size > max_size) {
+            max_size = queues[i].size;
+            src_no = i;
+        }
+    }
+
+    if (src_no < 0) {
+        return 0;
+    }
+
+    src = &queues[src_no];
+    dst = &queues[cpu_no];
+    // Always lock in CPU order so that two CPUs can't deadlock
+    first = (src_no < cpu_no) ? src : dst;
+    second = (src_no < cpu_no) ? dst : src;
+
+    spin_lock_irqsave(&first->lock, &irq);
+    spin_lock(&second->lock);
+
+    // Take the thread which would've run next there
+    if ((thr = sched_pick_class(src, NULL))) {
+        _assert(thr->state == THREAD_READY);
+        sched_unlink(src, thr);
+        thr->cpu = cpu_no;
+        sched_link(dst, thr, 0);
+    }
+
+    spin_release(&second->lock);
+    spin_release_irqrestore(&first->lock, &irq);
+
+    return thr != NULL;
+}
+
+#if defined(AMD64_SMP)
+// Make `cpu_no' notice newly queued work right away instead of
+// waiting for its next timer tick
+static void sched_kick(int cpu_no, struct thread *thr) {
+    struct thread *cur = cpus[cpu_no].thread;
+
+    if (cpu_no == (int) get_cpu()->processor_id) {
+        return;
+    }
+
+    // Racy, but only used as a hint: the target CPU decides for itself
+    if (cur && sched_preempts(thr, cur)) {
+        amd64_ipi_send(cpu_no, IPI_VECTOR_RESCHED);
+    }
+}
+#endif
+
 void sched_queue_to(struct thread *thr, int cpu_no) {
+    struct sched_queue *q = &queues[cpu_no];
+    int cpu_none = -1;
+    uintptr_t irq;
+    _assert(thr);
+
+    // Only a single CPU may claim the thread. This also filters out the
+    // threads which are already queued
     // FIXME: if this happens, there's absolutely some logic error -
     //        I should find out the places where threads are queued
     //        twice
-    if (thr->sched_prev || thr->sched_next) {
+    if (!__atomic_compare_exchange_n(&thr->cpu, &cpu_none, cpu_no, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
         return;
     }
-    uintptr_t irq;
-    spin_lock_irqsave(&sched_lock, &irq);
-    _assert(thr);
-    thr->state = THREAD_READY;
-    thr->cpu = cpu_no;
-
-    if (queue_heads[cpu_no]) {
-        struct thread *queue_tail = queue_heads[cpu_no]->sched_prev;
 
-        queue_tail->sched_next = thr;
-        thr->sched_prev = queue_tail;
-        queue_heads[cpu_no]->sched_prev = thr;
-        thr->sched_next = queue_heads[cpu_no];
-    } else {
-        thr->sched_next = thr;
-        thr->sched_prev = thr;
-
-        queue_heads[cpu_no] = thr;
-    }
+    spin_lock_irqsave(&q->lock, &irq);
+    thr->state = THREAD_READY;
+    thr->sched_stat.wakeup_time = system_time;
+    sched_link(q, thr, SCHED_ENQ_WAKEUP);
+    spin_release_irqrestore(&q->lock, &irq);
 
-    ++queue_sizes[cpu_no];
-    spin_release_irqrestore(&sched_lock, &irq);
+#if defined(AMD64_SMP)
+    sched_kick(cpu_no, thr);
+#endif
 }
 
 void sched_queue(struct thread *thr) {
@@ -79,106 +271,326 @@ void sched_queue(struct thread *thr) {
         panic("Tried to queue a thread from suspended process\n");
     }
 #if defined(AMD64_SMP)
-    size_t min_queue_size = (size_t) -1;
-    int min_queue_index = 0;
-    uintptr_t irq;
-    spin_lock_irqsave(&sched_lock, &irq);
+    // Queue sizes are read without locking: they're only used to pick
+    // a placement, idle CPUs will rebalance the rest by stealing
+    int cpu_no = get_cpu()->processor_id;
+    size_t min_queue_size = queues[cpu_no].size;
 
     for (int i = 0; i < sched_ncpus; ++i) {
-        if (queue_sizes[i] < min_queue_size) {
-            min_queue_index = i;
-            min_queue_size = queue_sizes[i];
+        if (queues[i].size < min_queue_size) {
+            cpu_no = i;
+            min_queue_size = queues[i].size;
         }
     }
-    spin_release_irqrestore(&sched_lock, &irq);
-    if (min_queue_size == 0) {
-        sched_queue_to(thr, (clk++) % sched_ncpus);
-    } else {
-        sched_queue_to(thr, min_queue_index);
-    }
+
+    sched_queue_to(thr, cpu_no);
 #else
     sched_queue_to(thr, 0);
 #endif
 }
 
-void sched_unqueue(struct thread *thr, enum thread_state new_state) {
+const struct sched_class *sched_class_find(const char *name) {
+    for (size_t i = 0; i < SCHED_CLASS_COUNT; ++i) {
+        if (!strcmp(sched_classes[i]->name, name)) {
+            return sched_classes[i];
+        }
+    }
+    return NULL;
+}
+
+int sched_set_policy(struct thread *thr, const struct sched_class *cls, int param) {
+    struct sched_queue *q = NULL;
     uintptr_t irq;
-    spin_lock_irqsave(&sched_lock, &irq);
+    int cpu_no;
+
+    if (cls == &sched_class_rt) {
+        if (param < 0 || param >= SCHED_RT_PRIO_COUNT) {
+            return -EINVAL;
+        }
+    } else if (cls == &sched_class_fair) {
+        if (param < SCHED_FAIR_NICE_MIN || param > SCHED_FAIR_NICE_MAX) {
+            return -EINVAL;
+        }
+    } else {
+        return -EINVAL;
+    }
+    if (thr->flags & THREAD_IDLE) {
+        return -EPERM;
+    }
+
+    // With every queue locked the thread can't get linked or unlinked
+    // behind our back. A thread which was claimed by sched_queue_to()
+    // but not linked yet will be linked with the new policy
+    asm volatile ("pushfq; cli; popq %0":"=r"(irq)::"memory");
+    for (int i = 0; i < sched_ncpus; ++i) {
+        spin_lock(&queues[i].lock);
+    }
+
+    cpu_no = thr->cpu;
+    if (cpu_no >= 0 && !list_empty(&thr->sched_link)) {
+        q = &queues[cpu_no];
+        sched_unlink(q, thr);
+    }
+
+    thr->sched_class = cls;
+    if (cls == &sched_class_rt) {
+        thr->sched_prio = param;
+    } else {
+        thr->sched_nice = param;
+    }
+    thr->sched_slice = 0;
+
+    if (q) {
+        sched_link(q, thr, 0);
+    }
+
+    for (int i = sched_ncpus - 1; i >= 0; --i) {
+        spin_release(&queues[i].lock);
+    }
+    sched_irq_restore(irq);
 
-    struct cpu *cpu = get_cpu();
 #if defined(AMD64_SMP)
-    assert(thr->cpu >= 0, "Tried to unqueue non-queued thread\n");
-    if ((int) cpu->processor_id != thr->cpu) {
-        // Need to ask another CPU to unqueue the task
-        panic("TODO: implement cross-CPU unqueue\n");
+    if (q) {
+        sched_kick(cpu_no, thr);
     }
 #endif
-    thr->cpu = -1;
-    int cpu_no = cpu->processor_id;
 
-    struct thread *sched_prev = thr->sched_prev;
-    struct thread *sched_next = thr->sched_next;
+    return 0;
+}
+
+#if defined(AMD64_SMP)
+// Asks the CPU which runs the thread to unqueue it, the sender waits
+// until `done' is set: 1 if it has been, -1 if the thread has moved
+// meanwhile and the request has to be retried
+struct sched_unqueue_req {
+    struct thread *thr;
+    int done;
+};
+
+// Runs on the CPU which owns the thread's queue
+static int sched_ipi_unqueue(void *arg, uintptr_t new_state) {
+    struct sched_unqueue_req *req = arg;
+    struct thread *thr = req->thr;
+    struct cpu *cpu = get_cpu();
+    struct sched_queue *q = &queues[cpu->processor_id];
+
+    spin_lock(&q->lock);
+    if (thr->cpu != (int) cpu->processor_id) {
+        // Was moved while the request was in flight
+        spin_release(&q->lock);
+        __atomic_store_n(&req->done, -1, __ATOMIC_RELEASE);
+        return 0;
+    }
 
-    _assert((new_state == THREAD_WAITING) ||
-            (new_state == THREAD_STOPPED));
-    _assert(queue_sizes[cpu_no]);
-    --queue_sizes[cpu_no];
     thr->state = new_state;
+    sched_unlink(q, thr);
+    __atomic_store_n(&thr->cpu, -1, __ATOMIC_RELEASE);
+    spin_release(&q->lock);
 
-    spin_release_irqrestore(&sched_lock, &irq);
-    thread_check_signal(thr, 0);
-    spin_lock_irqsave(&sched_lock, &irq);
+    // The request is on the sender's stack, don't touch it past this
+    __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+
+    // yield() will switch away from the thread as it's no longer queued
+    return thr == cpu->thread;
+}
+
+static int sched_ipi_migrate(void *arg, uintptr_t cpu_no) {
+    struct thread *thr = arg;
+    struct cpu *cpu = get_cpu();
+    int resched = 0;
+
+    if (thr->cpu == (int) cpu->processor_id) {
+        resched = thr == cpu->thread;
+        sched_migrate(thr, cpu_no);
+    }
+
+    return resched;
+}
+
+// Remove a thread which is queued on some other CPU. If it's not running
+// this is done right away, otherwise the owner CPU is asked to do it. In
+// both cases the thread is off the queues once this returns, so the
+// caller may go on changing or freeing it. The owner CPU has to take the
+// IPI meanwhile, so this must not be called with interrupts disabled
+static void sched_unqueue_remote(struct thread *thr, enum thread_state new_state) {
+    struct sched_unqueue_req req;
+    struct sched_queue *q;
+    uintptr_t irq;
+    int cpu_no, done;
+
+    while (1) {
+        if ((cpu_no = thr->cpu) < 0) {
+            // Not queued anymore
+            return;
+        }
+
+        q = &queues[cpu_no];
+        spin_lock_irqsave(&q->lock, &irq);
+        if (thr->cpu != cpu_no) {
+            // Got stolen by another CPU, retry
+            spin_release_irqrestore(&q->lock, &irq);
+            continue;
+        }
+
+        if (!thr->on_cpu) {
+            break;
+        }
+        spin_release_irqrestore(&q->lock, &irq);
+
+        req.thr = thr;
+        req.done = 0;
+        amd64_ipi_call(cpu_no, sched_ipi_unqueue, &req, new_state);
 
-    if (sched_next == thr) {
-        thr->sched_next = NULL;
-        thr->sched_prev = NULL;
+        while (!(done = __atomic_load_n(&req.done, __ATOMIC_ACQUIRE))) {
+            asm volatile ("pause");
+        }
+        if (done > 0) {
+            return;
+        }
+    }
 
-        queue_heads[cpu_no] = NULL;
+    thr->state = new_state;
+    sched_unlink(q, thr);
+    __atomic_store_n(&thr->cpu, -1, __ATOMIC_RELEASE);
+    spin_release_irqrestore(&q->lock, &irq);
+}
+
+int sched_migrate(struct thread *thr, int cpu_no) {
+    struct sched_queue *src, *dst, *first, *second;
+    int self_no, src_no;
+    uintptr_t irq;
+
+    _assert(cpu_no >= 0 && cpu_no < sched_ncpus);
+
+    while (1) {
+        if ((src_no = thr->cpu) < 0) {
+            // Will be placed on the next wakeup
+            return -1;
+        }
+        if (src_no == cpu_no) {
+            return 0;
+        }
+
+        src = &queues[src_no];
+        dst = &queues[cpu_no];
+        first = (src_no < cpu_no) ? src : dst;
+        second = (src_no < cpu_no) ? dst : src;
+
+        spin_lock_irqsave(&first->lock, &irq);
+        spin_lock(&second->lock);
+        if (thr->cpu == src_no) {
+            break;
+        }
+        spin_release(&second->lock);
+        spin_release_irqrestore(&first->lock, &irq);
+    }
+
+    self_no = get_cpu()->processor_id;
+    if (thr->on_cpu && src_no != self_no) {
+        // Only the CPU the thread runs on may move it away
+        spin_release(&second->lock);
+        spin_release_irqrestore(&first->lock, &irq);
+        amd64_ipi_call(src_no, sched_ipi_migrate, thr, cpu_no);
+        return 0;
+    }
+
+    // If the thread is running here, the target CPU won't pick
+    // it until it's switched away from
+    sched_unlink(src, thr);
+    thr->cpu = cpu_no;
+    sched_link(dst, thr, 0);
 
-        spin_release_irqrestore(&sched_lock, &irq);
+    spin_release(&second->lock);
+    spin_release_irqrestore(&first->lock, &irq);
 
-        cpu->thread = &threads_idle[cpu_no];
-        context_switch_to(&threads_idle[cpu_no], thr);
+    sched_kick(cpu_no, thr);
+    return 0;
+}
+#endif
+
+void sched_unqueue(struct thread *thr, enum thread_state new_state) {
+    struct sched_queue *q;
+    struct thread *next;
+    struct cpu *cpu;
+    uint64_t now;
+    uintptr_t irq;
+    int cpu_no;
+
+    _assert((new_state == THREAD_WAITING) ||
+            (new_state == THREAD_STOPPED));
+
+#if defined(AMD64_SMP)
+    if (thr != thread_self) {
+        sched_unqueue_remote(thr, new_state);
         return;
     }
+#endif
+
+    // Pending signals are handled before the thread goes to sleep
+    thread_check_signal(thr, 0);
 
-    if (thr == queue_heads[cpu_no]) {
-        queue_heads[cpu_no] = sched_next;
+    q = sched_lock_local(&cpu, &irq);
+    cpu_no = cpu->processor_id;
+    assert(thr->cpu == cpu_no, "Tried to unqueue non-queued thread\n");
+
+    now = system_time;
+    thr->sched_class->charge(q, thr, sched_stat_runtime(thr, now));
+    ++thr->sched_stat.nvcsw;
+
+    thr->state = new_state;
+    sched_unlink(q, thr);
+    __atomic_store_n(&thr->cpu, -1, __ATOMIC_SEQ_CST);
+
+    // A waker which still saw the thread queued (between it deciding to
+    // wait and this point) only leaves the flag, so the wait is cancelled
+    // here. Otherwise the waker has seen cpu == -1 and queues it itself
+    if (new_state == THREAD_WAITING && __atomic_exchange_n(&thr->wakeup_pending, 0, __ATOMIC_SEQ_CST)) {
+        int cpu_none = -1;
+        if (__atomic_compare_exchange_n(&thr->cpu, &cpu_none, cpu_no, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            thr->state = THREAD_RUNNING;
+            sched_link(q, thr, 0);
+            spin_release(&q->lock);
+            sched_irq_restore(irq);
+            return;
+        }
     }
 
-    _assert(thr && sched_next && sched_prev);
+    next = sched_pick(q, NULL, cpu_no);
+    sched_stat_run(next, now);
+    next->state = THREAD_RUNNING;
+    next->on_cpu = 1;
+    cpu->thread = next;
+    spin_release(&q->lock);
 
-    sched_next->sched_prev = sched_prev;
-    sched_prev->sched_next = sched_next;
+    context_switch_to(next, thr);
+    sched_irq_restore(irq);
+}
 
-    thr->sched_prev = NULL;
-    thr->sched_next = NULL;
+static void sched_debug_list(struct list_head *head) {
+    struct thread *thr;
 
-    spin_release_irqrestore(&sched_lock, &irq);
-    if (thr == cpu->thread) {
-        cpu->thread = sched_next;
-        context_switch_to(sched_next, thr);
+    list_for_each_entry(thr, head, sched_link) {
+        debugf(DEBUG_DEFAULT, "#%d (%s):<%p> ", thr->proc->pid, thr->proc->name, thr);
     }
 }
 
 void sched_debug_cycle(uint64_t ms) {
     uintptr_t irq;
-    spin_lock_irqsave(&sched_lock, &irq);
 
     for (int cpu = 0; cpu < sched_ncpus; ++cpu) {
+        struct sched_queue *q = &queues[cpu];
+        spin_lock_irqsave(&q->lock, &irq);
         debugf(DEBUG_DEFAULT, "cpu%d: ", cpu);
 
-        for (struct thread *thr = queue_heads[cpu]; thr; thr = thr->sched_next) {
-            debugf(DEBUG_DEFAULT, "#%d (%s):<%p> ", thr->proc->pid, thr->proc->name, thr);
-            if (thr->sched_next == queue_heads[cpu]) {
-                break;
-            }
+        for (int prio = SCHED_RT_PRIO_COUNT - 1; prio >= 0; --prio) {
+            sched_debug_list(&q->rt_queues[prio]);
         }
+        sched_debug_list(&q->fair_queue);
 
         debugc(DEBUG_DEFAULT, '\n');
+        spin_release_irqrestore(&q->lock, &irq);
     }
-
-    spin_release_irqrestore(&sched_lock, &irq);
 }
 
 //#if defined(DEBUG_COUNTERS)
@@ -298,36 +710,78 @@ void sched_debug_cycle(uint64_t ms) {
 //}
 //#endif
 //
-void yield(void) {
-    uintptr_t irq;
-    spin_lock_irqsave(&sched_lock, &irq);
-    struct cpu *cpu = get_cpu();
-    struct thread *from = cpu->thread;
-    struct thread *to;
-
-    if (from && from->sched_next) {
-        to = from->sched_next;
-    } else if (queue_heads[cpu->processor_id]) {
-        to = queue_heads[cpu->processor_id];
-    } else {
-        to = &threads_idle[cpu->processor_id];
-    }
 
-    spin_release_irqrestore(&sched_lock, &irq);
+static void sched_reschedule(int voluntary) {
+    struct sched_queue *q;
+    struct thread *from, *to;
+    struct cpu *cpu;
+    uint64_t now, delta;
+    int expired = 1;
+    uintptr_t irq;
 
     // Check if instead of switching to a proper thread context we
     // have to use signal handling
-    thread_check_signal(from, 0);
+    if (thread_self) {
+        thread_check_signal(thread_self, 0);
+    }
+
+    q = sched_lock_local(&cpu, &irq);
+    from = cpu->thread;
+    now = system_time;
 
     if (from) {
-        from->state = THREAD_READY;
+        delta = sched_stat_runtime(from, now);
+
+        // The thread may have been unqueued or moved out of this CPU's
+        // queue by a cross-CPU request
+        if (!(from->flags & THREAD_IDLE) &&
+            from->state == THREAD_RUNNING &&
+            from->cpu == (int) cpu->processor_id) {
+            expired = from->sched_class->charge(q, from, delta) || voluntary;
+        }
+    }
+
+    to = sched_pick(q, from, cpu->processor_id);
+    // Keep running until the slice is used up, unless something more
+    // important became runnable
+    if (!expired && to != from && !sched_preempts(to, from)) {
+        to = from;
+    }
+
+    if (to != from) {
+        if (from) {
+            if (from->state == THREAD_RUNNING) {
+                from->state = THREAD_READY;
+            }
+
+            if (voluntary) {
+                ++from->sched_stat.nvcsw;
+            } else {
+                ++from->sched_stat.nivcsw;
+            }
+        }
+
+        _assert(to->state != THREAD_STOPPED);
+        sched_stat_run(to, now);
+        to->state = THREAD_RUNNING;
+        to->on_cpu = 1;
+        cpu->thread = to;
     }
+    spin_release(&q->lock);
 
-    _assert(to->state != THREAD_STOPPED);
-    to->state = THREAD_RUNNING;
-    cpu->thread = to;
+    if (to != from) {
+        context_switch_to(to, from);
+    }
+    sched_irq_restore(irq);
+}
 
-    context_switch_to(to, from);
+// Preemption: timer ticks and reschedule requests
+void yield(void) {
+    sched_reschedule(0);
+}
+
+void sched_yield(void) {
+    sched_reschedule(1);
 }
 
 void sched_reboot(unsigned int cmd) {
@@ -339,7 +793,7 @@ void sched_reboot(unsigned int cmd) {
     process_signal(user_init, SIGTERM);
 
     while (user_init->proc_state != PROC_FINISHED) {
-        yield();
+        sched_yield();
     }
 
     kinfo("Flushing disk cache\n");
@@ -349,28 +803,41 @@ void sched_reboot(unsigned int cmd) {
 }
 
 void sched_init(void) {
+    for (int i = 0; i < AMD64_MAX_SMP; ++i) {
+        sched_rt_queue_init(&queues[i]);
+        sched_fair_queue_init(&queues[i]);
+    }
+
     for (int i = 0; i < sched_ncpus; ++i) {
-        thread_init(&threads_idle[i], (uintptr_t) idle, 0, 0);
+        thread_init(&threads_idle[i], (uintptr_t) idle, (void *) (uintptr_t) i, 0);
         threads_idle[i].cpu = i;
         threads_idle[i].proc = NULL;
+        threads_idle[i].flags |= THREAD_IDLE;
+        // Never queued, picked only when there's nothing else to run
+        threads_idle[i].sched_class = NULL;
     }
 
     sched_ready = 1;
 }
 
 void sched_enter(void) {
-    struct cpu *cpu = get_cpu();
-    kinfo("cpu%u entering sched\n", cpu->processor_id);
+    struct sched_queue *q;
+    struct thread *first_task;
+    struct cpu *cpu;
+    uintptr_t irq;
+
+    kinfo("cpu%u entering sched\n", get_cpu()->processor_id);
 
+    q = sched_lock_local(&cpu, &irq);
     extern void amd64_irq0(void);
     amd64_idt_set(cpu->processor_id, 32, (uintptr_t) amd64_irq0, 0x08, IDT_FLG_P | IDT_FLG_R0 | IDT_FLG_INT32);
 
-    struct thread *first_task = queue_heads[cpu->processor_id];
-    if (!first_task) {
-        first_task = &threads_idle[cpu->processor_id];
-    }
-
+    first_task = sched_pick(q, NULL, cpu->processor_id);
+    sched_stat_run(first_task, system_time);
     first_task->state = THREAD_RUNNING;
+    first_task->on_cpu = 1;
     cpu->thread = first_task;
+    spin_release(&q->lock);
+
     context_switch_first(first_task);
 }
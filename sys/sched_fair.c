@@ -0,0 +1,117 @@
+// Fair-share class: the thread which has received the least (weighted)
+// CPU time runs next.
+// While a thread is not queued, its virtual runtime is kept relative to
+// the queue's minimum, so that it can be placed on any CPU's queue later
+#include "sys/sched_class.h"
+#include "sys/assert.h"
+#include "sys/thread.h"
+
+#define SCHED_FAIR_WEIGHT_0     1024
+
+// Each nice step is about 10% of CPU time
+static const uint32_t sched_fair_weights[SCHED_FAIR_NICE_MAX - SCHED_FAIR_NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15
+};
+
+void sched_fair_queue_init(struct sched_queue *q) {
+    list_head_init(&q->fair_queue);
+    q->fair_min_vruntime = 0;
+}
+
+static void sched_fair_insert(struct sched_queue *q, struct thread *thr) {
+    struct thread *it;
+
+    // Threads with equal vruntime are kept in FIFO order
+    list_for_each_entry(it, &q->fair_queue, sched_link) {
+        if (it->sched_vruntime > thr->sched_vruntime) {
+            list_add_tail(&thr->sched_link, &it->sched_link);
+            return;
+        }
+    }
+
+    list_add_tail(&thr->sched_link, &q->fair_queue);
+}
+
+// The minimum only moves forward, otherwise threads could gain
+// runtime by being dequeued and queued again
+static void sched_fair_update_min(struct sched_queue *q) {
+    struct thread *first;
+
+    if (list_empty(&q->fair_queue)) {
+        return;
+    }
+
+    first = list_first_entry(&q->fair_queue, struct thread, sched_link);
+    if (first->sched_vruntime > q->fair_min_vruntime) {
+        q->fair_min_vruntime = first->sched_vruntime;
+    }
+}
+
+static void sched_fair_enqueue(struct sched_queue *q, struct thread *thr, int flags) {
+    if (flags & SCHED_ENQ_WAKEUP) {
+        if (thr->sched_vruntime < -SCHED_FAIR_WAKEUP_BONUS) {
+            thr->sched_vruntime = -SCHED_FAIR_WAKEUP_BONUS;
+        }
+        thr->sched_slice = SCHED_FAIR_SLICE;
+    }
+
+    thr->sched_vruntime += q->fair_min_vruntime;
+    sched_fair_insert(q, thr);
+    sched_fair_update_min(q);
+}
+
+static void sched_fair_dequeue(struct sched_queue *q, struct thread *thr) {
+    list_del_init(&thr->sched_link);
+    thr->sched_vruntime -= q->fair_min_vruntime;
+    sched_fair_update_min(q);
+}
+
+static struct thread *sched_fair_pick(struct sched_queue *q, struct thread *from) {
+    struct thread *thr;
+
+    list_for_each_entry(thr, &q->fair_queue, sched_link) {
+        if (thr == from || !thr->on_cpu) {
+            return thr;
+        }
+    }
+
+    return NULL;
+}
+
+static int sched_fair_charge(struct sched_queue *q, struct thread *thr, uint64_t delta) {
+    uint32_t weight = sched_fair_weights[thr->sched_nice - SCHED_FAIR_NICE_MIN];
+
+    thr->sched_vruntime += (delta * SCHED_FAIR_WEIGHT_0) / weight;
+
+    list_del(&thr->sched_link);
+    sched_fair_insert(q, thr);
+    sched_fair_update_min(q);
+
+    if (thr->sched_slice > delta) {
+        thr->sched_slice -= delta;
+        return 0;
+    }
+
+    thr->sched_slice = SCHED_FAIR_SLICE;
+    return 1;
+}
+
+static int sched_fair_preempt(const struct thread *thr, const struct thread *cur) {
+    return thr->sched_vruntime + SCHED_FAIR_WAKEUP_GRAN < cur->sched_vruntime;
+}
+
+const struct sched_class sched_class_fair = {
+    .name = "fair",
+    .enqueue = sched_fair_enqueue,
+    .dequeue = sched_fair_dequeue,
+    .pick = sched_fair_pick,
+    .charge = sched_fair_charge,
+    .preempt = sched_fair_preempt
+};
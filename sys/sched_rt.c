@@ -0,0 +1,78 @@
+// Fixed-priority realtime class: the highest non-empty priority level
+// always runs, threads of the same level are round-robined
+#include "sys/sched_class.h"
+#include "sys/assert.h"
+#include "sys/thread.h"
+
+void sched_rt_queue_init(struct sched_queue *q) {
+    q->rt_bitmap = 0;
+    for (size_t i = 0; i < SCHED_RT_PRIO_COUNT; ++i) {
+        list_head_init(&q->rt_queues[i]);
+    }
+}
+
+static void sched_rt_enqueue(struct sched_queue *q, struct thread *thr, int flags) {
+    int prio = thr->sched_prio;
+    _assert(prio >= 0 && prio < SCHED_RT_PRIO_COUNT);
+
+    if (flags & SCHED_ENQ_WAKEUP) {
+        thr->sched_slice = SCHED_RT_SLICE;
+    }
+    list_add_tail(&thr->sched_link, &q->rt_queues[prio]);
+    q->rt_bitmap |= 1U << prio;
+}
+
+static void sched_rt_dequeue(struct sched_queue *q, struct thread *thr) {
+    int prio = thr->sched_prio;
+
+    list_del_init(&thr->sched_link);
+    if (list_empty(&q->rt_queues[prio])) {
+        q->rt_bitmap &= ~(1U << prio);
+    }
+}
+
+static struct thread *sched_rt_pick(struct sched_queue *q, struct thread *from) {
+    uint32_t levels = q->rt_bitmap;
+    struct thread *thr;
+
+    while (levels) {
+        int prio = 31 - __builtin_clz(levels);
+
+        list_for_each_entry(thr, &q->rt_queues[prio], sched_link) {
+            if (thr == from || !thr->on_cpu) {
+                return thr;
+            }
+        }
+
+        levels &= ~(1U << prio);
+    }
+
+    return NULL;
+}
+
+static int sched_rt_charge(struct sched_queue *q, struct thread *thr, uint64_t delta) {
+    if (thr->sched_slice > delta) {
+        thr->sched_slice -= delta;
+        return 0;
+    }
+
+    // Go to the back of the priority level
+    thr->sched_slice = SCHED_RT_SLICE;
+    list_del(&thr->sched_link);
+    list_add_tail(&thr->sched_link, &q->rt_queues[thr->sched_prio]);
+
+    return 1;
+}
+
+static int sched_rt_preempt(const struct thread *thr, const struct thread *cur) {
+    return thr->sched_prio > cur->sched_prio;
+}
+
+const struct sched_class sched_class_rt = {
+    .name = "rt",
+    .enqueue = sched_rt_enqueue,
+    .dequeue = sched_rt_dequeue,
+    .pick = sched_rt_pick,
+    .charge = sched_rt_charge,
+    .preempt = sched_rt_preempt
+};
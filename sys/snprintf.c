@@ -188,8 +188,35 @@ int vsnprintf(char *buf, size_t len, const char *fmt, va_list args) {
 
             switch (c) {
             case 'l':
-                // Not supported
-                return -1;
+                c = *++fmt;
+                switch (c) {
+                case 'd':
+                    val.value_long = va_arg(args, long);
+                    clen = vsnprintf_ds(val.value_long, cbuf, 1, 1);
+                    __puts(cbuf, clen);
+                    break;
+                case 'u':
+                    val.value_uint64 = va_arg(args, uint64_t);
+                    clen = vsnprintf_ds(val.value_uint64, cbuf, 0, 1);
+                    __puts(cbuf, clen);
+                    break;
+                case 'x':
+                    val.value_uint64 = va_arg(args, uint64_t);
+                    clen = vsnprintf_xs(val.value_uint64, cbuf, s_print_xs_set0);
+                    __puts(cbuf, clen);
+                    break;
+                case 'X':
+                    val.value_uint64 = va_arg(args, uint64_t);
+                    clen = vsnprintf_xs(val.value_uint64, cbuf, s_print_xs_set1);
+                    __puts(cbuf, clen);
+                    break;
+                default:
+                    __putc('%');
+                    __putc('l');
+                    __putc(c);
+                    break;
+                }
+                break;
 
             case 's':
                 if ((val.value_str = va_arg(args, const char *))) {
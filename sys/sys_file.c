@@ -2,10 +2,14 @@
 #include "user/errno.h"
 #include "arch/amd64/hw/timer.h"
 #include "fs/ofile.h"
+#include "fs/node.h"
 #include "user/fcntl.h"
 #include "sys/char/ring.h"
 #include "sys/char/pipe.h"
 #include "sys/char/chr.h"
+#include "fs/splice.h"
+#include "user/epoll.h"
+#include "sys/epoll.h"
 #include "sys/sys_file.h"
 #include "sys/thread.h"
 #include "sys/assert.h"
@@ -110,11 +114,13 @@ int sys_truncate(const char *pathname, off_t length) {
     struct vfs_ioctx *ioctx = get_ioctx();
     int res;
 
-    if ((res = vfs_find(ioctx, ioctx->cwd_vnode, pathname, 0, &node)) != 0) {
-        return res;
+    vnode_lookup_enter();
+    if ((res = vfs_find(ioctx, ioctx->cwd_vnode, pathname, 0, &node)) == 0) {
+        res = vfs_ftruncate(ioctx, node, length);
     }
+    vnode_lookup_leave();
 
-    return vfs_ftruncate(ioctx, node, length);
+    return res;
 }
 
 int sys_ftruncate(int fd, off_t length) {
@@ -340,6 +346,125 @@ int sys_dup2(int from, int to) {
     return to;
 }
 
+int sys_fcntl(int fd, int cmd, uintptr_t arg) {
+    struct ofile *of;
+    if (!(of = get_fd(fd))) {
+        return -EBADF;
+    }
+
+    switch (cmd) {
+    case F_GETFD:
+        return (of->flags & OF_CLOEXEC) ? FD_CLOEXEC : 0;
+    case F_SETFD:
+        if (arg & FD_CLOEXEC) {
+            of->flags |= OF_CLOEXEC;
+        } else {
+            of->flags &= ~OF_CLOEXEC;
+        }
+        return 0;
+    case F_GETPIPE_SZ:
+        return pipe_get_size(of);
+    case F_SETPIPE_SZ:
+        return pipe_set_size(of, arg);
+    default:
+        return -EINVAL;
+    }
+}
+
+ssize_t sys_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+    struct ofile *in, *out;
+
+    if (!(in = get_fd(fd_in)) || !(out = get_fd(fd_out))) {
+        return -EBADF;
+    }
+    if (off_in) {
+        userptr_check(off_in);
+    }
+    if (off_out) {
+        userptr_check(off_out);
+    }
+
+    return vfs_splice(get_ioctx(), in, off_in, out, off_out, len);
+}
+
+ssize_t sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    struct ofile *in, *out;
+
+    if (!(in = get_fd(fd_in)) || !(out = get_fd(fd_out))) {
+        return -EBADF;
+    }
+
+    return vfs_tee(get_ioctx(), in, out, len);
+}
+
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    struct ofile *in, *out;
+
+    if (!(in = get_fd(in_fd)) || !(out = get_fd(out_fd))) {
+        return -EBADF;
+    }
+    if (offset) {
+        userptr_check(offset);
+    }
+
+    return vfs_sendfile(get_ioctx(), out, in, offset, count);
+}
+
+int sys_epoll_create(int size) {
+    struct process *proc = thread_self->proc;
+    struct ofile *of;
+    int fd = -1;
+    int res;
+
+    // Only has to be positive, the queue grows as needed
+    if (size <= 0) {
+        return -EINVAL;
+    }
+
+    for (int i = 0; i < THREAD_MAX_FDS; ++i) {
+        if (!proc->fds[i]) {
+            fd = i;
+            break;
+        }
+    }
+    if (fd == -1) {
+        return -EMFILE;
+    }
+
+    if ((res = epoll_create(&of)) != 0) {
+        return res;
+    }
+    proc->fds[fd] = ofile_dup(of);
+
+    return fd;
+}
+
+int sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    struct ofile *ep, *of;
+    struct epoll_event ev;
+
+    if (!(ep = get_fd(epfd)) || !(of = get_fd(fd))) {
+        return -EBADF;
+    }
+    if (op != EPOLL_CTL_DEL) {
+        userptr_check(event);
+        memcpy(&ev, event, sizeof(struct epoll_event));
+    }
+
+    return epoll_ctl(ep, op, fd, of, &ev);
+}
+
+int sys_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    struct ofile *ep;
+
+    userptr_check(events);
+    if (!(ep = get_fd(epfd))) {
+        return -EBADF;
+    }
+
+    return epoll_wait(thread_self, ep, events, maxevents, timeout);
+}
+
 int sys_openpty(int *master, int *slave) {
     return -EINVAL;
 }
@@ -516,17 +641,6 @@ int sys_select(int n, fd_set *inp, fd_set *outp, fd_set *excp, struct timeval *t
     int res;
 
     list_head_init(&thr->wait_head);
-    for (int i = 0; i < n; ++i) {
-        if (FD_ISSET(i, &_inp)) {
-            struct ofile *fd = proc->fds[i];
-            _assert(fd);
-
-            struct io_notify *w = sys_select_get_wait(fd);
-            _assert(w);
-
-            thread_wait_io_add(thr, w);
-        }
-    }
 
     struct io_notify *result;
     int ready = 0;
@@ -550,7 +664,9 @@ int sys_select(int n, fd_set *inp, fd_set *outp, fd_set *excp, struct timeval *t
                 struct io_notify *w = sys_select_get_wait(fd);
                 _assert(w);
 
-                thread_wait_io_add(thr, w);
+                if ((res = thread_wait_io_add(thr, w)) != 0) {
+                    break;
+                }
             }
         }
 
@@ -559,8 +675,11 @@ int sys_select(int n, fd_set *inp, fd_set *outp, fd_set *excp, struct timeval *t
         }
 
         if (deadline != (uint64_t) -1) {
+            thr->sleep_notify.value = 0;
             thr->sleep_deadline = deadline;
-            thread_wait_io_add(thr, &thr->sleep_notify);
+            if ((res = thread_wait_io_add(thr, &thr->sleep_notify)) != 0) {
+                break;
+            }
             timer_add_sleep(thr);
         }
 
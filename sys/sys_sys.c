@@ -15,7 +15,7 @@
 int sys_mount(const char *dev_name, const char *dir_name, const char *type, unsigned long flags, void *data) {
     struct process *proc = thread_self->proc;
     struct vnode *dev_node;
-    void *dev;
+    void *dev = NULL;
     int res;
     _assert(dir_name);
 
@@ -25,16 +25,19 @@ int sys_mount(const char *dev_name, const char *dir_name, const char *type, unsi
     }
 
     if (dev_name) {
-        if ((res = vfs_find(&proc->ioctx, proc->ioctx.cwd_vnode, dev_name, 0, &dev_node)) != 0) {
-            return res;
+        vnode_lookup_enter();
+        if ((res = vfs_find(&proc->ioctx, proc->ioctx.cwd_vnode, dev_name, 0, &dev_node)) == 0) {
+            // Check that it's a block device:
+            if (dev_node->type != VN_BLK) {
+                res = -EINVAL;
+            }
+            dev = dev_node->dev;
         }
+        vnode_lookup_leave();
 
-        // Check that it's a block device:
-        if (dev_node->type != VN_BLK) {
-            return -EINVAL;
+        if (res != 0) {
+            return res;
         }
-
-        dev = dev_node->dev;
     } else {
         dev = NULL;
     }
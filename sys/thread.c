@@ -1,10 +1,11 @@
 #include "arch/amd64/context.h"
-#include "sys/mem/vmalloc.h"
+#include "sys/mem/vma.h"
 #include "sys/mem/phys.h"
 #include "user/signal.h"
 #include "user/errno.h"
 #include "sys/string.h"
 #include "sys/thread.h"
+#include "sys/sched_class.h"
 #include "sys/sched.h"
 #include "sys/debug.h"
 #include "fs/ofile.h"
@@ -52,6 +53,7 @@ int sys_clone(int (*fn) (void *), void *stack, int flags, void *arg) {
     _assert(proc);
     struct thread *thr = kmalloc(sizeof(struct thread));
     _assert(thr);
+    uintptr_t irq;
 
     memset(thr, 0, sizeof(struct thread));
     thr->proc = proc;
@@ -67,8 +69,10 @@ int sys_clone(int (*fn) (void *), void *stack, int flags, void *arg) {
 
     thr->signal_entry = thread_self->signal_entry;
 
+    spin_lock_irqsave(&proc->thread_lock, &irq);
     list_add(&thr->thread_link, &proc->thread_list);
     ++proc->thread_count;
+    spin_release_irqrestore(&proc->thread_lock, &irq);
 
     sched_queue(thr);
 
@@ -82,8 +86,17 @@ int thread_init(struct thread *thr, uintptr_t entry, void *arg, int flags) {
     thr->signal_entry = MM_NADDR;
     thr->signal_stack_base = MM_NADDR;
     thr->signal_stack_size = 0;
-    thr->sched_prev = NULL;
-    thr->sched_next = NULL;
+    thr->cpu = -1;
+    thr->on_cpu = 0;
+    thr->wakeup_pending = 0;
+    thr->vnode_lookups = 0;
+    thr->sched_class = &sched_class_fair;
+    thr->sched_prio = 0;
+    thr->sched_nice = 0;
+    thr->sched_vruntime = 0;
+    thr->sched_slice = 0;
+    list_head_init(&thr->sched_link);
+    memset(&thr->sched_stat, 0, sizeof(struct sched_stat));
 
     thr->data.rsp0_base = MM_VIRTUALIZE(stack_pages);
     thr->data.rsp0_size = MM_PAGE_SIZE * THREAD_KSTACK_PAGES;
@@ -117,13 +130,19 @@ int thread_init(struct thread *thr, uintptr_t entry, void *arg, int flags) {
         uintptr_t ustack_base;
         if (!(flags & THR_INIT_STACK_SET)) {
             // Allocate thread user stack
-            ustack_base = vmfind(space, THREAD_USTACK_BEGIN, THREAD_USTACK_END, THREAD_USTACK_PAGES);
+            _assert(thr->proc);
+            ustack_base = vma_alloc(&thr->proc->vm,
+                                    THREAD_USTACK_BEGIN,
+                                    THREAD_USTACK_END,
+                                    THREAD_USTACK_PAGES,
+                                    MM_PAGE_WRITE | MM_PAGE_USER,
+                                    0);
             _assert(ustack_base != MM_NADDR);
-            for (size_t i = 0; i < THREAD_USTACK_PAGES; ++i) {
-                uintptr_t phys = mm_phys_alloc_page(PU_PRIVATE);
-                _assert(phys != MM_NADDR);
-                mm_map_single(space, ustack_base + i * MM_PAGE_SIZE, phys, MM_PAGE_WRITE | MM_PAGE_USER);
-            }
+            _assert(mm_map_range_alloc(space,
+                                       ustack_base,
+                                       THREAD_USTACK_PAGES,
+                                       PU_PRIVATE,
+                                       MM_PAGE_WRITE | MM_PAGE_USER) == 0);
             thr->data.rsp3_base = ustack_base;
             thr->data.rsp3_size = MM_PAGE_SIZE * THREAD_USTACK_PAGES;
         }
@@ -250,7 +269,7 @@ void thread_sigenter(int signum) {
         proc->proc_state = PROC_SUSPENDED;
 
         // Notify parent of suspension
-        if (proc->pid_notify.owner) {
+        if (thread_io_has_waiters(&proc->pid_notify)) {
             thread_notify_io(&proc->pid_notify);
         }
 
@@ -286,6 +305,7 @@ __attribute__((noreturn)) void sys_exit(int status) {
         if (!list_empty(&thr->wait_head)) {
             thread_wait_io_clear(thr);
         }
+        _assert(list_empty(&thr->sleep_notify.link));
 
         --proc->thread_count;
 
@@ -298,6 +318,8 @@ __attribute__((noreturn)) void sys_exit(int status) {
     if (!list_empty(&thr->wait_head)) {
         thread_wait_io_clear(thr);
     }
+    // The timer would refer to the thread after it's freed
+    _assert(list_empty(&thr->sleep_notify.link));
 
     // Close FDs even before being reaped
     for (size_t i = 0; i < THREAD_MAX_FDS; ++i) {
@@ -306,11 +328,12 @@ __attribute__((noreturn)) void sys_exit(int status) {
             proc->fds[i] = NULL;
         }
     }
+    vfs_set_cwd_vnode(&proc->ioctx, NULL);
 
     proc->exit_status = status;
 
     // Notify waitpid()ers
-    if (proc->pid_notify.owner) {
+    if (thread_io_has_waiters(&proc->pid_notify)) {
         thread_notify_io(&proc->pid_notify);
     }
 
@@ -320,7 +343,7 @@ __attribute__((noreturn)) void sys_exit(int status) {
 }
 
 void sys_yield(void) {
-    yield();
+    sched_yield();
 }
 
 void sys_sigreturn(void) {
@@ -330,7 +353,7 @@ void sys_sigreturn(void) {
 void thread_signal(struct thread *thr, int signum) {
     struct process *proc = thr->proc;
 
-    if (thr->sleep_notify.owner) {
+    if (thread_io_has_waiters(&thr->sleep_notify)) {
         thread_notify_io(&thr->sleep_notify);
     }
 
@@ -1,5 +1,6 @@
 #include "arch/amd64/hw/timer.h"
 #include "user/errno.h"
+#include "sys/mem/slab.h"
 #include "sys/thread.h"
 #include "sys/assert.h"
 #include "sys/sched.h"
@@ -7,17 +8,33 @@
 #include "user/wait.h"
 #include "sys/wait.h"
 
+static struct slab_cache *io_waiter_cache = NULL;
+
 void thread_wait_io_init(struct io_notify *n) {
-    n->owner = NULL;
     n->value = 0;
     n->lock = 0;
     list_head_init(&n->link);
-    // For wait_io_any
-    list_head_init(&n->own_link);
+    list_head_init(&n->waiters);
+    list_head_init(&n->watchers);
 }
 
-int thread_wait_io(struct thread *t, struct io_notify *n) {
+// Called with the notification's lock held
+static void io_waiter_enqueue(struct io_notify *n, struct io_waiter *w) {
+    if (w->flags & IO_WAIT_EXCLUSIVE) {
+        list_add_tail(&w->link, &n->waiters);
+    } else {
+        list_add(&w->link, &n->waiters);
+    }
+}
+
+static int thread_wait_io_common(struct thread *t, struct io_notify *n, uint32_t flags) {
+    struct io_waiter w;
     uintptr_t irq;
+    int woken, r;
+
+    w.thread = t;
+    w.notify = n;
+
     while (1) {
         spin_lock_irqsave(&n->lock, &irq);
         // Check value
@@ -29,106 +46,207 @@ int thread_wait_io(struct thread *t, struct io_notify *n) {
         }
 
         // Wait for the value to change
-        // TODO: multiple threads waiting on same io_notify
-        _assert(!n->owner);
-        n->owner = t;
+        __atomic_store_n(&t->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+        w.flags = flags;
+        io_waiter_enqueue(n, &w);
         spin_release_irqrestore(&n->lock, &irq);
 
         sched_unqueue(t, THREAD_WAITING);
 
+        // Notifier dequeues the waiters it wakes up, so if we're still
+        // queued, this is a signal or a spurious wakeup
+        spin_lock_irqsave(&n->lock, &irq);
+        if (!(woken = (w.flags & IO_WAIT_WOKEN))) {
+            list_del(&w.link);
+        }
+        spin_release_irqrestore(&n->lock, &irq);
+
+        if (woken) {
+            return 0;
+        }
+
         // Check if we were interrupted during io wait
-        n->owner = NULL;
-        int r = thread_check_signal(t, 0);
-        if (r != 0) {
+        if ((r = thread_check_signal(t, 0)) != 0) {
             return r;
         }
     }
 }
 
+int thread_wait_io(struct thread *t, struct io_notify *n) {
+    return thread_wait_io_common(t, n, 0);
+}
+
+int thread_wait_io_exclusive(struct thread *t, struct io_notify *n) {
+    return thread_wait_io_common(t, n, IO_WAIT_EXCLUSIVE);
+}
+
+static void thread_notify_io_common(struct io_notify *n, int all) {
+    struct list_head *it, *next;
+    struct io_waiter *w;
+    struct io_watch *watch;
+    struct thread *t;
+    uintptr_t irq;
+    int woken = 0, exclusive;
+
+    spin_lock_irqsave(&n->lock, &irq);
+    list_for_each_safe(it, next, &n->waiters) {
+        w = list_entry(it, struct io_waiter, link);
+        t = w->thread;
+        exclusive = w->flags & IO_WAIT_EXCLUSIVE;
+
+        // The waiter checks the flag under the lock, so it stays valid
+        // until we release it
+        list_del_init(&w->link);
+        w->flags |= IO_WAIT_WOKEN;
+        ++woken;
+
+        // If the thread hasn't gone to sleep yet, sched_unqueue() will
+        // see the flag instead. Threads already queued are ignored by
+        // sched_queue()
+        __atomic_store_n(&t->wakeup_pending, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&t->cpu, __ATOMIC_SEQ_CST) < 0) {
+            sched_queue(t);
+        }
+
+        if (exclusive && !all) {
+            break;
+        }
+    }
+    // Remember the notification for whoever comes to wait next
+    if (!woken) {
+        ++n->value;
+    }
+    list_for_each_entry(watch, &n->watchers, link) {
+        watch->func(watch);
+    }
+    spin_release_irqrestore(&n->lock, &irq);
+}
+
 void thread_notify_io(struct io_notify *n) {
+    thread_notify_io_common(n, 0);
+}
+
+void thread_notify_io_all(struct io_notify *n) {
+    thread_notify_io_common(n, 1);
+}
+
+void thread_io_watch_add(struct io_notify *n, struct io_watch *w, void (*func) (struct io_watch *)) {
     uintptr_t irq;
-    struct thread *t = NULL;
+    w->func = func;
+    w->notify = n;
     spin_lock_irqsave(&n->lock, &irq);
-    ++n->value;
-    t = n->owner;
-    n->owner = NULL;
+    list_add_tail(&w->link, &n->watchers);
     spin_release_irqrestore(&n->lock, &irq);
+}
 
-    if (t) {
-        // Prevent double task wakeup when
-        // two event sources simultaneously try
-        // to do it
-        if (t->sched_next) {
-            return;
-        }
-        sched_queue(t);
+void thread_io_watch_del(struct io_watch *w) {
+    uintptr_t irq;
+    if (!w->notify) {
+        return;
     }
+    spin_lock_irqsave(&w->notify->lock, &irq);
+    list_del(&w->link);
+    spin_release_irqrestore(&w->notify->lock, &irq);
+    w->notify = NULL;
 }
 
-void thread_wait_io_add(struct thread *thr, struct io_notify *n) {
+int thread_wait_io_add(struct thread *thr, struct io_notify *n) {
+    struct io_waiter *w;
     uintptr_t irq;
     _assert(n);
+
+    if (!io_waiter_cache) {
+        io_waiter_cache = slab_cache_get(sizeof(struct io_waiter));
+        _assert(io_waiter_cache);
+    }
+    if (!(w = slab_calloc(io_waiter_cache))) {
+        return -ENOMEM;
+    }
+    w->thread = thr;
+    w->notify = n;
+    list_add(&w->own_link, &thr->wait_head);
+
     spin_lock_irqsave(&n->lock, &irq);
-    _assert(!n->owner);
-    n->owner = thr;
-    list_add(&n->own_link, &thr->wait_head);
+    io_waiter_enqueue(n, w);
     spin_release_irqrestore(&n->lock, &irq);
+
+    return 0;
 }
 
 int thread_wait_io_any(struct thread *thr, struct io_notify **r_n) {
+    struct io_notify *n;
+    struct io_waiter *w;
     uintptr_t irq;
-    struct io_notify *n, *it;
+    int r;
 
     while (1) {
-        // Check if any of values are non-zero
+        // Wakeups from here on cancel the sleep below
+        __atomic_store_n(&thr->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+
+        // Check if any of the notifications woke us up or came
+        // before we started waiting
         n = NULL;
-        list_for_each_entry(it, &thr->wait_head, own_link) {
-            spin_lock_irqsave(&it->lock, &irq);
-            if (it->value) {
-                n = it;
-                break;
+        list_for_each_entry(w, &thr->wait_head, own_link) {
+            spin_lock_irqsave(&w->notify->lock, &irq);
+            if (w->flags & IO_WAIT_WOKEN) {
+                // Keep following it until thread_wait_io_clear()
+                w->flags &= ~IO_WAIT_WOKEN;
+                io_waiter_enqueue(w->notify, w);
+                n = w->notify;
+            } else if (w->notify->value) {
+                --w->notify->value;
+                n = w->notify;
             }
-            spin_release_irqrestore(&it->lock, &irq);
-        }
+            spin_release_irqrestore(&w->notify->lock, &irq);
 
-        if (n) {
-            // Found ready descriptor
-            --n->value;
-            spin_release_irqrestore(&it->lock, &irq);
-            *r_n = n;
+            if (n) {
+                *r_n = n;
+                timer_remove_sleep(thr);
+                return 0;
+            }
+        }
 
-            return 0;
-        } else {
-            // Wait
-            // TODO: reset owners
-            sched_unqueue(thr, THREAD_WAITING);
+        // Wait
+        sched_unqueue(thr, THREAD_WAITING);
 
-            int r = thread_check_signal(thr, 0);
-            if (r != 0) {
-                return r;
-            }
+        if ((r = thread_check_signal(thr, 0)) != 0) {
+            timer_remove_sleep(thr);
+            return r;
         }
     }
 }
 
 void thread_wait_io_clear(struct thread *t) {
+    struct io_waiter *w;
+    uintptr_t irq;
+
     while (!list_empty(&t->wait_head)) {
-        struct list_head *h = t->wait_head.next;
-        struct io_notify *n = list_entry(h, struct io_notify, own_link);
+        w = list_entry(t->wait_head.next, struct io_waiter, own_link);
         // TODO: maybe check here for sleep descriptors and cancel sleeps if needed
-        n->owner = NULL;
-        list_del_init(h);
+        spin_lock_irqsave(&w->notify->lock, &irq);
+        list_del_init(&w->link);
+        spin_release_irqrestore(&w->notify->lock, &irq);
+
+        list_del(&w->own_link);
+        slab_free(io_waiter_cache, w);
     }
 }
 
 int thread_sleep(struct thread *thr, uint64_t deadline, uint64_t *int_time) {
+    int res;
+
     // Cancel previous sleep
     list_del_init(&thr->sleep_notify.link);
     thr->sleep_notify.value = 0;
 
     thr->sleep_deadline = deadline;
     timer_add_sleep(thr);
-    return thread_wait_io(thr, &thr->sleep_notify);
+    res = thread_wait_io(thr, &thr->sleep_notify);
+    // Interrupted before the deadline, the timer must not see the
+    // sleep anymore once the thread may be gone
+    timer_remove_sleep(thr);
+
+    return res;
 }
 
 static int wait_check_pid(struct process *chld, int flags) {
@@ -199,14 +317,19 @@ int sys_waitpid(pid_t pid, int *status, int flags) {
             }
 
             // Build wait list
+            res = 0;
             for (struct process *_chld = proc_self->first_child; _chld; _chld = _chld->next_child) {
                 if (pid == -1 || _chld->pgid == -pid) {
-                    thread_wait_io_add(thr, &_chld->pid_notify);
+                    if ((res = thread_wait_io_add(thr, &_chld->pid_notify)) != 0) {
+                        break;
+                    }
                 }
             }
 
             // Wait for any of pgrp
-            res = thread_wait_io_any(thr, &notify);
+            if (res == 0) {
+                res = thread_wait_io_any(thr, &notify);
+            }
 
             thread_wait_io_clear(thr);
         } else {